@@ -0,0 +1,529 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Workload benchmark of a mount
+ *
+ *  "create" writes the synthetic source trees and the exclude rules for a
+ *  mount to a directory, "run" stresses a mount of these trees with the
+ *  given workloads and prints the operations per second and the latency
+ *  percentiles of every workload and thread count as JSON. See fsbench.sh
+ *  that is run by "make bench".
+ *
+ *  Every source contains the same directories, <depth> levels with <fanout>
+ *  subdirectories each, and the <files> files of every directory in the
+ *  last level are spread over the sources. Half of the rules are wildcards
+ *  that match no path and half exclude a file that was created in addition.
+ *
+ *  The workloads are:
+ *    stat     stat() of a random file
+ *    readdir  listing of a random directory of the last level
+ *    read     open(), read of 4 KiB and close() of a random file
+ *    write    open(), write of 4 KiB and close() of a random file
+ *    meta     create, chmod(), rename() and unlink() of a new file
+ *
+ *  usage: fsbench [options] create <dir>
+ *         fsbench [options] run <mountpoint> [workload...]
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FILE_SIZE 4096
+// samples that are kept per thread, later operations are only counted
+#define MAX_SAMPLES (1 << 20)
+#define MAX_THREADS 16
+
+enum op { OP_STAT, OP_READDIR, OP_READ, OP_WRITE, OP_META, N_OPS };
+
+static const char *op_names[N_OPS] = { "stat", "readdir", "read", "write", "meta" };
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	unsigned int seed;
+
+	uint64_t ops;
+	uint64_t errors;
+	uint32_t *samples; /* latencies in ns */
+	size_t n_samples;
+};
+
+static unsigned int n_sources = 2;
+static unsigned int depth = 3;
+static unsigned int fanout = 8;
+static unsigned int n_files = 16;
+static unsigned int n_rules = 1000;
+static unsigned int seconds = 3;
+static unsigned int threads[MAX_THREADS] = { 1, 4, 16 };
+static unsigned int n_threads = 3;
+static const char *label = "";
+
+static const char *dir;
+static unsigned int n_leaves;
+static enum op op;
+static int stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// formats a path of at most PATH_MAX bytes, returns -1 if it is longer
+static int format_path(char *path, const char *fmt, ...)
+{
+	va_list args;
+	int r;
+
+	va_start(args, fmt);
+	r = vsnprintf(path, PATH_MAX, fmt, args);
+	va_end(args);
+
+	return r < 0 || r >= PATH_MAX ? -1 : 0;
+}
+
+// writes the path of a directory of the last level relative to the root
+static int leaf_path(char *buf, size_t size, unsigned int leaf)
+{
+	unsigned int i, len = 0;
+	int r;
+
+	buf[0] = 0;
+	for (i=0; i < depth; i++) {
+		r = snprintf(buf + len, size - len, "/d%u", leaf % fanout);
+		if (r < 0 || (size_t) r >= size - len)
+			return -1;
+		len += r;
+		leaf /= fanout;
+	}
+
+	return 0;
+}
+
+static int write_file(const char *path, char fill)
+{
+	char buf[FILE_SIZE];
+	int fd, r = 0;
+
+	memset(buf, fill, sizeof(buf));
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -1;
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+		r = -1;
+	if (close(fd))
+		r = -1;
+
+	return r;
+}
+
+// mkdir -p for the directories below an existing base
+static int make_dirs(const char *base, const char *rel)
+{
+	char path[PATH_MAX];
+	const char *p;
+
+	for (p = rel + 1; ; p++) {
+		if (*p != '/' && *p != 0)
+			continue;
+		if (format_path(path, "%s%.*s", base, (int) (p - rel), rel) ||
+			(mkdir(path, 0755) && errno != EEXIST))
+			return -1;
+		if (*p == 0)
+			return 0;
+	}
+}
+
+static int create_tree(const char *root)
+{
+	char base[PATH_MAX], leaf[PATH_MAX], path[PATH_MAX];
+	unsigned int i, j, s;
+	FILE *rules;
+
+	if (!realpath(root, base)) {
+		perror("realpath");
+		return -1;
+	}
+
+	for (s=0; s < n_sources; s++) {
+		if (format_path(path, "%s/src%u", base, s) ||
+			(mkdir(path, 0755) && errno != EEXIST))
+			goto error;
+
+		for (i=0; i < n_leaves && depth > 0; i++) {
+			if (leaf_path(leaf, PATH_MAX, i) || make_dirs(path, leaf))
+				goto error;
+		}
+	}
+
+	for (i=0; i < n_leaves; i++) {
+		if (leaf_path(leaf, PATH_MAX, i))
+			goto error;
+		for (j=0; j < n_files; j++) {
+			if (format_path(path, "%s/src%u%s/f%u", base,
+				(i * n_files + j) % n_sources, leaf, j) ||
+				write_file(path, 'a' + j % 26))
+				goto error;
+		}
+	}
+
+	if (format_path(path, "%s/rules", base) || !(rules = fopen(path, "w")))
+		goto error;
+
+	for (i=0; i < n_rules; i++) {
+		if (i % 2 == 0) {
+			fprintf(rules, "**/tmp%u/**\n", i);
+			continue;
+		}
+
+		if (leaf_path(leaf, PATH_MAX, i % n_leaves) ||
+			format_path(path, "%s/src%u%s/x%u", base, i % n_sources, leaf, i) ||
+			write_file(path, 'x'))
+			break;
+		fprintf(rules, "%s\n", path);
+	}
+
+	if (fclose(rules) || i < n_rules)
+		goto error;
+
+	return 0;
+
+error:
+	fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+	return -1;
+}
+
+static int run_op(struct worker *w)
+{
+	char buf[FILE_SIZE];
+	char leaf[PATH_MAX], path[PATH_MAX], path2[PATH_MAX];
+	struct dirent *entry;
+	struct stat st;
+	DIR *d;
+	unsigned int i;
+	int fd, r = 0;
+
+	i = rand_r(&w->seed) % (n_leaves * n_files);
+	if (leaf_path(leaf, PATH_MAX, i / n_files))
+		return -1;
+
+	switch (op) {
+		case OP_STAT:
+			if (format_path(path, "%s%s/f%u", dir, leaf, i % n_files))
+				return -1;
+			return stat(path, &st);
+
+		case OP_READDIR:
+			if (format_path(path, "%s%s", dir, leaf) || !(d = opendir(path)))
+				return -1;
+			errno = 0;
+			while ((entry = readdir(d))) {}
+			if (errno)
+				r = -1;
+			closedir(d);
+			return r;
+
+		case OP_READ:
+		case OP_WRITE:
+			if (format_path(path, "%s%s/f%u", dir, leaf, i % n_files))
+				return -1;
+			fd = open(path, op == OP_READ ? O_RDONLY : O_WRONLY);
+			if (fd == -1)
+				return -1;
+			if (op == OP_READ) {
+				if (pread(fd, buf, sizeof(buf), 0) != sizeof(buf))
+					r = -1;
+			} else {
+				memset(buf, 'a' + i % 26, sizeof(buf));
+				if (pwrite(fd, buf, sizeof(buf), 0) != sizeof(buf))
+					r = -1;
+			}
+			if (close(fd))
+				r = -1;
+			return r;
+
+		case OP_META:
+			if (format_path(path, "%s%s/m%u.%lu", dir, leaf, w->id,
+				(unsigned long) w->ops) || format_path(path2, "%s.r", path))
+				return -1;
+			fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if (fd == -1)
+				return -1;
+			if (close(fd) || chmod(path, 0600) || rename(path, path2))
+				r = -1;
+			if (unlink(r ? path : path2))
+				r = -1;
+			return r;
+
+		default:
+			return -1;
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t start, ns;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		start = now_ns();
+		if (run_op(w))
+			w->errors++;
+		ns = now_ns() - start;
+
+		if (w->n_samples < MAX_SAMPLES)
+			w->samples[w->n_samples++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+// prints the latency of the given quantile of the sorted samples in us
+static double percentile(const uint32_t *all, size_t n, double q)
+{
+	return n ? all[(size_t) (n * q)] / 1e3 : 0.0;
+}
+
+// runs the current workload with n threads and prints its JSON object
+static int bench(unsigned int n, int first)
+{
+	struct worker *workers;
+	uint64_t ops = 0, errors = 0, start, elapsed, sum = 0;
+	uint32_t *all;
+	unsigned int i;
+	size_t n_all = 0, j;
+
+	workers = calloc(n, sizeof(struct worker));
+	if (!workers)
+		return -1;
+
+	stop = 0;
+	start = now_ns();
+	for (i=0; i < n; i++) {
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		workers[i].samples = malloc(MAX_SAMPLES * sizeof(uint32_t));
+		if (!workers[i].samples ||
+			pthread_create(&workers[i].thread, NULL, worker, &workers[i])) {
+			fprintf(stderr, "cannot start thread %u\n", i);
+			exit(1);
+		}
+	}
+
+	sleep(seconds);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	for (i=0; i < n; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		errors += workers[i].errors;
+		n_all += workers[i].n_samples;
+	}
+	elapsed = now_ns() - start;
+
+	all = malloc(n_all * sizeof(uint32_t) + 1);
+	if (!all)
+		return -1;
+
+	n_all = 0;
+	for (i=0; i < n; i++) {
+		memcpy(&all[n_all], workers[i].samples, workers[i].n_samples * sizeof(uint32_t));
+		n_all += workers[i].n_samples;
+		free(workers[i].samples);
+	}
+	qsort(all, n_all, sizeof(uint32_t), cmp_u32);
+
+	for (j=0; j < n_all; j++)
+		sum += all[j];
+
+	if (errors)
+		fprintf(stderr, "%s with %u threads: %lu errors\n", op_names[op], n,
+			(unsigned long) errors);
+
+	printf("%s\n    {\"workload\": \"%s\", \"threads\": %u, \"ops\": %lu, "
+		"\"errors\": %lu, \"ops_per_sec\": %.1f, \"latency_us\": {"
+		"\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+		"\"p999\": %.1f, \"max\": %.1f}}",
+		first ? "" : ",", op_names[op], n, (unsigned long) ops,
+		(unsigned long) errors, ops / (elapsed / 1e9),
+		n_all ? sum / 1e3 / n_all : 0.0,
+		percentile(all, n_all, 0.5), percentile(all, n_all, 0.9),
+		percentile(all, n_all, 0.99), percentile(all, n_all, 0.999),
+		n_all ? all[n_all - 1] / 1e3 : 0.0);
+	fflush(stdout);
+
+	free(all);
+	free(workers);
+
+	return errors ? -1 : 0;
+}
+
+static void print_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+static int run(char **ops, int n_ops)
+{
+	unsigned int i;
+	int j, r = 0, first = 1;
+
+	if (n_ops == 0) {
+		ops = (char **) op_names;
+		n_ops = N_OPS;
+	}
+
+	for (j=0; j < n_ops; j++) {
+		for (op=0; op < N_OPS && strcmp(ops[j], op_names[op]); op++) {}
+		if (op == N_OPS) {
+			fprintf(stderr, "unknown workload \"%s\"\n", ops[j]);
+			return -1;
+		}
+	}
+
+	printf("{\n  \"config\": {\"label\": ");
+	print_json_string(label);
+	printf(", \"sources\": %u, \"depth\": %u, \"fanout\": %u, \"files\": %u, "
+		"\"rules\": %u, \"seconds\": %u},\n  \"results\": [",
+		n_sources, depth, fanout, n_files, n_rules, seconds);
+
+	for (j=0; j < n_ops; j++) {
+		for (op=0; strcmp(ops[j], op_names[op]); op++) {}
+
+		for (i=0; i < n_threads; i++) {
+			if (bench(threads[i], first))
+				r = -1;
+			first = 0;
+		}
+	}
+
+	printf("\n  ]\n}\n");
+
+	return r;
+}
+
+static int parse_threads(const char *s)
+{
+	char *end;
+
+	for (n_threads = 0; n_threads < MAX_THREADS; s = end + 1) {
+		threads[n_threads] = strtoul(s, &end, 10);
+		if (end == s || threads[n_threads] == 0)
+			return -1;
+		n_threads++;
+		if (*end != ',')
+			return *end ? -1 : 0;
+	}
+
+	return -1;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [options] create <dir>\n"
+		"       %s [options] run <mountpoint> [stat|readdir|read|write|meta...]\n"
+		"\n"
+		"options:\n"
+		"  -s <n>          number of sources (default %u)\n"
+		"  -d <n>          levels of directories (default %u)\n"
+		"  -f <n>          subdirectories of every directory (default %u)\n"
+		"  -n <n>          files in every directory of the last level (default %u)\n"
+		"  -r <n>          number of exclude rules (default %u)\n"
+		"  -t <n>[,<n>...] numbers of threads (default 1,4,16)\n"
+		"  -T <seconds>    duration of every run (default %u)\n"
+		"  -l <label>      label of the results, e.g., the options of the mount\n",
+		argv0, argv0, n_sources, depth, fanout, n_files, n_rules, seconds);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:d:f:n:r:t:T:l:")) != -1) {
+		switch (opt) {
+			case 's': n_sources = strtoul(optarg, NULL, 10); break;
+			case 'd': depth = strtoul(optarg, NULL, 10); break;
+			case 'f': fanout = strtoul(optarg, NULL, 10); break;
+			case 'n': n_files = strtoul(optarg, NULL, 10); break;
+			case 'r': n_rules = strtoul(optarg, NULL, 10); break;
+			case 'T': seconds = strtoul(optarg, NULL, 10); break;
+			case 'l': label = optarg; break;
+			case 't':
+				if (parse_threads(optarg)) {
+					fprintf(stderr, "invalid thread counts \"%s\"\n", optarg);
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (n_sources == 0 || fanout == 0 || n_files == 0) {
+		fprintf(stderr, "need at least one source, subdirectory and file\n");
+		return 1;
+	}
+
+	n_leaves = 1;
+	for (i=0; i < depth; i++) {
+		if (n_leaves > UINT_MAX / fanout / n_files) {
+			fprintf(stderr, "too many files\n");
+			return 1;
+		}
+		n_leaves *= fanout;
+	}
+
+	dir = argv[optind + 1];
+
+	if (!strcmp(argv[optind], "create"))
+		return create_tree(dir) ? 1 : 0;
+	if (!strcmp(argv[optind], "run"))
+		return run(argv + optind + 2, argc - optind - 2) ? 1 : 0;
+
+	usage(argv[0]);
+	return 1;
+}
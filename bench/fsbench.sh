@@ -0,0 +1,67 @@
+#! /bin/bash
+#
+# Runs the workloads of fsbench on a mount of synthetic source trees and
+# writes the operations per second and latency percentiles as JSON, so runs
+# of different builds or options can be compared. This is run by
+# "make bench". The trees and the workloads are configured with environment
+# variables or make variables:
+#
+#   BENCH_SOURCES   number of sources (default 2)
+#   BENCH_DEPTH     levels of directories (default 3)
+#   BENCH_FANOUT    subdirectories of every directory (default 8)
+#   BENCH_FILES     files in every directory of the last level (default 16)
+#   BENCH_RULES     number of exclude rules (default 1000)
+#   BENCH_THREADS   comma-separated numbers of threads (default 1,4,16)
+#   BENCH_SECONDS   duration of every run (default 3)
+#   BENCH_WORKLOADS any of stat readdir read write meta (default all)
+#
+# The kernel caches are disabled, so every operation reaches sparsefs. Set
+# SPARSEFS and FSBENCH to compare different builds and SPARSEFS_ARGS for
+# options like --lowlevel.
+#
+# usage: ./fsbench.sh [output file]
+
+OUTPUT=${1:-/dev/stdout}
+SPARSEFS=${SPARSEFS:-../sparsefs}
+FSBENCH=${FSBENCH:-./fsbench}
+WORKDIR=$(mktemp -d $(pwd)/fsbench.XXXXXX)
+FDIR=${WORKDIR}/fuse
+
+OPTS="-s ${BENCH_SOURCES:-2} -d ${BENCH_DEPTH:-3} -f ${BENCH_FANOUT:-8} -n ${BENCH_FILES:-16}
+	-r ${BENCH_RULES:-1000} -t ${BENCH_THREADS:-1,4,16} -T ${BENCH_SECONDS:-3}"
+
+cleanup() {
+	mountpoint -q ${FDIR} && fusermount3 -zu ${FDIR}
+	rm -rf ${WORKDIR}
+}
+
+trap cleanup EXIT
+
+mkdir -p ${FDIR}
+
+${FSBENCH} ${OPTS} create ${WORKDIR} || exit 1
+
+args=""
+for i in $(seq 0 $(( ${BENCH_SOURCES:-2} - 1 ))); do
+	args="${args} -s ${WORKDIR}/src$i"
+done
+
+${SPARSEFS} -f ${args} --excludefile=${WORKDIR}/rules --entry-timeout=0 \
+	--attr-timeout=0 ${SPARSEFS_ARGS} ${FDIR} &
+FFS_PID=$!
+
+while ! mountpoint -q ${FDIR}; do
+	if ! kill -0 ${FFS_PID} 2>/dev/null; then
+		echo "sparsefs did not start" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+${FSBENCH} ${OPTS} -l "${SPARSEFS_ARGS}" run ${FDIR} ${BENCH_WORKLOADS} > ${OUTPUT}
+r=$?
+
+fusermount3 -u ${FDIR}
+wait ${FFS_PID}
+
+exit $r
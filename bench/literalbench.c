@@ -0,0 +1,119 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Microbenchmark of the rules without wildcards
+ *
+ *  Loads rule sets of different sizes that only consist of exact paths, like
+ *  a long --excludefile, and prints the time to load them and the time to
+ *  look up paths that match a rule and paths that do not.
+ *
+ *  usage: literalbench [number of rules...]
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ruleset.h"
+
+#define N_LOOKUPS 1000000
+#define MAX_LEN 128
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_path(char *buf, unsigned int i)
+{
+	snprintf(buf, MAX_LEN, "/data/src/d%u/s%u/file%u.txt", i / 1000, i % 10, i);
+}
+
+static int bench(unsigned int n_rules)
+{
+	struct ruleset *rs;
+	char path[MAX_LEN];
+	unsigned int i, hits;
+	double start, t_load, t_hit, t_miss;
+
+	rs = ruleset_new();
+	if (!rs)
+		return -1;
+
+	start = now();
+	for (i=0; i < n_rules; i++) {
+		make_path(path, i);
+		if (ruleset_append(rs, path, i % 2))
+			return -1;
+	}
+	if (ruleset_compile(rs))
+		return -1;
+	t_load = now() - start;
+
+	srand(1);
+
+	hits = 0;
+	start = now();
+	for (i=0; i < N_LOOKUPS; i++) {
+		make_path(path, rand() % n_rules);
+		hits += ruleset_match(rs, path) != NULL;
+	}
+	t_hit = now() - start;
+
+	if (hits != N_LOOKUPS) {
+		fprintf(stderr, "error: %u of %u rules found\n", hits, N_LOOKUPS);
+		return -1;
+	}
+
+	start = now();
+	for (i=0; i < N_LOOKUPS; i++) {
+		make_path(path, n_rules + rand() % n_rules);
+		hits += ruleset_match(rs, path) != NULL;
+	}
+	t_miss = now() - start;
+
+	if (hits != N_LOOKUPS) {
+		fprintf(stderr, "error: a missing rule was found\n");
+		return -1;
+	}
+
+	// the lookups include the time of make_path()
+	printf("%10u %14.1f %14.1f %14.1f\n", n_rules, t_load * 1e3,
+		t_hit * 1e9 / N_LOOKUPS, t_miss * 1e9 / N_LOOKUPS);
+
+	ruleset_free(rs);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int default_sizes[] = { 1000, 100000, 1000000 };
+	int i;
+
+	printf("%10s %14s %14s %14s\n", "rules", "load ms", "hit ns", "miss ns");
+
+	if (argc > 1) {
+		for (i=1; i < argc; i++) {
+			if (bench(strtoul(argv[i], NULL, 10)))
+				return 1;
+		}
+	} else {
+		for (i=0; i < 3; i++) {
+			if (bench(default_sizes[i]))
+				return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Benchmark of the startup time and memory of large rule files
+ *
+ *  Writes an exclude file with one path in each line, like a sparse checkout
+ *  list, and loads it in a new process as text and as a precompiled file of
+ *  ruleset_save(). For both, the time to load and compile the rules, the
+ *  resident memory after loading and after random lookups and the time of a
+ *  lookup are printed. The files are created in the current directory and
+ *  removed afterwards.
+ *
+ *  usage: loadbench [lines]
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ruleset.h"
+
+#define N_LOOKUPS 1000000
+#define MAX_LEN 128
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_path(char *buf, unsigned int i)
+{
+	snprintf(buf, MAX_LEN, "/data/checkout/module%u/src/dir%u/file%u.c", i / 10000, i / 100, i);
+}
+
+static long rss_kb(void)
+{
+	long size, resident;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+	fclose(f);
+
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// loads the file in a new process, so every run starts with a fresh heap
+static int bench(const char *label, const char *filename, const char *save, unsigned int n_lines)
+{
+	struct ruleset *rs;
+	char path[MAX_LEN];
+	double start, t_load, t_lookup;
+	unsigned int i, hits;
+	long rss_before, rss_load;
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (pid > 0) {
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			return -1;
+		return 0;
+	}
+
+	rss_before = rss_kb();
+
+	start = now();
+	rs = ruleset_new();
+	if (!rs || ruleset_parse_file(rs, filename, 1) || ruleset_compile(rs))
+		_exit(1);
+	t_load = now() - start;
+	rss_load = rss_kb();
+
+	srand(1);
+	hits = 0;
+	start = now();
+	for (i=0; i < N_LOOKUPS; i++) {
+		make_path(path, rand() % n_lines);
+		hits += ruleset_match(rs, path) != NULL;
+	}
+	t_lookup = now() - start;
+	if (hits != N_LOOKUPS) {
+		fprintf(stderr, "error: %u of %u paths found\n", hits, N_LOOKUPS);
+		_exit(1);
+	}
+
+	// the lookups include the time of make_path()
+	printf("%-12s %12.1f %12ld %14ld %12.1f\n", label, t_load * 1e3,
+		(rss_load - rss_before) / 1024, (rss_kb() - rss_before) / 1024,
+		t_lookup * 1e9 / N_LOOKUPS);
+	fflush(stdout);
+
+	if (save && ruleset_save(rs, save))
+		_exit(1);
+
+	ruleset_free(rs);
+	_exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	char text[] = "loadbench.txt.XXXXXX";
+	char binary[] = "loadbench.bin.XXXXXX";
+	char path[MAX_LEN];
+	unsigned int i, n_lines;
+	long size;
+	FILE *f;
+	int fd, r = 1;
+
+	n_lines = argc > 1 ? strtoul(argv[1], NULL, 10) : 5000000;
+
+	fd = mkstemp(text);
+	if (fd < 0 || !(f = fdopen(fd, "w")))
+		return 1;
+	for (i=0; i < n_lines; i++) {
+		make_path(path, i);
+		fprintf(f, "%s\n", path);
+	}
+	size = ftell(f);
+	if (fclose(f))
+		goto out;
+
+	fd = mkstemp(binary);
+	if (fd < 0)
+		goto out;
+	close(fd);
+
+	printf("%u lines, %ld MB\n", n_lines, size >> 20);
+	printf("%-12s %12s %12s %14s %12s\n", "file", "load ms", "rss MB",
+		"lookups MB", "lookup ns");
+
+	if (bench("text", text, binary, n_lines) || bench("precompiled", binary, NULL, n_lines))
+		goto out;
+
+	r = 0;
+
+out:
+	unlink(text);
+	unlink(binary);
+
+	return r;
+}
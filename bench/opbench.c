@@ -0,0 +1,223 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Concurrency benchmark of the path operations of a mount
+ *
+ *  Runs the given number of threads that stat or read random files of the
+ *  tree created by opbench.sh for some seconds and reports the operations per
+ *  second and the median and 99th percentile latency of all operations.
+ *
+ *  usage: opbench <dir> <files> <threads> <seconds> <stat|open|read>
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// the tree is spread over this many directories, see opbench.sh
+#define N_DIRS 16
+/*
+ * Every thread counts the latencies in a histogram with 64 buckets per power
+ * of two, so the percentiles are within 0.8% and no operation is left out.
+ */
+#define SUB_BITS 6
+#define N_BUCKETS ((64 - SUB_BITS + 1) << SUB_BITS)
+
+enum op { OP_STAT, OP_OPEN, OP_READ };
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+
+	uint64_t ops;
+	uint64_t errors;
+	uint64_t histogram[N_BUCKETS]; /* latencies in ns */
+};
+
+static const char *dir;
+static unsigned int n_files;
+static enum op op;
+static int stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int bucket(uint64_t ns)
+{
+	unsigned int e;
+
+	if (ns < (1 << SUB_BITS))
+		return ns;
+
+	e = 63 - __builtin_clzll(ns);
+
+	return ((e - SUB_BITS + 1) << SUB_BITS) + ((ns >> (e - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+/* returns the middle of a bucket in ns */
+static double bucket_value(unsigned int i)
+{
+	unsigned int e;
+
+	if (i < (1 << SUB_BITS))
+		return i;
+
+	e = (i >> SUB_BITS) + SUB_BITS - 1;
+
+	return (double) (((1ULL << SUB_BITS) + (i & ((1 << SUB_BITS) - 1))) << (e - SUB_BITS)) +
+		(double) (1ULL << (e - SUB_BITS)) / 2;
+}
+
+/* returns the latency in ns below which the given share of the operations are */
+static double percentile(const uint64_t *histogram, uint64_t n, double share)
+{
+	uint64_t rank, count = 0;
+	unsigned int i;
+
+	if (n == 0)
+		return 0;
+
+	rank = n * share;
+	for (i=0; i < N_BUCKETS; i++) {
+		count += histogram[i];
+		if (count > rank)
+			break;
+	}
+
+	return bucket_value(i);
+}
+
+static int run_op(const char *path)
+{
+	char buf[4096];
+	struct stat st;
+	int fd, r = 0;
+
+	switch (op) {
+		case OP_STAT:
+			return stat(path, &st);
+
+		case OP_OPEN:
+		case OP_READ:
+			fd = open(path, O_RDONLY);
+			if (fd == -1)
+				return -1;
+			if (op == OP_READ && pread(fd, buf, sizeof(buf), 0) == -1)
+				r = -1;
+			close(fd);
+			return r;
+	}
+
+	return -1;
+}
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	char path[PATH_MAX];
+	unsigned int i;
+	uint64_t start, ns;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		i = rand_r(&w->seed) % n_files;
+		snprintf(path, PATH_MAX, "%s/d%u/f%u", dir, i % N_DIRS, i);
+
+		start = now_ns();
+		if (run_op(path))
+			w->errors++;
+		ns = now_ns() - start;
+
+		w->histogram[bucket(ns)]++;
+		w->ops++;
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	unsigned int i, n_threads, seconds;
+	uint64_t ops = 0, errors = 0, start, elapsed;
+	uint64_t histogram[N_BUCKETS] = { 0 };
+	unsigned int j;
+
+	if (argc != 6) {
+		fprintf(stderr, "usage: %s <dir> <files> <threads> <seconds> <stat|open|read>\n", argv[0]);
+		return 1;
+	}
+
+	dir = argv[1];
+	n_files = strtoul(argv[2], NULL, 10);
+	n_threads = strtoul(argv[3], NULL, 10);
+	seconds = strtoul(argv[4], NULL, 10);
+
+	if (!strcmp(argv[5], "stat")) {
+		op = OP_STAT;
+	} else if (!strcmp(argv[5], "open")) {
+		op = OP_OPEN;
+	} else if (!strcmp(argv[5], "read")) {
+		op = OP_READ;
+	} else {
+		fprintf(stderr, "unknown operation \"%s\"\n", argv[5]);
+		return 1;
+	}
+
+	if (n_files == 0 || n_threads == 0) {
+		fprintf(stderr, "need at least one file and one thread\n");
+		return 1;
+	}
+
+	workers = calloc(n_threads, sizeof(struct worker));
+	if (!workers)
+		return 1;
+
+	start = now_ns();
+	for (i=0; i < n_threads; i++) {
+		workers[i].seed = i + 1;
+		if (pthread_create(&workers[i].thread, NULL, worker, &workers[i])) {
+			fprintf(stderr, "cannot start thread %u\n", i);
+			return 1;
+		}
+	}
+
+	sleep(seconds);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+	for (i=0; i < n_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		errors += workers[i].errors;
+		for (j=0; j < N_BUCKETS; j++)
+			histogram[j] += workers[i].histogram[j];
+	}
+	elapsed = now_ns() - start;
+
+	printf("%-6s %8u %12.0f %10.1f %10.1f %8lu\n", argv[5], n_threads,
+		ops / (elapsed / 1e9),
+		percentile(histogram, ops, 0.5) / 1e3,
+		percentile(histogram, ops, 0.99) / 1e3,
+		(unsigned long) errors);
+
+	free(workers);
+
+	return errors ? 1 : 0;
+}
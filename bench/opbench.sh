@@ -0,0 +1,69 @@
+#! /bin/bash
+#
+# Measures how the path operations scale with concurrent clients. A mount
+# with 1 and with 4 sources is stressed by 1 to 64 threads that stat, open or
+# read random files. The ${FILES} files are spread over the sources, so with
+# more sources, lookups have to probe more of them. The kernel caches are
+# disabled, so every operation reaches sparsefs. Set SPARSEFS to compare
+# different builds and SPARSEFS_ARGS for options like "-o clone_fd" or
+# --lowlevel.
+#
+# usage: ./opbench.sh [files] [seconds per run]
+
+FILES=${1:-10000}
+SECONDS_PER_RUN=${2:-3}
+SPARSEFS=${SPARSEFS:-../sparsefs}
+OPBENCH=${OPBENCH:-./opbench}
+WORKDIR=$(mktemp -d $(pwd)/opbench.XXXXXX)
+FDIR=${WORKDIR}/fuse
+
+cleanup() {
+	mountpoint -q ${FDIR} && fusermount3 -zu ${FDIR}
+	rm -rf ${WORKDIR}
+}
+
+trap cleanup EXIT
+
+# create_sources <number of sources>, file i is stored in source i % n
+create_sources() {
+	rm -rf ${WORKDIR}/src*
+	for i in $(seq 0 $(( $1 - 1 ))); do
+		for d in $(seq 0 15); do
+			mkdir -p ${WORKDIR}/src$i/d$d
+		done
+	done
+
+	for f in $(seq 0 $(( FILES - 1 ))); do
+		echo "file $f" > ${WORKDIR}/src$(( f % $1 ))/d$(( f % 16 ))/f$f
+	done
+}
+
+mkdir -p ${FDIR}
+
+printf "%8s %-6s %8s %12s %10s %10s %8s\n" "sources" "op" "threads" "ops/s" "p50 us" "p99 us" "errors"
+
+for n_sources in 1 4; do
+	create_sources ${n_sources}
+
+	args=""
+	for i in $(seq 0 $(( n_sources - 1 ))); do
+		args="${args} -s ${WORKDIR}/src$i"
+	done
+
+	${SPARSEFS} -f ${args} --entry-timeout=0 --attr-timeout=0 ${SPARSEFS_ARGS} ${FDIR} &
+	FFS_PID=$!
+
+	while ! mountpoint -q ${FDIR}; do
+		sleep 0.1
+	done
+
+	for op in stat open read; do
+		for threads in 1 2 4 8 16 32 64; do
+			printf "%8u " ${n_sources}
+			${OPBENCH} ${FDIR} ${FILES} ${threads} ${SECONDS_PER_RUN} ${op}
+		done
+	done
+
+	fusermount3 -u ${FDIR}
+	wait ${FFS_PID}
+done
@@ -0,0 +1,86 @@
+#! /bin/bash
+#
+# Measures the scan of all sources at mount time. ${FILES} files are spread
+# over 2 sources in directories of 1000 files each. A first mount scans the
+# sources and writes the snapshot file, the time until the file exists and
+# its size are reported. Then, the attributes of all files are read by find
+# through a mount without a snapshot and through a mount that maps the
+# snapshot file. The kernel caches are disabled, so every stat reaches
+# sparsefs. Set SPARSEFS to compare different builds.
+#
+# usage: ./prescan.sh [files]
+
+FILES=${1:-1000000}
+SPARSEFS=${SPARSEFS:-../sparsefs}
+WORKDIR=$(mktemp -d $(pwd)/prescan.XXXXXX)
+FDIR=${WORKDIR}/fuse
+SNAPSHOT=${WORKDIR}/snapshot
+ARGS="-s ${WORKDIR}/src0 -s ${WORKDIR}/src1 --entry-timeout=0 --attr-timeout=0"
+
+cleanup() {
+	mountpoint -q ${FDIR} && fusermount3 -zu ${FDIR}
+	rm -rf ${WORKDIR}
+}
+
+trap cleanup EXIT
+
+now_ns() {
+	date +%s%N
+}
+
+# directory d gets its even files in src0 and its odd files in src1
+create_sources() {
+	for d in $(seq 0 $(( (FILES + 999) / 1000 - 1 ))); do
+		mkdir -p ${WORKDIR}/src0/d$d ${WORKDIR}/src1/d$d
+		(cd ${WORKDIR}/src0/d$d && seq -f "f%.0f" 0 2 999 | xargs touch)
+		(cd ${WORKDIR}/src1/d$d && seq -f "f%.0f" 1 2 999 | xargs touch)
+	done
+
+	# directories modified within the last second are not used from the snapshot
+	sleep 2
+}
+
+mount_ffs() {
+	${SPARSEFS} -f ${ARGS} "$@" ${FDIR} &
+	FFS_PID=$!
+
+	while ! mountpoint -q ${FDIR}; do
+		sleep 0.1
+	done
+}
+
+umount_ffs() {
+	fusermount3 -u ${FDIR}
+	wait ${FFS_PID}
+}
+
+# stat_all <label>
+stat_all() {
+	local start=$(now_ns)
+
+	find ${FDIR} -type f -size +1 > /dev/null
+	printf "%-24s %10.3f s\n" "$1" $(echo "($(now_ns) - ${start}) / 1000000000" | bc -l)
+}
+
+mkdir -p ${FDIR}
+create_sources
+
+sync
+echo 3 > /proc/sys/vm/drop_caches 2>/dev/null
+
+start=$(now_ns)
+mount_ffs --prescan --prescan-file=${SNAPSHOT}
+while [ ! -e ${SNAPSHOT} ]; do
+	sleep 0.01
+done
+printf "%-24s %10.3f s\n" "scan" $(echo "($(now_ns) - ${start}) / 1000000000" | bc -l)
+printf "%-24s %10u bytes\n" "snapshot" $(stat -c %s ${SNAPSHOT})
+umount_ffs
+
+mount_ffs
+stat_all "stat without snapshot"
+umount_ffs
+
+mount_ffs --prescan-file=${SNAPSHOT}
+stat_all "stat with snapshot"
+umount_ffs
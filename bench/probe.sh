@@ -0,0 +1,72 @@
+#! /bin/bash
+#
+# Counts the FUSE requests caused by tools that probe every directory of a tree
+# for names like .git, __pycache__ or node_modules. Each of the ${DIRS}
+# directories contains a .git directory that is excluded by a rule, the other
+# names do not exist. The probes are repeated ${ROUNDS} times with a pause of
+# two seconds and the requests are counted in the debug output of libfuse for
+# different timeout options. Set SPARSEFS to compare different builds.
+#
+# usage: ./probe.sh [directories] [rounds]
+
+DIRS=${1:-1000}
+ROUNDS=${2:-3}
+SPARSEFS=${SPARSEFS:-../sparsefs}
+WORKDIR=$(mktemp -d $(pwd)/probe.XXXXXX)
+SDIR=${WORKDIR}/src
+FDIR=${WORKDIR}/fuse
+LOG=${WORKDIR}/log
+
+cleanup() {
+	mountpoint -q ${FDIR} && fusermount3 -zu ${FDIR}
+	rm -rf ${WORKDIR}
+}
+
+trap cleanup EXIT
+
+mkdir -p ${FDIR}
+for i in $(seq 1 ${DIRS}); do
+	mkdir -p ${SDIR}/d$i/.git
+	touch ${SDIR}/d$i/file
+done
+
+# run <options...>
+run() {
+	${SPARSEFS} -f -d -s ${SDIR} -X "**/.git" "$@" ${FDIR} 2> ${LOG} &
+	FFS_PID=$!
+
+	while ! mountpoint -q ${FDIR}; do
+		sleep 0.1
+	done
+
+	ls ${FDIR} > /dev/null
+	skip=$(wc -l < ${LOG})
+
+	for round in $(seq 1 ${ROUNDS}); do
+		[ ${round} -gt 1 ] && sleep 2
+
+		for i in $(seq 1 ${DIRS}); do
+			echo ${FDIR}/d$i/.git ${FDIR}/d$i/__pycache__ \
+				${FDIR}/d$i/node_modules
+		done | xargs stat > /dev/null 2>&1
+	done
+
+	fusermount3 -u ${FDIR}
+	wait ${FFS_PID}
+
+	# only count the requests of the probes
+	tail -n +$(( skip + 1 )) ${LOG} > ${LOG}.probes
+
+	printf "%-56s %10u %10u %10u\n" "${*:-(defaults)}" \
+		$(grep -c "opcode: LOOKUP" ${LOG}.probes) \
+		$(grep -c "opcode: GETATTR" ${LOG}.probes) \
+		$(grep -c "^unique:" ${LOG}.probes)
+}
+
+printf "%-56s %10s %10s %10s\n" "options" "lookups" "getattrs" "requests"
+
+run
+run --negative-timeout=1
+run --lowlevel --excluded-timeout=0
+run --lowlevel
+run --lowlevel --negative-timeout=1
@@ -0,0 +1,79 @@
+#! /bin/bash
+#
+# Measures the listing of a directory that is merged from multiple sources.
+# For 2, 4 and 8 sources, every source contains ${ENTRIES} files of which half
+# also exist in the previous source. The directory is listed through a fresh
+# mount and the wall clock and the CPU time the sparsefs process spent are
+# reported. Set SPARSEFS to compare different builds.
+#
+# usage: ./readdir.sh [entries per source]
+
+ENTRIES=${1:-100000}
+SPARSEFS=${SPARSEFS:-../sparsefs}
+WORKDIR=$(mktemp -d $(pwd)/readdir.XXXXXX)
+FDIR=${WORKDIR}/fuse
+CLK_TCK=$(getconf CLK_TCK)
+
+cleanup() {
+	mountpoint -q ${FDIR} && fusermount3 -zu ${FDIR}
+	rm -rf ${WORKDIR}
+}
+
+trap cleanup EXIT
+
+# prints the user+system CPU time of a process in clock ticks
+cputicks() {
+	awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+now_ns() {
+	date +%s%N
+}
+
+# create_source <index>
+create_source() {
+	mkdir -p ${WORKDIR}/src$1/dir
+
+	# shift the names by half a directory per source
+	(cd ${WORKDIR}/src$1/dir && seq -f "f%.0f" $(( $1 * ENTRIES / 2 )) \
+		$(( $1 * ENTRIES / 2 + ENTRIES - 1 )) | xargs touch)
+}
+
+mkdir -p ${FDIR}
+
+printf "%8s %10s %12s %12s\n" "sources" "entries" "time ms" "CPU ms"
+
+for n_sources in 2 4 8; do
+	args=""
+	for i in $(seq 0 $(( n_sources - 1 ))); do
+		[ -d ${WORKDIR}/src$i ] || create_source $i
+		args="${args} -s ${WORKDIR}/src$i"
+	done
+
+	${SPARSEFS} -f ${args} ${FDIR} &
+	FFS_PID=$!
+
+	while ! mountpoint -q ${FDIR}; do
+		sleep 0.1
+	done
+
+	# make sure the source directories are in the dentry cache
+	for i in $(seq 0 $(( n_sources - 1 ))); do
+		ls -f ${WORKDIR}/src$i/dir > /dev/null
+	done
+
+	start_cpu=$(cputicks ${FFS_PID})
+	start=$(now_ns)
+	entries=$(ls -f ${FDIR}/dir | wc -l)
+	end=$(now_ns)
+	end_cpu=$(cputicks ${FFS_PID})
+
+	awk -v n=${n_sources} -v entries=${entries} -v ns=$((end - start)) \
+		-v ticks=$((end_cpu - start_cpu)) -v hz=${CLK_TCK} 'BEGIN {
+		printf "%8u %10u %12.1f %12.1f\n", n, entries, ns / 1e6,
+			ticks * 1e3 / hz
+	}'
+
+	fusermount3 -u ${FDIR}
+	wait ${FFS_PID}
+done
@@ -0,0 +1,161 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Microbenchmark of the per-path decision cost of the wildcard rules
+ *
+ *  Compares the linear evaluation of the rule chain with wildmatch() against
+ *  the compiled rule matcher for synthetic rule sets of different sizes.
+ *
+ *  usage: rulebench [number of rules...]
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rulematch.h"
+#include "wildmatch.h"
+
+#define N_PATHS 100000
+#define MAX_LEN 128
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_rule(char *buf, unsigned int n_rules)
+{
+	unsigned int a = rand() % (n_rules / 4 + 1);
+	unsigned int b = rand() % 16;
+
+	switch (rand() % 6) {
+		case 0: snprintf(buf, MAX_LEN, "/data/src/d%u/**", a); break;
+		case 1: snprintf(buf, MAX_LEN, "/data/**/*.e%u", a); break;
+		case 2: snprintf(buf, MAX_LEN, "/data/src/d%u/*/f%u*", a, b); break;
+		case 3: snprintf(buf, MAX_LEN, "**/n%u", a); break;
+		case 4: snprintf(buf, MAX_LEN, "/data/src/d%u/s?/*.e%u", a, b); break;
+		case 5: snprintf(buf, MAX_LEN, "/data/src/d*/x%u/**", a); break;
+	}
+}
+
+static void make_path(char *buf, unsigned int n_rules)
+{
+	unsigned int a = rand() % (n_rules / 4 + 1);
+	unsigned int b = rand() % 16;
+
+	switch (rand() % 3) {
+		case 0: snprintf(buf, MAX_LEN, "/data/src/d%u/s%u/f%u.e%u", a, b % 10, b, b); break;
+		case 1: snprintf(buf, MAX_LEN, "/data/src/d%u/x%u/y/z.txt", b, a); break;
+		case 2: snprintf(buf, MAX_LEN, "/data/lib/d%u/n%u", b, a); break;
+	}
+}
+
+static int match_linear(char (*rules)[MAX_LEN], unsigned int n_rules, const char *path)
+{
+	unsigned int i;
+
+	for (i=0; i < n_rules; i++) {
+		if (wildmatch(rules[i], path, WM_PATHNAME, NULL) == WM_MATCH)
+			return i;
+	}
+
+	return -1;
+}
+
+static int bench(unsigned int n_rules)
+{
+	struct rule_matcher *m;
+	char (*rules)[MAX_LEN], (*paths)[MAX_LEN];
+	unsigned int i, n_linear, matches;
+	double start, t_compile, t_linear, t_compiled;
+
+	rules = malloc(sizeof(*rules) * n_rules);
+	paths = malloc(sizeof(*paths) * N_PATHS);
+	m = rule_matcher_new();
+	if (!rules || !paths || !m)
+		return -1;
+
+	for (i=0; i < n_rules; i++)
+		make_rule(rules[i], n_rules);
+	for (i=0; i < N_PATHS; i++)
+		make_path(paths[i], n_rules);
+
+	start = now();
+	for (i=0; i < n_rules; i++) {
+		if (rule_matcher_add(m, rules[i]) < 0)
+			return -1;
+	}
+	t_compile = now() - start;
+
+	// keep the number of wildmatch() calls of the linear run bounded
+	n_linear = 100000000 / n_rules;
+	if (n_linear > N_PATHS)
+		n_linear = N_PATHS;
+	if (n_linear < 100)
+		n_linear = 100;
+
+	start = now();
+	for (i=0; i < n_linear; i++) {
+		if (match_linear(rules, n_rules, paths[i]) != rule_matcher_match(m, paths[i])) {
+			fprintf(stderr, "error: mismatch for path %s\n", paths[i]);
+			return -1;
+		}
+	}
+
+	start = now();
+	for (i=0; i < n_linear; i++)
+		match_linear(rules, n_rules, paths[i]);
+	t_linear = now() - start;
+
+	matches = 0;
+	start = now();
+	for (i=0; i < N_PATHS; i++)
+		matches += rule_matcher_match(m, paths[i]) >= 0;
+	t_compiled = now() - start;
+
+	printf("%10u %14.1f %14.1f %14.1f %9.1f%%\n", n_rules, t_compile * 1e3,
+		t_linear * 1e9 / n_linear, t_compiled * 1e9 / N_PATHS,
+		matches * 100.0 / N_PATHS);
+
+	rule_matcher_free(m);
+	free(paths);
+	free(rules);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int default_sizes[] = { 10, 1000, 100000 };
+	int i;
+
+	srand(1);
+
+	printf("%10s %14s %14s %14s %10s\n", "rules", "compile ms",
+		"linear ns/path", "matcher ns/path", "matched");
+
+	if (argc > 1) {
+		for (i=1; i < argc; i++) {
+			if (bench(strtoul(argv[i], NULL, 10)))
+				return 1;
+		}
+	} else {
+		for (i=0; i < 3; i++) {
+			if (bench(default_sizes[i]))
+				return 1;
+		}
+	}
+
+	return 0;
+}
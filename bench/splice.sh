@@ -0,0 +1,83 @@
+#! /bin/bash
+#
+# Compares the splice (read_buf/write_buf) and the copy (read/write) data path
+# of sparsefs. For each mode, a file of ${SIZE_MB} MiB is read and written
+# through a fresh mount and the throughput and the CPU time the sparsefs
+# process spent per MiB are reported.
+#
+# usage: ./splice.sh [size in MiB]
+
+SIZE_MB=${1:-1024}
+SPARSEFS=${SPARSEFS:-../sparsefs}
+WORKDIR=$(mktemp -d $(pwd)/splice.XXXXXX)
+SRC=${WORKDIR}/src
+FDIR=${WORKDIR}/fuse
+CLK_TCK=$(getconf CLK_TCK)
+
+cleanup() {
+	mountpoint -q ${FDIR} && fusermount3 -zu ${FDIR}
+	rm -rf ${WORKDIR}
+}
+
+trap cleanup EXIT
+
+# prints the user+system CPU time of a process in clock ticks
+cputicks() {
+	awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+now_ns() {
+	date +%s%N
+}
+
+mount_ffs() {
+	${SPARSEFS} -f -s ${SRC} "$@" ${FDIR} &
+	FFS_PID=$!
+	
+	while ! mountpoint -q ${FDIR}; do
+		sleep 0.1
+	done
+}
+
+umount_ffs() {
+	fusermount3 -u ${FDIR}
+	wait ${FFS_PID}
+}
+
+# run <label> <command...>
+run() {
+	label=$1
+	shift
+	
+	start_cpu=$(cputicks ${FFS_PID})
+	start=$(now_ns)
+	"$@" 2>/dev/null
+	end=$(now_ns)
+	end_cpu=$(cputicks ${FFS_PID})
+	
+	awk -v label="${label}" -v mb=${SIZE_MB} -v ns=$((end - start)) \
+		-v ticks=$((end_cpu - start_cpu)) -v hz=${CLK_TCK} 'BEGIN {
+		printf "%-14s %10.1f MB/s %10.1f us CPU/MB\n", label,
+			mb / (ns / 1e9), ticks * 1e6 / hz / mb
+	}'
+}
+
+mkdir -p ${SRC} ${FDIR}
+dd if=/dev/urandom of=${SRC}/data bs=1M count=${SIZE_MB} status=none
+
+# make sure the source file is in the page cache
+cat ${SRC}/data > /dev/null
+
+for mode in splice copy; do
+	if [ "${mode}" == "copy" ]; then
+		mount_ffs --no-splice
+	else
+		mount_ffs
+	fi
+	
+	run "${mode} read" dd if=${FDIR}/data of=/dev/null bs=1M
+	run "${mode} write" dd if=/dev/zero of=${FDIR}/data bs=1M \
+		count=${SIZE_MB} conv=notrunc
+	
+	umount_ffs
+done
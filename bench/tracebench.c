@@ -0,0 +1,345 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Replays a trace of paths against a rule set without a mount
+ *
+ *  Loads the rules like sparsefs with the same options and evaluates every
+ *  path of the trace with the decision code of the mount, so rule sets can
+ *  be compared and tuned before they are deployed. Prints the time to load
+ *  the rules, the time per decision and the allocations of both. With -v,
+ *  the verdict of every path and the rule that decided it are printed.
+ *
+ *  The trace has one path in each line, e.g., the output of
+ *  "find /path/to/source". Paths that are not absolute, e.g., of "find .",
+ *  are taken relative to the first source.
+ *
+ *  usage: tracebench [options] <trace file or ->
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "filter.h"
+#include "ignore.h"
+#include "ruleset.h"
+
+struct trace {
+	char **paths; /* real paths, or FUSE paths with relative rules */
+	size_t n, size;
+};
+
+static unsigned long n_allocs;
+static unsigned long alloc_bytes;
+
+#ifdef __GLIBC__
+/*
+ * Counts the allocations of the rules and the decisions. glibc allows
+ * replacing malloc() and provides the original functions under these names.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	__atomic_fetch_add(&n_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	__atomic_fetch_add(&n_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&alloc_bytes, n * size, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&n_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&alloc_bytes, size, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns the path that the mount would evaluate for a line of the trace: the
+ * real path or, with relative rules, the part after the longest source path.
+ */
+static char *trace_path(const struct conf *conf, const char *line, int relative)
+{
+	const struct source *src = &conf->sources[0];
+	char buf[PATH_MAX];
+	size_t len = 0;
+	unsigned int i;
+
+	if (line[0] != '/') {
+		if (line[0] == '.' && (line[1] == '/' || line[1] == 0))
+			line++;
+		if (line[0] == '/')
+			line++;
+		if (snprintf(buf, PATH_MAX, "%s%s", src->path, line) >= PATH_MAX)
+			return NULL;
+		line = buf;
+	}
+
+	if (!relative)
+		return strdup(line);
+
+	for (i=0; i < conf->n_sources; i++) {
+		if (conf->sources[i].len > len &&
+			!strncmp(line, conf->sources[i].path, conf->sources[i].len))
+			len = conf->sources[i].len;
+	}
+
+	// the trailing '/' of the source path is the start of the FUSE path
+	if (len == 0)
+		return strdup(line);
+	if (line[len] == 0)
+		return strdup("/");
+
+	return strdup(&line[len - 1]);
+}
+
+static int read_trace(struct trace *t, const struct conf *conf, const char *filename,
+					int relative)
+{
+	char line[PATH_MAX];
+	char **paths;
+	size_t len;
+	FILE *f;
+
+	f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+	if (!f)
+		return -1;
+
+	while (fgets(line, PATH_MAX, f)) {
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[--len] = 0;
+		if (len == 0)
+			continue;
+
+		if (t->n == t->size) {
+			t->size = t->size ? t->size * 2 : 1024;
+			paths = realloc(t->paths, t->size * sizeof(char *));
+			if (!paths)
+				return -1;
+			t->paths = paths;
+		}
+
+		t->paths[t->n] = trace_path(conf, line, relative);
+		if (!t->paths[t->n])
+			return -1;
+		t->n++;
+	}
+
+	if (f != stdin)
+		fclose(f);
+
+	return 0;
+}
+
+static void print_verdicts(const struct conf *conf, struct ignore *ig,
+					const struct trace *t, int relative)
+{
+	const struct rule *rule;
+	int exclude;
+	size_t i;
+
+	for (i=0; i < t->n; i++) {
+		if (relative)
+			exclude = filter_fuse_path(conf, ig, t->paths[i], NULL);
+		else
+			exclude = filter_real_path(conf, ig, t->paths[i], NULL);
+
+		// literals of precompiled rule files have no pattern
+		rule = ruleset_match(conf->rules, t->paths[i]);
+		printf("%c %s\t%s\n", exclude ? '-' : '+', t->paths[i],
+			rule ? (rule->pattern[0] ? rule->pattern : "(precompiled)") :
+			"(default)");
+	}
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [options] <trace file or ->\n"
+		"\n"
+		"options:\n"
+		"  -s <dir>       source directory, can be given multiple times\n"
+		"  -i <patterns>  include rules separated by ':'\n"
+		"  -e <patterns>  exclude rules separated by ':'\n"
+		"  -I <file>      file with include rules\n"
+		"  -E <file>      file with exclude rules\n"
+		"  -x             exclude paths that no rule matches\n"
+		"  -p             enable the prune mode, like --prune\n"
+		"  -r             match relative to the sources, like --relative-rules\n"
+		"  -g <name>      read ignore files with this name, like --ignore-file\n"
+		"  -n <n>         replay the trace n times (default 10)\n"
+		"  -v             print the verdict and the deciding rule of every path\n"
+		"\n"
+		"The rules are applied in the order they are given, like in sparsefs.\n",
+		argv0);
+}
+
+int main(int argc, char **argv)
+{
+	struct trace t = { 0 };
+	struct conf *conf;
+	struct ignore *ig = NULL;
+	const char *ignore_name = NULL;
+	unsigned long load_allocs, load_bytes, allocs, bytes;
+	unsigned int rep, n_reps = 10, n_excluded = 0;
+	double start, t_load, t_decide;
+	int opt, r, relative = 0, verbose = 0, has_rules = 0;
+	size_t i;
+
+	conf = conf_new();
+	if (!conf)
+		return 1;
+
+	conf->rules = ruleset_new();
+	if (!conf->rules)
+		return 1;
+
+	load_allocs = n_allocs;
+	load_bytes = alloc_bytes;
+	start = now();
+
+	while ((opt = getopt(argc, argv, "s:i:e:I:E:xprg:n:v")) != -1) {
+		r = 0;
+		switch (opt) {
+			case 's':
+				r = conf_add_source(conf, optarg);
+				break;
+			case 'i':
+			case 'e':
+				r = ruleset_append_list(conf->rules, optarg, opt == 'e');
+				has_rules = 1;
+				break;
+			case 'I':
+			case 'E':
+				r = ruleset_parse_file(conf->rules, optarg, opt == 'E');
+				has_rules = 1;
+				break;
+			case 'x': conf->default_exclude = 1; break;
+			case 'r': relative = 1; break;
+			case 'g': ignore_name = optarg; break;
+			case 'n': n_reps = strtoul(optarg, NULL, 10); break;
+			case 'v': verbose = 1; break;
+			case 'p':
+				if (has_rules) {
+					fprintf(stderr, "error: -p must be given before the rules\n");
+					return 1;
+				}
+				r = ruleset_enable_prune(conf->rules);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+
+		if (r) {
+			fprintf(stderr, "error: cannot use -%c %s\n", opt, optarg ? optarg : "");
+			return 1;
+		}
+	}
+
+	if (ruleset_compile(conf->rules)) {
+		fprintf(stderr, "error: cannot compile the rules\n");
+		return 1;
+	}
+
+	t_load = now() - start;
+	load_allocs = n_allocs - load_allocs;
+	load_bytes = alloc_bytes - load_bytes;
+
+	if (optind != argc - 1 || conf->n_sources == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (read_trace(&t, conf, argv[optind], relative)) {
+		fprintf(stderr, "error: cannot read the trace \"%s\"\n", argv[optind]);
+		return 1;
+	}
+
+	// the ignore files read the sources of the published configuration
+	if (conf_publish(conf))
+		return 1;
+
+	if (ignore_name) {
+		ig = ignore_new(ignore_name, 1e9, NULL);
+		if (!ig) {
+			fprintf(stderr, "error: cannot allocate the ignore files\n");
+			return 1;
+		}
+	}
+
+	if (verbose)
+		print_verdicts(conf, ig, &t, relative);
+
+	// the first replay reads the ignore files, it is not measured
+	if (ig) {
+		for (i=0; i < t.n; i++) {
+			if (relative)
+				filter_fuse_path(conf, ig, t.paths[i], NULL);
+			else
+				filter_real_path(conf, ig, t.paths[i], NULL);
+		}
+	}
+
+	n_allocs = 0;
+	alloc_bytes = 0;
+	start = now();
+	for (rep=0; rep < n_reps; rep++) {
+		for (i=0; i < t.n; i++) {
+			if (relative)
+				n_excluded += filter_fuse_path(conf, ig, t.paths[i], NULL);
+			else
+				n_excluded += filter_real_path(conf, ig, t.paths[i], NULL);
+		}
+	}
+	t_decide = now() - start;
+
+	// printf() allocates its buffer
+	allocs = n_allocs;
+	bytes = alloc_bytes;
+
+	printf("%-20s %14zu\n", "paths", t.n);
+	printf("%-20s %14.1f\n", "load ms", t_load * 1e3);
+	printf("%-20s %14lu\n", "load allocations", load_allocs);
+	printf("%-20s %14lu\n", "load bytes", load_bytes);
+	if (t.n && n_reps) {
+		printf("%-20s %13.1f%%\n", "excluded", n_excluded * 100.0 / t.n / n_reps);
+		printf("%-20s %14.1f\n", "ns/decision", t_decide * 1e9 / t.n / n_reps);
+		printf("%-20s %14.3f\n", "allocations/decision", (double) allocs / t.n / n_reps);
+		printf("%-20s %14.1f\n", "bytes/decision", (double) bytes / t.n / n_reps);
+	}
+
+	ignore_free(ig);
+	for (i=0; i < t.n; i++)
+		free(t.paths[i]);
+	free(t.paths);
+
+	return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Microbenchmark of wildmatch() against precompiled patterns
+ *
+ *  Matches typical rule patterns and patterns that make wildmatch()
+ *  backtrack against synthetic paths and prints the time per match of both
+ *  and the time to compile a pattern.
+ *
+ *  usage: wildbench [paths]
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wildmatch.h"
+#include "wildprog.h"
+
+#define MAX_LEN 256
+
+static const char *patterns[] = {
+	"/data/src/d1/**",
+	"/data/**/*.e3",
+	"/data/src/d*/s?/*.e1[0-5]",
+	"**/node_modules/**",
+	"**/n1",
+	"/data/**/d*/**/x*/**/*.txt",
+	"**/*a*a*a*a*a*b",
+};
+#define N_PATTERNS (sizeof(patterns) / sizeof(patterns[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_path(char *buf)
+{
+	unsigned int a = rand() % 16;
+	unsigned int b = rand() % 16;
+
+	switch (rand() % 4) {
+		case 0: snprintf(buf, MAX_LEN, "/data/src/d%u/s%u/f%u.e%u", a, b % 10, b, b); break;
+		case 1: snprintf(buf, MAX_LEN, "/data/src/d%u/x%u/y/z.txt", b, a); break;
+		case 2: snprintf(buf, MAX_LEN, "/data/lib/d%u/node_modules/n%u", b, a); break;
+		case 3: snprintf(buf, MAX_LEN, "/data/aaaaaaaaaaaaaaaa%u/aaaaaaaaaaaaaaaa%u", a, b); break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct wildprog *wp;
+	char (*paths)[MAX_LEN];
+	unsigned int i, j, n_paths, n_compile, matches;
+	double start, t_compile, t_wildmatch, t_compiled;
+
+	n_paths = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+
+	paths = malloc(sizeof(*paths) * n_paths);
+	if (!paths)
+		return 1;
+
+	srand(1);
+	for (i=0; i < n_paths; i++)
+		make_path(paths[i]);
+
+	printf("%-28s %12s %16s %16s %10s\n", "pattern", "compile ns",
+		"wildmatch ns", "compiled ns", "matched");
+
+	for (i=0; i < N_PATTERNS; i++) {
+		n_compile = 10000;
+		start = now();
+		for (j=0; j < n_compile; j++)
+			wildprog_free(wildprog_compile(patterns[i], WM_PATHNAME));
+		t_compile = now() - start;
+
+		wp = wildprog_compile(patterns[i], WM_PATHNAME);
+		if (!wp)
+			return 1;
+
+		for (j=0; j < n_paths; j++) {
+			if ((wildmatch(patterns[i], paths[j], WM_PATHNAME, NULL) == WM_MATCH) !=
+				(wildprog_match(wp, paths[j]) == WM_MATCH)) {
+				fprintf(stderr, "error: mismatch for %s and %s\n", patterns[i], paths[j]);
+				return 1;
+			}
+		}
+
+		start = now();
+		for (j=0; j < n_paths; j++)
+			wildmatch(patterns[i], paths[j], WM_PATHNAME, NULL);
+		t_wildmatch = now() - start;
+
+		matches = 0;
+		start = now();
+		for (j=0; j < n_paths; j++)
+			matches += wildprog_match(wp, paths[j]) == WM_MATCH;
+		t_compiled = now() - start;
+
+		printf("%-28s %12.1f %16.1f %16.1f %9.1f%%\n", patterns[i],
+			t_compile * 1e9 / n_compile, t_wildmatch * 1e9 / n_paths,
+			t_compiled * 1e9 / n_paths, matches * 100.0 / n_paths);
+
+		wildprog_free(wp);
+	}
+
+	free(paths);
+
+	return 0;
+}
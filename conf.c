@@ -0,0 +1,136 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Versioned configuration that is shared by all FUSE threads
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * The current version is a single pointer that is replaced with RCU. A thread
+ * that called conf_get() is in a read section, so the version it got is only
+ * freed after it called conf_put(). Publishing is serialized by a mutex and
+ * waits for a grace period before it frees the previous version.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "conf.h"
+#include "rcu.h"
+
+static struct conf *current;
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct conf *conf_new(void)
+{
+	return calloc(1, sizeof(struct conf));
+}
+
+void conf_free(struct conf *c)
+{
+	unsigned int i;
+
+	if (!c)
+		return;
+
+	for (i=0; i < c->n_sources; i++)
+		free(c->sources[i].path);
+	free(c->sources);
+
+	ruleset_free(c->rules);
+	free(c);
+}
+
+int conf_add_source(struct conf *c, const char *path)
+{
+	struct source *sources;
+	size_t len;
+	char *copy;
+
+	len = strlen(path);
+
+	copy = malloc(len + 2);
+	if (!copy)
+		return -1;
+
+	// make sure the path ends with a '/'
+	if (len && path[len-1] == '/')
+		strcpy(copy, path);
+	else
+		sprintf(copy, "%s/", path);
+
+	sources = realloc(c->sources, sizeof(struct source) * (c->n_sources + 1));
+	if (!sources) {
+		free(copy);
+		return -1;
+	}
+
+	c->sources = sources;
+	c->sources[c->n_sources].path = copy;
+	c->sources[c->n_sources].len = strlen(copy);
+	c->n_sources++;
+
+	return 0;
+}
+
+struct conf *conf_copy(const struct conf *c)
+{
+	struct conf *copy;
+	unsigned int i;
+
+	copy = conf_new();
+	if (!copy)
+		return NULL;
+
+	copy->default_exclude = c->default_exclude;
+
+	for (i=0; i < c->n_sources; i++) {
+		if (conf_add_source(copy, c->sources[i].path)) {
+			conf_free(copy);
+			return NULL;
+		}
+	}
+
+	return copy;
+}
+
+const struct conf *conf_get(void)
+{
+	rcu_read_lock();
+
+	return rcu_dereference(current);
+}
+
+void conf_put(const struct conf *c)
+{
+	rcu_read_unlock();
+}
+
+int conf_publish(struct conf *c)
+{
+	struct conf *old;
+
+	pthread_mutex_lock(&publish_lock);
+
+	old = current;
+	if (old && old->n_sources != c->n_sources) {
+		pthread_mutex_unlock(&publish_lock);
+		return -1;
+	}
+
+	c->version = old ? old->version + 1 : 1;
+	rcu_assign_pointer(current, c);
+	rcu_synchronize();
+
+	pthread_mutex_unlock(&publish_lock);
+
+	conf_free(old);
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Versioned configuration that is shared by all FUSE threads
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef CONF_H
+#define CONF_H
+
+#include <ruleset.h>
+
+struct source {
+	char *path; /* absolute, ends with a '/' */
+	size_t len;
+};
+
+/*
+ * A version of the configuration. Once it was published with conf_publish(),
+ * it is never modified, so FUSE threads read it without locks. A change, e.g.,
+ * reloading the rules, publishes a copy with a higher version.
+ *
+ * Open files, inodes and directory snapshots refer to sources by their index,
+ * so all versions have the same number of sources.
+ */
+struct conf {
+	unsigned long version;
+
+	struct source *sources;
+	unsigned int n_sources;
+
+	struct ruleset *rules;
+	int default_exclude;
+};
+
+/* returns an empty configuration that is not published yet */
+struct conf *conf_new(void);
+
+/* returns an unpublished copy of the sources and the default of c, without rules */
+struct conf *conf_copy(const struct conf *c);
+
+void conf_free(struct conf *c);
+
+/* appends a source to an unpublished configuration, a '/' is added if missing */
+int conf_add_source(struct conf *c, const char *path);
+
+/*
+ * Returns the current version and keeps it valid until conf_put(). Both never
+ * block and can be nested, but the version should not be held while waiting
+ * for something else, as it delays the next conf_publish().
+ */
+const struct conf *conf_get(void);
+void conf_put(const struct conf *c);
+
+/*
+ * Makes c the current version and frees the previous version once no thread
+ * holds it anymore. Returns -1 if the number of sources differs from the
+ * current version, in this case c is not published.
+ */
+int conf_publish(struct conf *c);
+
+#endif
@@ -0,0 +1,317 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Snapshots of merged directory listings and a cache to share them
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * A snapshot stores the entries in a single array and their names in a single
+ * growing buffer. Entries refer to their names by offset, so growing the
+ * buffer does not invalidate them and a snapshot needs only a few
+ * allocations even for huge directories. If the snapshot was created with
+ * attributes, the complete stat data of the entries is kept in a second array.
+ *
+ * Snapshots are reference counted: every open directory handle and the cache
+ * hold a reference. The cache is direct-mapped like the path cache and
+ * protected by a single mutex as it is only used by opendir().
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dircache.h"
+#include "hash.h"
+
+struct dir_entry {
+	size_t name;
+	ino_t ino;
+	mode_t mode;
+};
+
+struct dir_snapshot {
+	unsigned long refs;
+
+	char *path;
+	struct timespec *mtimes;
+	unsigned int n_mtimes;
+
+	struct dir_entry *entries;
+	struct stat *attrs; /* only if has_attrs is set */
+	int has_attrs;
+	size_t count;
+	size_t size;
+
+	char *names;
+	size_t names_used;
+	size_t names_size;
+};
+
+struct dir_cache {
+	struct dir_snapshot **slots;
+	unsigned int size;
+
+	unsigned long hits;
+	unsigned long misses;
+
+	pthread_mutex_t lock;
+};
+
+struct dir_snapshot *dir_snapshot_new(const char *path,
+				const struct timespec *mtimes, unsigned int n_mtimes,
+				int attrs)
+{
+	struct dir_snapshot *s;
+
+	s = calloc(1, sizeof(struct dir_snapshot));
+	if (!s)
+		return NULL;
+
+	s->refs = 1;
+	s->path = strdup(path);
+	s->mtimes = malloc(sizeof(struct timespec) * (n_mtimes + 1));
+	if (!s->path || !s->mtimes) {
+		free(s->path);
+		free(s->mtimes);
+		free(s);
+		return NULL;
+	}
+
+	memcpy(s->mtimes, mtimes, sizeof(struct timespec) * n_mtimes);
+	s->n_mtimes = n_mtimes;
+
+	s->has_attrs = attrs;
+
+	return s;
+}
+
+void dir_snapshot_ref(struct dir_snapshot *s)
+{
+	__atomic_fetch_add(&s->refs, 1, __ATOMIC_RELAXED);
+}
+
+void dir_snapshot_unref(struct dir_snapshot *s)
+{
+	if (!s || __atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	free(s->path);
+	free(s->mtimes);
+	free(s->entries);
+	free(s->attrs);
+	free(s->names);
+	free(s);
+}
+
+int dir_snapshot_add(struct dir_snapshot *s, const char *name,
+				const struct stat *st)
+{
+	size_t len, size;
+	void *p;
+
+	if (s->count == s->size) {
+		size = s->size ? s->size * 2 : 64;
+
+		p = realloc(s->entries, sizeof(struct dir_entry) * size);
+		if (!p)
+			return -1;
+		s->entries = p;
+
+		if (s->has_attrs) {
+			p = realloc(s->attrs, sizeof(struct stat) * size);
+			if (!p)
+				return -1;
+			s->attrs = p;
+		}
+
+		s->size = size;
+	}
+
+	len = strlen(name) + 1;
+	if (s->names_size - s->names_used < len) {
+		size = s->names_size ? s->names_size * 2 : 1024;
+		while (size - s->names_used < len)
+			size *= 2;
+
+		p = realloc(s->names, size);
+		if (!p)
+			return -1;
+
+		s->names = p;
+		s->names_size = size;
+	}
+
+	memcpy(s->names + s->names_used, name, len);
+
+	s->entries[s->count].name = s->names_used;
+	s->entries[s->count].ino = st->st_ino;
+	s->entries[s->count].mode = st->st_mode;
+	if (s->has_attrs)
+		s->attrs[s->count] = *st;
+	s->count++;
+	s->names_used += len;
+
+	return 0;
+}
+
+size_t dir_snapshot_count(const struct dir_snapshot *s)
+{
+	return s->count;
+}
+
+const char *dir_snapshot_entry(const struct dir_snapshot *s, size_t i,
+				struct stat *st)
+{
+	if (s->has_attrs) {
+		*st = s->attrs[i];
+	} else {
+		memset(st, 0, sizeof(struct stat));
+		st->st_ino = s->entries[i].ino;
+		st->st_mode = s->entries[i].mode;
+	}
+
+	return s->names + s->entries[i].name;
+}
+
+struct dir_cache *dir_cache_new(unsigned int size)
+{
+	struct dir_cache *c;
+
+	c = calloc(1, sizeof(struct dir_cache));
+	if (!c)
+		return NULL;
+
+	c->size = size;
+	c->slots = calloc(size, sizeof(struct dir_snapshot *));
+	if (!c->slots) {
+		free(c);
+		return NULL;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+
+	return c;
+}
+
+void dir_cache_free(struct dir_cache *c)
+{
+	if (!c)
+		return;
+
+	dir_cache_clear(c);
+	pthread_mutex_destroy(&c->lock);
+	free(c->slots);
+	free(c);
+}
+
+static unsigned int dc_slot(struct dir_cache *c, const char *path)
+{
+	return hash_string(path) % c->size;
+}
+
+static int dc_same_mtimes(const struct dir_snapshot *s,
+				const struct timespec *mtimes, unsigned int n_mtimes)
+{
+	unsigned int i;
+
+	if (s->n_mtimes != n_mtimes)
+		return 0;
+
+	for (i=0; i < n_mtimes; i++) {
+		if (s->mtimes[i].tv_sec != mtimes[i].tv_sec ||
+			s->mtimes[i].tv_nsec != mtimes[i].tv_nsec)
+			return 0;
+	}
+
+	return 1;
+}
+
+struct dir_snapshot *dir_cache_lookup(struct dir_cache *c, const char *path,
+				const struct timespec *mtimes, unsigned int n_mtimes)
+{
+	struct dir_snapshot *s;
+	unsigned int slot;
+
+	slot = dc_slot(c, path);
+
+	pthread_mutex_lock(&c->lock);
+
+	s = c->slots[slot];
+	if (s && !strcmp(s->path, path) && dc_same_mtimes(s, mtimes, n_mtimes)) {
+		dir_snapshot_ref(s);
+		c->hits++;
+	} else {
+		s = NULL;
+		c->misses++;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	return s;
+}
+
+void dir_cache_insert(struct dir_cache *c, struct dir_snapshot *s)
+{
+	struct dir_snapshot *old;
+	struct timespec now;
+	unsigned int i, slot;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	for (i=0; i < s->n_mtimes; i++) {
+		if (s->mtimes[i].tv_sec >= now.tv_sec - 1)
+			return;
+	}
+
+	slot = dc_slot(c, s->path);
+	dir_snapshot_ref(s);
+
+	pthread_mutex_lock(&c->lock);
+	old = c->slots[slot];
+	c->slots[slot] = s;
+	pthread_mutex_unlock(&c->lock);
+
+	dir_snapshot_unref(old);
+}
+
+void dir_cache_clear(struct dir_cache *c)
+{
+	struct dir_snapshot *old;
+	unsigned int i;
+
+	for (i=0; i < c->size; i++) {
+		pthread_mutex_lock(&c->lock);
+		old = c->slots[i];
+		c->slots[i] = NULL;
+		pthread_mutex_unlock(&c->lock);
+
+		dir_snapshot_unref(old);
+	}
+}
+
+void dir_cache_foreach(struct dir_cache *c,
+				void (*fn)(const char *path, void *data), void *data)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&c->lock);
+	for (i=0; i < c->size; i++) {
+		if (c->slots[i])
+			fn(c->slots[i]->path, data);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void dir_cache_stats(struct dir_cache *c, unsigned long *hits,
+				unsigned long *misses)
+{
+	pthread_mutex_lock(&c->lock);
+	*hits = c->hits;
+	*misses = c->misses;
+	pthread_mutex_unlock(&c->lock);
+}
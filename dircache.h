@@ -0,0 +1,77 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Snapshots of merged directory listings and a cache to share them
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+struct dir_snapshot;
+struct dir_cache;
+
+/*
+ * Creates an empty snapshot of a FUSE directory. The snapshot is valid as long
+ * as the n_mtimes source directories have the given modification times. A
+ * source without this directory has a tv_sec of -1. If attrs is set, the
+ * complete stat data of the entries is stored, otherwise only the inode
+ * number and the type.
+ */
+struct dir_snapshot *dir_snapshot_new(const char *path,
+				const struct timespec *mtimes, unsigned int n_mtimes,
+				int attrs);
+
+/* the reference of the creator counts as well */
+void dir_snapshot_ref(struct dir_snapshot *s);
+void dir_snapshot_unref(struct dir_snapshot *s);
+
+/* appends an entry, returns -1 on error */
+int dir_snapshot_add(struct dir_snapshot *s, const char *name,
+				const struct stat *st);
+
+size_t dir_snapshot_count(const struct dir_snapshot *s);
+
+/* returns the name of entry i and stores its attributes in st */
+const char *dir_snapshot_entry(const struct dir_snapshot *s, size_t i,
+				struct stat *st);
+
+/* creates a cache for up to size snapshots, returns NULL on error */
+struct dir_cache *dir_cache_new(unsigned int size);
+void dir_cache_free(struct dir_cache *c);
+
+/*
+ * Returns a new reference to a cached snapshot of path if the source
+ * directories still have the given modification times, otherwise NULL.
+ */
+struct dir_snapshot *dir_cache_lookup(struct dir_cache *c, const char *path,
+				const struct timespec *mtimes, unsigned int n_mtimes);
+
+/*
+ * Stores a snapshot in the cache, replacing an older snapshot in its slot.
+ * Snapshots of directories that were modified within the last second are not
+ * stored as further changes in the same second might not change the mtime.
+ */
+void dir_cache_insert(struct dir_cache *c, struct dir_snapshot *s);
+
+void dir_cache_clear(struct dir_cache *c);
+
+/*
+ * Calls fn for the path of every cached snapshot. fn is called while the
+ * lock of the cache is held and must not use the cache.
+ */
+void dir_cache_foreach(struct dir_cache *c,
+				void (*fn)(const char *path, void *data), void *data);
+
+void dir_cache_stats(struct dir_cache *c, unsigned long *hits,
+				unsigned long *misses);
+
+#endif
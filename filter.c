@@ -0,0 +1,126 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Decision of the rules and ignore files whether a path is excluded
+ *
+ *  These functions do not depend on FUSE or on a mount, so they are also
+ *  linked into the benchmarks that replay paths against a rule set.
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <string.h>
+
+#include "filter.h"
+
+/*
+ * Returns the verdict of the ignore files for a FUSE path that no rule
+ * matched, or exclude if no pattern matches
+ */
+static int ignored(struct ignore *ig, const char *fuse_path, int exclude)
+{
+	int r;
+
+	if (!ig)
+		return exclude;
+
+	r = ignore_match(ig, fuse_path);
+
+	return r >= 0 ? r : exclude;
+}
+
+/*
+ * Like ignored() for a real path. The ignore files look at the FUSE path,
+ * which is the part after the longest source path.
+ */
+static int ignored_real_path(const struct conf *conf, struct ignore *ig,
+					const char *path, int exclude)
+{
+	size_t len = 0;
+	unsigned int i;
+
+	if (!ig)
+		return exclude;
+
+	for (i=0; i < conf->n_sources; i++) {
+		if (conf->sources[i].len > len &&
+			!strncmp(path, conf->sources[i].path, conf->sources[i].len))
+			len = conf->sources[i].len;
+	}
+
+	// the trailing '/' of the source path is the start of the FUSE path
+	if (len == 0)
+		return exclude;
+
+	return ignored(ig, &path[len - 1], exclude);
+}
+
+int filter_real_path(const struct conf *conf, struct ignore *ig, const char *path,
+				int *by_rules)
+{
+	const struct rule *curr_rule;
+	size_t len;
+	unsigned int i;
+
+	if (by_rules)
+		*by_rules = 1;
+
+	len = strlen(path);
+
+	// always accept "." and ".." directories
+	if (len >= 2 && strcmp(&path[len-2], "/.") == 0)
+		return 0;
+
+	if (len >= 3 && strcmp(&path[len-3], "/..") == 0)
+		return 0;
+
+	// always allow access to the srcdir itself (although it might appear empty)
+	for (i=0; i < conf->n_sources; i++) {
+		if (strcmp(path, conf->sources[i].path) == 0)
+			return 0;
+	}
+
+	curr_rule = ruleset_match(conf->rules, path);
+	if (curr_rule)
+		return curr_rule->exclude;
+
+	if (by_rules && ig)
+		*by_rules = 0;
+
+	return ignored_real_path(conf, ig, path, conf->default_exclude);
+}
+
+int filter_fuse_path(const struct conf *conf, struct ignore *ig, const char *path,
+				int *by_rules)
+{
+	const struct rule *curr_rule;
+	size_t len;
+
+	if (by_rules)
+		*by_rules = 1;
+
+	len = strlen(path);
+
+	// like the sources themselves, the root is always accepted
+	if (len < 2)
+		return 0;
+
+	// always accept "." and ".." directories
+	if (strcmp(&path[len-2], "/.") == 0)
+		return 0;
+
+	if (len >= 3 && strcmp(&path[len-3], "/..") == 0)
+		return 0;
+
+	curr_rule = ruleset_match(conf->rules, path);
+	if (curr_rule)
+		return curr_rule->exclude;
+
+	if (by_rules && ig)
+		*by_rules = 0;
+
+	return ignored(ig, path, conf->default_exclude);
+}
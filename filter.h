@@ -0,0 +1,32 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Decision of the rules and ignore files whether a path is excluded
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <conf.h>
+#include <ignore.h>
+
+/*
+ * Returns 1 if the rules of the configuration exclude a real path in one of
+ * its sources. The ignore files are optional and only asked if no rule
+ * matches. "." and ".." and the sources themselves are always included.
+ * If by_rules is set, it tells whether the verdict is independent of the
+ * ignore files, so it stays the same while the rules do.
+ */
+int filter_real_path(const struct conf *conf, struct ignore *ig, const char *path,
+				int *by_rules);
+
+/* like filter_real_path() for a FUSE path and relative rules, see --relative-rules */
+int filter_fuse_path(const struct conf *conf, struct ignore *ig, const char *path,
+				int *by_rules);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  FNV-1a hash of paths and names, shared by the hash tables of all modules
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_INIT 14695981039346656037ULL
+
+/* adds a value, usually one byte, to a hash that started with HASH_INIT */
+static inline uint64_t hash_add(uint64_t hash, uint64_t value)
+{
+	return (hash ^ value) * 1099511628211ULL;
+}
+
+/* adds len bytes of s to a hash, so a hash can be built from several parts */
+static inline uint64_t hash_update(uint64_t hash, const char *s, size_t len)
+{
+	size_t i;
+
+	for (i=0; i < len; i++)
+		hash = hash_add(hash, (unsigned char) s[i]);
+
+	return hash;
+}
+
+static inline uint64_t hash_bytes(const char *s, size_t len)
+{
+	return hash_update(HASH_INIT, s, len);
+}
+
+static inline uint64_t hash_string(const char *s)
+{
+	uint64_t hash = HASH_INIT;
+
+	for (; *s; s++)
+		hash = hash_add(hash, (unsigned char) *s);
+
+	return hash;
+}
+
+#endif
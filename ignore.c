@@ -0,0 +1,598 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Rules from gitignore-style files in the directories of the sources
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * Every directory whose paths were evaluated has a node with the parsed
+ * ignore file of the directory, if it has one, and a pointer to the node of
+ * its parent. A path is evaluated against the files along this chain, from
+ * its own directory up to the root, and the last pattern that matches in the
+ * deepest file decides, like in git. Whether a directory itself is ignored
+ * is stored in its node, as nothing below an ignored directory can be
+ * included again.
+ *
+ * Nodes are created when a path below them is evaluated for the first time.
+ * The ignore files are read and checked for changes without holding the
+ * lock, only the nodes are changed with the write lock. If an ignore file
+ * changed, the generation is increased, which invalidates the stored state
+ * of all directories. Once there are too many nodes, all of them are
+ * forgotten and created again on demand.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "conf.h"
+#include "hash.h"
+#include "ignore.h"
+#include "wildmatch.h"
+#include "wildprog.h"
+
+// number of hash buckets and of directories that are remembered
+#define IG_MAX_DIRS 65536
+
+#define IG_NEGATE 1
+#define IG_DIR_ONLY 2
+#define IG_ANCHORED 4
+
+struct ig_pattern {
+	char *pattern;
+	struct wildprog *prog; /* NULL if the pattern could not be compiled */
+	int flags;
+};
+
+struct ig_rules {
+	struct ig_pattern *patterns;
+	unsigned int n_patterns;
+};
+
+// identifies the version of an ignore file
+struct ig_file {
+	int source; /* -1 if no source contains the file */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+struct ig_dir {
+	char *path;
+	size_t len;
+	uint64_t hash;
+
+	struct ig_dir *parent;
+	struct ig_dir *next;
+
+	struct ig_rules *rules; /* NULL if the directory has no ignore file */
+	struct ig_file file;
+
+	uint64_t checked; /* time the file was checked, see ig_now() */
+	uint64_t state; /* generation << 1 | ignored */
+};
+
+struct ignore {
+	char *name;
+	uint64_t timeout;
+	void (*changed)(void);
+
+	pthread_rwlock_t lock;
+	struct ig_dir **buckets;
+	unsigned long count;
+	uint64_t generation;
+
+	unsigned long files;
+};
+
+static uint64_t ig_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* returns the length of the parent directory of a FUSE path or 0 for the root */
+static size_t ig_parent_len(const char *path, size_t len)
+{
+	if (len <= 1)
+		return 0;
+
+	while (len > 0 && path[--len] != '/') {}
+
+	return len ? len : 1;
+}
+
+static struct ig_dir *ig_find(const struct ignore *ig, const char *path, size_t len)
+{
+	struct ig_dir *d;
+	uint64_t hash;
+
+	hash = hash_bytes(path, len);
+
+	for (d = ig->buckets[hash & (IG_MAX_DIRS - 1)]; d; d = d->next) {
+		if (d->hash == hash && d->len == len && !memcmp(d->path, path, len))
+			return d;
+	}
+
+	return NULL;
+}
+
+static void ig_rules_free(struct ig_rules *r)
+{
+	unsigned int i;
+
+	if (!r)
+		return;
+
+	for (i=0; i < r->n_patterns; i++) {
+		free(r->patterns[i].pattern);
+		wildprog_free(r->patterns[i].prog);
+	}
+	free(r->patterns);
+	free(r);
+}
+
+static void ig_clear(struct ignore *ig)
+{
+	struct ig_dir *d, *next;
+	size_t i;
+
+	for (i=0; i < IG_MAX_DIRS; i++) {
+		for (d = ig->buckets[i]; d; d = next) {
+			next = d->next;
+			ig_rules_free(d->rules);
+			free(d->path);
+			free(d);
+		}
+		ig->buckets[i] = NULL;
+	}
+
+	ig->count = 0;
+	ig->generation++;
+}
+
+struct ignore *ignore_new(const char *name, double timeout, void (*changed)(void))
+{
+	struct ignore *ig;
+
+	ig = calloc(1, sizeof(struct ignore));
+	if (!ig)
+		return NULL;
+
+	ig->name = strdup(name);
+	ig->buckets = calloc(IG_MAX_DIRS, sizeof(struct ig_dir *));
+	if (!ig->name || !ig->buckets) {
+		free(ig->name);
+		free(ig->buckets);
+		free(ig);
+		return NULL;
+	}
+
+	ig->timeout = timeout * 1e9;
+	ig->changed = changed;
+	ig->generation = 1;
+	pthread_rwlock_init(&ig->lock, NULL);
+
+	return ig;
+}
+
+void ignore_free(struct ignore *ig)
+{
+	if (!ig)
+		return;
+
+	ig_clear(ig);
+	pthread_rwlock_destroy(&ig->lock);
+	free(ig->buckets);
+	free(ig->name);
+	free(ig);
+}
+
+/* builds the real path of a FUSE path in a source, name is appended if set */
+static int ig_real_path(char *buf, const struct source *src, const char *path,
+				size_t len, const char *name)
+{
+	int r;
+
+	if (name)
+		r = snprintf(buf, PATH_MAX, "%s%.*s%s%s", src->path, (int) len - 1,
+				&path[1], len > 1 ? "/" : "", name);
+	else
+		r = snprintf(buf, PATH_MAX, "%s%.*s", src->path, (int) len - 1, &path[1]);
+
+	return r < PATH_MAX ? 0 : -1;
+}
+
+/* finds the ignore file of a directory in the first source that contains it */
+static void ig_stat_file(struct ignore *ig, const char *dir, size_t len,
+				struct ig_file *file, char *realpath)
+{
+	const struct conf *conf;
+	struct stat st;
+	unsigned int i;
+
+	memset(file, 0, sizeof(struct ig_file));
+	file->source = -1;
+
+	conf = conf_get();
+	for (i=0; i < conf->n_sources; i++) {
+		if (ig_real_path(realpath, &conf->sources[i], dir, len, ig->name))
+			continue;
+
+		if (lstat(realpath, &st) == 0 && S_ISREG(st.st_mode)) {
+			file->source = i;
+			file->dev = st.st_dev;
+			file->ino = st.st_ino;
+			file->size = st.st_size;
+			file->mtime = st.st_mtim;
+			break;
+		}
+	}
+	conf_put(conf);
+}
+
+static int ig_same_file(const struct ig_file *a, const struct ig_file *b)
+{
+	return a->source == b->source && a->dev == b->dev && a->ino == b->ino &&
+		a->size == b->size && a->mtime.tv_sec == b->mtime.tv_sec &&
+		a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static int ig_add_pattern(struct ig_rules *r, char *line)
+{
+	struct ig_pattern *patterns;
+	size_t len;
+	int flags = 0;
+
+	len = strlen(line);
+
+	// trailing spaces are ignored unless they are escaped
+	while (len > 0 && line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\'))
+		line[--len] = 0;
+
+	if (len == 0 || line[0] == '#')
+		return 0;
+
+	if (line[0] == '!') {
+		flags |= IG_NEGATE;
+		line++;
+		len--;
+	} else if (line[0] == '\\' && (line[1] == '!' || line[1] == '#')) {
+		line++;
+		len--;
+	}
+
+	if (len > 0 && line[len - 1] == '/') {
+		flags |= IG_DIR_ONLY;
+		line[--len] = 0;
+	}
+
+	// a pattern with a '/' is relative to the directory of the file
+	if (strchr(line, '/'))
+		flags |= IG_ANCHORED;
+	if (line[0] == '/') {
+		line++;
+		len--;
+	}
+
+	if (len == 0)
+		return 0;
+
+	patterns = realloc(r->patterns, sizeof(struct ig_pattern) * (r->n_patterns + 1));
+	if (!patterns)
+		return -1;
+	r->patterns = patterns;
+
+	r->patterns[r->n_patterns].pattern = strdup(line);
+	if (!r->patterns[r->n_patterns].pattern)
+		return -1;
+	r->patterns[r->n_patterns].prog = wildprog_compile(line, WM_PATHNAME);
+	r->patterns[r->n_patterns].flags = flags;
+	r->n_patterns++;
+
+	return 0;
+}
+
+/* parses an ignore file, a file that cannot be read has no patterns */
+static struct ig_rules *ig_parse(const char *realpath)
+{
+	struct ig_rules *r;
+	char line[PATH_MAX];
+	size_t len;
+	FILE *f;
+
+	r = calloc(1, sizeof(struct ig_rules));
+	if (!r)
+		return NULL;
+
+	f = fopen(realpath, "r");
+	if (!f)
+		return r;
+
+	while (fgets(line, sizeof(line), f)) {
+		len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+
+		if (ig_add_pattern(r, line))
+			break;
+	}
+
+	fclose(f);
+
+	return r;
+}
+
+/* returns 1 if the FUSE path is a directory in the first source that contains it */
+static int ig_is_dir(const char *path)
+{
+	char realpath[PATH_MAX];
+	const struct conf *conf;
+	struct stat st;
+	unsigned int i;
+	int r = 0;
+
+	conf = conf_get();
+	for (i=0; i < conf->n_sources; i++) {
+		if (ig_real_path(realpath, &conf->sources[i], path, strlen(path), NULL))
+			continue;
+
+		if (lstat(realpath, &st) == 0) {
+			r = S_ISDIR(st.st_mode);
+			break;
+		}
+	}
+	conf_put(conf);
+
+	return r;
+}
+
+static int ig_dir_ignored(struct ignore *ig, struct ig_dir *d);
+
+/*
+ * Evaluates a path against the files of its directory and the directories
+ * above it. Called with the lock held and all nodes of the chain present.
+ */
+static int ig_verdict(struct ignore *ig, struct ig_dir *dir, const char *path)
+{
+	const struct ig_pattern *p;
+	const char *base, *rel, *name;
+	struct ig_dir *d;
+	unsigned int i;
+	int isdir = -1;
+
+	if (ig_dir_ignored(ig, dir))
+		return 1;
+
+	base = &path[dir->len == 1 ? 1 : dir->len + 1];
+
+	for (d = dir; d; d = d->parent) {
+		if (!d->rules)
+			continue;
+
+		rel = &path[d->len == 1 ? 1 : d->len + 1];
+
+		// the last pattern that matches decides
+		for (i = d->rules->n_patterns; i-- > 0; ) {
+			p = &d->rules->patterns[i];
+
+			name = p->flags & IG_ANCHORED ? rel : base;
+			if ((p->prog ? wildprog_match(p->prog, name) :
+				wildmatch(p->pattern, name, WM_PATHNAME, NULL)) != WM_MATCH)
+				continue;
+
+			if (p->flags & IG_DIR_ONLY) {
+				if (isdir < 0)
+					isdir = ig_is_dir(path);
+				if (!isdir)
+					continue;
+			}
+
+			return !(p->flags & IG_NEGATE);
+		}
+	}
+
+	return -1;
+}
+
+static int ig_dir_ignored(struct ignore *ig, struct ig_dir *d)
+{
+	uint64_t state, generation;
+	int ignored;
+
+	if (!d->parent)
+		return 0;
+
+	generation = __atomic_load_n(&ig->generation, __ATOMIC_RELAXED);
+	state = __atomic_load_n(&d->state, __ATOMIC_RELAXED);
+	if (state >> 1 == generation)
+		return state & 1;
+
+	ignored = ig_verdict(ig, d->parent, d->path) == 1;
+	__atomic_store_n(&d->state, generation << 1 | ignored, __ATOMIC_RELAXED);
+
+	return ignored;
+}
+
+/*
+ * Returns the node of a directory if it and all directories above it are
+ * present and were checked since start - timeout. Otherwise, the length of
+ * the path of the highest directory that has to be loaded is stored in load.
+ */
+static struct ig_dir *ig_chain(struct ignore *ig, const char *path, size_t len,
+				uint64_t start, size_t *load)
+{
+	struct ig_dir *dir, *d;
+	size_t parent;
+
+	dir = ig_find(ig, path, len);
+	if (!dir) {
+		*load = len;
+		while ((parent = ig_parent_len(path, *load)) && !ig_find(ig, path, parent))
+			*load = parent;
+		return NULL;
+	}
+
+	*load = 0;
+	for (d = dir; d; d = d->parent) {
+		if (__atomic_load_n(&d->checked, __ATOMIC_RELAXED) + ig->timeout < start)
+			*load = d->len;
+	}
+
+	return *load ? NULL : dir;
+}
+
+/* creates the node of a directory or reads its ignore file again */
+static void ig_load(struct ignore *ig, const char *path, size_t len)
+{
+	char realpath[PATH_MAX];
+	struct ig_rules *rules;
+	struct ig_file file;
+	struct ig_dir *d, *parent;
+	size_t parent_len;
+	uint64_t hash;
+	int changed = 0;
+
+	ig_stat_file(ig, path, len, &file, realpath);
+
+	// nothing to read if the file did not change
+	pthread_rwlock_wrlock(&ig->lock);
+	d = ig_find(ig, path, len);
+	if (d && ig_same_file(&d->file, &file)) {
+		__atomic_store_n(&d->checked, ig_now(), __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&ig->lock);
+		return;
+	}
+	pthread_rwlock_unlock(&ig->lock);
+
+	rules = NULL;
+	if (file.source >= 0) {
+		rules = ig_parse(realpath);
+		__atomic_fetch_add(&ig->files, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_rwlock_wrlock(&ig->lock);
+
+	d = ig_find(ig, path, len);
+	if (d) {
+		ig_rules_free(d->rules);
+		d->rules = rules;
+		d->file = file;
+		__atomic_store_n(&d->checked, ig_now(), __ATOMIC_RELAXED);
+
+		// the verdicts of all directories below may have changed
+		__atomic_store_n(&ig->generation, ig->generation + 1, __ATOMIC_RELAXED);
+		changed = 1;
+	} else {
+		if (ig->count >= IG_MAX_DIRS)
+			ig_clear(ig);
+
+		// the parent may have been forgotten meanwhile, then it is loaded first
+		parent_len = ig_parent_len(path, len);
+		parent = parent_len ? ig_find(ig, path, parent_len) : NULL;
+
+		d = (!parent_len || parent) ? calloc(1, sizeof(struct ig_dir)) : NULL;
+		if (d)
+			d->path = strndup(path, len);
+
+		if (d && d->path) {
+			hash = hash_bytes(path, len);
+			d->len = len;
+			d->hash = hash;
+			d->parent = parent;
+			d->rules = rules;
+			d->file = file;
+			d->checked = ig_now();
+			d->next = ig->buckets[hash & (IG_MAX_DIRS - 1)];
+			ig->buckets[hash & (IG_MAX_DIRS - 1)] = d;
+			ig->count++;
+		} else {
+			free(d);
+			ig_rules_free(rules);
+		}
+	}
+
+	pthread_rwlock_unlock(&ig->lock);
+
+	if (changed && ig->changed)
+		ig->changed();
+}
+
+int ignore_match(struct ignore *ig, const char *path)
+{
+	struct ig_dir *dir;
+	size_t len, dir_len, load;
+	uint64_t start;
+	int r, tries;
+
+	len = strlen(path);
+	dir_len = ig_parent_len(path, len);
+	if (!dir_len)
+		return -1;
+
+	start = ig_now();
+
+	// every try loads one directory, give up if they are forgotten again
+	for (tries = 0; tries < 64; tries++) {
+		pthread_rwlock_rdlock(&ig->lock);
+
+		dir = ig_chain(ig, path, dir_len, start, &load);
+		if (dir) {
+			r = ig_verdict(ig, dir, path);
+			pthread_rwlock_unlock(&ig->lock);
+			return r;
+		}
+
+		pthread_rwlock_unlock(&ig->lock);
+
+		ig_load(ig, path, load);
+	}
+
+	return -1;
+}
+
+int ignore_is_file(const struct ignore *ig, const char *path)
+{
+	const char *base = strrchr(path, '/');
+
+	return base && !strcmp(base + 1, ig->name);
+}
+
+void ignore_invalidate(struct ignore *ig, const char *path)
+{
+	struct ig_dir *d;
+	size_t len;
+
+	len = ig_parent_len(path, strlen(path));
+	if (!len)
+		return;
+
+	pthread_rwlock_rdlock(&ig->lock);
+	d = ig_find(ig, path, len);
+	if (d)
+		__atomic_store_n(&d->checked, 0, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&ig->lock);
+}
+
+void ignore_stats(struct ignore *ig, unsigned long *dirs, unsigned long *files)
+{
+	pthread_rwlock_rdlock(&ig->lock);
+	*dirs = ig->count;
+	pthread_rwlock_unlock(&ig->lock);
+
+	*files = __atomic_load_n(&ig->files, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,42 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Rules from gitignore-style files in the directories of the sources
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef IGNORE_H
+#define IGNORE_H
+
+struct ignore;
+
+/*
+ * Reads the ignore files with the given name, e.g., ".gitignore", when the
+ * paths of their directories are evaluated. A file is read from the first
+ * source that contains it and is checked again for changes after timeout
+ * seconds. If a file changed, changed() is called without locks held, so the
+ * caller can forget its cached decisions.
+ */
+struct ignore *ignore_new(const char *name, double timeout, void (*changed)(void));
+void ignore_free(struct ignore *ig);
+
+/*
+ * Evaluates the ignore files of the directories above a FUSE path. Returns 1
+ * if the path or one of its parent directories is ignored, 0 if a negated
+ * pattern ("!pattern") includes it again and -1 if no pattern matches.
+ */
+int ignore_match(struct ignore *ig, const char *path);
+
+/* returns 1 if the FUSE path is an ignore file */
+int ignore_is_file(const struct ignore *ig, const char *path);
+
+/* reads the ignore file of the directory of the FUSE path again before its next use */
+void ignore_invalidate(struct ignore *ig, const char *path);
+
+void ignore_stats(struct ignore *ig, unsigned long *dirs, unsigned long *files);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Set of file names used to merge the directories of multiple sources
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * Open addressing hash table with linear probing. The names are copied into
+ * large blocks that are freed together with the set, so adding a name does
+ * not need an allocation of its own.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "nameset.h"
+
+#define NS_BLOCK_SIZE 65536
+
+struct ns_block {
+	struct ns_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct ns_entry {
+	uint64_t hash;
+	const char *name;
+};
+
+struct name_set {
+	struct ns_entry *entries;
+	size_t size; /* power of two */
+	size_t count;
+
+	struct ns_block *blocks;
+};
+
+struct name_set *name_set_new(void)
+{
+	struct name_set *s;
+
+	s = calloc(1, sizeof(struct name_set));
+	if (!s)
+		return NULL;
+
+	s->size = 256;
+	s->entries = calloc(s->size, sizeof(struct ns_entry));
+	if (!s->entries) {
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+void name_set_free(struct name_set *s)
+{
+	struct ns_block *b, *next;
+
+	if (!s)
+		return;
+
+	for (b = s->blocks; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+
+	free(s->entries);
+	free(s);
+}
+
+static struct ns_entry *ns_find(const struct name_set *s, uint64_t hash, const char *name)
+{
+	struct ns_entry *e;
+	size_t i;
+
+	for (i = hash & (s->size - 1); ; i = (i + 1) & (s->size - 1)) {
+		e = &s->entries[i];
+
+		if (!e->name || (e->hash == hash && !strcmp(e->name, name)))
+			return e;
+	}
+}
+
+static int ns_grow(struct name_set *s)
+{
+	struct ns_entry *old, *e;
+	size_t i, old_size;
+
+	old = s->entries;
+	old_size = s->size;
+
+	s->entries = calloc(old_size * 2, sizeof(struct ns_entry));
+	if (!s->entries) {
+		s->entries = old;
+		return -1;
+	}
+	s->size = old_size * 2;
+
+	for (i=0; i < old_size; i++) {
+		if (!old[i].name)
+			continue;
+
+		e = ns_find(s, old[i].hash, old[i].name);
+		*e = old[i];
+	}
+
+	free(old);
+
+	return 0;
+}
+
+static char *ns_copy(struct name_set *s, const char *name)
+{
+	struct ns_block *b;
+	size_t len, size;
+	char *copy;
+
+	len = strlen(name) + 1;
+
+	b = s->blocks;
+	if (!b || b->size - b->used < len) {
+		size = len > NS_BLOCK_SIZE ? len : NS_BLOCK_SIZE;
+
+		b = malloc(sizeof(struct ns_block) + size);
+		if (!b)
+			return NULL;
+
+		b->used = 0;
+		b->size = size;
+		b->next = s->blocks;
+		s->blocks = b;
+	}
+
+	copy = b->data + b->used;
+	memcpy(copy, name, len);
+	b->used += len;
+
+	return copy;
+}
+
+int name_set_add(struct name_set *s, const char *name)
+{
+	struct ns_entry *e;
+	uint64_t hash;
+
+	// keep the load factor below 1/2
+	if (2 * (s->count + 1) > s->size && ns_grow(s))
+		return -1;
+
+	hash = hash_string(name);
+	e = ns_find(s, hash, name);
+	if (e->name)
+		return 0;
+
+	e->name = ns_copy(s, name);
+	if (!e->name)
+		return -1;
+
+	e->hash = hash;
+	s->count++;
+
+	return 1;
+}
+
+int name_set_contains(const struct name_set *s, const char *name)
+{
+	return ns_find(s, hash_string(name), name)->name != NULL;
+}
+
+void name_set_foreach(const struct name_set *s,
+				void (*cb)(const char *name, void *data), void *data)
+{
+	size_t i;
+
+	for (i=0; i < s->size; i++) {
+		if (s->entries[i].name)
+			cb(s->entries[i].name, data);
+	}
+}
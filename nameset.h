@@ -0,0 +1,33 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Set of file names used to merge the directories of multiple sources
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef NAMESET_H
+#define NAMESET_H
+
+struct name_set;
+
+struct name_set *name_set_new(void);
+void name_set_free(struct name_set *s);
+
+/*
+ * Adds a name to the set. Returns 1 if the name was added, 0 if it already
+ * was in the set and -1 on error.
+ */
+int name_set_add(struct name_set *s, const char *name);
+
+/* returns 1 if the name is in the set */
+int name_set_contains(const struct name_set *s, const char *name);
+
+/* calls cb for every name in the set in no particular order */
+void name_set_foreach(const struct name_set *s,
+				void (*cb)(const char *name, void *data), void *data);
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Cache for the filter decisions and the source resolution of FUSE paths
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * The cache is a direct-mapped table: every path has exactly one slot and a
+ * new entry replaces whatever was stored in its slot before. This keeps the
+ * memory usage bounded without any bookkeeping for the eviction.
+ *
+ * The slots are protected by a fixed number of mutexes. Clearing the cache
+ * only increments a generation counter, entries of older generations are
+ * treated as empty. Every change of a slot increments its sequence number.
+ * Together, both numbers tell whether a slot was invalidated between a
+ * lookup and the following insert of the freshly resolved entry.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+#include "pathcache.h"
+
+#define PC_LOCKS 64
+
+struct pc_entry {
+	uint64_t hash;
+	unsigned long seq;
+	unsigned long generation;
+	uint64_t expires;
+	unsigned int source;
+	int exclude;
+	char *path; /* followed by the real path in the same allocation */
+	size_t path_len;
+};
+
+struct path_cache {
+	struct pc_entry *entries;
+	unsigned int size; /* power of two */
+	uint64_t timeout;
+
+	unsigned long generation;
+	unsigned long hits;
+	unsigned long misses;
+
+	pthread_mutex_t locks[PC_LOCKS];
+};
+
+static uint64_t pc_now(void)
+{
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct path_cache *path_cache_new(unsigned int size, double timeout)
+{
+	struct path_cache *c;
+	unsigned int i;
+
+	c = calloc(1, sizeof(struct path_cache));
+	if (!c)
+		return NULL;
+
+	for (c->size = 1; c->size < size; c->size *= 2) {}
+
+	c->entries = calloc(c->size, sizeof(struct pc_entry));
+	if (!c->entries) {
+		free(c);
+		return NULL;
+	}
+
+	c->timeout = timeout * 1e9;
+	c->generation = 1;
+
+	for (i=0; i < PC_LOCKS; i++)
+		pthread_mutex_init(&c->locks[i], NULL);
+
+	return c;
+}
+
+void path_cache_free(struct path_cache *c)
+{
+	unsigned int i;
+
+	if (!c)
+		return;
+
+	for (i=0; i < c->size; i++)
+		free(c->entries[i].path);
+	for (i=0; i < PC_LOCKS; i++)
+		pthread_mutex_destroy(&c->locks[i]);
+
+	free(c->entries);
+	free(c);
+}
+
+static int pc_valid(struct path_cache *c, struct pc_entry *e, uint64_t hash,
+				const char *path, size_t path_len)
+{
+	return e->path && e->hash == hash && e->path_len == path_len &&
+		e->generation == __atomic_load_n(&c->generation, __ATOMIC_ACQUIRE) &&
+		e->expires > pc_now() && !memcmp(e->path, path, path_len);
+}
+
+int path_cache_lookup(struct path_cache *c, const char *path, char *realpath,
+				size_t realpath_size, unsigned int *source, int *exclude,
+				struct path_cache_ticket *ticket)
+{
+	struct pc_entry *e;
+	uint64_t hash;
+	size_t path_len, realpath_len;
+	unsigned int slot;
+	int hit;
+
+	path_len = strlen(path);
+	hash = hash_bytes(path, path_len);
+	slot = hash & (c->size - 1);
+	e = &c->entries[slot];
+
+	pthread_mutex_lock(&c->locks[slot % PC_LOCKS]);
+
+	ticket->generation = __atomic_load_n(&c->generation, __ATOMIC_ACQUIRE);
+	ticket->seq = e->seq;
+
+	hit = pc_valid(c, e, hash, path, path_len);
+	if (hit) {
+		realpath_len = strlen(e->path + path_len + 1);
+		if (realpath_len < realpath_size) {
+			memcpy(realpath, e->path + path_len + 1, realpath_len + 1);
+			*source = e->source;
+			*exclude = e->exclude;
+		} else {
+			hit = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&c->locks[slot % PC_LOCKS]);
+
+	__atomic_fetch_add(hit ? &c->hits : &c->misses, 1, __ATOMIC_RELAXED);
+
+	return hit;
+}
+
+void path_cache_insert(struct path_cache *c, const char *path,
+				const char *realpath, unsigned int source, int exclude,
+				const struct path_cache_ticket *ticket)
+{
+	struct pc_entry *e;
+	uint64_t hash;
+	size_t path_len, realpath_len;
+	unsigned int slot;
+	char *data;
+
+	path_len = strlen(path);
+	realpath_len = strlen(realpath);
+	hash = hash_bytes(path, path_len);
+	slot = hash & (c->size - 1);
+	e = &c->entries[slot];
+
+	data = malloc(path_len + realpath_len + 2);
+	if (!data)
+		return;
+
+	memcpy(data, path, path_len + 1);
+	memcpy(data + path_len + 1, realpath, realpath_len + 1);
+
+	pthread_mutex_lock(&c->locks[slot % PC_LOCKS]);
+
+	// drop the entry if the slot or the whole cache changed in the meantime
+	if (e->seq != ticket->seq ||
+		__atomic_load_n(&c->generation, __ATOMIC_ACQUIRE) != ticket->generation)
+	{
+		pthread_mutex_unlock(&c->locks[slot % PC_LOCKS]);
+		free(data);
+		return;
+	}
+
+	free(e->path);
+	e->seq++;
+	e->path = data;
+	e->path_len = path_len;
+	e->hash = hash;
+	e->generation = ticket->generation;
+	e->expires = pc_now() + c->timeout;
+	e->source = source;
+	e->exclude = exclude;
+
+	pthread_mutex_unlock(&c->locks[slot % PC_LOCKS]);
+}
+
+void path_cache_remove(struct path_cache *c, const char *path)
+{
+	struct pc_entry *e;
+	uint64_t hash;
+	size_t path_len;
+	unsigned int slot;
+
+	path_len = strlen(path);
+	hash = hash_bytes(path, path_len);
+	slot = hash & (c->size - 1);
+	e = &c->entries[slot];
+
+	pthread_mutex_lock(&c->locks[slot % PC_LOCKS]);
+
+	if (e->path && e->hash == hash && e->path_len == path_len &&
+		!memcmp(e->path, path, path_len))
+	{
+		free(e->path);
+		e->path = NULL;
+	}
+
+	// also drops concurrent inserts of entries for other paths of this slot
+	e->seq++;
+
+	pthread_mutex_unlock(&c->locks[slot % PC_LOCKS]);
+}
+
+void path_cache_clear(struct path_cache *c)
+{
+	__atomic_fetch_add(&c->generation, 1, __ATOMIC_RELEASE);
+}
+
+void path_cache_foreach(struct path_cache *c,
+				void (*fn)(const char *path, void *data), void *data)
+{
+	unsigned long generation;
+	uint64_t now;
+	unsigned int i;
+
+	generation = __atomic_load_n(&c->generation, __ATOMIC_ACQUIRE);
+	now = pc_now();
+
+	for (i=0; i < c->size; i++) {
+		pthread_mutex_lock(&c->locks[i % PC_LOCKS]);
+		if (c->entries[i].path && c->entries[i].generation == generation &&
+			c->entries[i].expires > now)
+			fn(c->entries[i].path, data);
+		pthread_mutex_unlock(&c->locks[i % PC_LOCKS]);
+	}
+}
+
+void path_cache_stats(struct path_cache *c, unsigned long *hits,
+				unsigned long *misses)
+{
+	*hits = __atomic_load_n(&c->hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&c->misses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Cache for the filter decisions and the source resolution of FUSE paths
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#include <stddef.h>
+
+struct path_cache;
+
+/*
+ * Returned by a lookup and passed to the following insert. It makes sure that
+ * an entry is not inserted if the path was invalidated in the meantime.
+ */
+struct path_cache_ticket {
+	unsigned long generation;
+	unsigned long seq;
+};
+
+/*
+ * Creates a cache with room for size entries that are valid for timeout
+ * seconds. Returns NULL on error.
+ */
+struct path_cache *path_cache_new(unsigned int size, double timeout);
+void path_cache_free(struct path_cache *c);
+
+/*
+ * Looks up a FUSE path. On a hit, the real path is copied into realpath and
+ * 1 is returned, otherwise 0.
+ */
+int path_cache_lookup(struct path_cache *c, const char *path, char *realpath,
+				size_t realpath_size, unsigned int *source, int *exclude,
+				struct path_cache_ticket *ticket);
+
+void path_cache_insert(struct path_cache *c, const char *path,
+				const char *realpath, unsigned int source, int exclude,
+				const struct path_cache_ticket *ticket);
+
+/* removes a single path from the cache */
+void path_cache_remove(struct path_cache *c, const char *path);
+
+/* invalidates all entries */
+void path_cache_clear(struct path_cache *c);
+
+/*
+ * Calls fn for the path of every valid entry. fn is called while a lock of
+ * the cache is held and must not use the cache.
+ */
+void path_cache_foreach(struct path_cache *c,
+				void (*fn)(const char *path, void *data), void *data);
+
+void path_cache_stats(struct path_cache *c, unsigned long *hits,
+				unsigned long *misses);
+
+#endif
@@ -0,0 +1,1015 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Snapshot of the sources that contain each path, created by a scan of all
+ *  sources and stored in a file that later mounts can map
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * The scan walks the directory trees of all sources at once: a pool of
+ * threads takes directories from a queue, reads the directory of every
+ * source and adds the subdirectories to the queue. Every thread collects its
+ * results in its own buffers, which are only put together when the file is
+ * written.
+ *
+ * The file contains the directories sorted by the hash of their path, the
+ * modification times of the directory in every source, the entries of every
+ * directory sorted by the hash of their name, and the strings:
+ *
+ *   header | dirs | mtimes | names | strings
+ *
+ * All offsets are relative to the file or the string table, so the file is
+ * used as it is mapped. A directory is only used if the modification times
+ * of its source directories still match. Directories that were modified
+ * while they were scanned are marked as unstable and never used, as a change
+ * within the same timestamp could be missed otherwise.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "prescan.h"
+
+#define PS_MAGIC "SFSSCAN1"
+
+// the directory changed during the scan
+#define PS_UNSTABLE 1
+
+// the directory changed after the scan
+#define PS_INVALID UINT64_MAX
+
+struct ps_header {
+	char magic[8];
+	uint32_t n_sources;
+	uint32_t sources; /* in the string table, one after the other */
+	uint64_t n_dirs;
+	uint64_t n_names;
+	uint64_t strings_size;
+	uint64_t dirs;
+	uint64_t mtimes;
+	uint64_t names;
+	uint64_t strings;
+};
+
+struct ps_dir {
+	uint64_t hash;
+	uint64_t first_name;
+	uint32_t path;
+	uint32_t n_names;
+	uint32_t mtimes; /* index of the first of n_sources modification times */
+	uint32_t flags;
+};
+
+struct ps_mtime {
+	int64_t sec; /* -1 if the source does not contain the directory */
+	int64_t nsec;
+};
+
+struct ps_name {
+	uint32_t hash;
+	uint32_t name;
+	uint64_t mask;
+};
+
+struct prescan {
+	void *map;
+	size_t size;
+
+	const struct ps_header *header;
+	const struct ps_dir *dirs;
+	const struct ps_mtime *mtimes;
+	const struct ps_name *names;
+	const char *strings;
+
+	char **sources;
+	unsigned int n_sources;
+	uint64_t known;
+
+	// time of the last check of every directory or PS_INVALID
+	uint64_t *checked;
+	uint64_t epoch;
+	uint64_t timeout;
+
+	unsigned long hits;
+	unsigned long misses;
+};
+
+static uint64_t ps_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* builds the real path of a FUSE directory in a source */
+static int ps_source_path(char *buf, const char *source, const char *path)
+{
+	return snprintf(buf, PATH_MAX, "%s%s", source, &path[1]) < PATH_MAX ? 0 : -1;
+}
+
+/*
+ * Scan
+ */
+
+struct ps_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static void *ps_append(struct ps_buf *b, const void *data, size_t len)
+{
+	size_t size;
+	char *p;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : 4096;
+		while (size < b->len + len)
+			size *= 2;
+
+		p = realloc(b->data, size);
+		if (!p)
+			return NULL;
+
+		b->data = p;
+		b->size = size;
+	}
+
+	p = b->data + b->len;
+	if (data)
+		memcpy(p, data, len);
+	b->len += len;
+
+	return p;
+}
+
+struct ps_scan;
+
+struct ps_worker {
+	struct ps_scan *scan;
+	pthread_t thread;
+
+	struct ps_buf dirs;
+	struct ps_buf mtimes;
+	struct ps_buf names;
+	struct ps_buf strings;
+
+	// the entries of the current directory
+	struct ps_name *entries;
+	uint8_t *queued; /* 1 if the entry was queued as a subdirectory */
+	uint32_t *slots; /* index + 1 of an entry, 0 if empty */
+	size_t n_entries;
+	size_t n_slots; /* power of two */
+};
+
+struct ps_scan {
+	char **sources;
+	unsigned int n_sources;
+	time_t start;
+
+	char **queue;
+	size_t n_queue;
+	size_t queue_size;
+	unsigned int active;
+	int error;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static int ps_push(struct ps_scan *scan, char *path)
+{
+	char **queue;
+	size_t size;
+
+	pthread_mutex_lock(&scan->lock);
+	if (scan->n_queue == scan->queue_size) {
+		size = scan->queue_size ? scan->queue_size * 2 : 1024;
+		queue = realloc(scan->queue, size * sizeof(char *));
+		if (!queue) {
+			pthread_mutex_unlock(&scan->lock);
+			return -1;
+		}
+
+		scan->queue = queue;
+		scan->queue_size = size;
+	}
+
+	scan->queue[scan->n_queue++] = path;
+	pthread_cond_signal(&scan->cond);
+	pthread_mutex_unlock(&scan->lock);
+
+	return 0;
+}
+
+static void ps_reset_entries(struct ps_worker *w)
+{
+	memset(w->slots, 0, w->n_slots * sizeof(uint32_t));
+	w->n_entries = 0;
+}
+
+static int ps_grow_entries(struct ps_worker *w)
+{
+	struct ps_name *entries;
+	uint8_t *queued;
+	uint32_t *slots;
+	size_t i, j, n_slots;
+
+	n_slots = w->n_slots ? w->n_slots * 2 : 1024;
+
+	entries = realloc(w->entries, n_slots / 2 * sizeof(struct ps_name));
+	if (!entries)
+		return -1;
+	w->entries = entries;
+
+	queued = realloc(w->queued, n_slots / 2);
+	if (!queued)
+		return -1;
+	w->queued = queued;
+
+	slots = calloc(n_slots, sizeof(uint32_t));
+	if (!slots)
+		return -1;
+
+	for (i=0; i < w->n_entries; i++) {
+		for (j = entries[i].hash & (n_slots - 1); slots[j]; j = (j + 1) & (n_slots - 1));
+		slots[j] = i + 1;
+	}
+
+	free(w->slots);
+	w->slots = slots;
+	w->n_slots = n_slots;
+
+	return 0;
+}
+
+/*
+ * Returns the entry of a name in the current directory, the name is added to
+ * the strings if it is new. The new flag is set for new entries.
+ */
+static struct ps_name *ps_entry(struct ps_worker *w, const char *name, int *new)
+{
+	struct ps_name *e;
+	uint32_t hash;
+	size_t i, len;
+	char *copy;
+
+	len = strlen(name);
+	hash = (uint32_t) hash_bytes(name, len);
+
+	*new = 0;
+	for (i = hash & (w->n_slots - 1); w->slots[i]; i = (i + 1) & (w->n_slots - 1)) {
+		e = &w->entries[w->slots[i] - 1];
+		if (e->hash == hash && !strcmp(w->strings.data + e->name, name))
+			return e;
+	}
+
+	// keep the load factor below 1/2
+	if (2 * (w->n_entries + 1) > w->n_slots) {
+		if (ps_grow_entries(w))
+			return NULL;
+		return ps_entry(w, name, new);
+	}
+
+	if (w->strings.len + len + 1 > UINT32_MAX)
+		return NULL;
+
+	copy = ps_append(&w->strings, name, len + 1);
+	if (!copy)
+		return NULL;
+
+	e = &w->entries[w->n_entries];
+	e->hash = hash;
+	e->name = copy - w->strings.data;
+	e->mask = 0;
+	w->queued[w->n_entries] = 0;
+	w->slots[i] = ++w->n_entries;
+
+	*new = 1;
+
+	return e;
+}
+
+static int ps_cmp_name(const void *a, const void *b)
+{
+	uint32_t x = ((const struct ps_name *) a)->hash;
+	uint32_t y = ((const struct ps_name *) b)->hash;
+
+	return x < y ? -1 : x > y;
+}
+
+static char *ps_join(const char *dir, const char *name)
+{
+	char *path;
+
+	path = malloc(strlen(dir) + strlen(name) + 2);
+	if (path)
+		sprintf(path, "%s%s%s", dir, dir[1] ? "/" : "", name);
+
+	return path;
+}
+
+/* reads the directory of every source that contains the FUSE directory path */
+static int ps_scan_dir(struct ps_worker *w, const char *path)
+{
+	struct ps_scan *scan = w->scan;
+	char realpath[PATH_MAX];
+	struct ps_mtime *mtime;
+	struct ps_name *e;
+	struct ps_dir dir;
+	struct dirent *de;
+	struct stat st;
+	unsigned int i;
+	char *copy, *subdir;
+	int fd, isdir, new;
+	DIR *dp;
+
+	memset(&dir, 0, sizeof(dir));
+	dir.hash = hash_bytes(path, strlen(path));
+	dir.mtimes = w->mtimes.len / sizeof(struct ps_mtime);
+
+	if (w->strings.len + strlen(path) + 1 > UINT32_MAX)
+		return -1;
+	copy = ps_append(&w->strings, path, strlen(path) + 1);
+	if (!copy)
+		return -1;
+	dir.path = copy - w->strings.data;
+
+	ps_reset_entries(w);
+
+	for (i=0; i < scan->n_sources; i++) {
+		mtime = ps_append(&w->mtimes, NULL, sizeof(struct ps_mtime));
+		if (!mtime)
+			return -1;
+		mtime->sec = -1;
+		mtime->nsec = 0;
+
+		if (ps_source_path(realpath, scan->sources[i], path)) {
+			dir.flags |= PS_UNSTABLE;
+			continue;
+		}
+
+		fd = open(realpath, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd == -1) {
+			if (errno != ENOENT && errno != ENOTDIR)
+				dir.flags |= PS_UNSTABLE;
+			continue;
+		}
+
+		dp = fdopendir(fd);
+		if (!dp || fstat(fd, &st)) {
+			if (dp)
+				closedir(dp);
+			else
+				close(fd);
+			dir.flags |= PS_UNSTABLE;
+			continue;
+		}
+
+		mtime->sec = st.st_mtim.tv_sec;
+		mtime->nsec = st.st_mtim.tv_nsec;
+		if (st.st_mtim.tv_sec >= scan->start - 1)
+			dir.flags |= PS_UNSTABLE;
+
+		while ((de = readdir(dp)) != NULL) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+
+			e = ps_entry(w, de->d_name, &new);
+			if (!e) {
+				closedir(dp);
+				return -1;
+			}
+
+			/*
+			 * every subdirectory is scanned once for all sources, the
+			 * name may be a file in the sources before
+			 */
+			if (!w->queued[e - w->entries]) {
+				isdir = de->d_type == DT_DIR;
+				if (de->d_type == DT_UNKNOWN)
+					isdir = fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+						S_ISDIR(st.st_mode);
+
+				if (isdir) {
+					subdir = ps_join(path, de->d_name);
+					if (!subdir || ps_push(scan, subdir)) {
+						free(subdir);
+						closedir(dp);
+						return -1;
+					}
+					w->queued[e - w->entries] = 1;
+				}
+			}
+
+			e->mask |= (uint64_t) 1 << i;
+		}
+
+		closedir(dp);
+	}
+
+	// without names, unstable directories are only kept for their subdirectories
+	if (!(dir.flags & PS_UNSTABLE)) {
+		qsort(w->entries, w->n_entries, sizeof(struct ps_name), ps_cmp_name);
+
+		dir.first_name = w->names.len / sizeof(struct ps_name);
+		dir.n_names = w->n_entries;
+		if (!ps_append(&w->names, w->entries, w->n_entries * sizeof(struct ps_name)))
+			return -1;
+	}
+
+	if (!ps_append(&w->dirs, &dir, sizeof(dir)))
+		return -1;
+
+	return 0;
+}
+
+static void *ps_worker(void *arg)
+{
+	struct ps_worker *w = arg;
+	struct ps_scan *scan = w->scan;
+	char *path;
+	int r;
+
+	pthread_mutex_lock(&scan->lock);
+	while (1) {
+		while (!scan->n_queue && scan->active && !scan->error)
+			pthread_cond_wait(&scan->cond, &scan->lock);
+
+		if (!scan->n_queue || scan->error)
+			break;
+
+		path = scan->queue[--scan->n_queue];
+		scan->active++;
+		pthread_mutex_unlock(&scan->lock);
+
+		r = ps_scan_dir(w, path);
+		free(path);
+
+		pthread_mutex_lock(&scan->lock);
+		scan->active--;
+		if (r)
+			scan->error = 1;
+		if (r || (!scan->active && !scan->n_queue))
+			pthread_cond_broadcast(&scan->cond);
+	}
+	pthread_mutex_unlock(&scan->lock);
+
+	return NULL;
+}
+
+static int ps_cmp_dir(const void *a, const void *b)
+{
+	uint64_t x = ((const struct ps_dir *) a)->hash;
+	uint64_t y = ((const struct ps_dir *) b)->hash;
+
+	return x < y ? -1 : x > y;
+}
+
+static int ps_write(FILE *f, const void *data, size_t len)
+{
+	return len && fwrite(data, len, 1, f) != 1 ? -1 : 0;
+}
+
+/* puts the results of the workers together and writes the file */
+static int ps_write_file(int fd, struct ps_scan *scan, struct ps_worker *workers,
+				unsigned int n_workers)
+{
+	struct ps_header header;
+	struct ps_dir *dirs, *d;
+	struct ps_name *n;
+	uint64_t strings_base, names_base, mtimes_base, n_dirs;
+	size_t i, j, len;
+	FILE *f;
+	int r = -1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PS_MAGIC, 8);
+	header.n_sources = scan->n_sources;
+
+	n_dirs = 0;
+	for (i=0; i < n_workers; i++)
+		n_dirs += workers[i].dirs.len / sizeof(struct ps_dir);
+
+	dirs = malloc(n_dirs * sizeof(struct ps_dir) + 1);
+	if (!dirs)
+		return -1;
+
+	// move the offsets of every worker behind those of the previous workers
+	strings_base = names_base = mtimes_base = 0;
+	d = dirs;
+	for (i=0; i < n_workers; i++) {
+		len = workers[i].dirs.len / sizeof(struct ps_dir);
+		if (len)
+			memcpy(d, workers[i].dirs.data, len * sizeof(struct ps_dir));
+		for (j=0; j < len; j++, d++) {
+			d->path += strings_base;
+			d->first_name += names_base;
+			d->mtimes += mtimes_base;
+		}
+
+		n = (struct ps_name *) workers[i].names.data;
+		for (j=0; j < workers[i].names.len / sizeof(struct ps_name); j++)
+			n[j].name += strings_base;
+
+		strings_base += workers[i].strings.len;
+		names_base += workers[i].names.len / sizeof(struct ps_name);
+		mtimes_base += workers[i].mtimes.len / sizeof(struct ps_mtime);
+	}
+
+	// the source paths are stored to recognize the file of other sources
+	header.sources = strings_base;
+	for (i=0; i < scan->n_sources; i++)
+		strings_base += strlen(scan->sources[i]) + 1;
+
+	if (strings_base > UINT32_MAX || mtimes_base > UINT32_MAX)
+		goto out;
+
+	qsort(dirs, n_dirs, sizeof(struct ps_dir), ps_cmp_dir);
+
+	header.n_dirs = n_dirs;
+	header.n_names = names_base;
+	header.strings_size = strings_base;
+	header.dirs = sizeof(header);
+	header.mtimes = header.dirs + n_dirs * sizeof(struct ps_dir);
+	header.names = header.mtimes + mtimes_base * sizeof(struct ps_mtime);
+	header.strings = header.names + names_base * sizeof(struct ps_name);
+
+	f = fdopen(dup(fd), "w");
+	if (!f)
+		goto out;
+
+	r = ps_write(f, &header, sizeof(header)) ||
+		ps_write(f, dirs, n_dirs * sizeof(struct ps_dir));
+	for (i=0; i < n_workers; i++)
+		r = r || ps_write(f, workers[i].mtimes.data, workers[i].mtimes.len);
+	for (i=0; i < n_workers; i++)
+		r = r || ps_write(f, workers[i].names.data, workers[i].names.len);
+	for (i=0; i < n_workers; i++)
+		r = r || ps_write(f, workers[i].strings.data, workers[i].strings.len);
+	for (i=0; i < scan->n_sources; i++)
+		r = r || ps_write(f, scan->sources[i], strlen(scan->sources[i]) + 1);
+
+	if (fclose(f))
+		r = -1;
+	r = r ? -1 : 0;
+
+out:
+	free(dirs);
+
+	return r;
+}
+
+/*
+ * Use
+ */
+
+/*
+ * Checks that the sections of the header fit the file and that every record
+ * refers to existing records and strings, and sets the sections of p. The
+ * file is used as it is mapped, so a corrupted or truncated file has to be
+ * rejected before any lookup.
+ */
+static int ps_validate(struct prescan *p, unsigned int n_sources)
+{
+	const struct ps_header *h = p->header;
+	const struct ps_dir *dir;
+	uint64_t i, n_mtimes, known;
+
+	// bounds the sizes first, so the offsets below cannot overflow
+	if (memcmp(h->magic, PS_MAGIC, 8) || h->n_sources != n_sources ||
+		h->n_dirs > p->size / sizeof(struct ps_dir) ||
+		h->n_names > p->size / sizeof(struct ps_name) ||
+		h->names > p->size || h->strings_size > p->size || h->strings_size == 0)
+		return -1;
+
+	if (h->dirs != sizeof(struct ps_header) ||
+		h->mtimes != h->dirs + h->n_dirs * sizeof(struct ps_dir) ||
+		h->names < h->mtimes ||
+		(h->names - h->mtimes) % sizeof(struct ps_mtime) ||
+		h->strings != h->names + h->n_names * sizeof(struct ps_name) ||
+		h->strings + h->strings_size != p->size ||
+		h->sources >= h->strings_size)
+		return -1;
+
+	p->dirs = (const struct ps_dir *) ((const char *) p->map + h->dirs);
+	p->mtimes = (const struct ps_mtime *) ((const char *) p->map + h->mtimes);
+	p->names = (const struct ps_name *) ((const char *) p->map + h->names);
+	p->strings = (const char *) p->map + h->strings;
+
+	/*
+	 * The string table ends with a NUL, so every offset within the table
+	 * points to a terminated string. The offsets themselves are checked
+	 * below.
+	 */
+	if (p->strings[h->strings_size - 1] != '\0')
+		return -1;
+
+	n_mtimes = (h->names - h->mtimes) / sizeof(struct ps_mtime);
+	for (i=0; i < h->n_dirs; i++) {
+		dir = &p->dirs[i];
+
+		if (dir->path >= h->strings_size || p->strings[dir->path] != '/' ||
+			dir->first_name > h->n_names ||
+			dir->n_names > h->n_names - dir->first_name ||
+			dir->mtimes > n_mtimes || n_sources > n_mtimes - dir->mtimes)
+			return -1;
+	}
+
+	known = n_sources == 64 ? UINT64_MAX : ((uint64_t) 1 << n_sources) - 1;
+	for (i=0; i < h->n_names; i++) {
+		if (p->names[i].name >= h->strings_size || (p->names[i].mask & ~known))
+			return -1;
+	}
+
+	return 0;
+}
+
+static struct prescan *ps_map(int fd, const struct conf *conf, double timeout)
+{
+	const struct ps_header *h;
+	struct prescan *p;
+	struct stat st;
+	const char *s;
+	unsigned int i;
+
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(struct ps_header))
+		return NULL;
+
+	p = calloc(1, sizeof(struct prescan));
+	if (!p)
+		return NULL;
+
+	p->size = st.st_size;
+	p->map = mmap(NULL, p->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p->map == MAP_FAILED) {
+		free(p);
+		return NULL;
+	}
+
+	h = p->header = p->map;
+	if (ps_validate(p, conf->n_sources))
+		goto error;
+
+	s = p->strings + h->sources;
+	for (i=0; i < conf->n_sources; i++) {
+		if (s >= p->strings + h->strings_size || strcmp(s, conf->sources[i].path))
+			goto error;
+		s += strlen(s) + 1;
+	}
+
+	p->n_sources = conf->n_sources;
+	p->known = p->n_sources == 64 ? UINT64_MAX : ((uint64_t) 1 << p->n_sources) - 1;
+	p->timeout = timeout * 1e9;
+	p->epoch = 0;
+
+	p->sources = calloc(p->n_sources, sizeof(char *));
+	p->checked = calloc(h->n_dirs + 1, sizeof(uint64_t));
+	if (!p->sources || !p->checked)
+		goto error;
+
+	for (i=0; i < p->n_sources; i++) {
+		p->sources[i] = strdup(conf->sources[i].path);
+		if (!p->sources[i])
+			goto error;
+	}
+
+	return p;
+
+error:
+	prescan_close(p);
+	return NULL;
+}
+
+struct prescan *prescan_open(const char *file, const struct conf *conf,
+				double timeout)
+{
+	struct prescan *p;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	p = ps_map(fd, conf, timeout);
+	close(fd);
+
+	return p;
+}
+
+struct prescan *prescan_build(const char *file, const struct conf *conf,
+				double timeout, unsigned int threads,
+				struct prescan_stats *stats)
+{
+	struct ps_worker *workers;
+	struct ps_scan scan;
+	struct prescan *p = NULL;
+	char tmpfile[PATH_MAX];
+	uint64_t start;
+	unsigned int i, started;
+	char *root;
+	int fd;
+
+	if (conf->n_sources > PRESCAN_MAX_SOURCES || threads == 0)
+		return NULL;
+
+	// the file is replaced at once, so another mount never sees half of it
+	if (file) {
+		if (snprintf(tmpfile, PATH_MAX, "%s.XXXXXX", file) >= PATH_MAX)
+			return NULL;
+		fd = mkstemp(tmpfile);
+	} else {
+		fd = open("/tmp", O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+	}
+	if (fd == -1)
+		return NULL;
+
+	memset(&scan, 0, sizeof(scan));
+	scan.n_sources = conf->n_sources;
+	scan.start = time(NULL);
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.cond, NULL);
+
+	start = ps_now();
+
+	scan.sources = calloc(conf->n_sources, sizeof(char *));
+	workers = calloc(threads, sizeof(struct ps_worker));
+	root = strdup("/");
+	if (!scan.sources || !workers || !root || ps_push(&scan, root)) {
+		free(root);
+		goto out;
+	}
+
+	for (i=0; i < conf->n_sources; i++)
+		scan.sources[i] = conf->sources[i].path;
+
+	started = 0;
+	for (i=0; i < threads; i++) {
+		workers[i].scan = &scan;
+		if (ps_grow_entries(&workers[i]))
+			break;
+		if (pthread_create(&workers[i].thread, NULL, ps_worker, &workers[i]))
+			break;
+		started++;
+	}
+
+	if (started == 0)
+		scan.error = 1;
+
+	for (i=0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	if (!scan.error && ps_write_file(fd, &scan, workers, started) == 0) {
+		if (file && rename(tmpfile, file) == 0)
+			file = NULL;
+		if (!file)
+			p = ps_map(fd, conf, timeout);
+	}
+
+	if (p && stats) {
+		stats->dirs = p->header->n_dirs;
+		stats->entries = p->header->n_names;
+		stats->seconds = (ps_now() - start) / 1e9;
+		stats->size = p->size;
+	}
+
+	for (i=0; i < threads; i++) {
+		free(workers[i].dirs.data);
+		free(workers[i].mtimes.data);
+		free(workers[i].names.data);
+		free(workers[i].strings.data);
+		free(workers[i].entries);
+		free(workers[i].queued);
+		free(workers[i].slots);
+	}
+
+out:
+	if (file)
+		unlink(tmpfile);
+	close(fd);
+
+	for (i=0; i < scan.n_queue; i++)
+		free(scan.queue[i]);
+	free(scan.queue);
+	free(scan.sources);
+	free(workers);
+	pthread_mutex_destroy(&scan.lock);
+	pthread_cond_destroy(&scan.cond);
+
+	return p;
+}
+
+void prescan_close(struct prescan *p)
+{
+	unsigned int i;
+
+	if (!p)
+		return;
+
+	if (p->sources) {
+		for (i=0; i < p->n_sources; i++)
+			free(p->sources[i]);
+		free(p->sources);
+	}
+
+	free(p->checked);
+	munmap(p->map, p->size);
+	free(p);
+}
+
+/* returns the index of a FUSE directory or n_dirs */
+static uint64_t ps_find_dir(struct prescan *p, const char *path, size_t len)
+{
+	uint64_t hash, lo, hi, mid;
+	const char *s;
+
+	hash = hash_bytes(path, len);
+
+	lo = 0;
+	hi = p->header->n_dirs;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (p->dirs[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < p->header->n_dirs && p->dirs[lo].hash == hash; lo++) {
+		s = p->strings + p->dirs[lo].path;
+		if (!strncmp(s, path, len) && s[len] == '\0')
+			return lo;
+	}
+
+	return p->header->n_dirs;
+}
+
+/* compares the modification times of the directory in all sources */
+static int ps_check(struct prescan *p, uint64_t i)
+{
+	const struct ps_dir *dir = &p->dirs[i];
+	const struct ps_mtime *mtime;
+	char realpath[PATH_MAX];
+	struct stat st;
+	unsigned int j;
+	int exists;
+
+	if (dir->flags & PS_UNSTABLE)
+		return -1;
+
+	for (j=0; j < p->n_sources; j++) {
+		mtime = &p->mtimes[dir->mtimes + j];
+
+		if (ps_source_path(realpath, p->sources[j], p->strings + dir->path))
+			return -1;
+
+		exists = stat(realpath, &st) == 0 && S_ISDIR(st.st_mode);
+		if (exists != (mtime->sec != -1))
+			return -1;
+
+		if (exists && (st.st_mtim.tv_sec != mtime->sec ||
+			st.st_mtim.tv_nsec != mtime->nsec))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int ps_valid(struct prescan *p, uint64_t i)
+{
+	uint64_t checked, now;
+
+	checked = __atomic_load_n(&p->checked[i], __ATOMIC_RELAXED);
+	if (checked == PS_INVALID)
+		return 0;
+
+	now = ps_now();
+	if (checked && checked >= __atomic_load_n(&p->epoch, __ATOMIC_RELAXED) &&
+		now - checked < p->timeout)
+		return 1;
+
+	if (ps_check(p, i)) {
+		__atomic_store_n(&p->checked[i], PS_INVALID, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	// only store the time if the directory was not invalidated meanwhile
+	if (!__atomic_compare_exchange_n(&p->checked[i], &checked, now, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return checked != PS_INVALID;
+
+	return 1;
+}
+
+/* splits a FUSE path into the length of its directory and its name */
+static const char *ps_split(const char *path, size_t *dir_len)
+{
+	const char *slash;
+
+	slash = strrchr(path, '/');
+	if (!slash || !slash[1])
+		return NULL;
+
+	// the entries of the root directory
+	*dir_len = slash == path ? 1 : (size_t) (slash - path);
+
+	return slash + 1;
+}
+
+int prescan_lookup(struct prescan *p, const char *path, uint64_t *known,
+				uint64_t *present)
+{
+	const struct ps_dir *dir;
+	const struct ps_name *names;
+	const char *name;
+	uint64_t i, lo, hi, mid;
+	uint32_t hash;
+	size_t len;
+
+	name = ps_split(path, &len);
+	if (!name)
+		return 0;
+
+	i = ps_find_dir(p, path, len);
+	if (i == p->header->n_dirs || !ps_valid(p, i)) {
+		__atomic_fetch_add(&p->misses, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	dir = &p->dirs[i];
+	names = &p->names[dir->first_name];
+	hash = (uint32_t) hash_bytes(name, strlen(name));
+
+	lo = 0;
+	hi = dir->n_names;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (names[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*known = p->known;
+	*present = 0;
+	for (; lo < dir->n_names && names[lo].hash == hash; lo++) {
+		if (!strcmp(p->strings + names[lo].name, name)) {
+			*present = names[lo].mask;
+			break;
+		}
+	}
+
+	__atomic_fetch_add(&p->hits, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+void prescan_invalidate(struct prescan *p, const char *path)
+{
+	uint64_t i;
+	size_t len;
+
+	// the directory that contains the path
+	if (ps_split(path, &len)) {
+		i = ps_find_dir(p, path, len);
+		if (i < p->header->n_dirs)
+			__atomic_store_n(&p->checked[i], PS_INVALID, __ATOMIC_RELAXED);
+	}
+
+	// the path itself if it is a directory
+	i = ps_find_dir(p, path, strlen(path));
+	if (i < p->header->n_dirs)
+		__atomic_store_n(&p->checked[i], PS_INVALID, __ATOMIC_RELAXED);
+}
+
+void prescan_invalidate_all(struct prescan *p)
+{
+	__atomic_store_n(&p->epoch, ps_now(), __ATOMIC_RELAXED);
+}
+
+void prescan_stats(struct prescan *p, unsigned long *hits,
+				unsigned long *misses)
+{
+	*hits = __atomic_load_n(&p->hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&p->misses, __ATOMIC_RELAXED);
+}
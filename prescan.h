@@ -0,0 +1,68 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Snapshot of the sources that contain each path, created by a scan of all
+ *  sources and stored in a file that later mounts can map
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef PRESCAN_H
+#define PRESCAN_H
+
+#include <stdint.h>
+
+#include <conf.h>
+
+// like the source index, the sources are stored as bits of a 64 bit mask
+#define PRESCAN_MAX_SOURCES 64
+
+struct prescan;
+
+struct prescan_stats {
+	unsigned long dirs;
+	unsigned long entries;
+	double seconds;
+	uint64_t size; /* of the file */
+};
+
+/*
+ * Maps a snapshot file. Returns NULL if the file does not exist, is damaged or
+ * does not belong to the sources of conf. A directory of the snapshot is used for
+ * timeout seconds before the modification times of its source directories
+ * are checked again.
+ */
+struct prescan *prescan_open(const char *file, const struct conf *conf,
+				double timeout);
+
+/*
+ * Scans all sources with the given number of threads, writes the snapshot to
+ * file and maps it. Without a file, a temporary file is used. Returns NULL
+ * on error.
+ */
+struct prescan *prescan_build(const char *file, const struct conf *conf,
+				double timeout, unsigned int threads,
+				struct prescan_stats *stats);
+
+void prescan_close(struct prescan *p);
+
+/*
+ * Looks up the sources of a FUSE path like src_index_lookup(). Returns 0 if
+ * the directory of the path is not in the snapshot or changed since the scan.
+ */
+int prescan_lookup(struct prescan *p, const char *path, uint64_t *known,
+				uint64_t *present);
+
+/* stops using the directory of a path that was changed through the mount */
+void prescan_invalidate(struct prescan *p, const char *path);
+
+/* checks all directories again before they are used, e.g., after a rename */
+void prescan_invalidate_all(struct prescan *p);
+
+void prescan_stats(struct prescan *p, unsigned long *hits,
+				unsigned long *misses);
+
+#endif
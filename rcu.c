@@ -0,0 +1,118 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Minimal read-copy-update to replace shared data without blocking readers
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * Every thread that reads registers a counter. When it enters its outermost
+ * read section, it stores the current grace period in the counter and when it
+ * leaves, it stores 0. rcu_synchronize() starts a new grace period and waits
+ * until every counter is either 0 or already shows the new grace period. A
+ * reader that stored the old grace period may have loaded the old pointer,
+ * all others will load the new one.
+ *
+ * This is the "memb" flavor of liburcu reduced to what sparsefs needs. The
+ * counters of threads that exit are removed by a thread-specific destructor.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rcu.h"
+
+struct rcu_reader {
+	unsigned long ctr;
+	unsigned int nesting;
+
+	struct rcu_reader *next;
+};
+
+static unsigned long rcu_gp = 1;
+
+static struct rcu_reader *readers;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct rcu_reader *self;
+
+static void rcu_unregister(void *arg)
+{
+	struct rcu_reader *r = arg, **p;
+
+	pthread_mutex_lock(&readers_lock);
+	for (p = &readers; *p; p = &(*p)->next) {
+		if (*p == r) {
+			*p = r->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&readers_lock);
+
+	free(r);
+}
+
+static void rcu_create_key(void)
+{
+	pthread_key_create(&reader_key, rcu_unregister);
+}
+
+static struct rcu_reader *rcu_register(void)
+{
+	struct rcu_reader *r;
+
+	// without memory, the thread could not be tracked, so just retry
+	while (!(r = calloc(1, sizeof(struct rcu_reader))))
+		sched_yield();
+
+	pthread_once(&reader_key_once, rcu_create_key);
+	pthread_setspecific(reader_key, r);
+
+	pthread_mutex_lock(&readers_lock);
+	r->next = readers;
+	readers = r;
+	pthread_mutex_unlock(&readers_lock);
+
+	return r;
+}
+
+void rcu_read_lock(void)
+{
+	if (!self)
+		self = rcu_register();
+
+	if (self->nesting++ == 0)
+		__atomic_store_n(&self->ctr, __atomic_load_n(&rcu_gp, __ATOMIC_RELAXED),
+					__ATOMIC_SEQ_CST);
+}
+
+void rcu_read_unlock(void)
+{
+	if (--self->nesting == 0)
+		__atomic_store_n(&self->ctr, 0, __ATOMIC_RELEASE);
+}
+
+void rcu_synchronize(void)
+{
+	struct timespec pause = { 0, 100000 };
+	struct rcu_reader *r;
+	unsigned long gp, ctr;
+
+	gp = __atomic_add_fetch(&rcu_gp, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&readers_lock);
+	for (r = readers; r; r = r->next) {
+		while ((ctr = __atomic_load_n(&r->ctr, __ATOMIC_SEQ_CST)) != 0 && ctr != gp)
+			nanosleep(&pause, NULL);
+	}
+	pthread_mutex_unlock(&readers_lock);
+}
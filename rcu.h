@@ -0,0 +1,35 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Minimal read-copy-update to replace shared data without blocking readers
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef RCU_H
+#define RCU_H
+
+/*
+ * Readers access the data only between rcu_read_lock() and rcu_read_unlock()
+ * and load the pointer with rcu_dereference(). Read sections can be nested
+ * and never block, except for a short registration on the first call of a
+ * thread.
+ */
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_SEQ_CST)
+
+/*
+ * Writers store the new pointer with rcu_assign_pointer() and then wait with
+ * rcu_synchronize() until no reader can use the old data anymore, so it can
+ * be freed. Writers must be serialized by the caller.
+ */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_SEQ_CST)
+
+void rcu_synchronize(void);
+
+#endif
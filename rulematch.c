@@ -0,0 +1,624 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Compiled matcher for an ordered list of wildcard rules
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * Every pattern consists of a literal prefix up to its first wildcard, the
+ * part with the wildcards and a literal suffix after its last wildcard. A path
+ * can only match a pattern if it starts with the prefix and ends with the
+ * suffix, so these cheap checks are done before the pattern is matched.
+ * Patterns are compiled with wildprog_compile() when they are added, only
+ * patterns that cannot be compiled are matched with wildmatch().
+ *
+ * To avoid looking at every pattern for every path, the directory part of the
+ * prefix is stored in a trie of path segments. Within a trie node, patterns
+ * are grouped by a literal path segment that has to appear at a fixed depth
+ * below the node, e.g., "x" for "a/b*" + "/c?/x/" + "**" in node "a/".
+ * Patterns without such a segment are grouped by their last segment if it is
+ * a literal, e.g., "x" for "**" + "/x", or else by the file extension of
+ * their suffix. A lookup only visits the trie nodes along the path and, in
+ * every node, the groups of the path's segments and extension and the
+ * patterns that could not be grouped.
+ *
+ * Patterns are numbered in the order they were added and the lists in the
+ * trie are sorted by this number. Hence, the first match in every list is
+ * the best candidate of this list and lists can be skipped as soon as their
+ * next entry is worse than the best match found so far.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "rulematch.h"
+#include "wildmatch.h"
+#include "wildprog.h"
+
+struct rm_pattern {
+	char *pattern;
+	struct wildprog *prog;
+	size_t dir_len;
+	size_t prefix_len;
+	const char *suffix;
+	size_t suffix_len;
+};
+
+struct rm_list {
+	unsigned int *ids;
+	unsigned int n;
+	unsigned int size;
+};
+
+/* edge from a trie node to the node of one of its subdirectories */
+struct rm_edge {
+	uint64_t hash;
+	unsigned int parent;
+	unsigned int child; /* 0 marks an empty slot as the root is nobody's child */
+	const char *segment;
+	size_t segment_len;
+};
+
+/*
+ * Patterns of a trie node that require the same literal segment at the same
+ * depth below the node, the same last segment (RM_LAST) or, for depth 0, the
+ * same extension
+ */
+struct rm_group {
+	uint64_t hash;
+	unsigned int node;
+	unsigned int depth;
+	const char *key; /* NULL marks an empty slot */
+	size_t key_len;
+	struct rm_list list;
+};
+
+/* groups are only used for segments up to this depth below a node */
+#define RM_MAX_DEPTH 31
+#define RM_LAST (RM_MAX_DEPTH + 1)
+
+struct rule_matcher {
+	struct rm_pattern *patterns;
+	unsigned int n_patterns;
+	unsigned int patterns_size;
+
+	/*
+	 * patterns without a group and a bitmask of the depths of the groups of
+	 * every node, bit 0 is set if the node has groups for the last segment
+	 */
+	struct rm_list *nodes;
+	uint32_t *depths;
+	unsigned int n_nodes;
+	unsigned int nodes_size;
+
+	/* open addressing tables, their size is always a power of two */
+	struct rm_edge *edges;
+	size_t n_edges;
+	size_t edges_size;
+
+	struct rm_group *groups;
+	size_t n_groups;
+	size_t groups_size;
+};
+
+static uint64_t rm_hash(uint64_t seed, const char *s, size_t len)
+{
+	return hash_update(hash_add(HASH_INIT, seed), s, len);
+}
+
+static int rm_list_append(struct rm_list *list, unsigned int id)
+{
+	unsigned int *ids;
+
+	if (list->n == list->size) {
+		ids = realloc(list->ids, sizeof(unsigned int) * (list->size ? list->size * 2 : 4));
+		if (!ids)
+			return -1;
+
+		list->ids = ids;
+		list->size = list->size ? list->size * 2 : 4;
+	}
+
+	list->ids[list->n++] = id;
+
+	return 0;
+}
+
+static struct rm_edge *rm_edge_slot(const struct rm_edge *edges, size_t size,
+		unsigned int parent, const char *segment, size_t segment_len, uint64_t hash)
+{
+	size_t i;
+
+	for (i = hash & (size - 1); edges[i].child; i = (i + 1) & (size - 1)) {
+		if (edges[i].hash == hash && edges[i].parent == parent &&
+			edges[i].segment_len == segment_len &&
+			!memcmp(edges[i].segment, segment, segment_len))
+			break;
+	}
+
+	return (struct rm_edge *) &edges[i];
+}
+
+static struct rm_group *rm_group_slot(const struct rm_group *groups, size_t size,
+		unsigned int node, unsigned int depth, const char *key, size_t key_len,
+		uint64_t hash)
+{
+	size_t i;
+
+	for (i = hash & (size - 1); groups[i].key; i = (i + 1) & (size - 1)) {
+		if (groups[i].hash == hash && groups[i].node == node &&
+			groups[i].depth == depth && groups[i].key_len == key_len &&
+			!memcmp(groups[i].key, key, key_len))
+			break;
+	}
+
+	return (struct rm_group *) &groups[i];
+}
+
+static int rm_edges_grow(struct rule_matcher *m)
+{
+	struct rm_edge *edges, *slot;
+	size_t i, size;
+
+	size = m->edges_size ? m->edges_size * 2 : 64;
+	edges = calloc(size, sizeof(struct rm_edge));
+	if (!edges)
+		return -1;
+
+	for (i=0; i < m->edges_size; i++) {
+		if (!m->edges[i].child)
+			continue;
+
+		slot = rm_edge_slot(edges, size, m->edges[i].parent, m->edges[i].segment,
+						m->edges[i].segment_len, m->edges[i].hash);
+		*slot = m->edges[i];
+	}
+
+	free(m->edges);
+	m->edges = edges;
+	m->edges_size = size;
+
+	return 0;
+}
+
+static int rm_groups_grow(struct rule_matcher *m)
+{
+	struct rm_group *groups, *slot;
+	size_t i, size;
+
+	size = m->groups_size ? m->groups_size * 2 : 64;
+	groups = calloc(size, sizeof(struct rm_group));
+	if (!groups)
+		return -1;
+
+	for (i=0; i < m->groups_size; i++) {
+		if (!m->groups[i].key)
+			continue;
+
+		slot = rm_group_slot(groups, size, m->groups[i].node, m->groups[i].depth,
+						m->groups[i].key, m->groups[i].key_len, m->groups[i].hash);
+		*slot = m->groups[i];
+	}
+
+	free(m->groups);
+	m->groups = groups;
+	m->groups_size = size;
+
+	return 0;
+}
+
+static int rm_new_node(struct rule_matcher *m)
+{
+	struct rm_list *nodes;
+	uint32_t *depths;
+	unsigned int size;
+
+	if (m->n_nodes == m->nodes_size) {
+		size = m->nodes_size ? m->nodes_size * 2 : 16;
+
+		nodes = realloc(m->nodes, sizeof(struct rm_list) * size);
+		if (!nodes)
+			return -1;
+		m->nodes = nodes;
+
+		depths = realloc(m->depths, sizeof(uint32_t) * size);
+		if (!depths)
+			return -1;
+		m->depths = depths;
+
+		m->nodes_size = size;
+	}
+
+	memset(&m->nodes[m->n_nodes], 0, sizeof(struct rm_list));
+	m->depths[m->n_nodes] = 0;
+
+	return m->n_nodes++;
+}
+
+/*
+ * Returns the child of node for the given path segment or 0 if there is none
+ */
+static unsigned int rm_find_child(const struct rule_matcher *m, unsigned int node,
+				const char *segment, size_t segment_len)
+{
+	if (!m->edges_size)
+		return 0;
+
+	return rm_edge_slot(m->edges, m->edges_size, node, segment, segment_len,
+				rm_hash(node, segment, segment_len))->child;
+}
+
+/*
+ * Returns the child of node for the given path segment, creates it if
+ * necessary. Returns -1 on error.
+ */
+static int rm_add_child(struct rule_matcher *m, unsigned int node,
+				const char *segment, size_t segment_len)
+{
+	struct rm_edge *slot;
+	uint64_t hash;
+	int child;
+
+	child = rm_find_child(m, node, segment, segment_len);
+	if (child)
+		return child;
+
+	if ((m->n_edges + 1) * 2 > m->edges_size && rm_edges_grow(m))
+		return -1;
+
+	child = rm_new_node(m);
+	if (child < 0)
+		return -1;
+
+	hash = rm_hash(node, segment, segment_len);
+	slot = rm_edge_slot(m->edges, m->edges_size, node, segment, segment_len, hash);
+	slot->hash = hash;
+	slot->parent = node;
+	slot->child = child;
+	slot->segment = segment;
+	slot->segment_len = segment_len;
+	m->n_edges++;
+
+	return child;
+}
+
+static uint64_t rm_group_hash(unsigned int node, unsigned int depth,
+				const char *key, size_t key_len)
+{
+	return rm_hash((uint64_t) node << 8 | depth, key, key_len);
+}
+
+/*
+ * Returns the group of a node for the given depth and key or NULL if there
+ * is none
+ */
+static const struct rm_group *rm_find_group(const struct rule_matcher *m,
+				unsigned int node, unsigned int depth, const char *key, size_t key_len)
+{
+	const struct rm_group *slot;
+
+	if (!m->groups_size)
+		return NULL;
+
+	slot = rm_group_slot(m->groups, m->groups_size, node, depth, key, key_len,
+				rm_group_hash(node, depth, key, key_len));
+
+	return slot->key ? slot : NULL;
+}
+
+/*
+ * Returns the group of a node for the given depth and key, creates it if
+ * necessary. Returns NULL on error.
+ */
+static struct rm_group *rm_add_group(struct rule_matcher *m, unsigned int node,
+				unsigned int depth, const char *key, size_t key_len)
+{
+	struct rm_group *slot;
+	uint64_t hash;
+
+	hash = rm_group_hash(node, depth, key, key_len);
+
+	if (m->groups_size) {
+		slot = rm_group_slot(m->groups, m->groups_size, node, depth, key, key_len, hash);
+		if (slot->key)
+			return slot;
+	}
+
+	if ((m->n_groups + 1) * 2 > m->groups_size && rm_groups_grow(m))
+		return NULL;
+
+	slot = rm_group_slot(m->groups, m->groups_size, node, depth, key, key_len, hash);
+	slot->hash = hash;
+	slot->node = node;
+	slot->depth = depth;
+	slot->key = key;
+	slot->key_len = key_len;
+	m->n_groups++;
+
+	if (depth == RM_LAST)
+		m->depths[node] |= 1;
+	else if (depth)
+		m->depths[node] |= 1U << depth;
+
+	return slot;
+}
+
+struct rule_matcher *rule_matcher_new(void)
+{
+	struct rule_matcher *m;
+
+	m = calloc(1, sizeof(struct rule_matcher));
+	if (!m)
+		return NULL;
+
+	// create the root node
+	if (rm_new_node(m) < 0) {
+		free(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+void rule_matcher_free(struct rule_matcher *m)
+{
+	unsigned int i;
+	size_t j;
+
+	if (!m)
+		return;
+
+	for (i=0; i < m->n_patterns; i++) {
+		free(m->patterns[i].pattern);
+		wildprog_free(m->patterns[i].prog);
+	}
+	for (i=0; i < m->n_nodes; i++)
+		free(m->nodes[i].ids);
+	for (j=0; j < m->groups_size; j++)
+		free(m->groups[j].list.ids);
+
+	free(m->patterns);
+	free(m->nodes);
+	free(m->depths);
+	free(m->edges);
+	free(m->groups);
+	free(m);
+}
+
+int rule_matcher_add(struct rule_matcher *m, const char *pattern)
+{
+	struct rm_pattern *p;
+	struct rm_group *group;
+	struct rm_list *list;
+	const char *s, *slash, *next, *end;
+	unsigned int depth;
+	size_t length;
+	int node;
+
+	if (m->n_patterns == m->patterns_size) {
+		p = realloc(m->patterns, sizeof(struct rm_pattern) * (m->patterns_size ? m->patterns_size * 2 : 16));
+		if (!p)
+			return -1;
+
+		m->patterns = p;
+		m->patterns_size = m->patterns_size ? m->patterns_size * 2 : 16;
+	}
+
+	p = &m->patterns[m->n_patterns];
+	p->pattern = strdup(pattern);
+	if (!p->pattern)
+		return -1;
+
+	// NULL if the pattern is too long, it is matched with wildmatch() then
+	p->prog = wildprog_compile(pattern, WM_PATHNAME);
+
+	length = strlen(pattern);
+
+	// literal prefix and its directory part
+	p->prefix_len = strcspn(p->pattern, "*?[\\");
+	p->dir_len = 0;
+	for (s = p->pattern; s < p->pattern + p->prefix_len; s++) {
+		if (*s == '/')
+			p->dir_len = s - p->pattern + 1;
+	}
+
+	// literal suffix, only determined for patterns with plain '*' and '?'
+	p->suffix = p->pattern + length;
+	p->suffix_len = 0;
+	if (!strpbrk(p->pattern, "[\\")) {
+		for (s = p->pattern + length; s > p->pattern && s[-1] != '*' && s[-1] != '?'; s--) {}
+
+		// "**/" also matches an empty string including the slash
+		if (s > p->pattern + 1 && s[-1] == '*' && s[-2] == '*' && s[0] == '/')
+			s++;
+
+		p->suffix = s;
+		p->suffix_len = p->pattern + length - s;
+	}
+
+	// insert the directory part of the prefix into the trie
+	node = 0;
+	for (s = p->pattern; (slash = memchr(s, '/', p->pattern + p->dir_len - s)); s = slash + 1) {
+		node = rm_add_child(m, node, s, slash - s);
+		if (node < 0)
+			goto error;
+	}
+
+	group = NULL;
+
+	/*
+	 * Look for a literal segment at a fixed depth below the node. Every
+	 * segment before the first "**" matches exactly one segment of the path.
+	 * Escaped slashes and classes could hide a '/', so skip these patterns.
+	 */
+	if (!strpbrk(p->pattern, "[\\")) {
+		end = strstr(p->pattern, "**");
+		if (!end)
+			end = p->pattern + length;
+
+		depth = 0;
+		for (s = p->pattern + p->dir_len; (slash = memchr(s, '/', end - s)); s = slash + 1) {
+			if (++depth > RM_MAX_DEPTH)
+				break;
+
+			// the segment after this slash has to end before the "**"
+			next = memchr(slash + 1, '/', end - slash - 1);
+			if (!next && end != p->pattern + length)
+				break;
+			if (!next)
+				next = end;
+
+			if (!memchr(slash + 1, '*', next - slash - 1) &&
+				!memchr(slash + 1, '?', next - slash - 1)) {
+				group = rm_add_group(m, node, depth, slash + 1, next - slash - 1);
+				if (!group)
+					goto error;
+				break;
+			}
+		}
+	}
+
+	// otherwise group the pattern by its last segment if it is a literal
+	if (!group && !strpbrk(p->pattern, "[\\")) {
+		slash = strrchr(p->pattern, '/');
+		if (slash && slash + 1 >= p->suffix) {
+			group = rm_add_group(m, node, RM_LAST, slash + 1, p->pattern + length - slash - 1);
+			if (!group)
+				goto error;
+		}
+	}
+
+	// otherwise group the pattern by the extension of its suffix, if possible
+	if (!group && !memchr(p->suffix, '/', p->suffix_len)) {
+		for (s = p->suffix + p->suffix_len; s > p->suffix && s[-1] != '.'; s--) {}
+		if (s > p->suffix) {
+			group = rm_add_group(m, node, 0, s, p->suffix + p->suffix_len - s);
+			if (!group)
+				goto error;
+		}
+	}
+
+	list = group ? &group->list : &m->nodes[node];
+
+	if (rm_list_append(list, m->n_patterns))
+		goto error;
+
+	return m->n_patterns++;
+
+error:
+	free(p->pattern);
+	wildprog_free(p->prog);
+	return -1;
+}
+
+static void rm_check(const struct rule_matcher *m, const struct rm_list *list,
+				const char *path, size_t length, unsigned int *best)
+{
+	const struct rm_pattern *p;
+	unsigned int i;
+
+	for (i=0; i < list->n && list->ids[i] < *best; i++) {
+		p = &m->patterns[list->ids[i]];
+
+		// the directory part of the prefix was already matched by the trie
+		if (strncmp(path + p->dir_len, p->pattern + p->dir_len, p->prefix_len - p->dir_len))
+			continue;
+
+		if (p->suffix_len > length ||
+			memcmp(path + length - p->suffix_len, p->suffix, p->suffix_len))
+			continue;
+
+		if ((p->prog ? wildprog_match(p->prog, path) :
+			wildmatch(p->pattern, path, WM_PATHNAME, NULL)) == WM_MATCH) {
+			*best = list->ids[i];
+			return;
+		}
+	}
+}
+
+/*
+ * Checks the groups of a node for the segments of the path below the node,
+ * s points to the first of these segments
+ */
+static void rm_check_segments(const struct rule_matcher *m, unsigned int node,
+				const char *s, const char *path, size_t length, unsigned int *best)
+{
+	const struct rm_group *group;
+	const char *next;
+	unsigned int depth;
+
+	for (depth=1; depth <= RM_MAX_DEPTH && (m->depths[node] >> depth); depth++) {
+		s = memchr(s, '/', path + length - s);
+		if (!s)
+			return;
+		s++;
+
+		if (!(m->depths[node] & (1U << depth)))
+			continue;
+
+		next = memchr(s, '/', path + length - s);
+		if (!next)
+			next = path + length;
+
+		group = rm_find_group(m, node, depth, s, next - s);
+		if (group)
+			rm_check(m, &group->list, path, length, best);
+	}
+}
+
+int rule_matcher_match(const struct rule_matcher *m, const char *path)
+{
+	const struct rm_group *group;
+	const char *s, *slash, *ext, *last;
+	unsigned int best, node;
+	size_t length;
+
+	length = strlen(path);
+
+	// last path segment and its extension
+	for (s = path + length; s > path && s[-1] != '.' && s[-1] != '/'; s--) {}
+	ext = (s > path && s[-1] == '.') ? s : NULL;
+	for (last = s; last > path && last[-1] != '/'; last--) {}
+
+	best = UINT_MAX;
+	node = 0;
+	s = path;
+	while (1) {
+		rm_check(m, &m->nodes[node], path, length, &best);
+
+		if (m->depths[node] & ~1U)
+			rm_check_segments(m, node, s, path, length, &best);
+
+		if (m->depths[node] & 1) {
+			group = rm_find_group(m, node, RM_LAST, last, path + length - last);
+			if (group)
+				rm_check(m, &group->list, path, length, &best);
+		}
+
+		if (ext) {
+			group = rm_find_group(m, node, 0, ext, path + length - ext);
+			if (group)
+				rm_check(m, &group->list, path, length, &best);
+		}
+
+		slash = memchr(s, '/', path + length - s);
+		if (!slash)
+			break;
+
+		node = rm_find_child(m, node, s, slash - s);
+		if (!node)
+			break;
+
+		s = slash + 1;
+	}
+
+	return best == UINT_MAX ? -1 : (int) best;
+}
@@ -0,0 +1,32 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Compiled matcher for an ordered list of wildcard rules
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef RULEMATCH_H
+#define RULEMATCH_H
+
+struct rule_matcher;
+
+struct rule_matcher *rule_matcher_new(void);
+void rule_matcher_free(struct rule_matcher *m);
+
+/*
+ * Adds a pattern to the matcher. Patterns are numbered in the order they are
+ * added, starting with 0. Returns the number of the pattern or -1 on error.
+ */
+int rule_matcher_add(struct rule_matcher *m, const char *pattern);
+
+/*
+ * Returns the number of the first pattern that matches path (wildmatch() with
+ * WM_PATHNAME) or -1 if no pattern matches.
+ */
+int rule_matcher_match(const struct rule_matcher *m, const char *path);
+
+#endif
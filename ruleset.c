@@ -0,0 +1,1199 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Ordered set of include and exclude rules
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * Rules without wildcards are stored in a hash table and are checked first.
+ * The table uses open addressing with linear probing, stores the hash of
+ * every pattern and doubles its size when it is three quarters full, so
+ * loading and looking up millions of paths stays cheap. If a pattern is
+ * added twice, the first rule stays in the table and the second is dropped
+ * as it could never match first.
+ * The wildcard rules are kept in a chain in the order they were added and
+ * are compiled into a rule_matcher.
+ *
+ * The rules and their patterns are allocated from an arena that is freed
+ * with the ruleset. A rule file is mapped privately and its lines become the
+ * patterns in place, so loading a file with millions of lines does not
+ * allocate memory for every line. As the end of every line is overwritten
+ * with a NUL, every page of the file is copied once by the kernel, so the file
+ * takes its size in memory. A precompiled file is not written to and its
+ * pages stay shared with the page cache.
+ *
+ * ruleset_save() writes the rules to a precompiled file: the hash table of
+ * the rules without wildcards as it is used for lookups, the wildcard rules,
+ * the sorted include rules for prunes() and the patterns. Such a file is
+ * mapped by ruleset_parse_file() and its table is used in place, so loading
+ * it does not depend on the number of rules without wildcards. As a path can
+ * be in several tables, the tables are searched in the order they were
+ * added and a new table is started for the rules that are appended after a
+ * precompiled file.
+ *
+ * A ruleset is not changed after it was compiled, so it can be shared by all
+ * threads without locking. To change the rules, a new ruleset is built.
+ *
+ * In prune mode, a rule "dir/" is added twice: as "dir" and with "**" after
+ * the '/', which matches everything below. If the first rule that matches a
+ * path is such an exclude rule, or any other that ends with "**" after a '/',
+ * and no include rule before it can match a path below, everything below the
+ * path is excluded as well. These paths are remembered in a table, so the
+ * paths below them are answered by looking up their ancestors instead of
+ * matching the rules again. The table is sized from the number of rules when
+ * the ruleset is compiled and entries are only added, with a compare-and-swap
+ * of the slot, so lookups take no lock. Once it is half full, further paths
+ * are matched every time. The table belongs to the ruleset and is dropped
+ * with it when the rules are reloaded.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "rulematch.h"
+#include "ruleset.h"
+#include "wildmatch.h"
+
+// initial size of the table of rules without wildcards, a power of two
+#define LITERALS_MIN_SIZE 64
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+// the table of pruned paths has two slots per rule within these bounds
+#define PRUNE_MIN_SIZE 1024
+#define PRUNE_MAX_SIZE (1 << 20)
+
+// precompiled rule files, in the byte order of the machine that wrote them
+#define RULES_MAGIC "SFSRULE1"
+#define RULES_PRUNE 1
+
+struct rules_header {
+	char magic[8];
+	uint32_t flags;
+	uint32_t n_wildcards;
+	uint64_t table_size; /* a power of two */
+	uint64_t n_includes;
+	uint64_t table_offset;
+	uint64_t wildcards_offset;
+	uint64_t includes_offset;
+	uint64_t strings_offset;
+	uint64_t strings_size; /* the last byte is 0 */
+};
+
+struct rules_entry {
+	uint64_t hash;
+	uint32_t pattern; /* offset in the strings plus 1, 0 marks an empty slot */
+	uint16_t exclude;
+	uint16_t dir;
+};
+
+struct rules_wildcard {
+	uint32_t pattern;
+	uint16_t exclude;
+	uint16_t dir;
+};
+
+// the include rules without wildcards are an array of sorted uint32_t offsets
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct mapping {
+	struct mapping *next;
+	void *addr;
+	size_t length;
+};
+
+struct prune_entry {
+	uint64_t hash;
+	const struct rule *rule;
+	char path[];
+};
+
+struct prune_table {
+	struct prune_entry **entries; /* NULL marks an empty slot */
+	size_t size; /* a power of two */
+	size_t count;
+};
+
+struct literal_entry {
+	uint64_t hash;
+	struct rule *rule; /* NULL marks an empty slot */
+};
+
+/* rules without wildcards that were appended or are mapped from a file */
+struct literal_table {
+	struct literal_entry *entries;
+	size_t size;
+	size_t n;
+
+	// sorted include rules without wildcards, see prunes()
+	char **includes;
+	size_t n_includes;
+
+	// a precompiled file, its rules share one rule per verdict
+	const struct rules_header *file;
+	const struct rules_entry *file_entries;
+	const uint32_t *file_includes;
+	const char *strings;
+	struct rule verdicts[2][2];
+};
+
+struct ruleset {
+	struct rule *head;
+	struct rule *tail;
+
+	// rules without wildcards, searched in this order
+	struct literal_table *literals;
+	unsigned int n_literals;
+
+	// the wildcard rules of the chain, compiled by ruleset_compile()
+	struct rule_matcher *matcher;
+	struct rule **matcher_rules;
+
+	// paths whose subtree is excluded, only in prune mode
+	struct prune_table *prune;
+
+	// memory of the rules and patterns
+	struct arena_block *arena;
+	struct mapping *mappings;
+};
+
+static void *arena_alloc(struct ruleset *rs, size_t size)
+{
+	struct arena_block *b = rs->arena;
+	size_t block_size;
+	void *p;
+
+	size = (size + 7) & ~(size_t) 7;
+
+	if (!b || b->used + size > b->size) {
+		block_size = size > ARENA_BLOCK_SIZE / 4 ? size : ARENA_BLOCK_SIZE;
+
+		b = malloc(sizeof(struct arena_block) + block_size);
+		if (!b)
+			return NULL;
+
+		b->used = 0;
+		b->size = block_size;
+
+		// keep filling the current block if this one is only for a large allocation
+		if (block_size != ARENA_BLOCK_SIZE && rs->arena) {
+			b->next = rs->arena->next;
+			rs->arena->next = b;
+		} else {
+			b->next = rs->arena;
+			rs->arena = b;
+		}
+	}
+
+	p = b->data + b->used;
+	b->used += size;
+
+	return p;
+}
+
+static char *arena_strndup(struct ruleset *rs, const char *s, size_t len)
+{
+	char *copy;
+
+	copy = arena_alloc(rs, len + 1);
+	if (!copy)
+		return NULL;
+
+	memcpy(copy, s, len);
+	copy[len] = 0;
+
+	return copy;
+}
+
+/* hashes eight bytes at a time */
+static uint64_t literal_hash(const char *s, size_t len)
+{
+	uint64_t hash = len * 0x9e3779b97f4a7c15ULL;
+	uint64_t word;
+
+	for (; len >= 8; s += 8, len -= 8) {
+		memcpy(&word, s, 8);
+		hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 32;
+	}
+
+	word = 0;
+	memcpy(&word, s, len);
+	hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 29;
+
+	return hash;
+}
+
+/* returns a pattern of a precompiled file, an invalid offset yields "" */
+static const char *file_string(const struct literal_table *t, uint32_t offset)
+{
+	if (offset >= t->file->strings_size)
+		return "";
+
+	return t->strings + offset;
+}
+
+static const char *include_literal(const struct literal_table *t, size_t i)
+{
+	if (t->file)
+		return file_string(t, t->file_includes[i]);
+
+	return t->includes[i];
+}
+
+static const struct rule *literal_lookup(const struct literal_table *t, const char *s, uint64_t hash)
+{
+	const struct rules_entry *f;
+	const struct literal_entry *e;
+	size_t i, j, mask;
+
+	if (!t->file) {
+		mask = t->size - 1;
+		for (i = hash & mask, j = 0; j < t->size && (e = &t->entries[i])->rule; i = (i + 1) & mask, j++) {
+			if (e->hash == hash && !strcmp(e->rule->pattern, s))
+				return e->rule;
+		}
+
+		return NULL;
+	}
+
+	mask = t->file->table_size - 1;
+	for (i = hash & mask, j = 0; j < t->file->table_size && (f = &t->file_entries[i])->pattern; i = (i + 1) & mask, j++) {
+		if (f->hash == hash && !strcmp(file_string(t, f->pattern - 1), s))
+			return &t->verdicts[!!f->exclude][!!f->dir];
+	}
+
+	return NULL;
+}
+
+static const struct rule *get_rule_by_hash(const struct ruleset *rs, const char *s)
+{
+	const struct rule *rule;
+	uint64_t hash;
+	unsigned int i;
+
+	if (!rs->n_literals)
+		return NULL;
+
+	hash = literal_hash(s, strlen(s));
+	for (i=0; i < rs->n_literals; i++) {
+		rule = literal_lookup(&rs->literals[i], s, hash);
+		if (rule)
+			return rule;
+	}
+
+	return NULL;
+}
+
+/* inserts an entry whose pattern is not in the table yet */
+static void literal_insert(struct literal_entry *entries, size_t size, uint64_t hash, struct rule *rule)
+{
+	size_t i;
+
+	for (i = hash & (size - 1); entries[i].rule; i = (i + 1) & (size - 1)) {}
+
+	entries[i].hash = hash;
+	entries[i].rule = rule;
+}
+
+static int literals_grow(struct literal_table *t)
+{
+	struct literal_entry *entries;
+	size_t i, size;
+
+	size = t->size ? t->size * 2 : LITERALS_MIN_SIZE;
+	entries = calloc(size, sizeof(struct literal_entry));
+	if (!entries)
+		return -1;
+
+	for (i=0; i < t->size; i++) {
+		if (t->entries[i].rule)
+			literal_insert(entries, size, t->entries[i].hash, t->entries[i].rule);
+	}
+
+	free(t->entries);
+	t->entries = entries;
+	t->size = size;
+
+	return 0;
+}
+
+/* returns a new table at the end of the search order */
+static struct literal_table *literals_add(struct ruleset *rs)
+{
+	struct literal_table *tables;
+
+	tables = realloc(rs->literals, sizeof(struct literal_table) * (rs->n_literals + 1));
+	if (!tables)
+		return NULL;
+
+	rs->literals = tables;
+	memset(&tables[rs->n_literals], 0, sizeof(struct literal_table));
+
+	return &tables[rs->n_literals++];
+}
+
+struct ruleset *ruleset_new(void)
+{
+	return calloc(1, sizeof(struct ruleset));
+}
+
+int ruleset_enable_prune(struct ruleset *rs)
+{
+	rs->prune = calloc(1, sizeof(struct prune_table));
+	if (!rs->prune)
+		return -1;
+
+	return 0;
+}
+
+void ruleset_free(struct ruleset *rs)
+{
+	struct arena_block *b, *next_block;
+	struct mapping *m, *next_mapping;
+	unsigned int i;
+	size_t j;
+
+	if (!rs)
+		return;
+
+	for (i=0; i < rs->n_literals; i++) {
+		free(rs->literals[i].entries);
+		free(rs->literals[i].includes);
+	}
+	free(rs->literals);
+
+	rule_matcher_free(rs->matcher);
+	free(rs->matcher_rules);
+
+	if (rs->prune) {
+		for (j=0; j < rs->prune->size; j++)
+			free(rs->prune->entries[j]);
+		free(rs->prune->entries);
+		free(rs->prune);
+	}
+
+	// the mappings are in the arena
+	for (m = rs->mappings; m; m = next_mapping) {
+		next_mapping = m->next;
+		munmap(m->addr, m->length);
+	}
+
+	for (b = rs->arena; b; b = next_block) {
+		next_block = b->next;
+		free(b);
+	}
+
+	free(rs);
+}
+
+/* adds a rule that takes the normalized pattern */
+static int add_rule(struct ruleset *rs, struct rule *rule)
+{
+	struct literal_table *t;
+
+	// if pattern contains wildcards do not add it to the hashtable
+	if (strpbrk(rule->pattern, "*?")) {
+		if (!rs->head) {
+			rs->head = rule;
+			rs->tail = rule;
+		} else {
+			rs->tail->next = rule;
+			rs->tail = rule;
+		}
+
+		return 0;
+	}
+
+	// an earlier rule with the same pattern always matches first
+	if (get_rule_by_hash(rs, rule->pattern))
+		return 0;
+
+	t = rs->n_literals ? &rs->literals[rs->n_literals - 1] : NULL;
+	if (!t || t->file) {
+		t = literals_add(rs);
+		if (!t)
+			return -1;
+	}
+
+	if ((t->n + 1) * 4 > t->size * 3 && literals_grow(t))
+		return -1;
+
+	literal_insert(t->entries, t->size, literal_hash(rule->pattern, strlen(rule->pattern)), rule);
+	t->n++;
+
+	return 0;
+}
+
+/* appends a rule for a pattern in the arena or a mapping, the pattern is normalized in place */
+static int append_rule(struct ruleset *rs, char *pattern, size_t pattern_length, int exclude)
+{
+	struct rule *rule, *subtree;
+	int dir = 0;
+
+	rule = arena_alloc(rs, sizeof(struct rule));
+	if (!rule)
+		return -1;
+
+	rule->pattern = pattern;
+
+	// strip quotation marks at start and end
+	if (pattern_length > 1 && (rule->pattern[0] == '"' ||
+		rule->pattern[pattern_length-1] == '"'))
+	{
+		rule->pattern[pattern_length-1] = 0;
+		memmove(rule->pattern, &rule->pattern[1], pattern_length - 1);
+		pattern_length -= 2;
+	}
+
+	// strip trailing '/' from directories
+	if (pattern_length > 0 && rule->pattern[pattern_length-1] == '/') {
+		rule->pattern[pattern_length-1] = 0;
+		pattern_length--;
+		dir = 1;
+	}
+
+	rule->exclude = exclude;
+	rule->dir = dir && rs->prune;
+	rule->next = NULL;
+
+	// in prune mode, the rule of a directory also matches everything below it
+	subtree = NULL;
+	if (dir && rs->prune && pattern_length > 0) {
+		subtree = arena_alloc(rs, sizeof(struct rule));
+		if (subtree)
+			subtree->pattern = arena_alloc(rs, pattern_length + 4);
+		if (!subtree || !subtree->pattern)
+			return -1;
+
+		sprintf(subtree->pattern, "%s/**", rule->pattern);
+		subtree->exclude = exclude;
+		subtree->dir = 0;
+		subtree->next = NULL;
+	}
+
+	if (add_rule(rs, rule))
+		return -1;
+	if (subtree && add_rule(rs, subtree))
+		return -1;
+
+	return 0;
+}
+
+int ruleset_append(struct ruleset *rs, const char *pattern, int exclude)
+{
+	size_t length = strlen(pattern);
+	char *copy;
+
+	copy = arena_strndup(rs, pattern, length);
+	if (!copy)
+		return -1;
+
+	return append_rule(rs, copy, length, exclude);
+}
+
+int ruleset_append_list(struct ruleset *rs, const char *patterns, int exclude)
+{
+	const char *str = patterns;
+	const char *end;
+	char *pattern;
+	size_t length;
+
+	while (1) {
+		end = strchr(str, ':');
+		length = end ? (size_t) (end - str) : strlen(str);
+
+		pattern = arena_strndup(rs, str, length);
+		if (!pattern)
+			return -1;
+
+		if (append_rule(rs, pattern, length, exclude))
+			return -1;
+
+		if (!end)
+			break;
+
+		str = end + 1;
+	}
+
+	return 0;
+}
+
+/* returns 1 if the line only contains whitespaces */
+static int blank(const char *s, size_t length)
+{
+	size_t i;
+
+	for (i=0; i < length; i++) {
+		if (!isspace((unsigned char) s[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int add_mapping(struct ruleset *rs, void *addr, size_t length)
+{
+	struct mapping *m;
+
+	m = arena_alloc(rs, sizeof(struct mapping));
+	if (!m) {
+		munmap(addr, length);
+		return -1;
+	}
+
+	m->addr = addr;
+	m->length = length;
+	m->next = rs->mappings;
+	rs->mappings = m;
+
+	return 0;
+}
+
+/*
+ * Adds the rules of a mapped precompiled file. Only the header is checked,
+ * invalid offsets in the tables are caught when they are used.
+ */
+static int load_precompiled(struct ruleset *rs, const char *addr, size_t size)
+{
+	const struct rules_header *h = (const struct rules_header *) addr;
+	const struct rules_wildcard *w;
+	struct literal_table *t;
+	struct rule *rule;
+	uint64_t i;
+	int exclude, dir;
+
+	if (size < sizeof(struct rules_header) ||
+		!!(h->flags & RULES_PRUNE) != !!rs->prune ||
+		h->table_size == 0 || (h->table_size & (h->table_size - 1)) ||
+		h->table_offset % 8 || h->wildcards_offset % 8 || h->includes_offset % 4 ||
+		h->table_offset > size || h->table_size > (size - h->table_offset) / sizeof(struct rules_entry) ||
+		h->wildcards_offset > size || h->n_wildcards > (size - h->wildcards_offset) / sizeof(struct rules_wildcard) ||
+		h->includes_offset > size || h->n_includes > (size - h->includes_offset) / sizeof(uint32_t) ||
+		h->strings_offset > size || h->strings_size == 0 || h->strings_size > size - h->strings_offset ||
+		addr[h->strings_offset + h->strings_size - 1] != 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	t = literals_add(rs);
+	if (!t)
+		return -1;
+
+	t->file = h;
+	t->file_entries = (const struct rules_entry *) (addr + h->table_offset);
+	t->file_includes = (const uint32_t *) (addr + h->includes_offset);
+	t->strings = addr + h->strings_offset;
+	t->n_includes = h->n_includes;
+	for (exclude = 0; exclude < 2; exclude++) {
+		for (dir = 0; dir < 2; dir++) {
+			t->verdicts[exclude][dir].pattern = (char *) "";
+			t->verdicts[exclude][dir].exclude = exclude;
+			t->verdicts[exclude][dir].dir = dir;
+		}
+	}
+
+	w = (const struct rules_wildcard *) (addr + h->wildcards_offset);
+	for (i=0; i < h->n_wildcards; i++) {
+		rule = arena_alloc(rs, sizeof(struct rule));
+		if (!rule)
+			return -1;
+
+		// the mapping is read-only, but patterns are not changed after they were added
+		rule->pattern = (char *) file_string(t, w[i].pattern);
+		rule->exclude = w[i].exclude;
+		rule->dir = w[i].dir;
+		rule->next = NULL;
+
+		if (add_rule(rs, rule))
+			return -1;
+	}
+
+	return 0;
+}
+
+int ruleset_parse_file(struct ruleset *rs, const char *filename, int exclude)
+{
+	struct stat st;
+	char *addr, *line, *end, *next, *newline;
+	size_t length;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	// the lines become the patterns, writes only change the private copy
+	addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	if (add_mapping(rs, addr, st.st_size))
+		return -1;
+
+	if ((size_t) st.st_size >= sizeof(RULES_MAGIC) - 1 &&
+		!memcmp(addr, RULES_MAGIC, sizeof(RULES_MAGIC) - 1))
+	{
+		mprotect(addr, st.st_size, PROT_READ);
+		return load_precompiled(rs, addr, st.st_size);
+	}
+
+	madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+	end = addr + st.st_size;
+	for (line = addr; line < end; line = next) {
+		newline = memchr(line, '\n', end - line);
+		if (newline) {
+			length = newline - line;
+			*newline = 0;
+			next = newline + 1;
+		} else {
+			// the last line has no room for the terminating zero
+			length = end - line;
+			line = arena_strndup(rs, line, length);
+			if (!line)
+				return -1;
+			next = end;
+		}
+
+		if (length == 0 || line[0] == '#' || blank(line, length))
+			continue;
+
+		if (append_rule(rs, line, length, exclude))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int cmp_string(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* collects the include rules without wildcards for prunes() */
+static int collect_include_literals(struct ruleset *rs)
+{
+	struct literal_table *t;
+	struct rule *rule;
+	unsigned int i;
+	size_t j;
+
+	for (i=0; i < rs->n_literals; i++) {
+		t = &rs->literals[i];
+		if (t->file)
+			continue;
+
+		t->includes = malloc(sizeof(char *) * (t->n + 1));
+		if (!t->includes)
+			return -1;
+
+		for (j=0; j < t->size; j++) {
+			rule = t->entries[j].rule;
+			if (rule && !rule->exclude)
+				t->includes[t->n_includes++] = rule->pattern;
+		}
+
+		qsort(t->includes, t->n_includes, sizeof(char *), cmp_string);
+	}
+
+	return 0;
+}
+
+/* allocates the table of pruned paths for the given number of rules */
+static int prune_init(struct prune_table *t, size_t n_rules)
+{
+	t->size = PRUNE_MIN_SIZE;
+	while (t->size < PRUNE_MAX_SIZE && t->size < 2 * n_rules)
+		t->size *= 2;
+
+	t->entries = calloc(t->size, sizeof(struct prune_entry *));
+	if (!t->entries)
+		return -1;
+
+	return 0;
+}
+
+int ruleset_compile(struct ruleset *rs)
+{
+	struct rule *curr_rule;
+	unsigned int n_rules, i;
+	size_t n_literals;
+	int id;
+
+	if (rs->prune && collect_include_literals(rs))
+		return -1;
+
+	n_rules = 0;
+	for (curr_rule = rs->head; curr_rule; curr_rule = curr_rule->next)
+		n_rules++;
+
+	if (rs->prune) {
+		// a precompiled table has at least one slot per rule
+		n_literals = 0;
+		for (i=0; i < rs->n_literals; i++)
+			n_literals += rs->literals[i].file ? rs->literals[i].file->table_size : rs->literals[i].n;
+
+		if (prune_init(rs->prune, n_rules + n_literals))
+			return -1;
+	}
+
+	rs->matcher = rule_matcher_new();
+	rs->matcher_rules = malloc(sizeof(struct rule *) * (n_rules + 1));
+	if (!rs->matcher || !rs->matcher_rules)
+		return -1;
+
+	for (curr_rule = rs->head; curr_rule; curr_rule = curr_rule->next) {
+		id = rule_matcher_add(rs->matcher, curr_rule->pattern);
+		if (id < 0)
+			return -1;
+
+		rs->matcher_rules[id] = curr_rule;
+	}
+
+	return 0;
+}
+
+struct save_state {
+	struct rules_entry *entries;
+	uint64_t table_size;
+	uint32_t *includes;
+	uint64_t n_includes;
+	char *strings;
+	size_t strings_size;
+	size_t strings_alloc;
+};
+
+/* returns the offset of a copy of s in the strings or -1 */
+static int64_t save_string(struct save_state *st, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *strings;
+	size_t offset;
+
+	if (st->strings_size + len > st->strings_alloc) {
+		st->strings_alloc = (st->strings_size + len) * 2;
+		strings = realloc(st->strings, st->strings_alloc);
+		if (!strings)
+			return -1;
+		st->strings = strings;
+	}
+
+	offset = st->strings_size;
+	memcpy(st->strings + offset, s, len);
+	st->strings_size += len;
+
+	// offsets are stored in 32 bits
+	if (st->strings_size > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	return offset;
+}
+
+static int save_literal(struct save_state *st, const char *s, int exclude, int dir)
+{
+	struct rules_entry *e;
+	uint64_t hash, mask = st->table_size - 1;
+	int64_t offset;
+	size_t i;
+
+	hash = literal_hash(s, strlen(s));
+	for (i = hash & mask; (e = &st->entries[i])->pattern; i = (i + 1) & mask) {
+		// an earlier table has the same pattern
+		if (e->hash == hash && !strcmp(st->strings + e->pattern - 1, s))
+			return 0;
+	}
+
+	offset = save_string(st, s);
+	if (offset < 0)
+		return -1;
+
+	e->hash = hash;
+	e->pattern = offset + 1;
+	e->exclude = exclude;
+	e->dir = dir;
+
+	if (!exclude)
+		st->includes[st->n_includes++] = offset;
+
+	return 0;
+}
+
+static int save_literals(struct save_state *st, const struct ruleset *rs)
+{
+	const struct literal_table *t;
+	const struct rules_entry *f;
+	unsigned int i;
+	uint64_t j;
+
+	for (i=0; i < rs->n_literals; i++) {
+		t = &rs->literals[i];
+
+		for (j=0; !t->file && j < t->size; j++) {
+			if (t->entries[j].rule && save_literal(st, t->entries[j].rule->pattern,
+					t->entries[j].rule->exclude, t->entries[j].rule->dir))
+				return -1;
+		}
+
+		for (j=0; t->file && j < t->file->table_size; j++) {
+			f = &t->file_entries[j];
+			if (f->pattern && save_literal(st, file_string(t, f->pattern - 1), f->exclude, f->dir))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+int ruleset_save(const struct ruleset *rs, const char *filename)
+{
+	struct save_state st;
+	struct rules_header h;
+	struct rules_wildcard *wildcards = NULL;
+	const struct rule *rule;
+	const char **sorted = NULL;
+	char *tmp = NULL;
+	uint64_t i, n = 0, n_wildcards = 0;
+	int64_t offset;
+	int fd = -1, r = -1;
+
+	memset(&st, 0, sizeof(st));
+
+	for (i=0; i < rs->n_literals; i++)
+		n += rs->literals[i].file ? rs->literals[i].file->table_size : rs->literals[i].n;
+	for (rule = rs->head; rule; rule = rule->next)
+		n_wildcards++;
+
+	if (n_wildcards > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	for (st.table_size = LITERALS_MIN_SIZE; (n + 1) * 4 > st.table_size * 3; st.table_size *= 2) {}
+
+	st.entries = calloc(st.table_size, sizeof(struct rules_entry));
+	st.includes = malloc(sizeof(uint32_t) * (n + 1));
+	wildcards = malloc(sizeof(struct rules_wildcard) * (n_wildcards + 1));
+	tmp = malloc(strlen(filename) + 8);
+	if (!st.entries || !st.includes || !wildcards || !tmp)
+		goto out;
+
+	// start with an empty string, so the strings are never empty
+	if (save_string(&st, "") < 0 || save_literals(&st, rs))
+		goto out;
+
+	for (i = 0, rule = rs->head; rule; rule = rule->next, i++) {
+		offset = save_string(&st, rule->pattern);
+		if (offset < 0)
+			goto out;
+
+		wildcards[i].pattern = offset;
+		wildcards[i].exclude = rule->exclude;
+		wildcards[i].dir = rule->dir;
+	}
+
+	// sort the include rules by their patterns
+	sorted = malloc(sizeof(char *) * (st.n_includes + 1));
+	if (!sorted)
+		goto out;
+	for (i=0; i < st.n_includes; i++)
+		sorted[i] = st.strings + st.includes[i];
+	qsort(sorted, st.n_includes, sizeof(char *), cmp_string);
+	for (i=0; i < st.n_includes; i++)
+		st.includes[i] = sorted[i] - st.strings;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, RULES_MAGIC, sizeof(h.magic));
+	h.flags = rs->prune ? RULES_PRUNE : 0;
+	h.n_wildcards = n_wildcards;
+	h.table_size = st.table_size;
+	h.n_includes = st.n_includes;
+	h.table_offset = sizeof(h);
+	h.wildcards_offset = h.table_offset + st.table_size * sizeof(struct rules_entry);
+	h.includes_offset = h.wildcards_offset + n_wildcards * sizeof(struct rules_wildcard);
+	h.strings_offset = h.includes_offset + st.n_includes * sizeof(uint32_t);
+	h.strings_size = st.strings_size;
+
+	// replace the file atomically, a running instance may have mapped it
+	sprintf(tmp, "%s.XXXXXX", filename);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out;
+
+	if (write_all(fd, &h, sizeof(h)) ||
+		write_all(fd, st.entries, st.table_size * sizeof(struct rules_entry)) ||
+		write_all(fd, wildcards, n_wildcards * sizeof(struct rules_wildcard)) ||
+		write_all(fd, st.includes, st.n_includes * sizeof(uint32_t)) ||
+		write_all(fd, st.strings, st.strings_size) ||
+		fchmod(fd, 0644) || close(fd))
+	{
+		fd = -1;
+		unlink(tmp);
+		goto out;
+	}
+	fd = -1;
+
+	if (rename(tmp, filename)) {
+		unlink(tmp);
+		goto out;
+	}
+
+	r = 0;
+
+out:
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp);
+	}
+	free(sorted);
+	free(tmp);
+	free(wildcards);
+	free(st.strings);
+	free(st.includes);
+	free(st.entries);
+
+	return r;
+}
+
+/* returns the rule of a pruned path with the given length and hash */
+static const struct rule *prune_find(const struct prune_table *t, const char *path,
+					size_t len, uint64_t hash)
+{
+	const struct prune_entry *e;
+	size_t i;
+
+	for (i = hash & (t->size - 1); ; i = (i + 1) & (t->size - 1)) {
+		e = __atomic_load_n(&t->entries[i], __ATOMIC_ACQUIRE);
+		if (!e)
+			return NULL;
+		if (e->hash == hash && !strncmp(e->path, path, len) && e->path[len] == '\0')
+			return e->rule;
+	}
+}
+
+/*
+ * Returns the rule that excluded path or its nearest pruned ancestor. The
+ * hashes of the ancestors are those of the prefixes of the path, so they are
+ * computed in a single pass and a lookup takes O(length + depth) steps.
+ */
+static const struct rule *prune_lookup(const struct prune_table *t, const char *path)
+{
+	const struct rule *rule = NULL, *r;
+	uint64_t hash = HASH_INIT; /* of the prefix, like hash_bytes() */
+	size_t i;
+
+	if (!__atomic_load_n(&t->count, __ATOMIC_RELAXED))
+		return NULL;
+
+	for (i=0; ; i++) {
+		if (!path[i] || (path[i] == '/' && i > 0)) {
+			r = prune_find(t, path, i, hash);
+			if (r)
+				rule = r;
+		}
+		if (!path[i])
+			break;
+
+		hash = hash_add(hash, (unsigned char) path[i]);
+	}
+
+	return rule;
+}
+
+static void prune_insert(struct prune_table *t, const char *path, const struct rule *rule)
+{
+	struct prune_entry *e, *curr;
+	uint64_t hash;
+	size_t i, n, len;
+
+	// the paths that do not fit anymore are found again by matching the rules
+	if (2 * (__atomic_load_n(&t->count, __ATOMIC_RELAXED) + 1) > t->size)
+		return;
+
+	len = strlen(path);
+	hash = hash_bytes(path, len);
+
+	e = malloc(sizeof(struct prune_entry) + len + 1);
+	if (!e)
+		return;
+	e->hash = hash;
+	e->rule = rule;
+	memcpy(e->path, path, len + 1);
+
+	for (i = hash & (t->size - 1), n = 0; n < t->size; i = (i + 1) & (t->size - 1), n++) {
+		curr = NULL;
+		if (__atomic_compare_exchange_n(&t->entries[i], &curr, e, 0,
+						__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			__atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		// another thread added the path first
+		if (curr->hash == hash && !strcmp(curr->path, path))
+			break;
+	}
+
+	free(e);
+}
+
+/*
+ * Returns 1 if the exclude rule matched path and excludes everything below it
+ * as well, i.e., it also matches the paths below and no include rule that is
+ * checked before it can match one of them.
+ */
+static int prunes(const struct ruleset *rs, const struct rule *rule, const char *path)
+{
+	const struct literal_table *t;
+	const struct rule *r;
+	const char *lit_path;
+	size_t len, prefix, lit, lo, hi, mid;
+	unsigned int i;
+	int cmp;
+
+	if (!rule->exclude)
+		return 0;
+
+	len = strlen(rule->pattern);
+	if (!rule->dir && strcmp(rule->pattern, "**") &&
+		(len < 3 || strcmp(&rule->pattern[len - 3], "/**")))
+		return 0;
+
+	len = strlen(path);
+
+	// include rules without wildcards that are below the path
+	for (i=0; i < rs->n_literals; i++) {
+		t = &rs->literals[i];
+
+		lo = 0;
+		hi = t->n_includes;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			lit_path = include_literal(t, mid);
+			cmp = strncmp(lit_path, path, len);
+			if (cmp < 0 || (cmp == 0 && lit_path[len] < '/'))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < t->n_includes) {
+			lit_path = include_literal(t, lo);
+			if (!strncmp(lit_path, path, len) && lit_path[len] == '/')
+				return 0;
+		}
+	}
+
+	/*
+	 * A wildcard rule only matches paths that start with the part before its
+	 * first wildcard. The rule of a directory without wildcards is checked
+	 * before all wildcard rules, but its rule for the paths below is not.
+	 */
+	for (r = rs->head; r && r != rule; r = r->next) {
+		if (r->exclude)
+			continue;
+
+		prefix = strcspn(r->pattern, "*?[\\");
+		lit = prefix < len + 1 ? prefix : len + 1;
+
+		if (strncmp(r->pattern, path, lit < len ? lit : len))
+			continue;
+		if (lit <= len || r->pattern[len] == '/')
+			return 0;
+	}
+
+	return 1;
+}
+
+const struct rule *ruleset_match(const struct ruleset *rs, const char *path)
+{
+	const struct rule *pruned;
+	const struct rule *curr_rule;
+	int id;
+
+	if (rs->prune && rs->prune->entries && (pruned = prune_lookup(rs->prune, path)))
+		return pruned;
+
+	// if pattern contains wildcards do not look in the hash table
+	// TODO consider escaped characters
+	if (strpbrk(path, "*?"))
+		curr_rule = 0;
+	else
+		curr_rule = get_rule_by_hash(rs, path);
+
+	if (!curr_rule && rs->matcher) {
+		id = rule_matcher_match(rs->matcher, path);
+
+		curr_rule = id < 0 ? 0 : rs->matcher_rules[id];
+	} else if (!curr_rule) {
+		curr_rule = rs->head;
+		while (curr_rule) {
+			if (wildmatch(curr_rule->pattern, path, WM_PATHNAME, NULL) == WM_MATCH)
+				break;
+			curr_rule = curr_rule->next;
+		}
+	}
+
+	if (rs->prune && rs->prune->entries && curr_rule && prunes(rs, curr_rule, path))
+		prune_insert(rs->prune, path, curr_rule);
+
+	return curr_rule;
+}
+
+const struct rule *ruleset_wildcards(const struct ruleset *rs)
+{
+	return rs->head;
+}
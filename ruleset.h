@@ -0,0 +1,62 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Ordered set of include and exclude rules
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef RULESET_H
+#define RULESET_H
+
+struct rule {
+	char *pattern;
+	int exclude;
+	int dir; /* given with a trailing '/' in prune mode */
+	struct rule *next;
+};
+
+struct ruleset;
+
+struct ruleset *ruleset_new(void);
+void ruleset_free(struct ruleset *rs);
+
+/*
+ * Enables the prune mode, must be called before rules are appended. A rule
+ * with a trailing '/' then also matches everything below the paths it
+ * matches, and paths whose whole subtree is excluded are remembered, so the
+ * paths below them are not matched again.
+ */
+int ruleset_enable_prune(struct ruleset *rs);
+
+/* appends a single rule with a copy of the pattern, returns -1 on error */
+int ruleset_append(struct ruleset *rs, const char *pattern, int exclude);
+
+/* appends the rules of a list of patterns separated by ':' */
+int ruleset_append_list(struct ruleset *rs, const char *patterns, int exclude);
+
+/*
+ * Appends the rules of a file with one pattern in each line. Empty lines and
+ * lines starting with '#' are ignored. A precompiled file of ruleset_save()
+ * is used with the verdicts it contains. Its rules without wildcards that
+ * ruleset_match() returns have an empty pattern. Returns -1 if the file
+ * cannot be read or was saved with a different prune mode.
+ */
+int ruleset_parse_file(struct ruleset *rs, const char *filename, int exclude);
+
+/* writes the rules to a precompiled file, returns -1 on error */
+int ruleset_save(const struct ruleset *rs, const char *filename);
+
+/* compiles the wildcard rules, must be called before ruleset_match() */
+int ruleset_compile(struct ruleset *rs);
+
+/* returns the first rule that matches the absolute path or NULL */
+const struct rule *ruleset_match(const struct ruleset *rs, const char *path);
+
+/* returns the first of the wildcard rules in the order they were added */
+const struct rule *ruleset_wildcards(const struct ruleset *rs);
+
+#endif
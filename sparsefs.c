@@ -21,53 +21,110 @@
 #endif
 
 #ifdef linux
-/* For pread()/pwrite() */
-#define _XOPEN_SOURCE 500
+/* For pread()/pwrite() and st_mtim */
+#define _XOPEN_SOURCE 700
 #endif
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <limits.h>
 #include <unistd.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <libgen.h>
-#include <wildmatch.h>
-#include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#include <conf.h>
+#include <filter.h>
+#include <ruleset.h>
+#include <pathcache.h>
+#include <srcindex.h>
+#include <stats.h>
+#include <prescan.h>
+#include <ignore.h>
+#include <nameset.h>
+#include <dircache.h>
+#include <trace.h>
+#include <sparsefs.h>
 
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
-//#define ENABLE_OUTPUT
-#ifdef ENABLE_OUTPUT
-#define ffs_debug(f, ...) fprintf(stdout, f, ## __VA_ARGS__)
-#define ffs_info(f, ...) syslog(LOG_INFO, f, ## __VA_ARGS__)
-#define ffs_error(f, ...) syslog(LOG_ERR, f, ## __VA_ARGS__)
-#else
-#define ffs_debug(f, ...)
-#define ffs_info(f, ...)
-#define ffs_error(f, ...)
-#endif
-
 int default_exclude = 0;
 int debug = 0;
+int use_splice = 1;
+int readdir_stat = 0;
+
+// cache for the results of resolve_path()
+struct path_cache *cache = 0;
+unsigned int cache_size = 16384;
+double cache_timeout = 1.0;
+
+// seconds the kernel caches names, attributes and names that do not exist
+double entry_timeout = 1.0;
+double attr_timeout = 1.0;
+double negative_timeout = 0.0;
+// seconds the kernel caches names that are excluded by the rules in all sources
+double excluded_timeout = 60.0;
+
+// snapshots of directory listings shared between handles, see ffs_opendir()
+struct dir_cache *dir_cache = 0;
+unsigned int dir_cache_size = 0;
+
+// sources of the entries of listed directories, started by ffs_start()
+struct src_index *source_index = 0;
+unsigned int source_index_size = 0;
+
+// snapshot of all sources, loaded or created by a thread of ffs_start()
+struct prescan *prescan = 0;
+int prescan_force = 0;
+char *prescan_file = 0;
+
+// requested trace level and output, the trace is started by ffs_init()
+int trace = TRACE_OFF;
+FILE *trace_file = 0;
 
-struct source {
-	char *path;
-} *sources = 0;
+// serve the mount with the inode-based backend of sparsefs_ll.c
+int lowlevel = 0;
+
+// the instance of the high-level backend while it is mounted, see reload_rules()
+static struct fuse *hl_fuse;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the sources given on the command line, published by main()
+static struct conf *initial_conf = 0;
+// the number of sources, the same in all versions of the configuration
 unsigned int n_sources = 0;
 
+static const char *op_names[OP_MAX] = {
+	"getattr", "access", "readlink", "opendir", "readdir", "releasedir",
+	"mknod", "mkdir", "symlink", "unlink", "rmdir", "rename", "link",
+	"chmod", "chown", "truncate", "utimens", "create", "open", "read",
+	"write", "statfs", "flush", "release", "fsync", "setxattr", "getxattr",
+	"listxattr", "removexattr", "lookup", "forget", "setattr",
+};
+
+struct op_counter op_counters[OP_MAX];
+
+int count_syscalls = 0;
+
+__thread enum ffs_op current_op;
+__thread int op_excluded;
+
 enum {
 	KEY_EXCLUDE,
 	KEY_INCLUDE,
@@ -75,6 +132,28 @@ enum {
 	KEY_INCLUDEFILE,
 	KEY_DEFAULT_EXCLUDE,
 	KEY_DEFAULT_INCLUDE,
+	KEY_NO_SPLICE,
+	KEY_READDIR_STAT,
+	KEY_CACHE_SIZE,
+	KEY_CACHE_TIMEOUT,
+	KEY_ENTRY_TIMEOUT,
+	KEY_ATTR_TIMEOUT,
+	KEY_NEGATIVE_TIMEOUT,
+	KEY_EXCLUDED_TIMEOUT,
+	KEY_COUNT_SYSCALLS,
+	KEY_DIR_CACHE,
+	KEY_SOURCE_INDEX,
+	KEY_PRESCAN,
+	KEY_PRESCAN_FILE,
+	KEY_TRACE,
+	KEY_TRACE_FILE,
+	KEY_LOWLEVEL,
+	KEY_WATCH_RULES,
+	KEY_PRUNE,
+	KEY_RELATIVE_RULES,
+	KEY_IGNORE_FILE,
+	KEY_SAVE_RULES,
+	KEY_STATS_SOCKET,
 	KEY_SOURCE,
 	KEY_HELP,
 	KEY_VERSION,
@@ -95,6 +174,50 @@ static struct fuse_opt ffs_opts[] = {
 	FUSE_OPT_KEY("--includefile=%s",        KEY_INCLUDEFILE),
 	FUSE_OPT_KEY("--default-exclude",       KEY_DEFAULT_EXCLUDE),
 	FUSE_OPT_KEY("--default-include",       KEY_DEFAULT_INCLUDE),
+	FUSE_OPT_KEY("--no-splice",             KEY_NO_SPLICE),
+	FUSE_OPT_KEY("nosplice",                KEY_NO_SPLICE),
+	FUSE_OPT_KEY("--readdir-stat",          KEY_READDIR_STAT),
+	FUSE_OPT_KEY("readdir_stat",            KEY_READDIR_STAT),
+	FUSE_OPT_KEY("--cache-size=%s",         KEY_CACHE_SIZE),
+	FUSE_OPT_KEY("cache_size=%s",           KEY_CACHE_SIZE),
+	FUSE_OPT_KEY("--cache-timeout=%s",      KEY_CACHE_TIMEOUT),
+	FUSE_OPT_KEY("cache_timeout=%s",        KEY_CACHE_TIMEOUT),
+	FUSE_OPT_KEY("--entry-timeout=%s",      KEY_ENTRY_TIMEOUT),
+	FUSE_OPT_KEY("entry_timeout=%s",        KEY_ENTRY_TIMEOUT),
+	FUSE_OPT_KEY("--attr-timeout=%s",       KEY_ATTR_TIMEOUT),
+	FUSE_OPT_KEY("attr_timeout=%s",         KEY_ATTR_TIMEOUT),
+	FUSE_OPT_KEY("--negative-timeout=%s",   KEY_NEGATIVE_TIMEOUT),
+	FUSE_OPT_KEY("negative_timeout=%s",     KEY_NEGATIVE_TIMEOUT),
+	FUSE_OPT_KEY("--excluded-timeout=%s",   KEY_EXCLUDED_TIMEOUT),
+	FUSE_OPT_KEY("excluded_timeout=%s",     KEY_EXCLUDED_TIMEOUT),
+	FUSE_OPT_KEY("--count-syscalls",        KEY_COUNT_SYSCALLS),
+	FUSE_OPT_KEY("count_syscalls",          KEY_COUNT_SYSCALLS),
+	FUSE_OPT_KEY("--dir-cache=%s",          KEY_DIR_CACHE),
+	FUSE_OPT_KEY("dir_cache=%s",            KEY_DIR_CACHE),
+	FUSE_OPT_KEY("--source-index=%s",       KEY_SOURCE_INDEX),
+	FUSE_OPT_KEY("source_index=%s",         KEY_SOURCE_INDEX),
+	FUSE_OPT_KEY("--prescan",               KEY_PRESCAN),
+	FUSE_OPT_KEY("prescan",                 KEY_PRESCAN),
+	FUSE_OPT_KEY("--prescan-file=%s",       KEY_PRESCAN_FILE),
+	FUSE_OPT_KEY("prescan_file=%s",         KEY_PRESCAN_FILE),
+	FUSE_OPT_KEY("--trace=%s",              KEY_TRACE),
+	FUSE_OPT_KEY("trace=%s",                KEY_TRACE),
+	FUSE_OPT_KEY("--trace-file=%s",         KEY_TRACE_FILE),
+	FUSE_OPT_KEY("trace_file=%s",           KEY_TRACE_FILE),
+	FUSE_OPT_KEY("--lowlevel",              KEY_LOWLEVEL),
+	FUSE_OPT_KEY("lowlevel",                KEY_LOWLEVEL),
+	FUSE_OPT_KEY("--watch-rules",           KEY_WATCH_RULES),
+	FUSE_OPT_KEY("watch_rules",             KEY_WATCH_RULES),
+	FUSE_OPT_KEY("--prune",                 KEY_PRUNE),
+	FUSE_OPT_KEY("prune",                   KEY_PRUNE),
+	FUSE_OPT_KEY("--relative-rules",        KEY_RELATIVE_RULES),
+	FUSE_OPT_KEY("relative_rules",          KEY_RELATIVE_RULES),
+	FUSE_OPT_KEY("--ignore-file=%s",        KEY_IGNORE_FILE),
+	FUSE_OPT_KEY("ignore_file=%s",          KEY_IGNORE_FILE),
+	FUSE_OPT_KEY("--save-rules=%s",         KEY_SAVE_RULES),
+	FUSE_OPT_KEY("save_rules=%s",           KEY_SAVE_RULES),
+	FUSE_OPT_KEY("--stats-socket=%s",       KEY_STATS_SOCKET),
+	FUSE_OPT_KEY("stats_socket=%s",         KEY_STATS_SOCKET),
 	FUSE_OPT_KEY("-d",                      KEY_KEEP_OPT),
 	
 	FUSE_OPT_KEY("-h",            KEY_HELP),
@@ -104,268 +227,464 @@ static struct fuse_opt ffs_opts[] = {
 	FUSE_OPT_END
 };
 
-struct rule {
-	char *pattern;
+/*
+ * The rule options in the order they were given, so the rules can be built
+ * again if the rule files change
+ */
+struct rule_option {
+	char *arg;
 	int exclude;
-	struct rule *next;
-};
+	int file;
+	int wd; /* inotify watch of the directory of a rule file */
+} *rule_options = 0;
+unsigned int n_rule_options = 0;
+
+// reload the rules if a rule file changes
+int watch_rules = 0;
+
+// rules with a trailing '/' match subtrees, excluded subtrees are remembered
+int prune = 0;
 
-struct {
-	struct rule *head;
-	struct rule *tail;
-} chain;
+// match the rules against the FUSE path instead of the real path in each source
+int relative_rules = 0;
 
-// TODO find a way to determine a good number
-#define HT_LENGTH 100
-struct rule *ht[HT_LENGTH] = {0};
+// rules from gitignore-style files with this name, created by main()
+struct ignore *ignore = 0;
+char *ignore_name = 0;
 
+// write the rules to a precompiled file instead of mounting
+char *save_rules = 0;
 
+// serve the statistics of the operations on this Unix socket, see stats.h
+char *stats_socket = 0;
 
-unsigned long calc_hash(const char *hstr)
+/*
+ * Append a source directory to the list
+ */
+static int append_source(const char *source)
 {
-	unsigned long hash = 5381;
-	const unsigned char *str = hstr;
-	int c;
+	if (!initial_conf) {
+		initial_conf = conf_new();
+		if (!initial_conf)
+			return -1;
+	}
+	
+	if (conf_add_source(initial_conf, source))
+		return -1;
 	
-	while (c = *str++)
-		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	n_sources = initial_conf->n_sources;
 	
-	return hash;
+	return 0;
 }
 
-struct rule *getRuleByHash(const char *s)
+/*
+ * Remembers a rule option. Rule files are stored with their absolute path as
+ * the working directory changes if sparsefs runs in the background.
+ */
+static int append_rule_option(const char *arg, int exclude, int file)
 {
-	unsigned long hash;
-	struct rule *e;
+	struct rule_option *opts;
+	char *copy;
+	
+	if (file) {
+		copy = realpath(arg, NULL);
+		
+		// like before reloading was possible, missing files are ignored
+		if (!copy) {
+			ffs_error("cannot open file \"%s\"\n", arg);
+			return 0;
+		}
+	} else {
+		copy = strdup(arg);
+		if (!copy)
+			return -1;
+	}
 	
-	hash = calc_hash(s);
+	opts = realloc(rule_options, sizeof(struct rule_option) * (n_rule_options + 1));
+	if (!opts) {
+		free(copy);
+		return -1;
+	}
 	
-	e = ht[hash % HT_LENGTH];
-	for (; e && strcmp(e->pattern, s); e = e->next) {}
+	rule_options = opts;
+	rule_options[n_rule_options].arg = copy;
+	rule_options[n_rule_options].exclude = exclude;
+	rule_options[n_rule_options].file = file;
+	rule_options[n_rule_options].wd = -1;
+	n_rule_options++;
 	
-	return e;
+	return 0;
 }
 
 /*
- * Appends a single rule to the filter chain.
+ * Builds and compiles the rules from the rule options, returns NULL on error
  */
-static int append_rule(char *pattern, int exclude)
+static struct ruleset *load_rules(void)
 {
-	size_t pattern_length;
-	char *quotmark;
-	unsigned long hash;
-	struct rule *rule, *ht_head;
-	
-	rule = malloc(sizeof(struct rule));
-	if (!rule)
-		return -1;
+	struct ruleset *rs;
+	unsigned int i;
+	int r;
 	
-	rule->pattern = pattern;
-	pattern_length = strlen(pattern);
+	rs = ruleset_new();
+	if (!rs)
+		return NULL;
 	
-	// strip quotation marks at start and end
-	if (pattern[0] == '"' || pattern[pattern_length-1] == '"') {
-		rule->pattern = &pattern[1];
-		pattern[pattern_length-1] = 0;
-		pattern_length--;
+	if (prune && ruleset_enable_prune(rs)) {
+		ruleset_free(rs);
+		return NULL;
 	}
 	
-	// strip trailing '/' from directories
-	if (pattern[pattern_length-1] == '/')
-		pattern[pattern_length-1] = 0;
-	
-	rule->exclude = exclude;
-	rule->next = NULL;
-	
-	// if pattern contains wildcards do not add it to the hashtable
-	if (strpbrk(pattern, "*?")) {
-		if (!chain.head) {
-			chain.head = rule;
-			chain.tail = rule;
-		}
-		else {
-			chain.tail->next = rule;
-			chain.tail = rule;
-		}
-	} else {
-		hash = calc_hash(rule->pattern);
-		ht_head = ht[hash % HT_LENGTH];
+	for (i=0; i < n_rule_options; i++) {
+		if (rule_options[i].file)
+			r = ruleset_parse_file(rs, rule_options[i].arg, rule_options[i].exclude);
+		else
+			r = ruleset_append_list(rs, rule_options[i].arg, rule_options[i].exclude);
 		
-		if (ht_head) {
-			for (; ht_head->next; ht_head = ht_head->next) {}
-			ht_head->next = rule;
-		} else {
-			ht[hash % HT_LENGTH] = rule;
+		if (r) {
+			syslog(LOG_ERR, "cannot read the rules \"%s\"\n", rule_options[i].arg);
+			ruleset_free(rs);
+			return NULL;
 		}
 	}
 	
-	return 0;
+	if (ruleset_compile(rs)) {
+		ruleset_free(rs);
+		return NULL;
+	}
+	
+	return rs;
 }
 
 /*
- * Appends multiple rules to the filter chain.
+ * Checks whether the provided path should be excluded.
  */
-static int append_rules(char *patterns, int exclude)
+int exclude_chroot_path(const char *path, int *by_rules)
 {
-	char *str = patterns;
+	const struct conf *conf;
+	int exclude;
 	
-	while (1) {
-		if (append_rule(str, exclude) == -1)
-			return -1;
-		
-		if (!(str = strchr(str, ':')))
-			break;
-		
-		*str = '\0';
-		str++;
-	}
+	// the configuration may be replaced by reload_rules() at any time
+	conf = conf_get();
+	exclude = filter_real_path(conf, ignore, path, by_rules);
+	conf_put(conf);
 	
-	return 0;
+	return exclude;
 }
 
 /*
- * Append a source directory to the list
+ * Checks whether relative rules exclude a FUSE path. The verdict is the same
+ * in all sources, so it is only evaluated once for a path.
  */
-static int append_source(char *source)
+int exclude_fuse_path(const char *path, int *by_rules)
 {
-	size_t srcdir_length;
+	const struct conf *conf;
+	int exclude;
 	
-	n_sources += 1;
-	sources = (struct source*) realloc(sources, sizeof(struct source) * n_sources);
+	conf = conf_get();
+	exclude = filter_fuse_path(conf, ignore, path, by_rules);
+	conf_put(conf);
 	
-	srcdir_length = strlen(source);
+	return exclude;
+}
+
+/*
+ * build the real path of a FUSE path in a source
+ */
+void source_path(char *realpath, size_t realpath_size, unsigned int source,
+					const char *fuse_path)
+{
+	const struct conf *conf = conf_get();
+	const struct source *src = &conf->sources[source];
 	
-	// make sure srcdir ends with a '/'
-	if (source[srcdir_length-1] == '/') {
-		sources[n_sources-1].path = strdup(source);
-	} else {
-		sources[n_sources-1].path = (char*) malloc(srcdir_length + 2);
-		sprintf(sources[n_sources-1].path, "%s/", source);
-	}
+	// concatenate strings and strip starting '/' from $fuse_path
+	path_join(realpath, realpath_size, src->path, src->len, &fuse_path[1]);
 	
-	return 0;
+	conf_put(conf);
 }
 
 /*
- * check if string only contains whitespaces and calculate length
+ * Returns the first source starting at $source whose rules include the path,
+ * or n_sources. The real path in this source is stored in $realpath.
  */
-void checkString(const char *s, size_t *length, char *empty) {
-	*length = 0;
-	*empty = 1;
-	while (*s != '\0') {
-		if (*empty && !isspace(*s))
-			*empty = 0;
-		s++;
-		(*length)++;
+static unsigned int next_included(char *realpath, size_t realpath_size,
+					const char *fuse_path, unsigned int source)
+{
+	/*
+	 * The verdict of relative rules holds for all sources. Later sources
+	 * are only asked for once the first call included the path.
+	 */
+	if (relative_rules) {
+		if (source == 0 && exclude_fuse_path(fuse_path, NULL)) {
+			// like below, the path in the last source is left behind
+			source_path(realpath, realpath_size, n_sources - 1, fuse_path);
+			return n_sources;
+		}
+		if (source < n_sources)
+			source_path(realpath, realpath_size, source, fuse_path);
+		return source;
+	}
+	
+	for (; source < n_sources; source++) {
+		source_path(realpath, realpath_size, source, fuse_path);
+		
+		if (!exclude_chroot_path(realpath, NULL))
+			break;
 	}
+	
+	return source;
 }
 
 /*
- * read rules from file
+ * build real path and check if it should be excluded, also returns the index
+ * of the source the path was resolved against
+ *
+ * The rules only look at the name of a path, so a source is only probed if
+ * its rules include the path. Unless $strict is set, the last source that
+ * includes the path is returned without probing: if the path does not exist
+ * there either, the syscall of the caller will fail with ENOENT anyway.
+ *
+ * If the directory of the path was listed before, the source index tells
+ * which sources contain the path without probing them.
+ *
+ * For the statistics, an excluded path counts as excluded by the rules if
+ * the rules of a source were skipped, as the path may exist there.
  */
-static int parse_file(const char *filename, int exclude)
+static int resolve_path(char *realpath, size_t realpath_size,
+					const char *fuse_path, unsigned int *source, int strict)
 {
-	FILE *f;
-	char line[PATH_MAX];
-	char empty;
-	size_t len;
+	struct path_cache_ticket ticket;
+	char nextpath[PATH_MAX];
+	struct prescan *snapshot;
+	uint64_t known, present;
+	unsigned int i, next, last;
+	int exclude, indexed, skipped;
+	
+	// strict lookups need a probed result which the cache cannot guarantee
+	if (!strict && cache && path_cache_lookup(cache, fuse_path, realpath,
+							realpath_size, &i, &exclude, &ticket))
+	{
+		if (trace_level >= TRACE_VERDICTS)
+			trace_verdict(fuse_path, i, exclude, 1);
+		
+		// only the rules exclude paths in the non-strict mode
+		op_excluded = exclude;
+		
+		if (source)
+			*source = i;
+		
+		return exclude;
+	}
 	
-	f = fopen(filename, "r");
-	if (f) {
-		while (fgets(line, sizeof(line), f)) {
-			checkString(line, &len, &empty);
-			
-			if (empty)
-				continue;
-			if (line[0] == '#')
-				continue;
+	exclude = 1;
+	i = next_included(realpath, realpath_size, fuse_path, 0);
+	skipped = i > 0;
+	
+	indexed = source_index && src_index_lookup(source_index, fuse_path, &known, &present);
+	if (!indexed) {
+		snapshot = __atomic_load_n(&prescan, __ATOMIC_ACQUIRE);
+		indexed = snapshot && prescan_lookup(snapshot, fuse_path, &known, &present);
+	}
+	
+	if (indexed) {
+		/*
+		 * The index or the snapshot tell which of the known sources
+		 * contain the path, only the other sources are probed.
+		 */
+		last = n_sources;
+		while (i < n_sources) {
+			if (!(known & SRC_INDEX_BIT(i)) &&
+				SYSCALL(access(realpath, F_OK)) != -1)
+				present |= SRC_INDEX_BIT(i);
 			
-			// remove trailing newlines
-			if (line[len-1] == '\n')
-				line[len-1] = 0;
+			if (present & SRC_INDEX_BIT(i)) {
+				exclude = 0;
+				break;
+			}
 			
-			append_rule(strdup(line), exclude);
+			last = i;
+			i = next_included(realpath, realpath_size, fuse_path, i + 1);
+			if (i > last + 1)
+				skipped = 1;
 		}
 		
-		fclose(f);
+		// as without the index, the last included source is used if none has the path
+		if (exclude && !strict && last < n_sources) {
+			i = last;
+			source_path(realpath, realpath_size, i, fuse_path);
+			exclude = 0;
+		}
 	} else {
-		ffs_error("cannot open file \"%s\"\n", filename);
+		while (i < n_sources) {
+			next = next_included(nextpath, PATH_MAX, fuse_path, i + 1);
+			if (next > i + 1)
+				skipped = 1;
+			
+			if (!strict && next == n_sources) {
+				exclude = 0;
+				break;
+			}
+			
+			// only use this source if the path exists in it
+			if (SYSCALL(access(realpath, F_OK)) != -1) {
+				exclude = 0;
+				break;
+			}
+			
+			i = next;
+			if (i < n_sources)
+				snprintf(realpath, realpath_size, "%s", nextpath);
+		}
 	}
+	
+	if (exclude && skipped)
+		op_excluded = 1;
+	
+	if (!strict && cache)
+		path_cache_insert(cache, fuse_path, realpath, i, exclude, &ticket);
+	
+	if (trace_level >= TRACE_VERDICTS)
+		trace_verdict(fuse_path, i, exclude, 0);
+	
+	if (source)
+		*source = i;
+	
+	return exclude;
 }
 
 /*
- * Checks whether the provided path should be excluded.
+ * Resolves a path that is about to be created. A source that already has the
+ * path is used like in the strict mode of resolve_path(), otherwise the first
+ * source whose rules include the path and that contains its parent directory.
  */
-static int exclude_chroot_path(const char *path)
+static int resolve_new_path(char *realpath, size_t realpath_size,
+					const char *fuse_path, unsigned int *source)
 {
-	struct stat st, symt;
-	struct rule *curr_rule;
-	size_t len;
+	struct stat st;
 	unsigned int i;
+	char *slash;
+	int r;
 	
-	lstat(path, &st);
-	len = strlen(path);
+	if (!resolve_path(realpath, realpath_size, fuse_path, source, 1))
+		return 0;
 	
-	// always allow access to the srcdir itself (although it might appear empty)
-	for (i=0; i < n_sources; i++) {
-		if (strcmp(path, sources[i].path) == 0)
-			return 0;
+	i = next_included(realpath, realpath_size, fuse_path, 0);
+	while (i < n_sources) {
+		// the parent of the root of a source always exists
+		slash = strrchr(realpath, '/');
+		if (!slash || slash == realpath)
+			break;
+		
+		*slash = 0;
+		r = SYSCALL(stat(realpath, &st));
+		*slash = '/';
+		if (r == 0 && S_ISDIR(st.st_mode))
+			break;
+		
+		i = next_included(realpath, realpath_size, fuse_path, i + 1);
 	}
 	
-	// always accept "." and ".." directories
-	if (strcmp(&path[len-2], "/.") == 0)
-		return 0;
-	
-	if (strcmp(&path[len-3], "/..") == 0)
-		return 0;
+	if (trace_level >= TRACE_VERDICTS)
+		trace_verdict(fuse_path, i, i == n_sources, 0);
 	
-	// if pattern contains wildcards do not look in the hash table
-	// TODO consider escaped characters
-	if (strpbrk(path, "*?"))
-		curr_rule = 0;
-	else
-		curr_rule = getRuleByHash(path);
+	// the name is not excluded if it can be created
+	if (i < n_sources)
+		op_excluded = 0;
 	
-	if (!curr_rule) {
-		curr_rule = chain.head;
-		while (curr_rule) {
-			if (wildmatch(curr_rule->pattern, path, WM_PATHNAME, NULL) == WM_MATCH) {
-				break;
-			}
-			curr_rule = curr_rule->next;
-		}
-	}
+	if (source)
+		*source = i;
 	
-	if (curr_rule)
-		return curr_rule->exclude;
-	else
-		return default_exclude;
+	return i == n_sources;
 }
 
 /*
- * build real path and check if it should be excluded
+ * Probes the sources the index knows for a path that was created or removed.
+ * The inotify events would update the index as well, but only later.
  */
-static int exclude_path(char *realpath, size_t realpath_size, const char *fuse_path)
+static void update_index(const char *fuse_path)
 {
+	char realpath[PATH_MAX];
+	uint64_t known, present;
+	struct stat st;
 	unsigned int i;
-	int exclude;
 	
-	exclude = 1;
+	if (!src_index_lookup(source_index, fuse_path, &known, &present))
+		return;
+	
 	for (i=0; i < n_sources; i++) {
-		// concatenate strings and strip starting '/' from $fuse_path
-		snprintf(realpath, realpath_size, "%s%s", sources[i].path, &fuse_path[1]);
+		if (!(known & SRC_INDEX_BIT(i)))
+			continue;
 		
-		// only check this path if it exists in this source
-		if (access(realpath, F_OK) != -1) {
-			exclude = exclude_chroot_path(realpath);
-			
-			// if this path is included, use it
-			if (!exclude)
-				break;
-		}
+		// like readdir, count entries that are dangling symlinks
+		source_path(realpath, PATH_MAX, i, fuse_path);
+		src_index_set(source_index, fuse_path, i,
+				SYSCALL(lstat(realpath, &st)) == 0);
 	}
+}
+
+/*
+ * forget the cached resolution of a path that was created or removed
+ */
+static void invalidate_path(const char *fuse_path)
+{
+	struct prescan *snapshot;
 	
-	return exclude;
+	if (cache)
+		path_cache_remove(cache, fuse_path);
+	if (source_index)
+		update_index(fuse_path);
+	
+	snapshot = __atomic_load_n(&prescan, __ATOMIC_ACQUIRE);
+	if (snapshot)
+		prescan_invalidate(snapshot, fuse_path);
+	
+	invalidate_ignore_file(fuse_path);
+}
+
+void invalidate_ignore_file(const char *fuse_path)
+{
+	// the file is read again on the next lookup, see ignore_changed()
+	if (ignore && ignore_is_file(ignore, fuse_path))
+		ignore_invalidate(ignore, fuse_path);
+}
+
+/*
+ * forget all cached resolutions, e.g., after a directory was moved
+ */
+static void invalidate_all(void)
+{
+	if (cache)
+		path_cache_clear(cache);
+}
+
+/*
+ * Called by the ignore files if one of them changed. In the low-level mode,
+ * the kernel is not told to forget names, as this can be called during a
+ * lookup in the same directory. The names expire after --entry-timeout or
+ * --negative-timeout seconds, names excluded by an ignore file never get the
+ * excluded timeout.
+ */
+static void ignore_changed(void)
+{
+	invalidate_all();
+	if (dir_cache)
+		dir_cache_clear(dir_cache);
+}
+
+/*
+ * build real path and check if it should be excluded
+ */
+static int exclude_path(char *realpath, size_t realpath_size, const char *fuse_path)
+{
+	return resolve_path(realpath, realpath_size, fuse_path, NULL, 0);
+}
+
+/*
+ * like exclude_path() for a path that is about to be created, see
+ * resolve_new_path()
+ */
+static int exclude_new_path(char *realpath, size_t realpath_size, const char *fuse_path)
+{
+	return resolve_new_path(realpath, realpath_size, fuse_path, NULL);
 }
 
 /*
@@ -387,10 +706,21 @@ static const char *str_consume(const char *str1, char *str2)
  * FUSE callback operations
  */
 
-static int ffs_getattr(const char *path, struct stat *stbuf)
+static int ffs_getattr(const char *path, struct stat *stbuf,
+				struct fuse_file_info *fi)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_GETATTR);
+	
+	// an open file was already resolved by open() or create()
+	if (fi) {
+		if (SYSCALL(fstat(FFS_FILE(fi)->fd, stbuf)) == -1)
+			return -errno;
+		
+		return 0;
+	}
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("getattr: path %s (expanded %s), exclude %s\n", path,
@@ -400,7 +730,7 @@ static int ffs_getattr(const char *path, struct stat *stbuf)
 		return -ENOENT;
 	
 	int res;
-	res = lstat(realpath, stbuf);
+	res = SYSCALL(lstat(realpath, stbuf));
 	if (res == -1)
 		return -errno;
 	
@@ -411,6 +741,8 @@ static int ffs_access(const char *path, int mask)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_ACCESS);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("access: path %s (expanded %s), exclude %s\n", path,
@@ -420,7 +752,7 @@ static int ffs_access(const char *path, int mask)
 		return -ENOENT;
 	
 	int res;
-	res = access(realpath, mask);
+	res = SYSCALL(access(realpath, mask));
 	if (res == -1)
 		return -errno;
 	
@@ -431,6 +763,8 @@ static int ffs_readlink(const char *path, char *buf, size_t size)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_READLINK);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("readlink: path %s (expanded %s), exclude %s\n", path,
@@ -440,7 +774,7 @@ static int ffs_readlink(const char *path, char *buf, size_t size)
 		return -ENOENT;
 	
 	int res;
-	res = readlink(realpath, buf, size - 1);
+	res = SYSCALL(readlink(realpath, buf, size - 1));
 	if (res == -1)
 		return -errno;
 	
@@ -448,41 +782,75 @@ static int ffs_readlink(const char *path, char *buf, size_t size)
 	return 0;
 }
 
-static int ffs_readdir_helper(unsigned int source_idx, char *realpath, const char *path, void *buf, fuse_fill_dir_t filler) {
+/*
+ * Reads the directory of a single source. Entries are skipped if an earlier
+ * source already contained an included entry with the same name, which is
+ * checked with the set $names. If $remember is set, the included names of this
+ * source are added to the set for the following sources. If $fill is set, the
+ * included entries are added to the snapshot. All entries are added to the
+ * source index if $idx is set.
+ */
+static int ffs_readdir_helper(char *realpath, const char *path,
+				unsigned int source, open_source_dir_t open_dir, void *data,
+				struct name_set *names, int remember, int fill,
+				struct dir_snapshot *snap, struct src_index_dir *idx)
+{
 	char subpath[PATH_MAX];
+	char fuse_subpath[PATH_MAX];
 	DIR *dp;
 	struct dirent *de;
-	int exclude;
-	unsigned int i;
+	size_t len, fuse_len, name_len;
+	int fd, exclude, res;
 	
-	dp = opendir(realpath);
-	if (dp == NULL)
-		return -errno;
+	len = snprintf(subpath, PATH_MAX, "%s%s", realpath, path[1] == 0 ? "":"/");
+	if (len >= PATH_MAX)
+		return -ENAMETOOLONG;
 	
-	while ((de = readdir(dp)) != NULL) {
-		char skip = 0;
+	fuse_len = snprintf(fuse_subpath, PATH_MAX, "%s%s", path, path[1] == 0 ? "":"/");
+	if (fuse_len >= PATH_MAX)
+		return -ENAMETOOLONG;
+	
+	// watch the directory before it is read to not miss any change
+	if (idx)
+		src_index_dir_source(idx, source, realpath);
+	
+	if (open_dir) {
+		fd = open_dir(source, realpath, data);
+		if (fd < 0)
+			return fd;
 		
-		// check if one of the previous sources already added an entity with this name
-		for (i=0; i < source_idx; i++) {
-			snprintf(subpath, PATH_MAX, "%s%s%s%s", sources[i].path, &path[1], path[1] == 0 ? "":"/", de->d_name);
-			fprintf(stderr, "rdir %s\n", subpath);
-			if (access(subpath, F_OK) != -1) {
-				exclude = exclude_chroot_path(subpath);
-				
-				// was entity in previous source excluded?
-				if (!exclude) {
-					skip = 1;
-					break;
-				}
-			}
+		dp = fdopendir(fd);
+		if (dp == NULL) {
+			res = -errno;
+			close(fd);
+			return res;
 		}
+	} else {
+		dp = SYSCALL(opendir(realpath));
+		if (dp == NULL)
+			return -errno;
+	}
+	
+	res = 0;
+	while ((de = readdir(dp)) != NULL) {
+		if (idx)
+			src_index_dir_add(idx, source, de->d_name);
 		
-		if (skip)
+		// check if one of the previous sources already added an entity with this name
+		if (names && name_set_contains(names, de->d_name))
 			continue;
 		
-		snprintf(subpath, PATH_MAX, "%s%s%s", realpath, path[1] == 0 ? "":"/", de->d_name);
+		name_len = strlen(de->d_name);
+		if (len + name_len >= PATH_MAX || fuse_len + name_len >= PATH_MAX)
+			continue;
+		memcpy(&subpath[len], de->d_name, name_len + 1);
 		
-		exclude = exclude_chroot_path(subpath);
+		if (relative_rules) {
+			memcpy(&fuse_subpath[fuse_len], de->d_name, name_len + 1);
+			exclude = exclude_fuse_path(fuse_subpath, NULL);
+		} else {
+			exclude = exclude_chroot_path(subpath, NULL);
+		}
 		
 		ffs_debug("readdir[2]: path %s (expanded %s), exclude: %s\n",
 				  de->d_name, subpath, exclude ? "y" : "n");
@@ -490,61 +858,229 @@ static int ffs_readdir_helper(unsigned int source_idx, char *realpath, const cha
 		if (exclude)
 			continue;
 		
+		if (remember && name_set_add(names, de->d_name) < 0) {
+			res = -ENOMEM;
+			break;
+		}
+		
+		if (!fill)
+			continue;
+		
 		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
+		
+		// st_nlink stays 0 if the attributes are incomplete, see ffs_readdir()
+		if (!readdir_stat || SYSCALL(fstatat(dirfd(dp), de->d_name, &st,
+							AT_SYMLINK_NOFOLLOW)) == -1)
+		{
+			// the entry was removed in the meantime
+			if (readdir_stat && errno == ENOENT)
+				continue;
+			
+			memset(&st, 0, sizeof(st));
+			st.st_ino = de->d_ino;
+			st.st_mode = de->d_type << 12;
+		}
+		
+		if (dir_snapshot_add(snap, de->d_name, &st)) {
+			res = -ENOMEM;
 			break;
+		}
 	}
 	
-	closedir(dp);
+	SYSCALL(closedir(dp));
 	
-	return 0;
+	return res;
 }
 
-static int ffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-				   off_t offset, struct fuse_file_info *fi)
+/*
+ * Adds the merged entries of a directory from all sources to the snapshot
+ */
+int merge_dir(const char *path, struct dir_snapshot *snap,
+				open_source_dir_t open_dir, void *data)
 {
 	char realpath[PATH_MAX];
-	int i, r, exclude;
-	ffs_debug("readdir[1]: path %s (expanded %s), exclude: %s\n", path,
-			realpath, exclude ? "y" : "n");
+	struct name_set *names;
+	struct src_index_dir *idx;
+	int i, r, last, listed, root, relative_listed;
 	
 	// If we have to list the root of the fuse directory, we add the root entries
-	// from all sources. Else, we just show the entries from the 
-	if (!strcmp(path, "/")) {
-		for (i=0; i < n_sources; i++) {
-			r = ffs_readdir_helper(i, sources[i].path, path, buf, filler);
-			if (r)
-				return r;
-		}
-	} else {
+	// from all sources. Else, we just show the entries from the sources whose
+	// rules include this directory.
+	root = !strcmp(path, "/");
+	
+	// relative rules list the directory in all sources or in none
+	relative_listed = relative_rules && (root || !exclude_fuse_path(path, NULL));
+	
+	// sources after the last one that lists this directory do not matter
+	last = -1;
+	for (i=0; i < n_sources; i++) {
+		source_path(realpath, PATH_MAX, i, path);
+		
+		if (relative_rules ? relative_listed : (root || !exclude_chroot_path(realpath, NULL)))
+			last = i;
+	}
+	
+	/*
+	 * Remember the names of the sources so entries of later sources with
+	 * the same name are hidden. This includes the sources that do not list
+	 * this directory themselves as their entries may be included anyway.
+	 */
+	names = NULL;
+	if (last > 0) {
+		names = name_set_new();
+		if (!names)
+			return -ENOMEM;
+	}
+	
+	// the index is only complete if all listed directories were read
+	idx = source_index ? src_index_dir_begin(source_index, path) : NULL;
+	
+	r = 0;
+	for (i=0; i <= last; i++) {
+		source_path(realpath, PATH_MAX, i, path);
+		
+		listed = relative_rules ? relative_listed : (root || !exclude_chroot_path(realpath, NULL));
+		
+		r = ffs_readdir_helper(realpath, path, i, open_dir, data, names,
+				i < last, listed, snap, idx);
+		
+		// skip sources that do not contain this directory
+		if (r == -ENOENT || (r < 0 && !listed))
+			r = 0;
+		else if (r)
+			break;
+	}
+	
+	if (idx)
+		src_index_dir_end(idx, r == 0);
+	
+	name_set_free(names);
+	
+	return r;
+}
+
+/*
+ * Builds a snapshot of the merged directory that is returned by readdir()
+ * until the directory is released. If the shared cache is enabled, the
+ * modification times of the source directories tell whether a snapshot of
+ * an earlier handle is still valid.
+ */
+static int ffs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	char realpath[PATH_MAX];
+	struct timespec *mtimes;
+	struct dir_snapshot *snap;
+	struct stat st;
+	unsigned int i, n_mtimes;
+	int r;
+	
+	OP_BEGIN(OP_OPENDIR);
+	
+	ffs_debug("opendir: path %s\n", path);
+	
+	mtimes = malloc(sizeof(struct timespec) * n_sources);
+	if (!mtimes)
+		return -ENOMEM;
+	
+	/*
+	 * The modification times are only needed to validate cached snapshots.
+	 * Snapshots with attributes are not shared as the attributes of the
+	 * entries change without changing the mtime of the directory.
+	 */
+	n_mtimes = 0;
+	if (dir_cache && !readdir_stat) {
 		for (i=0; i < n_sources; i++) {
-			snprintf(realpath, PATH_MAX, "%s%s", sources[i].path, &path[1]);
+			source_path(realpath, PATH_MAX, i, path);
 			
-			if (access(realpath, F_OK) != -1) {
-				exclude = exclude_chroot_path(realpath);
+			if (SYSCALL(stat(realpath, &st)) == 0) {
+				mtimes[i] = st.st_mtim;
 			} else {
-				continue;
-			}
-			
-			if (!exclude) {
-				r = ffs_readdir_helper(i, realpath, path, buf, filler);
-				if (r)
-					return r;
+				mtimes[i].tv_sec = -1;
+				mtimes[i].tv_nsec = 0;
 			}
 		}
+		n_mtimes = n_sources;
+		
+		snap = dir_cache_lookup(dir_cache, path, mtimes, n_mtimes);
+		if (snap) {
+			free(mtimes);
+			fi->fh = (uintptr_t) snap;
+			return 0;
+		}
+	}
+	
+	snap = dir_snapshot_new(path, mtimes, n_mtimes, readdir_stat);
+	free(mtimes);
+	if (!snap)
+		return -ENOMEM;
+	
+	r = merge_dir(path, snap, NULL, NULL);
+	if (r) {
+		dir_snapshot_unref(snap);
+		return r;
+	}
+	
+	if (n_mtimes > 0)
+		dir_cache_insert(dir_cache, snap);
+	
+	fi->fh = (uintptr_t) snap;
+	
+	return 0;
+}
+
+/*
+ * Returns the entries of the snapshot starting at offset, so a listing can be
+ * continued over multiple calls with a buffer of bounded size
+ */
+static int ffs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+				   off_t offset, struct fuse_file_info *fi,
+				   enum fuse_readdir_flags flags)
+{
+	struct dir_snapshot *snap = FFS_DIR(fi);
+	struct stat st;
+	size_t i, count;
+	const char *name;
+	
+	OP_BEGIN(OP_READDIR);
+	
+	ffs_debug("readdir[1]: path %s, offset %lld%s\n", path, (long long) offset,
+			flags & FUSE_READDIR_PLUS ? ", plus" : "");
+	
+	count = dir_snapshot_count(snap);
+	for (i = offset; i < count; i++) {
+		name = dir_snapshot_entry(snap, i, &st);
+		
+		/*
+		 * With complete attributes, the kernel does not have to send a
+		 * getattr request for every entry. The offset of an entry is the
+		 * offset of the following entry.
+		 */
+		if (filler(buf, name, &st, i + 1, (flags & FUSE_READDIR_PLUS) &&
+				st.st_nlink > 0 ? FUSE_FILL_DIR_PLUS : 0))
+			break;
 	}
 	
 	return 0;
 }
 
+static int ffs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	OP_BEGIN(OP_RELEASEDIR);
+	
+	ffs_debug("releasedir: path %s\n", path);
+	
+	dir_snapshot_unref(FFS_DIR(fi));
+	
+	return 0;
+}
+
 static int ffs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
 	char realpath[PATH_MAX];
 	
-	int exclude = exclude_path(realpath, PATH_MAX, path);
+	OP_BEGIN(OP_MKNOD);
+	
+	int exclude = exclude_new_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("mknod: path %s (expanded %s), exclude %s\n", path, realpath,
 			exclude ? "y" : "n");
@@ -557,13 +1093,14 @@ static int ffs_mknod(const char *path, mode_t mode, dev_t rdev)
 	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
 	 *       is more portable */
 	if (S_ISREG(mode)) {
-		res = open(realpath, O_CREAT | O_EXCL | O_WRONLY, mode);
+		res = SYSCALL(open(realpath, O_CREAT | O_EXCL | O_WRONLY, mode));
 		if (res >= 0)
-			res = close(res);
+			res = SYSCALL(close(res));
 	} else if (S_ISFIFO(mode))
-		res = mkfifo(realpath, mode);
+		res = SYSCALL(mkfifo(realpath, mode));
 	else
-		res = mknod(realpath, mode, rdev);
+		res = SYSCALL(mknod(realpath, mode, rdev));
+	invalidate_path(path);
 	if (res == -1)
 		return -errno;
 	
@@ -574,7 +1111,9 @@ static int ffs_mkdir(const char *path, mode_t mode)
 {
 	char realpath[PATH_MAX];
 	
-	int exclude = exclude_path(realpath, PATH_MAX, path);
+	OP_BEGIN(OP_MKDIR);
+	
+	int exclude = exclude_new_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("mkdir: path %s (expanded %s), exclude %s\n", path, realpath,
 			exclude ? "y" : "n");
@@ -583,7 +1122,8 @@ static int ffs_mkdir(const char *path, mode_t mode)
 		return -ENOENT;
 	
 	int res;
-	res = mkdir(realpath, mode);
+	res = SYSCALL(mkdir(realpath, mode));
+	invalidate_path(path);
 	if (res == -1)
 		return -errno;
 	
@@ -594,6 +1134,8 @@ static int ffs_unlink(const char *path)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_UNLINK);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("unlink: path %s (expanded %s), exclude %s\n", path,
@@ -603,7 +1145,8 @@ static int ffs_unlink(const char *path)
 		return -ENOENT;
 	
 	int res;
-	res = unlink(realpath);
+	res = SYSCALL(unlink(realpath));
+	invalidate_path(path);
 	if (res == -1)
 		return -errno;
 	
@@ -614,6 +1157,8 @@ static int ffs_rmdir(const char *path)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_RMDIR);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("rmdir: path %s (expanded %s), exclude %s\n", path, realpath,
@@ -623,7 +1168,8 @@ static int ffs_rmdir(const char *path)
 		return -ENOENT;
 	
 	int res;
-	res = rmdir(realpath);
+	res = SYSCALL(rmdir(realpath));
+	invalidate_path(path);
 	if (res == -1)
 		return -errno;
 	
@@ -635,8 +1181,10 @@ static int ffs_symlink(const char *from, const char *to)
 	char xfrom[PATH_MAX];
 	char xto[PATH_MAX];
 	
+	OP_BEGIN(OP_SYMLINK);
+	
 	int exclude_from = exclude_path(xfrom, PATH_MAX, from);
-	int exclude_to = exclude_path(xto, PATH_MAX, to);
+	int exclude_to = exclude_new_path(xto, PATH_MAX, to);
 	
 	ffs_debug("symlink: from %s (expanded %s), exclude %s; to %s"
 			" (expanded %s), exclude %s\n", from, xfrom,
@@ -646,20 +1194,27 @@ static int ffs_symlink(const char *from, const char *to)
 		return -ENOENT;
 	
 	int res;
-	res = symlink(from, xto);
+	res = SYSCALL(symlink(from, xto));
+	invalidate_path(to);
 	if (res == -1)
 		return -errno;
 	
 	return 0;
 }
 
-static int ffs_rename(const char *from, const char *to)
+static int ffs_rename(const char *from, const char *to, unsigned int flags)
 {
 	char xfrom[PATH_MAX];
 	char xto[PATH_MAX];
 	
+	OP_BEGIN(OP_RENAME);
+	
+	// RENAME_EXCHANGE and RENAME_NOREPLACE are not supported
+	if (flags)
+		return -EINVAL;
+	
 	int exclude_from = exclude_path(xfrom, PATH_MAX, from);
-	int exclude_to = exclude_path(xto, PATH_MAX, to);
+	int exclude_to = exclude_new_path(xto, PATH_MAX, to);
 	
 	ffs_debug("rename: from %s (expanded %s), exclude %s; to %s"
 			" (expanded %s), exclude %s\n", from, xfrom,
@@ -669,7 +1224,16 @@ static int ffs_rename(const char *from, const char *to)
 		return -ENOENT;
 	
 	int res;
-	res = rename(xfrom, xto);
+	res = SYSCALL(rename(xfrom, xto));
+	invalidate_all();
+	if (source_index) {
+		src_index_remove_tree(source_index, from);
+		src_index_remove_tree(source_index, to);
+		update_index(from);
+		update_index(to);
+	}
+	if (__atomic_load_n(&prescan, __ATOMIC_ACQUIRE))
+		prescan_invalidate_all(prescan);
 	if (res == -1)
 		return -errno;
 	
@@ -681,8 +1245,10 @@ static int ffs_link(const char *from, const char *to)
 	char xfrom[PATH_MAX];
 	char xto[PATH_MAX];
 	
+	OP_BEGIN(OP_LINK);
+	
 	int exclude_from = exclude_path(xfrom, PATH_MAX, from);
-	int exclude_to = exclude_path(xto, PATH_MAX, to);
+	int exclude_to = exclude_new_path(xto, PATH_MAX, to);
 	
 	ffs_debug("link: from %s (expanded %s), exclude %s; to %s"
 			" (expanded %s), exclude %s\n", from, xfrom,
@@ -692,17 +1258,20 @@ static int ffs_link(const char *from, const char *to)
 		return -ENOENT;
 	
 	int res;
-	res = link(xfrom, xto);
+	res = SYSCALL(link(xfrom, xto));
+	invalidate_path(to);
 	if (res == -1)
 		return -errno;
 	
 	return 0;
 }
 
-static int ffs_chmod(const char *path, mode_t mode)
+static int ffs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_CHMOD);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("chmod: path %s (expanded %s), exclude %s\n", path, realpath,
@@ -712,17 +1281,20 @@ static int ffs_chmod(const char *path, mode_t mode)
 		return -ENOENT;
 	
 	int res;
-	res = chmod(realpath, mode);
+	res = SYSCALL(chmod(realpath, mode));
 	if (res == -1)
 		return -errno;
 	
 	return 0;
 }
 
-static int ffs_chown(const char *path, uid_t uid, gid_t gid)
+static int ffs_chown(const char *path, uid_t uid, gid_t gid,
+				struct fuse_file_info *fi)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_CHOWN);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("chown: path %s (expanded %s), exclude %s\n", path, realpath,
@@ -732,17 +1304,26 @@ static int ffs_chown(const char *path, uid_t uid, gid_t gid)
 		return -ENOENT;
 	
 	int res;
-	res = lchown(realpath, uid, gid);
+	res = SYSCALL(lchown(realpath, uid, gid));
 	if (res == -1)
 		return -errno;
 	
 	return 0;
 }
 
-static int ffs_truncate(const char *path, off_t size)
+static int ffs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_TRUNCATE);
+	
+	if (fi) {
+		if (SYSCALL(ftruncate(FFS_FILE(fi)->fd, size)) == -1)
+			return -errno;
+		
+		return 0;
+	}
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("truncate: path %s (expanded %s), exclude %s\n", path,
@@ -752,17 +1333,20 @@ static int ffs_truncate(const char *path, off_t size)
 		return -ENOENT;
 	
 	int res;
-	res = truncate(realpath, size);
+	res = SYSCALL(truncate(realpath, size));
 	if (res == -1)
 		return -errno;
 	
 	return 0;
 }
 
-static int ffs_utimens(const char *path, const struct timespec ts[2])
+static int ffs_utimens(const char *path, const struct timespec ts[2],
+				struct fuse_file_info *fi)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_UTIMENS);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("utimens: path %s (expanded %s), exclude %s\n", path,
@@ -779,18 +1363,65 @@ static int ffs_utimens(const char *path, const struct timespec ts[2])
 	tv[1].tv_sec = ts[1].tv_sec;
 	tv[1].tv_usec = ts[1].tv_nsec / 1000;
 	
-	res = utimes(realpath, tv);
+	res = SYSCALL(utimes(realpath, tv));
 	if (res == -1)
 		return -errno;
 	
 	return 0;
 }
 
+/*
+ * Keeps the file descriptor of the real file open until release()
+ */
+int ffs_file_attach(struct fuse_file_info *fi, int fd, unsigned int source)
+{
+	struct ffs_file *file;
+	
+	file = malloc(sizeof(struct ffs_file));
+	if (!file) {
+		close(fd);
+		return -ENOMEM;
+	}
+	
+	file->fd = fd;
+	file->source = source;
+	fi->fh = (uintptr_t) file;
+	
+	return 0;
+}
+
+static int ffs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	char realpath[PATH_MAX];
+	unsigned int source;
+	
+	OP_BEGIN(OP_CREATE);
+	
+	int exclude = resolve_new_path(realpath, PATH_MAX, path, &source);
+	
+	ffs_debug("create: path %s (expanded %s), exclude %s\n", path, realpath,
+			exclude ? "y" : "n");
+	
+	if (exclude)
+		return -ENOENT;
+	
+	int fd;
+	fd = SYSCALL(open(realpath, fi->flags, mode));
+	invalidate_path(path);
+	if (fd == -1)
+		return -errno;
+	
+	return ffs_file_attach(fi, fd, source);
+}
+
 static int ffs_open(const char *path, struct fuse_file_info *fi)
 {
 	char realpath[PATH_MAX];
+	unsigned int source;
 	
-	int exclude = exclude_path(realpath, PATH_MAX, path);
+	OP_BEGIN(OP_OPEN);
+	
+	int exclude = resolve_path(realpath, PATH_MAX, path, &source, 0);
 	
 	ffs_debug("open: path %s (expanded %s), exclude %s\n", path, realpath,
 			exclude ? "y" : "n");
@@ -798,112 +1429,530 @@ static int ffs_open(const char *path, struct fuse_file_info *fi)
 	if (exclude)
 		return -ENOENT;
 	
-	int res;
-	res = open(realpath, fi->flags);
-	if (res == -1)
+	int fd;
+	fd = SYSCALL(open(realpath, fi->flags));
+	if (fd == -1)
 		return -errno;
 	
-	close(res);
-	return 0;
+	return ffs_file_attach(fi, fd, source);
 }
 
 static int ffs_read(const char *path, char *buf, size_t size, off_t offset,
 				struct fuse_file_info *fi)
+{
+	struct ffs_file *file = FFS_FILE(fi);
+	
+	OP_BEGIN(OP_READ);
+	
+	ffs_debug("read: path %s (source %u)\n", path, file->source);
+	
+	int res;
+	res = SYSCALL(pread(file->fd, buf, size, offset));
+	if (res == -1)
+		res = -errno;
+	
+	return res;
+}
+
+static int ffs_write(const char *path, const char *buf, size_t size,
+				 off_t offset, struct fuse_file_info *fi)
+{
+	struct ffs_file *file = FFS_FILE(fi);
+	
+	OP_BEGIN(OP_WRITE);
+	
+	ffs_debug("write: path %s (source %u)\n", path, file->source);
+	
+	int res;
+	res = SYSCALL(pwrite(file->fd, buf, size, offset));
+	if (res == -1)
+		res = -errno;
+	
+	return res;
+}
+
+/*
+ * Instead of copying the data into a buffer, return a reference to the real
+ * file so libfuse can splice() it directly into /dev/fuse
+ */
+static int ffs_read_buf(const char *path, struct fuse_bufvec **bufp,
+				size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct ffs_file *file = FFS_FILE(fi);
+	struct fuse_bufvec *src;
+	
+	OP_BEGIN(OP_READ);
+	
+	ffs_debug("read_buf: path %s (source %u)\n", path, file->source);
+	
+	src = malloc(sizeof(struct fuse_bufvec));
+	if (!src)
+		return -ENOMEM;
+	
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = file->fd;
+	src->buf[0].pos = offset;
+	
+	*bufp = src;
+	
+	return 0;
+}
+
+static int ffs_write_buf(const char *path, struct fuse_bufvec *buf,
+				 off_t offset, struct fuse_file_info *fi)
+{
+	struct ffs_file *file = FFS_FILE(fi);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	
+	OP_BEGIN(OP_WRITE);
+	
+	ffs_debug("write_buf: path %s (source %u)\n", path, file->source);
+	
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = file->fd;
+	dst.buf[0].pos = offset;
+	
+	return SYSCALL(fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK));
+}
+
+static int ffs_statfs(const char *path, struct statvfs *stbuf)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_STATFS);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
-	ffs_debug("read: path %s (expanded %s), exclude %s\n", path, realpath,
-			exclude ? "y" : "n");
+	ffs_debug("statfs: path %s (expanded %s), exclude %s\n", path,
+			realpath, exclude ? "y" : "n");
+	
+	if (exclude)
+		return -ENOENT;
+	
+	int res;
+	res = SYSCALL(statvfs(realpath, stbuf));
+	if (res == -1)
+		return -errno;
+	
+	return 0;
+}
+
+static int ffs_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct ffs_file *file = FFS_FILE(fi);
+	
+	OP_BEGIN(OP_FLUSH);
+	
+	ffs_debug("flush: path %s (source %u)\n", path, file->source);
+	
+	/*
+	 * The file may have been dup()'ed by the caller, so closing a duplicate
+	 * of our descriptor is the only way to report errors of close() back
+	 * to the application without invalidating fi->fh.
+	 */
+	int fd;
+	fd = SYSCALL(dup(file->fd));
+	if (fd == -1)
+		return -errno;
+	
+	if (SYSCALL(close(fd)) == -1)
+		return -errno;
+	
+	return 0;
+}
+
+static int ffs_release(const char *path, struct fuse_file_info *fi)
+{
+	struct ffs_file *file = FFS_FILE(fi);
+	
+	OP_BEGIN(OP_RELEASE);
+	
+	ffs_debug("release: path %s (source %u)\n", path, file->source);
+	
+	SYSCALL(close(file->fd));
+	free(file);
+	
+	return 0;
+}
+
+static int ffs_fsync(const char *path, int isdatasync,
+				 struct fuse_file_info *fi)
+{
+	struct ffs_file *file = FFS_FILE(fi);
+	
+	OP_BEGIN(OP_FSYNC);
+	
+	ffs_debug("fsync: path %s (source %u), datasync %d\n", path,
+			file->source, isdatasync);
+	
+	int res;
+	if (isdatasync)
+		res = SYSCALL(fdatasync(file->fd));
+	else
+		res = SYSCALL(fsync(file->fd));
+	if (res == -1)
+		return -errno;
+	
+	return 0;
+}
+
+/*
+ * Writes the statistics of the caches and the syscall counters to the log
+ */
+static void log_stats(void)
+{
+	unsigned long hits, misses, calls, syscalls;
+	unsigned int i;
+	
+	if (cache) {
+		path_cache_stats(cache, &hits, &misses);
+		syslog(LOG_INFO, "decision cache: %lu hits, %lu misses\n", hits, misses);
+	}
+	
+	if (dir_cache) {
+		dir_cache_stats(dir_cache, &hits, &misses);
+		syslog(LOG_INFO, "directory cache: %lu hits, %lu misses\n", hits, misses);
+	}
+	
+	if (source_index) {
+		src_index_stats(source_index, &hits, &misses);
+		syslog(LOG_INFO, "source index: %lu hits, %lu misses\n", hits, misses);
+	}
+	
+	if (__atomic_load_n(&prescan, __ATOMIC_ACQUIRE)) {
+		prescan_stats(prescan, &hits, &misses);
+		syslog(LOG_INFO, "prescan: %lu hits, %lu misses\n", hits, misses);
+	}
+	
+	if (ignore) {
+		ignore_stats(ignore, &hits, &misses);
+		syslog(LOG_INFO, "ignore files: %lu directories, %lu files read\n", hits, misses);
+	}
+	
+	if (!count_syscalls)
+		return;
+	
+	for (i=0; i < OP_MAX; i++) {
+		calls = __atomic_load_n(&op_counters[i].calls, __ATOMIC_RELAXED);
+		syscalls = __atomic_load_n(&op_counters[i].syscalls, __ATOMIC_RELAXED);
+		
+		if (calls)
+			syslog(LOG_INFO, "%s: %lu calls, %lu syscalls (%.2f per call)\n",
+				op_names[i], calls, syscalls, (double) syscalls / calls);
+	}
+}
+
+struct path_list {
+	char **paths;
+	size_t n, size;
+};
+
+static void path_list_add(const char *path, void *data)
+{
+	struct path_list *l = data;
+	char **paths;
+	size_t size;
+	
+	if (l->n == l->size) {
+		size = l->size ? l->size * 2 : 64;
+		paths = realloc(l->paths, size * sizeof(char *));
+		if (!paths)
+			return;
+		l->paths = paths;
+		l->size = size;
+	}
+	
+	l->paths[l->n] = strdup(path);
+	if (l->paths[l->n])
+		l->n++;
+}
+
+/*
+ * Tells the kernel to forget the attributes and listings of the paths in the
+ * caches and of the root. The high-level API only knows paths, so names the
+ * kernel looked up but that are no longer in the caches keep their entries
+ * for up to --entry-timeout seconds.
+ */
+static void invalidate_kernel_paths(struct fuse *fuse, struct path_list *l)
+{
+	size_t i;
+	
+	for (i=0; i < l->n; i++) {
+		fuse_invalidate_path(fuse, l->paths[i]);
+		free(l->paths[i]);
+	}
+	free(l->paths);
+	
+	fuse_invalidate_path(fuse, "/");
+}
+
+/*
+ * Builds the rules again from the rule options and replaces the active rules.
+ * Operations that are still using the old rules finish without waiting, the
+ * old rules are freed once the last of them is done. If the new rules cannot
+ * be loaded, the old rules stay active.
+ */
+static void reload_rules(void)
+{
+	struct path_list paths = { 0 };
+	const struct conf *conf;
+	struct conf *next;
+	unsigned long version;
+	struct fuse *fuse;
+	
+	pthread_mutex_lock(&reload_lock);
+	
+	conf = conf_get();
+	next = conf_copy(conf);
+	conf_put(conf);
+	
+	if (next)
+		next->rules = load_rules();
+	if (!next || !next->rules) {
+		syslog(LOG_ERR, "cannot reload the rules, keeping the old rules\n");
+		conf_free(next);
+		pthread_mutex_unlock(&reload_lock);
+		return;
+	}
+	
+	if (conf_publish(next)) {
+		syslog(LOG_ERR, "cannot publish the reloaded rules, keeping the old rules\n");
+		conf_free(next);
+		pthread_mutex_unlock(&reload_lock);
+		return;
+	}
+	version = next->version;
+	
+	// the paths the kernel has to forget, see invalidate_kernel_paths()
+	fuse = hl_fuse;
+	if (fuse && cache)
+		path_cache_foreach(cache, path_list_add, &paths);
+	if (fuse && dir_cache)
+		dir_cache_foreach(dir_cache, path_list_add, &paths);
+	
+	// forget the decisions and listings that were made with the old rules
+	invalidate_all();
+	if (dir_cache)
+		dir_cache_clear(dir_cache);
+	if (lowlevel)
+		ffs_ll_invalidate();
+	if (fuse)
+		invalidate_kernel_paths(fuse, &paths);
+	
+	pthread_mutex_unlock(&reload_lock);
+	
+	syslog(LOG_INFO, "reloaded the rules, configuration version %lu\n", version);
+}
+
+/*
+ * Reloads the rules if a rule file is written or replaced. The directories
+ * of the files are watched as editors often replace a file with a new one.
+ */
+static void *watch_thread(void *arg)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	int fd = (intptr_t) arg;
+	unsigned int i;
+	ssize_t len;
+	char *p;
+	int reload;
+	
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		reload = 0;
+		
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			
+			for (i=0; i < n_rule_options; i++) {
+				if (rule_options[i].wd == ev->wd && ev->len &&
+					!strcmp(strrchr(rule_options[i].arg, '/') + 1, ev->name))
+					reload = 1;
+			}
+		}
+		
+		if (reload)
+			reload_rules();
+	}
+	
+	close(fd);
+	
+	return NULL;
+}
+
+static void start_watch_thread(void)
+{
+	pthread_t thread;
+	unsigned int i;
+	char *dir;
+	int fd;
+	
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd == -1) {
+		syslog(LOG_ERR, "cannot watch the rule files: %s\n", strerror(errno));
+		return;
+	}
+	
+	for (i=0; i < n_rule_options; i++) {
+		if (!rule_options[i].file)
+			continue;
+		
+		// the file names are absolute, see append_rule_option()
+		dir = strndup(rule_options[i].arg,
+				strrchr(rule_options[i].arg, '/') - rule_options[i].arg + 1);
+		if (!dir)
+			continue;
+		
+		rule_options[i].wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (rule_options[i].wd == -1)
+			syslog(LOG_ERR, "cannot watch \"%s\": %s\n", dir, strerror(errno));
+		free(dir);
+	}
+	
+	if (pthread_create(&thread, NULL, watch_thread, (void *) (intptr_t) fd) == 0)
+		pthread_detach(thread);
+	else
+		close(fd);
+}
+
+/*
+ * Handles the signals that main() blocked for all FUSE threads
+ */
+static void *signal_thread(void *arg)
+{
+	sigset_t *sigset = arg;
+	int sig;
+	
+	while (sigwait(sigset, &sig) == 0) {
+		if (sig == SIGUSR1)
+			log_stats();
+		else if (sig == SIGHUP)
+			reload_rules();
+	}
+	
+	return NULL;
+}
+
+/*
+ * Maps the snapshot file or scans the sources, the operations probe the
+ * sources until the snapshot is ready
+ */
+static void *prescan_thread(void *arg)
+{
+	struct prescan_stats stats;
+	struct prescan *snapshot = NULL;
+	const struct conf *current;
+	struct conf *c;
+	long cpus;
+	
+	// the scan takes long, so it must not hold the current version
+	current = conf_get();
+	c = conf_copy(current);
+	conf_put(current);
+	if (!c) {
+		syslog(LOG_ERR, "prescan: cannot copy the configuration\n");
+		return NULL;
+	}
 	
-	if (exclude)
-		return -ENOENT;
+	if (prescan_file && !prescan_force) {
+		snapshot = prescan_open(prescan_file, c, cache_timeout);
+		if (snapshot)
+			syslog(LOG_INFO, "prescan: using \"%s\"\n", prescan_file);
+	}
 	
-	int fd;
-	int res;
+	if (!snapshot) {
+		// the scan waits for the disks more than for the CPUs
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		cpus = cpus < 1 ? 1 : (cpus > 16 ? 16 : cpus);
+		
+		snapshot = prescan_build(prescan_file, c, cache_timeout, 2 * cpus, &stats);
+		if (snapshot)
+			syslog(LOG_INFO, "prescan: %lu directories, %lu entries in %.2f s, %llu bytes\n",
+				stats.dirs, stats.entries, stats.seconds,
+				(unsigned long long) stats.size);
+		else
+			syslog(LOG_ERR, "prescan: cannot scan the sources\n");
+	}
 	
-	fd = open(realpath, O_RDONLY);
-	if (fd == -1)
-		return -errno;
+	conf_free(c);
 	
-	res = pread(fd, buf, size, offset);
-	if (res == -1)
-		res = -errno;
+	__atomic_store_n(&prescan, snapshot, __ATOMIC_RELEASE);
 	
-	close(fd);
-	return res;
+	return NULL;
 }
 
-static int ffs_write(const char *path, const char *buf, size_t size,
-				 off_t offset, struct fuse_file_info *fi)
+/*
+ * Common initialization of both backends, called once the mount exists
+ */
+void ffs_start(struct fuse_conn_info *conn)
 {
-	char realpath[PATH_MAX];
+	static sigset_t sigset;
+	pthread_t thread;
 	
-	int exclude = exclude_path(realpath, PATH_MAX, path);
+	// let the kernel splice data from and to /dev/fuse if it is able to
+	if (use_splice)
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+			FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
 	
-	ffs_debug("write: path %s (expanded %s), exclude %s\n", path, realpath,
-			exclude ? "y" : "n");
+	// readdirplus only saves requests if readdir() has complete attributes
+	if (readdir_stat)
+		conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
+	else
+		conn->want &= ~FUSE_CAP_READDIRPLUS;
 	
-	ffs_debug("write: path %s (expanded %s)\n", path, realpath);
+	// start the threads here as fuse_daemonize() forks before init is called
+	if (trace_start(trace, trace_file, 16384))
+		syslog(LOG_ERR, "cannot start the trace\n");
 	
-	if (exclude)
-		return -ENOENT;
+	// the low-level backend does not probe the sources for every operation
+	if (!lowlevel && source_index_size > 0) {
+		source_index = src_index_new(source_index_size, n_sources);
+		if (!source_index)
+			syslog(LOG_ERR, "cannot start the source index\n");
+	}
 	
-	int fd;
-	int res;
+	if (!lowlevel && (prescan_force || prescan_file)) {
+		if (pthread_create(&thread, NULL, prescan_thread, NULL) == 0)
+			pthread_detach(thread);
+	}
 	
-	fd = open(realpath, O_WRONLY);
-	if (fd == -1)
-		return -errno;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
+	sigaddset(&sigset, SIGHUP);
+	if (pthread_create(&thread, NULL, signal_thread, &sigset) == 0)
+		pthread_detach(thread);
 	
-	res = pwrite(fd, buf, size, offset);
-	if (res == -1)
-		res = -errno;
+	if (watch_rules)
+		start_watch_thread();
 	
-	close(fd);
-	return res;
+	if (stats_socket && stats_serve(stats_socket))
+		syslog(LOG_ERR, "cannot serve the statistics on \"%s\": %s\n",
+			stats_socket, strerror(errno));
 }
 
-static int ffs_statfs(const char *path, struct statvfs *stbuf)
+void ffs_stop(void)
 {
-	char realpath[PATH_MAX];
-	
-	int exclude = exclude_path(realpath, PATH_MAX, path);
-	
-	ffs_debug("statfs: path %s (expanded %s), exclude %s\n", path,
-			realpath, exclude ? "y" : "n");
-	
-	if (exclude)
-		return -ENOENT;
-	
-	int res;
-	res = statvfs(realpath, stbuf);
-	if (res == -1)
-		return -errno;
-	
-	return 0;
+	log_stats();
+	trace_stop();
+	stats_stop();
 }
 
-static int ffs_release(const char *path, struct fuse_file_info *fi)
+static void *ffs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
-	/* 
-	 * Just a stub.  This method is optional and can safely be left
-	 *       unimplemented
-	 */
+	// libfuse cannot tell excluded from missing paths, see ll_lookup()
+	cfg->entry_timeout = entry_timeout;
+	cfg->attr_timeout = attr_timeout;
+	cfg->negative_timeout = negative_timeout;
 	
-	return 0;
+	ffs_start(conn);
+	
+	return NULL;
 }
 
-static int ffs_fsync(const char *path, int isdatasync,
-				 struct fuse_file_info *fi)
+static void ffs_destroy(void *private_data)
 {
-	/* 
-	 * Just a stub.  This method is optional and can safely be left
-	 *       unimplemented
-	 */
-	
-	return 0;
+	ffs_stop();
 }
 
 #ifdef HAVE_SETXATTR
@@ -914,6 +1963,8 @@ static int ffs_setxattr(const char *path, const char *name, const char *value,
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_SETXATTR);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("setxattr: path %s (expanded %s), exclude %s\n", path,
@@ -922,7 +1973,7 @@ static int ffs_setxattr(const char *path, const char *name, const char *value,
 	if (exclude)
 		return -ENOENT;
 	
-	int res = lsetxattr(realpath, name, value, size, flags);
+	int res = SYSCALL(lsetxattr(realpath, name, value, size, flags));
 	if (res == -1)
 		return -errno;
 	return 0;
@@ -933,6 +1984,8 @@ static int ffs_getxattr(const char *path, const char *name, char *value,
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_GETXATTR);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("getxattr: path %s (expanded %s), exclude %s\n", path,
@@ -941,7 +1994,7 @@ static int ffs_getxattr(const char *path, const char *name, char *value,
 	if (exclude)
 		return -ENOENT;
 	
-	int res = lgetxattr(realpath, name, value, size);
+	int res = SYSCALL(lgetxattr(realpath, name, value, size));
 	if (res == -1)
 		return -errno;
 	return res;
@@ -951,6 +2004,8 @@ static int ffs_listxattr(const char *path, char *list, size_t size)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_LISTXATTR);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("listxattr: path %s (expanded %s), exclude %s\n", path,
@@ -959,7 +2014,7 @@ static int ffs_listxattr(const char *path, char *list, size_t size)
 	if (exclude)
 		return -ENOENT;
 	
-	int res = llistxattr(realpath, list, size);
+	int res = SYSCALL(llistxattr(realpath, list, size));
 	if (res == -1)
 		return -errno;
 	return res;
@@ -969,6 +2024,8 @@ static int ffs_removexattr(const char *path, const char *name)
 {
 	char realpath[PATH_MAX];
 	
+	OP_BEGIN(OP_REMOVEXATTR);
+	
 	int exclude = exclude_path(realpath, PATH_MAX, path);
 	
 	ffs_debug("removexattr: path %s (expanded %s), exclude %s\n", path,
@@ -977,7 +2034,7 @@ static int ffs_removexattr(const char *path, const char *name)
 	if (exclude)
 		return -ENOENT;
 	
-	int res = lremovexattr(realpath, name);
+	int res = SYSCALL(lremovexattr(realpath, name));
 	if (res == -1)
 		return -errno;
 	return 0;
@@ -985,11 +2042,101 @@ static int ffs_removexattr(const char *path, const char *name)
 
 #endif /* HAVE_SETXATTR */
 
+/*
+ * Wrappers that trace the result and latency of the operations and record
+ * their statistics. They are only installed in ffs_oper if tracing or the
+ * statistics are enabled. bytes is evaluated after the operation.
+ */
+#define TRACED(name, op, path, bytes, params, args) \
+	static int trace_##name params \
+	{ \
+		uint64_t start = trace_now(); \
+		int res; \
+		op_excluded = 0; \
+		res = ffs_##name args; \
+		if (trace_level >= TRACE_OPS) \
+			trace_op(#name, path, res, start); \
+		if (stats_enabled) \
+			stats_record(op, start, res < 0 ? -res : 0, op_excluded, bytes); \
+		return res; \
+	}
+
+TRACED(getattr, OP_GETATTR, path, 0, (const char *path, struct stat *stbuf,
+	struct fuse_file_info *fi), (path, stbuf, fi))
+TRACED(access, OP_ACCESS, path, 0, (const char *path, int mask), (path, mask))
+TRACED(readlink, OP_READLINK, path, 0,
+	(const char *path, char *buf, size_t size), (path, buf, size))
+TRACED(opendir, OP_OPENDIR, path, 0,
+	(const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(readdir, OP_READDIR, path, 0, (const char *path, void *buf, fuse_fill_dir_t filler,
+	off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags),
+	(path, buf, filler, offset, fi, flags))
+TRACED(releasedir, OP_RELEASEDIR, path, 0,
+	(const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(mknod, OP_MKNOD, path, 0,
+	(const char *path, mode_t mode, dev_t rdev), (path, mode, rdev))
+TRACED(mkdir, OP_MKDIR, path, 0, (const char *path, mode_t mode), (path, mode))
+TRACED(symlink, OP_SYMLINK, to, 0, (const char *from, const char *to), (from, to))
+TRACED(unlink, OP_UNLINK, path, 0, (const char *path), (path))
+TRACED(rmdir, OP_RMDIR, path, 0, (const char *path), (path))
+TRACED(rename, OP_RENAME, from, 0, (const char *from, const char *to, unsigned int flags),
+	(from, to, flags))
+TRACED(link, OP_LINK, to, 0, (const char *from, const char *to), (from, to))
+TRACED(chmod, OP_CHMOD, path, 0,
+	(const char *path, mode_t mode, struct fuse_file_info *fi),
+	(path, mode, fi))
+TRACED(chown, OP_CHOWN, path, 0, (const char *path, uid_t uid, gid_t gid,
+	struct fuse_file_info *fi), (path, uid, gid, fi))
+TRACED(truncate, OP_TRUNCATE, path, 0,
+	(const char *path, off_t size, struct fuse_file_info *fi),
+	(path, size, fi))
+TRACED(utimens, OP_UTIMENS, path, 0, (const char *path, const struct timespec ts[2],
+	struct fuse_file_info *fi), (path, ts, fi))
+TRACED(create, OP_CREATE, path, 0,
+	(const char *path, mode_t mode, struct fuse_file_info *fi),
+	(path, mode, fi))
+TRACED(open, OP_OPEN, path, 0, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(read, OP_READ, path, res > 0 ? res : 0,
+	(const char *path, char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi), (path, buf, size, offset, fi))
+TRACED(write, OP_WRITE, path, res > 0 ? res : 0,
+	(const char *path, const char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi), (path, buf, size, offset, fi))
+// read_buf is only used without the statistics, see main()
+TRACED(read_buf, OP_READ, path, 0,
+	(const char *path, struct fuse_bufvec **bufp, size_t size,
+	off_t offset, struct fuse_file_info *fi), (path, bufp, size, offset, fi))
+TRACED(write_buf, OP_WRITE, path, res > 0 ? res : 0,
+	(const char *path, struct fuse_bufvec *buf, off_t offset,
+	struct fuse_file_info *fi), (path, buf, offset, fi))
+TRACED(statfs, OP_STATFS, path, 0,
+	(const char *path, struct statvfs *stbuf), (path, stbuf))
+TRACED(flush, OP_FLUSH, path, 0,
+	(const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(release, OP_RELEASE, path, 0,
+	(const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(fsync, OP_FSYNC, path, 0,
+	(const char *path, int isdatasync, struct fuse_file_info *fi),
+	(path, isdatasync, fi))
+#ifdef HAVE_SETXATTR
+TRACED(setxattr, OP_SETXATTR, path, 0,
+	(const char *path, const char *name, const char *value,
+	size_t size, int flags), (path, name, value, size, flags))
+TRACED(getxattr, OP_GETXATTR, path, 0, (const char *path, const char *name, char *value,
+	size_t size), (path, name, value, size))
+TRACED(listxattr, OP_LISTXATTR, path, 0,
+	(const char *path, char *list, size_t size), (path, list, size))
+TRACED(removexattr, OP_REMOVEXATTR, path, 0,
+	(const char *path, const char *name), (path, name))
+#endif
+
 static struct fuse_operations ffs_oper = {
 	.getattr    = ffs_getattr,
 	.access     = ffs_access,
 	.readlink   = ffs_readlink,
+	.opendir    = ffs_opendir,
 	.readdir    = ffs_readdir,
+	.releasedir = ffs_releasedir,
 	.mknod      = ffs_mknod,
 	.mkdir      = ffs_mkdir,
 	.symlink    = ffs_symlink,
@@ -1001,12 +2148,18 @@ static struct fuse_operations ffs_oper = {
 	.chown      = ffs_chown,
 	.truncate   = ffs_truncate,
 	.utimens    = ffs_utimens,
+	.create     = ffs_create,
 	.open       = ffs_open,
 	.read       = ffs_read,
 	.write      = ffs_write,
+	.read_buf   = ffs_read_buf,
+	.write_buf  = ffs_write_buf,
 	.statfs     = ffs_statfs,
+	.flush      = ffs_flush,
 	.release    = ffs_release,
 	.fsync      = ffs_fsync,
+	.init       = ffs_init,
+	.destroy    = ffs_destroy,
 #ifdef HAVE_SETXATTR
 	.setxattr   = ffs_setxattr,
 	.getxattr   = ffs_getxattr,
@@ -1015,6 +2168,49 @@ static struct fuse_operations ffs_oper = {
 #endif
 };
 
+/*
+ * Replaces the operations of ffs_oper with their traced wrappers, which also
+ * record the statistics
+ */
+static void trace_operations(void)
+{
+#define TRACE_OPER(name) if (ffs_oper.name) ffs_oper.name = trace_##name
+	TRACE_OPER(getattr);
+	TRACE_OPER(access);
+	TRACE_OPER(readlink);
+	TRACE_OPER(opendir);
+	TRACE_OPER(readdir);
+	TRACE_OPER(releasedir);
+	TRACE_OPER(mknod);
+	TRACE_OPER(mkdir);
+	TRACE_OPER(symlink);
+	TRACE_OPER(unlink);
+	TRACE_OPER(rmdir);
+	TRACE_OPER(rename);
+	TRACE_OPER(link);
+	TRACE_OPER(chmod);
+	TRACE_OPER(chown);
+	TRACE_OPER(truncate);
+	TRACE_OPER(utimens);
+	TRACE_OPER(create);
+	TRACE_OPER(open);
+	TRACE_OPER(read);
+	TRACE_OPER(write);
+	TRACE_OPER(read_buf);
+	TRACE_OPER(write_buf);
+	TRACE_OPER(statfs);
+	TRACE_OPER(flush);
+	TRACE_OPER(release);
+	TRACE_OPER(fsync);
+#ifdef HAVE_SETXATTR
+	TRACE_OPER(setxattr);
+	TRACE_OPER(getxattr);
+	TRACE_OPER(listxattr);
+	TRACE_OPER(removexattr);
+#endif
+#undef TRACE_OPER
+}
+
 static void usage(const char *progname)
 {
 	fprintf(stderr,
@@ -1033,6 +2229,41 @@ static void usage(const char *progname)
 		"    --includefile=<filename>               file with one include pattern in each line\n"
 		"    --default-exclude                      exclude unmatched items (default)\n"
 		"    --default-include                      include unmatched items\n"
+		"    --prune, -o prune                      rules ending with '/' also match everything below a\n"
+		"                                           directory, excluded subtrees are not matched again\n"
+		"    --relative-rules, -o relative_rules    match the rules against paths relative to the mount root\n"
+		"    --ignore-file=<name>, -o ignore_file=<name>\n"
+		"                                           read gitignore-style files with this name, e.g., .gitignore\n"
+		"    --save-rules=<file>, -o save_rules=<file>\n"
+		"                                           write the rules to a precompiled rule file and exit\n"
+		"    --stats-socket=<path>, -o stats_socket=<path>\n"
+		"                                           count the operations and serve the statistics on this socket\n"
+		"    --no-splice, -o nosplice               copy data through a buffer instead of using splice()\n"
+		"    --readdir-stat, -o readdir_stat        return the complete attributes of entries in readdir\n"
+		"    --cache-size=<n>, -o cache_size=<n>    number of cached path decisions (default 16384, 0 disables)\n"
+		"    --cache-timeout=<s>, -o cache_timeout=<s>\n"
+		"                                           seconds a path decision is cached (default 1.0)\n"
+		"    --entry-timeout=<s>, -o entry_timeout=<s>\n"
+		"                                           seconds the kernel caches names (default 1.0)\n"
+		"    --attr-timeout=<s>, -o attr_timeout=<s>\n"
+		"                                           seconds the kernel caches attributes (default 1.0)\n"
+		"    --negative-timeout=<s>, -o negative_timeout=<s>\n"
+		"                                           seconds the kernel caches missing names (default 0)\n"
+		"    --excluded-timeout=<s>, -o excluded_timeout=<s>\n"
+		"                                           seconds the kernel caches excluded names (default 60,\n"
+		"                                           only with --lowlevel)\n"
+		"    --dir-cache=<n>, -o dir_cache=<n>      number of directory listings shared between handles (default 0)\n"
+		"    --source-index=<n>, -o source_index=<n>\n"
+		"                                           number of listed directories whose sources are indexed (default 0)\n"
+		"    --prescan, -o prescan                  scan all sources at mount time\n"
+		"    --prescan-file=<file>, -o prescan_file=<file>\n"
+		"                                           keep the scan in this file and use it for later mounts\n"
+		"    --count-syscalls, -o count_syscalls    count the syscalls issued by each FUSE operation\n"
+		"    --trace=<level>, -o trace=<level>      trace operations at level off, ops, verdicts or debug\n"
+		"    --trace-file=<file>, -o trace_file=<file>\n"
+		"                                           write the trace to this file (default stderr)\n"
+		"    --lowlevel, -o lowlevel                use the inode-based low-level FUSE API\n"
+		"    --watch-rules, -o watch_rules          reload the rule files if they change (also on SIGHUP)\n"
 		"\n", progname);
 }
 
@@ -1049,7 +2280,7 @@ static int ffs_opt_proc(void *data, const char *arg, int key,
 				return -1;
 			
 			if (strlen(str) > 0)
-				append_source(strdup(str));
+				append_source(str);
 			
 			return 0;
 			
@@ -1059,12 +2290,8 @@ static int ffs_opt_proc(void *data, const char *arg, int key,
 				&& !(str = str_consume(arg, "-X")))
 				return -1;
 			
-			/*
-			 * Not actually a memory leak. We don't want this memory
-			 * deallocated until program exit.
-			 */
-			if (strlen(str) > 0)
-				append_rules(strdup(str), 1);
+			if (strlen(str) > 0 && append_rule_option(str, 1, 0))
+				return -1;
 			
 			return 0;
 			
@@ -1072,7 +2299,8 @@ static int ffs_opt_proc(void *data, const char *arg, int key,
 			if (!(str = str_consume(arg, "--excludefile=")))
 				return -1;
 			
-			parse_file(str, 1);
+			if (append_rule_option(str, 1, 1))
+				return -1;
 			
 			return 0;
 			
@@ -1082,9 +2310,8 @@ static int ffs_opt_proc(void *data, const char *arg, int key,
 				&& !(str = str_consume(arg, "-I")))
 				return -1;
 			
-			/* See comment for KEY_EXCLUDE above. */
-			if (strlen(str) > 0)
-				append_rules(strdup(str), 0);
+			if (strlen(str) > 0 && append_rule_option(str, 0, 0))
+				return -1;
 			
 			return 0;
 			
@@ -1092,7 +2319,8 @@ static int ffs_opt_proc(void *data, const char *arg, int key,
 			if (!(str = str_consume(arg, "--includefile=")))
 				return -1;
 			
-			parse_file(str, 0);
+			if (append_rule_option(str, 0, 1))
+				return -1;
 			
 			return 0;
 			
@@ -1104,9 +2332,154 @@ static int ffs_opt_proc(void *data, const char *arg, int key,
 			default_exclude = 0;
 			return 0;
 			
+		case KEY_NO_SPLICE:
+			use_splice = 0;
+			return 0;
+			
+		case KEY_READDIR_STAT:
+			readdir_stat = 1;
+			return 0;
+			
+		case KEY_CACHE_SIZE:
+			if (!(str = str_consume(arg, "--cache-size="))
+				&& !(str = str_consume(arg, "cache_size=")))
+				return -1;
+			
+			cache_size = strtoul(str, NULL, 10);
+			
+			return 0;
+			
+		case KEY_CACHE_TIMEOUT:
+			if (!(str = str_consume(arg, "--cache-timeout="))
+				&& !(str = str_consume(arg, "cache_timeout=")))
+				return -1;
+			
+			cache_timeout = strtod(str, NULL);
+			
+			return 0;
+			
+		case KEY_ENTRY_TIMEOUT:
+			if (!(str = str_consume(arg, "--entry-timeout="))
+				&& !(str = str_consume(arg, "entry_timeout=")))
+				return -1;
+			
+			entry_timeout = strtod(str, NULL);
+			
+			return 0;
+			
+		case KEY_ATTR_TIMEOUT:
+			if (!(str = str_consume(arg, "--attr-timeout="))
+				&& !(str = str_consume(arg, "attr_timeout=")))
+				return -1;
+			
+			attr_timeout = strtod(str, NULL);
+			
+			return 0;
+			
+		case KEY_NEGATIVE_TIMEOUT:
+			if (!(str = str_consume(arg, "--negative-timeout="))
+				&& !(str = str_consume(arg, "negative_timeout=")))
+				return -1;
+			
+			negative_timeout = strtod(str, NULL);
+			
+			return 0;
+			
+		case KEY_EXCLUDED_TIMEOUT:
+			if (!(str = str_consume(arg, "--excluded-timeout="))
+				&& !(str = str_consume(arg, "excluded_timeout=")))
+				return -1;
+			
+			excluded_timeout = strtod(str, NULL);
+			
+			return 0;
+			
+		case KEY_COUNT_SYSCALLS:
+			count_syscalls = 1;
+			return 0;
+			
+		case KEY_DIR_CACHE:
+			if (!(str = str_consume(arg, "--dir-cache="))
+				&& !(str = str_consume(arg, "dir_cache=")))
+				return -1;
+			
+			dir_cache_size = strtoul(str, NULL, 10);
+			
+			return 0;
+			
+		case KEY_SOURCE_INDEX:
+			if (!(str = str_consume(arg, "--source-index="))
+				&& !(str = str_consume(arg, "source_index=")))
+				return -1;
+			
+			source_index_size = strtoul(str, NULL, 10);
+			
+			return 0;
+			
+		case KEY_PRESCAN:
+			prescan_force = 1;
+			return 0;
+			
+		case KEY_PRESCAN_FILE:
+			if (!(str = str_consume(arg, "--prescan-file="))
+				&& !(str = str_consume(arg, "prescan_file=")))
+				return -1;
+			
+			// like rule files, as the working directory changes in the background
+			if (str[0] == '/') {
+				prescan_file = strdup(str);
+			} else {
+				char cwd[PATH_MAX];
+				
+				if (!getcwd(cwd, PATH_MAX))
+					return -1;
+				prescan_file = malloc(strlen(cwd) + strlen(str) + 2);
+				if (prescan_file)
+					sprintf(prescan_file, "%s/%s", cwd, str);
+			}
+			if (!prescan_file)
+				return -1;
+			
+			return 0;
+			
+		case KEY_TRACE:
+			if (!(str = str_consume(arg, "--trace="))
+				&& !(str = str_consume(arg, "trace=")))
+				return -1;
+			
+			if (!strcmp(str, "off"))
+				trace = TRACE_OFF;
+			else if (!strcmp(str, "ops"))
+				trace = TRACE_OPS;
+			else if (!strcmp(str, "verdicts"))
+				trace = TRACE_VERDICTS;
+			else if (!strcmp(str, "debug"))
+				trace = TRACE_DEBUG;
+			else {
+				fprintf(stderr, "error: unknown trace level \"%s\".\n", str);
+				return -1;
+			}
+			
+			return 0;
+			
+		case KEY_TRACE_FILE:
+			if (!(str = str_consume(arg, "--trace-file="))
+				&& !(str = str_consume(arg, "trace_file=")))
+				return -1;
+			
+			trace_file = fopen(str, "a");
+			if (!trace_file) {
+				fprintf(stderr, "error: cannot open trace file \"%s\".\n", str);
+				return -1;
+			}
+			
+			return 0;
+			
 		case KEY_HELP:
 			usage(outargs->argv[0]);
-			fuse_opt_add_arg(outargs, "-ho");
+			fuse_opt_add_arg(outargs, "--help");
+			// an empty program name keeps libfuse from printing its own usage line
+			outargs->argv[0][0] = '\0';
 			fuse_main(outargs->argc, outargs->argv, &ffs_oper, NULL);
 			exit(1);
 			
@@ -1116,6 +2489,60 @@ static int ffs_opt_proc(void *data, const char *arg, int key,
 			fuse_main(outargs->argc, outargs->argv, &ffs_oper, NULL);
 			exit(0);
 			
+		case KEY_LOWLEVEL:
+			lowlevel = 1;
+			return 0;
+			
+		case KEY_WATCH_RULES:
+			watch_rules = 1;
+			return 0;
+			
+		case KEY_PRUNE:
+			prune = 1;
+			return 0;
+			
+		case KEY_RELATIVE_RULES:
+			relative_rules = 1;
+			return 0;
+			
+		case KEY_IGNORE_FILE:
+			if (!(str = str_consume(arg, "--ignore-file="))
+				&& !(str = str_consume(arg, "ignore_file=")))
+				return -1;
+			
+			if (!*str || strchr(str, '/')) {
+				ffs_error("the ignore file has to be a file name\n");
+				return -1;
+			}
+			
+			ignore_name = strdup(str);
+			if (!ignore_name)
+				return -1;
+			
+			return 0;
+			
+		case KEY_SAVE_RULES:
+			if (!(str = str_consume(arg, "--save-rules="))
+				&& !(str = str_consume(arg, "save_rules=")))
+				return -1;
+			
+			save_rules = strdup(str);
+			if (!save_rules)
+				return -1;
+			
+			return 0;
+			
+		case KEY_STATS_SOCKET:
+			if (!(str = str_consume(arg, "--stats-socket="))
+				&& !(str = str_consume(arg, "stats_socket=")))
+				return -1;
+			
+			stats_socket = strdup(str);
+			if (!stats_socket)
+				return -1;
+			
+			return 0;
+			
 		case KEY_KEEP_OPT:
 			debug = 1;
 			return 1;
@@ -1124,6 +2551,66 @@ static int ffs_opt_proc(void *data, const char *arg, int key,
 	return 1;
 }
 
+/*
+ * Like fuse_main(), but keeps the instance for reload_rules(). The worker
+ * thread options -o max_idle_threads and -o clone_fd are parsed by libfuse.
+ */
+static int ffs_hl_main(struct fuse_args *args)
+{
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse *fuse;
+	int ret = 1;
+	
+	if (fuse_parse_cmdline(args, &opts) != 0)
+		return 1;
+	
+	if (!opts.mountpoint) {
+		fprintf(stderr, "error: no mountpoint specified.\n");
+		return 1;
+	}
+	
+	fuse = fuse_new(args, &ffs_oper, sizeof(ffs_oper), NULL);
+	if (!fuse)
+		goto out;
+	
+	if (fuse_mount(fuse, opts.mountpoint))
+		goto out_destroy;
+	
+	if (fuse_daemonize(opts.foreground))
+		goto out_unmount;
+	
+	if (fuse_set_signal_handlers(fuse_get_session(fuse)))
+		goto out_unmount;
+	
+	pthread_mutex_lock(&reload_lock);
+	hl_fuse = fuse;
+	pthread_mutex_unlock(&reload_lock);
+	
+	if (opts.singlethread) {
+		ret = fuse_loop(fuse);
+	} else {
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		ret = fuse_loop_mt(fuse, &config);
+	}
+	ret = ret ? 1 : 0;
+	
+	// a reload must not use the instance once it is destroyed
+	pthread_mutex_lock(&reload_lock);
+	hl_fuse = NULL;
+	pthread_mutex_unlock(&reload_lock);
+	fuse_remove_signal_handlers(fuse_get_session(fuse));
+out_unmount:
+	fuse_unmount(fuse);
+out_destroy:
+	fuse_destroy(fuse);
+out:
+	free(opts.mountpoint);
+	
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	unsigned int i;
@@ -1135,36 +2622,65 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 	
+	/* Log to the screen if debug is enabled. */
+	openlog("sparsefs", debug ? LOG_PERROR : 0, LOG_USER);
+	
+	// the rules do not depend on the sources, so none are needed to save them
+	if (save_rules) {
+		struct ruleset *rs = load_rules();
+		
+		if (!rs) {
+			fprintf(stderr, "error: cannot compile the filter rules.\n");
+			return 1;
+		}
+		
+		if (ruleset_save(rs, save_rules)) {
+			fprintf(stderr, "error: cannot write the rules to \"%s\": %s\n",
+				save_rules, strerror(errno));
+			ruleset_free(rs);
+			return 1;
+		}
+		
+		ruleset_free(rs);
+		return 0;
+	}
+	
 	if (n_sources == 0) {
 		fprintf(stderr, "error: no source directory specified.\n");
 		usage(argv[0]);
 		return 1;
 	}
 	
-	/* Log to the screen if debug is enabled. */
-	openlog("sparsefs", debug ? LOG_PERROR : 0, LOG_USER);
-	
 	for (i=0; i < n_sources; i++) {
-		if (sources[i].path[0] != '/') {
+		const char *path = initial_conf->sources[i].path;
+		
+		if (path[0] != '/') {
 			fprintf(stderr, "error: source directory must be an absolute path.\n");
 			usage(argv[0]);
 			return 1;
 		}
 		
 		struct stat st;
-		if (stat(sources[i].path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
 			fprintf(stderr, "error: source directory path does not exist or is not a directory.\n");
 			usage(argv[0]);
 			return 1;
 		}
 		
-		ffs_info("source dir: %s\n", sources[i].path);
+		ffs_info("source dir: %s\n", path);
 	}
 	
 	/* Log startup information */
 	ffs_info("default action: %s\n", default_exclude ? "exclude" : "include");
 	
-	struct rule *curr_rule = chain.head;
+	initial_conf->default_exclude = default_exclude;
+	initial_conf->rules = load_rules();
+	if (!initial_conf->rules) {
+		fprintf(stderr, "error: cannot compile the filter rules.\n");
+		return 1;
+	}
+	
+	const struct rule *curr_rule = ruleset_wildcards(initial_conf->rules);
 	i = 1;
 	while (curr_rule) {
 		ffs_info("filter %d: %s %s\n", i++,
@@ -1173,8 +2689,88 @@ int main(int argc, char *argv[])
 		curr_rule = curr_rule->next;
 	}
 	
+	// from now on, the configuration is only changed by publishing a copy
+	conf_publish(initial_conf);
+	initial_conf = NULL;
+	
+	// the low-level backend keeps the decisions in its inodes
+	if (!lowlevel && cache_size > 0 && cache_timeout > 0) {
+		cache = path_cache_new(cache_size, cache_timeout);
+		if (!cache) {
+			fprintf(stderr, "error: cannot allocate the decision cache.\n");
+			return 1;
+		}
+	}
+	
+	if (source_index_size > 0 && n_sources > SRC_INDEX_MAX_SOURCES) {
+		fprintf(stderr, "error: the source index supports up to %u sources.\n",
+				SRC_INDEX_MAX_SOURCES);
+		return 1;
+	}
+	
+	if (ignore_name) {
+		ignore = ignore_new(ignore_name, cache_timeout, ignore_changed);
+		if (!ignore) {
+			fprintf(stderr, "error: cannot allocate the ignore files.\n");
+			return 1;
+		}
+	}
+	
+	if ((prescan_force || prescan_file) && n_sources > PRESCAN_MAX_SOURCES) {
+		fprintf(stderr, "error: the prescan supports up to %u sources.\n",
+				PRESCAN_MAX_SOURCES);
+		return 1;
+	}
+	
+	if (dir_cache_size > 0) {
+		dir_cache = dir_cache_new(dir_cache_size);
+		if (!dir_cache) {
+			fprintf(stderr, "error: cannot allocate the directory cache.\n");
+			return 1;
+		}
+	}
+	
+	// the signals are handled by signal_thread(), see ffs_init()
+	sigset_t sigset;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
+	sigaddset(&sigset, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	
+	/*
+	 * Without read_buf/write_buf, libfuse falls back to read/write. The
+	 * statistics need read() as libfuse does not tell how much of the file
+	 * that read_buf returns it actually read.
+	 */
+	if (!use_splice || stats_socket)
+		ffs_oper.read_buf = NULL;
+	if (!use_splice)
+		ffs_oper.write_buf = NULL;
+	
+	if (stats_socket) {
+		if (stats_socket[0] != '/') {
+			fprintf(stderr, "error: the statistics socket must be an absolute path.\n");
+			return 1;
+		}
+		
+		if (stats_init(op_names, OP_MAX)) {
+			fprintf(stderr, "error: cannot allocate the statistics.\n");
+			return 1;
+		}
+	}
+	
+	if (trace >= TRACE_OPS && !trace_file)
+		trace_file = stderr;
+	
+	if (trace >= TRACE_OPS || stats_socket)
+		trace_operations();
+	
 	umask(0);
-	int ret = fuse_main(args.argc, args.argv, &ffs_oper, NULL);
+	int ret;
+	if (lowlevel)
+		ret = ffs_ll_main(&args);
+	else
+		ret = ffs_hl_main(&args);
 	
 	return ret;
 }
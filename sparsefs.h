@@ -0,0 +1,202 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Declarations shared by the high-level and the low-level FUSE backend
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef SPARSEFS_H
+#define SPARSEFS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <conf.h>
+#include <dircache.h>
+#include <trace.h>
+
+struct fuse_args;
+struct fuse_conn_info;
+struct fuse_file_info;
+
+// debug messages are written to the trace if it is enabled with "--trace=debug"
+#define ffs_debug(f, ...) do { \
+		if (trace_level >= TRACE_DEBUG) \
+			trace_printf(f, ## __VA_ARGS__); \
+	} while (0)
+
+//#define ENABLE_OUTPUT
+#ifdef ENABLE_OUTPUT
+#define ffs_info(f, ...) syslog(LOG_INFO, f, ## __VA_ARGS__)
+#define ffs_error(f, ...) syslog(LOG_ERR, f, ## __VA_ARGS__)
+#else
+#define ffs_info(f, ...)
+#define ffs_error(f, ...)
+#endif
+
+extern int use_splice;
+extern int readdir_stat;
+extern struct dir_cache *dir_cache;
+
+extern double entry_timeout;
+extern double attr_timeout;
+extern double negative_timeout;
+extern double excluded_timeout;
+
+// see --relative-rules
+extern int relative_rules;
+
+// the sources are part of the configuration, see conf.h
+extern unsigned int n_sources;
+
+/*
+ * State of an open file, stored in fi->fh between open() and release()
+ */
+struct ffs_file {
+	int fd;
+	unsigned int source;
+};
+
+#define FFS_FILE(fi) ((struct ffs_file *) (uintptr_t) (fi)->fh)
+
+/* keeps the file descriptor of the real file open until release() */
+int ffs_file_attach(struct fuse_file_info *fi, int fd, unsigned int source);
+
+// snapshot of an open directory, stored in fi->fh until releasedir()
+#define FFS_DIR(fi) ((struct dir_snapshot *) (uintptr_t) (fi)->fh)
+
+/*
+ * Optional accounting of the syscalls that are issued on behalf of each FUSE
+ * operation, enabled with --count-syscalls. Every operation announces itself
+ * with OP_BEGIN() and every syscall is wrapped with SYSCALL().
+ */
+enum ffs_op {
+	OP_GETATTR,
+	OP_ACCESS,
+	OP_READLINK,
+	OP_OPENDIR,
+	OP_READDIR,
+	OP_RELEASEDIR,
+	OP_MKNOD,
+	OP_MKDIR,
+	OP_SYMLINK,
+	OP_UNLINK,
+	OP_RMDIR,
+	OP_RENAME,
+	OP_LINK,
+	OP_CHMOD,
+	OP_CHOWN,
+	OP_TRUNCATE,
+	OP_UTIMENS,
+	OP_CREATE,
+	OP_OPEN,
+	OP_READ,
+	OP_WRITE,
+	OP_STATFS,
+	OP_FLUSH,
+	OP_RELEASE,
+	OP_FSYNC,
+	OP_SETXATTR,
+	OP_GETXATTR,
+	OP_LISTXATTR,
+	OP_REMOVEXATTR,
+	// only used by the low-level backend
+	OP_LOOKUP,
+	OP_FORGET,
+	OP_SETATTR,
+	OP_MAX
+};
+
+struct op_counter {
+	unsigned long calls;
+	unsigned long syscalls;
+};
+extern struct op_counter op_counters[OP_MAX];
+
+extern int count_syscalls;
+
+// the operation the current FUSE thread is working on
+extern __thread enum ffs_op current_op;
+
+// set by the current operation if the rules excluded its path, see stats.h
+extern __thread int op_excluded;
+
+#define OP_BEGIN(op) do { \
+		if (count_syscalls) { \
+			current_op = (op); \
+			__atomic_fetch_add(&op_counters[op].calls, 1, __ATOMIC_RELAXED); \
+		} \
+	} while (0)
+
+#define SYSCALL(call) (count_syscalls ? \
+	(__atomic_fetch_add(&op_counters[current_op].syscalls, 1, __ATOMIC_RELAXED), (call)) : \
+	(call))
+
+/* returns 1 if the rules exclude the real path, see filter_real_path() for by_rules */
+int exclude_chroot_path(const char *path, int *by_rules);
+
+/* returns 1 if relative rules exclude the FUSE path, see --relative-rules */
+int exclude_fuse_path(const char *path, int *by_rules);
+
+/* reads an ignore file again before its next use if the FUSE path is one */
+void invalidate_ignore_file(const char *fuse_path);
+
+/*
+ * Joins a directory and a name with a '/' unless the directory ends with one
+ * or the name is empty. Like snprintf(), the result is truncated to size and
+ * the length of the complete path is returned.
+ */
+static inline size_t path_join(char *buf, size_t size, const char *dir,
+					size_t dir_len, const char *name)
+{
+	size_t name_len, sep, len;
+
+	name_len = strlen(name);
+	sep = name_len && dir_len && dir[dir_len - 1] != '/';
+	len = dir_len + sep + name_len;
+
+	if (len < size) {
+		memcpy(buf, dir, dir_len);
+		buf[dir_len] = '/';
+		memcpy(buf + dir_len + sep, name, name_len + 1);
+	} else if (size > 0) {
+		snprintf(buf, size, "%.*s%s%s", (int) dir_len, dir, sep ? "/" : "", name);
+	}
+
+	return len;
+}
+
+/* builds the real path of a FUSE path in a source */
+void source_path(char *realpath, size_t realpath_size, unsigned int source,
+					const char *fuse_path);
+
+/*
+ * Opens the directory of the FUSE path in a source for merge_dir(), returns a
+ * file descriptor or a negative errno
+ */
+typedef int (*open_source_dir_t)(unsigned int source, const char *realpath,
+					void *data);
+
+/*
+ * Adds the merged entries of a directory from all sources to the snapshot. If
+ * open_dir is NULL, the directories are opened by their real path.
+ */
+int merge_dir(const char *path, struct dir_snapshot *snap,
+					open_source_dir_t open_dir, void *data);
+
+/* negotiates the capabilities and starts the trace and signal threads */
+void ffs_start(struct fuse_conn_info *conn);
+void ffs_stop(void);
+
+/* runs the low-level backend, see sparsefs_ll.c */
+int ffs_ll_main(struct fuse_args *args);
+
+/* makes the kernel forget the names it cached, e.g., after the rules changed */
+void ffs_ll_invalidate(void);
+
+#endif
@@ -0,0 +1,1679 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Backend for the inode-based low-level API of libfuse 3
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * Every inode the kernel knows about holds an O_PATH descriptor of the file in
+ * the source it was resolved against. Directories hold a descriptor for every
+ * source that contains them, so their entries can be merged and looked up
+ * without building real paths. The rules are evaluated once when the kernel
+ * looks up a name and all further operations work on the descriptors with the
+ * *at() syscalls, so their cost does not depend on the depth of the path.
+ *
+ * As the rules match real paths, every inode also remembers its FUSE path.
+ * It is only used to check the rules for the entries of a directory. The
+ * inodes are kept in a hash table keyed by device and inode number, so a file
+ * reached by different names is the same inode for the kernel.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+// for O_PATH and AT_EMPTY_PATH
+#define _GNU_SOURCE
+
+#define FUSE_USE_VERSION 31
+
+// names that get the excluded timeout until the next change of the rules
+#define LL_EXCLUDED_MAX 65536
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <nameset.h>
+#include <sparsefs.h>
+#include <stats.h>
+
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+
+struct ll_inode {
+	struct ll_inode *next;
+
+	dev_t dev;
+	ino_t ino;
+	uint64_t nlookup;
+
+	unsigned int source;
+	int *fds; /* one per source, -1 if the source does not contain the file */
+
+	char *path;
+	fuse_ino_t parent; /* of the name the inode was looked up by last */
+};
+
+static struct {
+	struct ll_inode **buckets;
+	size_t size; /* power of two */
+	size_t count;
+
+	pthread_mutex_t lock;
+} inodes;
+
+// the root is not in the table and is never forgotten
+static struct ll_inode root;
+
+static struct fuse_session *ll_session;
+
+/*
+ * Names that were answered with an excluded negative entry, as "<parent>/<name>"
+ * with the parent in hex. The kernel has to forget them if the rules change.
+ * Protected by the lock of the inode table.
+ */
+static struct name_set *excluded_names;
+static size_t n_excluded_names;
+
+static struct ll_inode *ll_inode(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &root;
+
+	return (struct ll_inode *) (uintptr_t) ino;
+}
+
+static fuse_ino_t ll_ino(struct ll_inode *inode)
+{
+	if (inode == &root)
+		return FUSE_ROOT_ID;
+
+	return (uintptr_t) inode;
+}
+
+static int ll_fd(struct ll_inode *inode)
+{
+	return inode->fds[inode->source];
+}
+
+/*
+ * O_PATH descriptors cannot be used for I/O, so files are reopened and
+ * syscalls without an *at() variant are called through /proc
+ */
+static void ll_proc_path(char *buf, size_t size, int fd)
+{
+	snprintf(buf, size, "/proc/self/fd/%d", fd);
+}
+
+static size_t ll_bucket(dev_t dev, ino_t ino)
+{
+	uint64_t hash;
+
+	hash = ((uint64_t) ino ^ ((uint64_t) dev << 32)) * 0x9E3779B97F4A7C15ULL;
+
+	return (hash >> 32) & (inodes.size - 1);
+}
+
+/* must be called with the lock held */
+static struct ll_inode *ll_find(dev_t dev, ino_t ino)
+{
+	struct ll_inode *inode;
+
+	for (inode = inodes.buckets[ll_bucket(dev, ino)]; inode; inode = inode->next) {
+		if (inode->dev == dev && inode->ino == ino)
+			return inode;
+	}
+
+	return NULL;
+}
+
+/* must be called with the lock held, keeps the longer chains on error */
+static void ll_grow(void)
+{
+	struct ll_inode **old, *inode, *next;
+	size_t i, slot, old_size;
+
+	old = inodes.buckets;
+	old_size = inodes.size;
+
+	inodes.buckets = calloc(old_size * 2, sizeof(struct ll_inode *));
+	if (!inodes.buckets) {
+		inodes.buckets = old;
+		return;
+	}
+	inodes.size = old_size * 2;
+
+	for (i=0; i < old_size; i++) {
+		for (inode = old[i]; inode; inode = next) {
+			next = inode->next;
+
+			slot = ll_bucket(inode->dev, inode->ino);
+			inode->next = inodes.buckets[slot];
+			inodes.buckets[slot] = inode;
+		}
+	}
+
+	free(old);
+}
+
+static void ll_inode_free(struct ll_inode *inode)
+{
+	unsigned int i;
+
+	for (i=0; i < n_sources; i++) {
+		if (inode->fds[i] >= 0)
+			close(inode->fds[i]);
+	}
+
+	free(inode->fds);
+	free(inode->path);
+	free(inode);
+}
+
+/*
+ * Builds the FUSE path of an entry of a directory, or of the directory itself
+ * if name is NULL. The path of a directory changes if it is renamed, so it is
+ * read with the lock held.
+ */
+static int ll_path(struct ll_inode *dir, const char *name, char *buf, size_t size)
+{
+	size_t len;
+
+	pthread_mutex_lock(&inodes.lock);
+	if (name)
+		len = path_join(buf, size, dir->path, strlen(dir->path), name);
+	else
+		len = snprintf(buf, size, "%s", dir->path);
+	pthread_mutex_unlock(&inodes.lock);
+
+	return len < size ? 0 : ENAMETOOLONG;
+}
+
+/*
+ * Resolves an entry of a directory like resolve_path() in strict mode: the
+ * first source whose rules include the FUSE path and that contains the entry
+ * is used. Returns the source or n_sources if the entry is excluded or does
+ * not exist. If excluded is set, it tells whether the rules of all sources
+ * exclude the path without asking the ignore files, so the verdict cannot
+ * change while the rules stay the same. The statistics count the entry as
+ * excluded if the rules of any source were skipped.
+ */
+static unsigned int ll_resolve(struct ll_inode *dir, const char *name,
+					const char *path, struct stat *st, int *excluded)
+{
+	char realpath[PATH_MAX];
+	int rules_excluded = 1, skipped = 0, by_rules;
+	unsigned int i;
+
+	// relative rules are evaluated once for all sources
+	if (relative_rules && exclude_fuse_path(path, &by_rules)) {
+		i = n_sources;
+		skipped = 1;
+		rules_excluded = by_rules;
+	} else {
+		i = 0;
+	}
+
+	for (; i < n_sources; i++) {
+		if (!relative_rules) {
+			source_path(realpath, PATH_MAX, i, path);
+			if (exclude_chroot_path(realpath, &by_rules)) {
+				skipped = 1;
+				if (!by_rules)
+					rules_excluded = 0;
+				continue;
+			}
+		}
+
+		rules_excluded = 0;
+
+		if (dir->fds[i] < 0)
+			continue;
+
+		if (SYSCALL(fstatat(dir->fds[i], name, st, AT_SYMLINK_NOFOLLOW)) == 0)
+			break;
+	}
+
+	if (trace_level >= TRACE_VERDICTS)
+		trace_verdict(path, i, i == n_sources, 0);
+
+	if (excluded)
+		*excluded = rules_excluded;
+	if (i == n_sources && skipped)
+		op_excluded = 1;
+
+	return i;
+}
+
+/*
+ * Resolves an entry that is about to be created: like ll_resolve() if the
+ * entry exists, otherwise the first source whose rules include the path and
+ * that contains the directory. Returns n_sources if there is none.
+ */
+static unsigned int ll_resolve_new(struct ll_inode *dir, const char *name,
+					const char *path, struct stat *st)
+{
+	char realpath[PATH_MAX];
+	unsigned int i;
+
+	i = ll_resolve(dir, name, path, st, NULL);
+	if (i < n_sources)
+		return i;
+
+	if (relative_rules && exclude_fuse_path(path, NULL))
+		return n_sources;
+
+	for (i=0; i < n_sources; i++) {
+		if (dir->fds[i] < 0)
+			continue;
+
+		if (!relative_rules) {
+			source_path(realpath, PATH_MAX, i, path);
+			if (exclude_chroot_path(realpath, NULL))
+				continue;
+		}
+
+		break;
+	}
+
+	// the name is not excluded if it can be created
+	if (i < n_sources)
+		op_excluded = 0;
+
+	return i;
+}
+
+/*
+ * Creates the inode of an entry that was resolved against source. If another
+ * thread created the same inode in the meantime, its inode is returned.
+ */
+static struct ll_inode *ll_inode_new(struct ll_inode *dir, const char *name,
+					const char *path, unsigned int source, const struct stat *st)
+{
+	struct ll_inode *inode, *other;
+	unsigned int i;
+	size_t slot;
+	int err;
+
+	inode = calloc(1, sizeof(struct ll_inode));
+	if (!inode)
+		return NULL;
+
+	inode->fds = malloc(sizeof(int) * n_sources);
+	inode->path = strdup(path);
+	if (!inode->fds || !inode->path) {
+		free(inode->fds);
+		free(inode->path);
+		free(inode);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	inode->dev = st->st_dev;
+	inode->ino = st->st_ino;
+	inode->nlookup = 1;
+	inode->source = source;
+	inode->parent = ll_ino(dir);
+
+	for (i=0; i < n_sources; i++)
+		inode->fds[i] = -1;
+
+	/*
+	 * The entries of a directory are merged from all sources that contain
+	 * it, even from sources whose rules exclude the directory itself.
+	 */
+	for (i=0; i < n_sources; i++) {
+		if (dir->fds[i] < 0 || (i != source && !S_ISDIR(st->st_mode)))
+			continue;
+
+		inode->fds[i] = SYSCALL(openat(dir->fds[i], name, O_PATH | O_NOFOLLOW |
+						(i != source ? O_DIRECTORY : 0)));
+		if (i == source && inode->fds[i] == -1) {
+			err = errno;
+			ll_inode_free(inode);
+			errno = err;
+			return NULL;
+		}
+	}
+
+	pthread_mutex_lock(&inodes.lock);
+	other = ll_find(inode->dev, inode->ino);
+	if (other) {
+		other->nlookup++;
+		other->parent = ll_ino(dir);
+	} else {
+		if (inodes.count >= inodes.size)
+			ll_grow();
+
+		slot = ll_bucket(inode->dev, inode->ino);
+		inode->next = inodes.buckets[slot];
+		inodes.buckets[slot] = inode;
+		inodes.count++;
+	}
+	pthread_mutex_unlock(&inodes.lock);
+
+	if (other) {
+		ll_inode_free(inode);
+		return other;
+	}
+
+	return inode;
+}
+
+/*
+ * Looks up an entry of a directory and increases the lookup count of its
+ * inode. Returns 0 or an errno, see ll_resolve() for excluded.
+ */
+static int ll_lookup_entry(struct ll_inode *dir, const char *name,
+					struct fuse_entry_param *e, int *excluded)
+{
+	char path[PATH_MAX];
+	struct ll_inode *inode;
+	unsigned int source;
+	int r;
+
+	r = ll_path(dir, name, path, PATH_MAX);
+	if (r)
+		return r;
+
+	memset(e, 0, sizeof(struct fuse_entry_param));
+
+	source = ll_resolve(dir, name, path, &e->attr, excluded);
+
+	ffs_debug("lookup: path %s, source %u\n", path, source);
+
+	if (source == n_sources)
+		return ENOENT;
+
+	pthread_mutex_lock(&inodes.lock);
+	inode = ll_find(e->attr.st_dev, e->attr.st_ino);
+	if (inode) {
+		inode->nlookup++;
+		inode->parent = ll_ino(dir);
+	}
+	pthread_mutex_unlock(&inodes.lock);
+
+	if (!inode) {
+		inode = ll_inode_new(dir, name, path, source, &e->attr);
+		if (!inode)
+			return errno;
+	}
+
+	e->ino = ll_ino(inode);
+	e->attr_timeout = attr_timeout;
+	e->entry_timeout = entry_timeout;
+
+	return 0;
+}
+
+static void ll_forget_one(fuse_ino_t ino, uint64_t nlookup)
+{
+	struct ll_inode *inode = ll_inode(ino);
+	struct ll_inode **p;
+
+	if (inode == &root)
+		return;
+
+	pthread_mutex_lock(&inodes.lock);
+	inode->nlookup -= nlookup;
+	if (inode->nlookup == 0) {
+		p = &inodes.buckets[ll_bucket(inode->dev, inode->ino)];
+		while (*p != inode)
+			p = &(*p)->next;
+		*p = inode->next;
+		inodes.count--;
+	} else {
+		inode = NULL;
+	}
+	pthread_mutex_unlock(&inodes.lock);
+
+	if (inode)
+		ll_inode_free(inode);
+}
+
+/*
+ * Updates the paths of a renamed file and of all inodes below it. This is the
+ * counterpart of invalidate_all() in the high-level backend.
+ */
+static void ll_rename_paths(const char *from, const char *to, fuse_ino_t newparent)
+{
+	struct ll_inode *inode;
+	size_t i, len;
+	char *path;
+
+	len = strlen(from);
+
+	pthread_mutex_lock(&inodes.lock);
+	for (i=0; i < inodes.size; i++) {
+		for (inode = inodes.buckets[i]; inode; inode = inode->next) {
+			if (strncmp(inode->path, from, len) ||
+				(inode->path[len] != '\0' && inode->path[len] != '/'))
+				continue;
+
+			path = malloc(strlen(to) + strlen(&inode->path[len]) + 1);
+			if (!path)
+				continue;
+
+			sprintf(path, "%s%s", to, &inode->path[len]);
+			free(inode->path);
+			inode->path = path;
+
+			if (inode->path[strlen(to)] == '\0')
+				inode->parent = newparent;
+		}
+	}
+	pthread_mutex_unlock(&inodes.lock);
+}
+
+/* the result of the current operation for the statistics, see COUNTED() */
+static __thread int op_error;
+static __thread uint64_t op_bytes;
+
+static void ll_reply_err(fuse_req_t req, int err)
+{
+	op_error = err;
+	fuse_reply_err(req, err);
+}
+
+static void ll_reply_attr(fuse_req_t req, int fd)
+{
+	struct stat st;
+
+	if (SYSCALL(fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) == -1)
+		ll_reply_err(req, errno);
+	else
+		fuse_reply_attr(req, &st, attr_timeout);
+}
+
+static void ll_reply_entry(fuse_req_t req, struct ll_inode *dir, const char *name)
+{
+	struct fuse_entry_param e;
+	int r;
+
+	r = ll_lookup_entry(dir, name, &e, NULL);
+	if (r)
+		ll_reply_err(req, r);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+/*
+ * Remembers a name that is answered with the excluded timeout. Returns -1 if
+ * the name cannot be remembered, e.g. because LL_EXCLUDED_MAX names are
+ * remembered already, so the kernel could not be told to forget it.
+ */
+static int ll_remember_excluded(fuse_ino_t parent, const char *name)
+{
+	char key[NAME_MAX + 32];
+	int r = -1;
+
+	snprintf(key, sizeof(key), "%llx/%s", (unsigned long long) parent, name);
+
+	pthread_mutex_lock(&inodes.lock);
+	if (!excluded_names)
+		excluded_names = name_set_new();
+	if (excluded_names) {
+		if (n_excluded_names < LL_EXCLUDED_MAX)
+			r = name_set_add(excluded_names, key);
+		else if (name_set_contains(excluded_names, key))
+			r = 0;
+
+		if (r == 1)
+			n_excluded_names++;
+	}
+	pthread_mutex_unlock(&inodes.lock);
+
+	return r < 0 ? -1 : 0;
+}
+
+struct ll_inval {
+	fuse_ino_t parent;
+	char *name;
+};
+
+struct ll_inval_list {
+	struct ll_inval *entries;
+	size_t count;
+	size_t size;
+};
+
+static void ll_inval_add(struct ll_inval_list *list, fuse_ino_t parent, const char *name)
+{
+	struct ll_inval *entries;
+
+	if (list->count == list->size) {
+		list->size = list->size ? list->size * 2 : 64;
+		entries = realloc(list->entries, list->size * sizeof(struct ll_inval));
+		if (!entries) {
+			list->size = list->count;
+			return;
+		}
+		list->entries = entries;
+	}
+
+	list->entries[list->count].parent = parent;
+	list->entries[list->count].name = strdup(name);
+	if (list->entries[list->count].name)
+		list->count++;
+}
+
+static void ll_inval_add_excluded(const char *key, void *data)
+{
+	char *name;
+	fuse_ino_t parent;
+
+	parent = strtoull(key, &name, 16);
+	ll_inval_add(data, parent, name + 1);
+}
+
+/*
+ * Makes the kernel forget all names it looked up, so they are looked up again
+ * with the current rules. Entries that are in use stay valid in the kernel
+ * until they are closed, but they are looked up again by the next open.
+ */
+void ffs_ll_invalidate(void)
+{
+	struct ll_inval_list list = { NULL, 0, 0 };
+	struct name_set *excluded;
+	struct ll_inode *inode;
+	size_t i;
+
+	if (!ll_session)
+		return;
+
+	pthread_mutex_lock(&inodes.lock);
+	for (i=0; i < inodes.size; i++) {
+		for (inode = inodes.buckets[i]; inode; inode = inode->next)
+			ll_inval_add(&list, inode->parent, strrchr(inode->path, '/') + 1);
+	}
+
+	excluded = excluded_names;
+	excluded_names = NULL;
+	n_excluded_names = 0;
+	pthread_mutex_unlock(&inodes.lock);
+
+	if (excluded) {
+		name_set_foreach(excluded, ll_inval_add_excluded, &list);
+		name_set_free(excluded);
+	}
+
+	/*
+	 * The kernel may send requests while it processes the notifications,
+	 * so they are sent without holding the lock. Notifications for inodes
+	 * that were forgotten in the meantime just fail.
+	 */
+	for (i=0; i < list.count; i++) {
+		fuse_lowlevel_notify_inval_entry(ll_session, list.entries[i].parent,
+					list.entries[i].name, strlen(list.entries[i].name));
+		free(list.entries[i].name);
+	}
+	free(list.entries);
+
+	// cached listings of the root directory
+	fuse_lowlevel_notify_inval_inode(ll_session, FUSE_ROOT_ID, 0, 0);
+}
+
+/*
+ * FUSE callback operations
+ */
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	ffs_start(conn);
+}
+
+static void ll_destroy(void *userdata)
+{
+	ffs_stop();
+}
+
+/*
+ * Missing names are answered with a negative entry that the kernel caches for
+ * negative_timeout seconds. Names that are excluded by the rules of all
+ * sources stay excluded, so they are cached for excluded_timeout seconds.
+ * This does not apply to names that an ignore file excludes, as the file may
+ * change at any time.
+ * This saves a request for every repeated probe of names like ".git". If
+ * the name cannot be remembered for a change of the rules, the negative
+ * timeout is used instead.
+ */
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e;
+	double timeout;
+	int r, excluded;
+
+	OP_BEGIN(OP_LOOKUP);
+
+	r = ll_lookup_entry(ll_inode(parent), name, &e, &excluded);
+	if (r == ENOENT) {
+		if (excluded && excluded_timeout > 0 && ll_remember_excluded(parent, name))
+			excluded = 0;
+
+		timeout = excluded ? excluded_timeout : negative_timeout;
+		if (timeout > 0) {
+			memset(&e, 0, sizeof(e));
+			e.entry_timeout = timeout;
+			fuse_reply_entry(req, &e);
+			op_error = ENOENT;
+			return;
+		}
+	}
+
+	if (r)
+		ll_reply_err(req, r);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	OP_BEGIN(OP_FORGET);
+
+	ll_forget_one(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count,
+				struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	OP_BEGIN(OP_FORGET);
+
+	for (i=0; i < count; i++)
+		ll_forget_one(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	OP_BEGIN(OP_GETATTR);
+
+	ll_reply_attr(req, fi ? FFS_FILE(fi)->fd : ll_fd(ll_inode(ino)));
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+				int to_set, struct fuse_file_info *fi)
+{
+	struct ll_inode *inode = ll_inode(ino);
+	char procpath[64];
+	struct timespec ts[2];
+	uid_t uid;
+	gid_t gid;
+	int fd, res;
+
+	OP_BEGIN(OP_SETATTR);
+
+	fd = ll_fd(inode);
+	ll_proc_path(procpath, sizeof(procpath), fd);
+
+	res = 0;
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		if (fi)
+			res = SYSCALL(fchmod(FFS_FILE(fi)->fd, attr->st_mode));
+		else
+			res = SYSCALL(chmod(procpath, attr->st_mode));
+		if (res == -1)
+			goto out;
+	}
+
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid = to_set & FUSE_SET_ATTR_UID ? attr->st_uid : (uid_t) -1;
+		gid = to_set & FUSE_SET_ATTR_GID ? attr->st_gid : (gid_t) -1;
+
+		res = SYSCALL(fchownat(fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW));
+		if (res == -1)
+			goto out;
+	}
+
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if (fi)
+			res = SYSCALL(ftruncate(FFS_FILE(fi)->fd, attr->st_size));
+		else
+			res = SYSCALL(truncate(procpath, attr->st_size));
+		if (res == -1)
+			goto out;
+	}
+
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		ts[0].tv_sec = ts[1].tv_sec = 0;
+		ts[0].tv_nsec = ts[1].tv_nsec = UTIME_OMIT;
+
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			ts[0].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_ATIME)
+			ts[0] = attr->st_atim;
+
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			ts[1].tv_nsec = UTIME_NOW;
+		else if (to_set & FUSE_SET_ATTR_MTIME)
+			ts[1] = attr->st_mtim;
+
+		if (fi)
+			res = SYSCALL(futimens(FFS_FILE(fi)->fd, ts));
+		else
+			res = SYSCALL(utimensat(AT_FDCWD, procpath, ts, 0));
+	}
+
+out:
+	if (res == -1)
+		ll_reply_err(req, errno);
+	else
+		ll_reply_attr(req, fd);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	char procpath[64];
+
+	OP_BEGIN(OP_ACCESS);
+
+	ll_proc_path(procpath, sizeof(procpath), ll_fd(ll_inode(ino)));
+
+	if (SYSCALL(access(procpath, mask)) == -1)
+		ll_reply_err(req, errno);
+	else
+		ll_reply_err(req, 0);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char buf[PATH_MAX];
+	int res;
+
+	OP_BEGIN(OP_READLINK);
+
+	res = SYSCALL(readlinkat(ll_fd(ll_inode(ino)), "", buf, sizeof(buf) - 1));
+	if (res == -1) {
+		ll_reply_err(req, errno);
+		return;
+	}
+
+	buf[res] = '\0';
+	fuse_reply_readlink(req, buf);
+}
+
+/*
+ * Creates a directory, a node or a symlink if link is set, see
+ * ll_resolve_new() for the source
+ */
+static void ll_make(fuse_req_t req, fuse_ino_t parent, const char *name,
+				mode_t mode, dev_t rdev, const char *link)
+{
+	struct ll_inode *dir = ll_inode(parent);
+	char path[PATH_MAX];
+	struct stat st;
+	unsigned int source;
+	int fd, res;
+
+	res = ll_path(dir, name, path, PATH_MAX);
+	if (res) {
+		ll_reply_err(req, res);
+		return;
+	}
+
+	source = ll_resolve_new(dir, name, path, &st);
+	if (source == n_sources) {
+		ll_reply_err(req, ENOENT);
+		return;
+	}
+
+	fd = dir->fds[source];
+	if (link)
+		res = SYSCALL(symlinkat(link, fd, name));
+	else if (S_ISDIR(mode))
+		res = SYSCALL(mkdirat(fd, name, mode));
+	else
+		res = SYSCALL(mknodat(fd, name, mode, rdev));
+	if (res == -1) {
+		ll_reply_err(req, errno);
+		return;
+	}
+
+	invalidate_ignore_file(path);
+
+	ll_reply_entry(req, dir, name);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+				mode_t mode, dev_t rdev)
+{
+	OP_BEGIN(OP_MKNOD);
+
+	ll_make(req, parent, name, mode, rdev, NULL);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+				mode_t mode)
+{
+	OP_BEGIN(OP_MKDIR);
+
+	ll_make(req, parent, name, S_IFDIR | mode, 0, NULL);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+				const char *name)
+{
+	OP_BEGIN(OP_SYMLINK);
+
+	ll_make(req, parent, name, S_IFLNK, 0, link);
+}
+
+static void ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name,
+				int flags)
+{
+	struct ll_inode *dir = ll_inode(parent);
+	char path[PATH_MAX];
+	struct stat st;
+	unsigned int source;
+	int res;
+
+	res = ll_path(dir, name, path, PATH_MAX);
+	if (res) {
+		ll_reply_err(req, res);
+		return;
+	}
+
+	source = ll_resolve(dir, name, path, &st, NULL);
+	if (source == n_sources) {
+		ll_reply_err(req, ENOENT);
+		return;
+	}
+
+	if (SYSCALL(unlinkat(dir->fds[source], name, flags)) == -1) {
+		ll_reply_err(req, errno);
+		return;
+	}
+
+	invalidate_ignore_file(path);
+	ll_reply_err(req, 0);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	OP_BEGIN(OP_UNLINK);
+
+	ll_remove(req, parent, name, 0);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	OP_BEGIN(OP_RMDIR);
+
+	ll_remove(req, parent, name, AT_REMOVEDIR);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+				fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	struct ll_inode *dir = ll_inode(parent);
+	struct ll_inode *newdir = ll_inode(newparent);
+	char from[PATH_MAX], to[PATH_MAX];
+	struct stat st;
+	unsigned int sfrom, sto;
+	int res;
+
+	OP_BEGIN(OP_RENAME);
+
+	// RENAME_EXCHANGE and RENAME_NOREPLACE are not supported
+	if (flags) {
+		ll_reply_err(req, EINVAL);
+		return;
+	}
+
+	res = ll_path(dir, name, from, PATH_MAX);
+	if (!res)
+		res = ll_path(newdir, newname, to, PATH_MAX);
+	if (res) {
+		ll_reply_err(req, res);
+		return;
+	}
+
+	sfrom = ll_resolve(dir, name, from, &st, NULL);
+	sto = ll_resolve_new(newdir, newname, to, &st);
+	if (sfrom == n_sources || sto == n_sources) {
+		ll_reply_err(req, ENOENT);
+		return;
+	}
+
+	res = SYSCALL(renameat(dir->fds[sfrom], name, newdir->fds[sto], newname));
+	if (res == -1) {
+		ll_reply_err(req, errno);
+		return;
+	}
+
+	invalidate_ignore_file(from);
+	invalidate_ignore_file(to);
+	ll_rename_paths(from, to, newparent);
+	ll_reply_err(req, 0);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+				const char *newname)
+{
+	struct ll_inode *newdir = ll_inode(newparent);
+	char procpath[64];
+	char path[PATH_MAX];
+	struct stat st;
+	unsigned int source;
+	int res;
+
+	OP_BEGIN(OP_LINK);
+
+	res = ll_path(newdir, newname, path, PATH_MAX);
+	if (res) {
+		ll_reply_err(req, res);
+		return;
+	}
+
+	source = ll_resolve_new(newdir, newname, path, &st);
+	if (source == n_sources) {
+		ll_reply_err(req, ENOENT);
+		return;
+	}
+
+	ll_proc_path(procpath, sizeof(procpath), ll_fd(ll_inode(ino)));
+	res = SYSCALL(linkat(AT_FDCWD, procpath, newdir->fds[source], newname,
+				AT_SYMLINK_FOLLOW));
+	if (res == -1) {
+		ll_reply_err(req, errno);
+		return;
+	}
+
+	invalidate_ignore_file(path);
+
+	ll_reply_entry(req, newdir, newname);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct ll_inode *inode = ll_inode(ino);
+	char procpath[64];
+	int fd, res;
+
+	OP_BEGIN(OP_OPEN);
+
+	ll_proc_path(procpath, sizeof(procpath), ll_fd(inode));
+
+	fd = SYSCALL(open(procpath, fi->flags & ~O_NOFOLLOW));
+	if (fd == -1) {
+		ll_reply_err(req, errno);
+		return;
+	}
+
+	res = ffs_file_attach(fi, fd, inode->source);
+	if (res)
+		ll_reply_err(req, -res);
+	else
+		fuse_reply_open(req, fi);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+				mode_t mode, struct fuse_file_info *fi)
+{
+	struct ll_inode *dir = ll_inode(parent);
+	struct fuse_entry_param e;
+	char path[PATH_MAX];
+	struct stat st;
+	unsigned int source;
+	int fd, res;
+
+	OP_BEGIN(OP_CREATE);
+
+	res = ll_path(dir, name, path, PATH_MAX);
+	if (res) {
+		ll_reply_err(req, res);
+		return;
+	}
+
+	source = ll_resolve_new(dir, name, path, &st);
+	if (source == n_sources) {
+		ll_reply_err(req, ENOENT);
+		return;
+	}
+
+	fd = SYSCALL(openat(dir->fds[source], name, (fi->flags | O_CREAT) & ~O_NOFOLLOW,
+				mode));
+	if (fd == -1) {
+		ll_reply_err(req, errno);
+		return;
+	}
+
+	invalidate_ignore_file(path);
+
+	res = ll_lookup_entry(dir, name, &e, NULL);
+	if (res) {
+		SYSCALL(close(fd));
+		ll_reply_err(req, res);
+		return;
+	}
+
+	res = ffs_file_attach(fi, fd, source);
+	if (res) {
+		ll_forget_one(e.ino, 1);
+		ll_reply_err(req, -res);
+		return;
+	}
+
+	fuse_reply_create(req, &e, fi);
+}
+
+/*
+ * Passes a reference to the real file to libfuse, which splices the data
+ * directly into /dev/fuse. libfuse then replies read errors on its own and
+ * does not tell how much it read, so the data is read here instead if the
+ * statistics count it or if splicing is disabled, where libfuse would copy
+ * it anyway.
+ */
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+				struct fuse_file_info *fi)
+{
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+	ssize_t res;
+	char *data;
+
+	OP_BEGIN(OP_READ);
+
+	if (use_splice && !stats_enabled) {
+		buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		buf.buf[0].fd = FFS_FILE(fi)->fd;
+		buf.buf[0].pos = offset;
+
+		SYSCALL(fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE));
+		return;
+	}
+
+	data = malloc(size);
+	if (!data) {
+		ll_reply_err(req, ENOMEM);
+		return;
+	}
+
+	res = SYSCALL(pread(FFS_FILE(fi)->fd, data, size, offset));
+	if (res == -1) {
+		ll_reply_err(req, errno);
+	} else if (fuse_reply_buf(req, data, res) < 0) {
+		if (stats_enabled)
+			stats_record_send_failure(OP_READ);
+	} else {
+		op_bytes = res;
+	}
+
+	free(data);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf,
+				off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	ssize_t res;
+
+	OP_BEGIN(OP_WRITE);
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = FFS_FILE(fi)->fd;
+	dst.buf[0].pos = offset;
+
+	res = SYSCALL(fuse_buf_copy(&dst, buf, use_splice ? FUSE_BUF_SPLICE_NONBLOCK :
+				FUSE_BUF_NO_SPLICE));
+	if (res < 0) {
+		ll_reply_err(req, -res);
+	} else {
+		fuse_reply_write(req, res);
+		op_bytes = res;
+	}
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int fd;
+
+	OP_BEGIN(OP_FLUSH);
+
+	// see ffs_flush()
+	fd = SYSCALL(dup(FFS_FILE(fi)->fd));
+	if (fd == -1 || SYSCALL(close(fd)) == -1)
+		ll_reply_err(req, errno);
+	else
+		ll_reply_err(req, 0);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct ffs_file *file = FFS_FILE(fi);
+
+	OP_BEGIN(OP_RELEASE);
+
+	SYSCALL(close(file->fd));
+	free(file);
+
+	ll_reply_err(req, 0);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+				struct fuse_file_info *fi)
+{
+	int res;
+
+	OP_BEGIN(OP_FSYNC);
+
+	if (datasync)
+		res = SYSCALL(fdatasync(FFS_FILE(fi)->fd));
+	else
+		res = SYSCALL(fsync(FFS_FILE(fi)->fd));
+
+	ll_reply_err(req, res == -1 ? errno : 0);
+}
+
+static int ll_open_source_dir(unsigned int source, const char *realpath,
+				void *data)
+{
+	struct ll_inode *dir = data;
+	int fd;
+
+	if (dir->fds[source] < 0)
+		return -ENOENT;
+
+	fd = SYSCALL(openat(dir->fds[source], ".", O_RDONLY | O_DIRECTORY));
+
+	return fd == -1 ? -errno : fd;
+}
+
+/*
+ * Builds a snapshot of the merged directory, see ffs_opendir()
+ */
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct ll_inode *dir = ll_inode(ino);
+	char path[PATH_MAX];
+	struct timespec *mtimes;
+	struct dir_snapshot *snap;
+	struct stat st;
+	unsigned int i, n_mtimes;
+	int r;
+
+	OP_BEGIN(OP_OPENDIR);
+
+	r = ll_path(dir, NULL, path, PATH_MAX);
+	if (r) {
+		ll_reply_err(req, r);
+		return;
+	}
+
+	ffs_debug("opendir: path %s\n", path);
+
+	mtimes = malloc(sizeof(struct timespec) * n_sources);
+	if (!mtimes) {
+		ll_reply_err(req, ENOMEM);
+		return;
+	}
+
+	n_mtimes = 0;
+	if (dir_cache && !readdir_stat) {
+		for (i=0; i < n_sources; i++) {
+			if (dir->fds[i] >= 0 && SYSCALL(fstatat(dir->fds[i], "", &st,
+									AT_EMPTY_PATH)) == 0)
+			{
+				mtimes[i] = st.st_mtim;
+			} else {
+				mtimes[i].tv_sec = -1;
+				mtimes[i].tv_nsec = 0;
+			}
+		}
+		n_mtimes = n_sources;
+
+		snap = dir_cache_lookup(dir_cache, path, mtimes, n_mtimes);
+		if (snap) {
+			free(mtimes);
+			fi->fh = (uintptr_t) snap;
+			fuse_reply_open(req, fi);
+			return;
+		}
+	}
+
+	snap = dir_snapshot_new(path, mtimes, n_mtimes, readdir_stat);
+	free(mtimes);
+	if (!snap) {
+		ll_reply_err(req, ENOMEM);
+		return;
+	}
+
+	r = merge_dir(path, snap, ll_open_source_dir, dir);
+	if (r) {
+		dir_snapshot_unref(snap);
+		ll_reply_err(req, -r);
+		return;
+	}
+
+	if (n_mtimes > 0)
+		dir_cache_insert(dir_cache, snap);
+
+	fi->fh = (uintptr_t) snap;
+	fuse_reply_open(req, fi);
+}
+
+/*
+ * Returns the entries of the snapshot starting at offset. With plus, every
+ * entry except "." and ".." is looked up so the kernel can create its inode
+ * right away.
+ */
+static void ll_readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
+				off_t offset, struct fuse_file_info *fi, int plus)
+{
+	struct dir_snapshot *snap = FFS_DIR(fi);
+	struct fuse_entry_param e;
+	struct stat st;
+	const char *name;
+	size_t i, count, pos, len;
+	char *buf;
+
+	buf = malloc(size);
+	if (!buf) {
+		ll_reply_err(req, ENOMEM);
+		return;
+	}
+
+	pos = 0;
+	count = dir_snapshot_count(snap);
+	for (i = offset; i < count; i++) {
+		name = dir_snapshot_entry(snap, i, &st);
+
+		if (!plus) {
+			len = fuse_add_direntry(req, buf + pos, size - pos, name, &st, i + 1);
+			if (len > size - pos)
+				break;
+
+			pos += len;
+			continue;
+		}
+
+		if (!strcmp(name, ".") || !strcmp(name, "..")) {
+			memset(&e, 0, sizeof(e));
+			e.attr.st_ino = st.st_ino;
+			e.attr.st_mode = st.st_mode;
+		} else if (ll_lookup_entry(ll_inode(ino), name, &e, NULL)) {
+			// the entry was removed in the meantime
+			continue;
+		}
+
+		len = fuse_add_direntry_plus(req, buf + pos, size - pos, name, &e, i + 1);
+		if (len > size - pos) {
+			if (e.ino)
+				ll_forget_one(e.ino, 1);
+			break;
+		}
+
+		pos += len;
+	}
+
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+				off_t offset, struct fuse_file_info *fi)
+{
+	OP_BEGIN(OP_READDIR);
+
+	ll_readdir_common(req, ino, size, offset, fi, 0);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+				off_t offset, struct fuse_file_info *fi)
+{
+	OP_BEGIN(OP_READDIR);
+
+	ll_readdir_common(req, ino, size, offset, fi, 1);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	OP_BEGIN(OP_RELEASEDIR);
+
+	dir_snapshot_unref(FFS_DIR(fi));
+	ll_reply_err(req, 0);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs stbuf;
+
+	OP_BEGIN(OP_STATFS);
+
+	if (SYSCALL(fstatvfs(ll_fd(ll_inode(ino)), &stbuf)) == -1)
+		ll_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &stbuf);
+}
+
+#ifdef HAVE_SETXATTR
+
+/* xattr operations are optional */
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+				const char *value, size_t size, int flags)
+{
+	char procpath[64];
+
+	OP_BEGIN(OP_SETXATTR);
+
+	ll_proc_path(procpath, sizeof(procpath), ll_fd(ll_inode(ino)));
+
+	if (SYSCALL(setxattr(procpath, name, value, size, flags)) == -1)
+		ll_reply_err(req, errno);
+	else
+		ll_reply_err(req, 0);
+}
+
+/*
+ * Without a buffer, the kernel only asks for the size of the value or list
+ */
+static void ll_reply_xattr(fuse_req_t req, char *buf, size_t size, ssize_t res)
+{
+	if (res == -1)
+		ll_reply_err(req, errno);
+	else if (size == 0)
+		fuse_reply_xattr(req, res);
+	else
+		fuse_reply_buf(req, buf, res);
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+				size_t size)
+{
+	char procpath[64];
+	char *buf = NULL;
+
+	OP_BEGIN(OP_GETXATTR);
+
+	ll_proc_path(procpath, sizeof(procpath), ll_fd(ll_inode(ino)));
+
+	if (size && !(buf = malloc(size))) {
+		ll_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ll_reply_xattr(req, buf, size, SYSCALL(getxattr(procpath, name, buf, size)));
+	free(buf);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	char procpath[64];
+	char *buf = NULL;
+
+	OP_BEGIN(OP_LISTXATTR);
+
+	ll_proc_path(procpath, sizeof(procpath), ll_fd(ll_inode(ino)));
+
+	if (size && !(buf = malloc(size))) {
+		ll_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ll_reply_xattr(req, buf, size, SYSCALL(listxattr(procpath, buf, size)));
+	free(buf);
+}
+
+static void ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+	char procpath[64];
+
+	OP_BEGIN(OP_REMOVEXATTR);
+
+	ll_proc_path(procpath, sizeof(procpath), ll_fd(ll_inode(ino)));
+
+	if (SYSCALL(removexattr(procpath, name)) == -1)
+		ll_reply_err(req, errno);
+	else
+		ll_reply_err(req, 0);
+}
+
+#endif /* HAVE_SETXATTR */
+
+static const struct fuse_lowlevel_ops ll_oper = {
+	.init         = ll_init,
+	.destroy      = ll_destroy,
+	.lookup       = ll_lookup,
+	.forget       = ll_forget,
+	.forget_multi = ll_forget_multi,
+	.getattr      = ll_getattr,
+	.setattr      = ll_setattr,
+	.access       = ll_access,
+	.readlink     = ll_readlink,
+	.mknod        = ll_mknod,
+	.mkdir        = ll_mkdir,
+	.symlink      = ll_symlink,
+	.unlink       = ll_unlink,
+	.rmdir        = ll_rmdir,
+	.rename       = ll_rename,
+	.link         = ll_link,
+	.open         = ll_open,
+	.create       = ll_create,
+	.read         = ll_read,
+	.write_buf    = ll_write_buf,
+	.flush        = ll_flush,
+	.release      = ll_release,
+	.fsync        = ll_fsync,
+	.opendir      = ll_opendir,
+	.readdir      = ll_readdir,
+	.readdirplus  = ll_readdirplus,
+	.releasedir   = ll_releasedir,
+	.statfs       = ll_statfs,
+#ifdef HAVE_SETXATTR
+	.setxattr     = ll_setxattr,
+	.getxattr     = ll_getxattr,
+	.listxattr    = ll_listxattr,
+	.removexattr  = ll_removexattr,
+#endif
+};
+
+/*
+ * Wrappers that record the statistics of the operations. They are only used
+ * in ll_counted_oper if the statistics are enabled.
+ */
+#define COUNTED(name, op, params, args) \
+	static void counted_##name params \
+	{ \
+		uint64_t start = trace_now(); \
+		op_error = 0; \
+		op_bytes = 0; \
+		op_excluded = 0; \
+		ll_##name args; \
+		stats_record(op, start, op_error, op_excluded, op_bytes); \
+	}
+
+COUNTED(lookup, OP_LOOKUP, (fuse_req_t req, fuse_ino_t parent, const char *name),
+	(req, parent, name))
+COUNTED(forget, OP_FORGET, (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup),
+	(req, ino, nlookup))
+COUNTED(forget_multi, OP_FORGET, (fuse_req_t req, size_t count,
+	struct fuse_forget_data *forgets), (req, count, forgets))
+COUNTED(getattr, OP_GETATTR, (fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info *fi), (req, ino, fi))
+COUNTED(setattr, OP_SETATTR, (fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+	int to_set, struct fuse_file_info *fi), (req, ino, attr, to_set, fi))
+COUNTED(access, OP_ACCESS, (fuse_req_t req, fuse_ino_t ino, int mask),
+	(req, ino, mask))
+COUNTED(readlink, OP_READLINK, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+COUNTED(mknod, OP_MKNOD, (fuse_req_t req, fuse_ino_t parent, const char *name,
+	mode_t mode, dev_t rdev), (req, parent, name, mode, rdev))
+COUNTED(mkdir, OP_MKDIR, (fuse_req_t req, fuse_ino_t parent, const char *name,
+	mode_t mode), (req, parent, name, mode))
+COUNTED(symlink, OP_SYMLINK, (fuse_req_t req, const char *link, fuse_ino_t parent,
+	const char *name), (req, link, parent, name))
+COUNTED(unlink, OP_UNLINK, (fuse_req_t req, fuse_ino_t parent, const char *name),
+	(req, parent, name))
+COUNTED(rmdir, OP_RMDIR, (fuse_req_t req, fuse_ino_t parent, const char *name),
+	(req, parent, name))
+COUNTED(rename, OP_RENAME, (fuse_req_t req, fuse_ino_t parent, const char *name,
+	fuse_ino_t newparent, const char *newname, unsigned int flags),
+	(req, parent, name, newparent, newname, flags))
+COUNTED(link, OP_LINK, (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+	const char *newname), (req, ino, newparent, newname))
+COUNTED(open, OP_OPEN, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+	(req, ino, fi))
+COUNTED(create, OP_CREATE, (fuse_req_t req, fuse_ino_t parent, const char *name,
+	mode_t mode, struct fuse_file_info *fi), (req, parent, name, mode, fi))
+COUNTED(read, OP_READ, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+	struct fuse_file_info *fi), (req, ino, size, offset, fi))
+COUNTED(write_buf, OP_WRITE, (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf,
+	off_t offset, struct fuse_file_info *fi), (req, ino, buf, offset, fi))
+COUNTED(flush, OP_FLUSH, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+	(req, ino, fi))
+COUNTED(release, OP_RELEASE, (fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info *fi), (req, ino, fi))
+COUNTED(fsync, OP_FSYNC, (fuse_req_t req, fuse_ino_t ino, int datasync,
+	struct fuse_file_info *fi), (req, ino, datasync, fi))
+COUNTED(opendir, OP_OPENDIR, (fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info *fi), (req, ino, fi))
+COUNTED(readdir, OP_READDIR, (fuse_req_t req, fuse_ino_t ino, size_t size,
+	off_t offset, struct fuse_file_info *fi), (req, ino, size, offset, fi))
+COUNTED(readdirplus, OP_READDIR, (fuse_req_t req, fuse_ino_t ino, size_t size,
+	off_t offset, struct fuse_file_info *fi), (req, ino, size, offset, fi))
+COUNTED(releasedir, OP_RELEASEDIR, (fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info *fi), (req, ino, fi))
+COUNTED(statfs, OP_STATFS, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+#ifdef HAVE_SETXATTR
+COUNTED(setxattr, OP_SETXATTR, (fuse_req_t req, fuse_ino_t ino, const char *name,
+	const char *value, size_t size, int flags), (req, ino, name, value, size, flags))
+COUNTED(getxattr, OP_GETXATTR, (fuse_req_t req, fuse_ino_t ino, const char *name,
+	size_t size), (req, ino, name, size))
+COUNTED(listxattr, OP_LISTXATTR, (fuse_req_t req, fuse_ino_t ino, size_t size),
+	(req, ino, size))
+COUNTED(removexattr, OP_REMOVEXATTR, (fuse_req_t req, fuse_ino_t ino,
+	const char *name), (req, ino, name))
+#endif
+
+static const struct fuse_lowlevel_ops ll_counted_oper = {
+	.init         = ll_init,
+	.destroy      = ll_destroy,
+	.lookup       = counted_lookup,
+	.forget       = counted_forget,
+	.forget_multi = counted_forget_multi,
+	.getattr      = counted_getattr,
+	.setattr      = counted_setattr,
+	.access       = counted_access,
+	.readlink     = counted_readlink,
+	.mknod        = counted_mknod,
+	.mkdir        = counted_mkdir,
+	.symlink      = counted_symlink,
+	.unlink       = counted_unlink,
+	.rmdir        = counted_rmdir,
+	.rename       = counted_rename,
+	.link         = counted_link,
+	.open         = counted_open,
+	.create       = counted_create,
+	.read         = counted_read,
+	.write_buf    = counted_write_buf,
+	.flush        = counted_flush,
+	.release      = counted_release,
+	.fsync        = counted_fsync,
+	.opendir      = counted_opendir,
+	.readdir      = counted_readdir,
+	.readdirplus  = counted_readdirplus,
+	.releasedir   = counted_releasedir,
+	.statfs       = counted_statfs,
+#ifdef HAVE_SETXATTR
+	.setxattr     = counted_setxattr,
+	.getxattr     = counted_getxattr,
+	.listxattr    = counted_listxattr,
+	.removexattr  = counted_removexattr,
+#endif
+};
+
+/*
+ * Opens the source directories for the root inode and creates the table
+ */
+static int ll_setup(void)
+{
+	const struct conf *conf;
+	unsigned int i;
+
+	inodes.size = 1024;
+	inodes.buckets = calloc(inodes.size, sizeof(struct ll_inode *));
+	root.fds = malloc(sizeof(int) * n_sources);
+	root.path = strdup("/");
+	if (!inodes.buckets || !root.fds || !root.path)
+		return -1;
+
+	pthread_mutex_init(&inodes.lock, NULL);
+
+	conf = conf_get();
+	for (i=0; i < n_sources; i++) {
+		root.fds[i] = open(conf->sources[i].path, O_PATH | O_DIRECTORY);
+		if (root.fds[i] == -1)
+			break;
+	}
+	conf_put(conf);
+
+	return i < n_sources ? -1 : 0;
+}
+
+int ffs_ll_main(struct fuse_args *args)
+{
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse_session *se;
+	int ret = 1;
+
+	if (fuse_parse_cmdline(args, &opts) != 0)
+		return 1;
+
+	if (!opts.mountpoint) {
+		fprintf(stderr, "error: no mountpoint specified.\n");
+		return 1;
+	}
+
+	if (ll_setup()) {
+		fprintf(stderr, "error: cannot open the source directories.\n");
+		goto out;
+	}
+
+	se = fuse_session_new(args, stats_enabled ? &ll_counted_oper : &ll_oper,
+				sizeof(ll_oper), NULL);
+	if (!se)
+		goto out;
+	ll_session = se;
+
+	if (fuse_set_signal_handlers(se))
+		goto out_destroy;
+
+	if (fuse_session_mount(se, opts.mountpoint))
+		goto out_signals;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		ret = fuse_session_loop_mt(se, &config);
+	}
+	ret = ret ? 1 : 0;
+
+	fuse_session_unmount(se);
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_destroy:
+	ll_session = NULL;
+	fuse_session_destroy(se);
+out:
+	free(opts.mountpoint);
+
+	return ret;
+}
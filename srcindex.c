@@ -0,0 +1,640 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Index of the sources that contain the entries of a directory
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * Every indexed directory maps the names of its entries to a bit mask of the
+ * sources that contain them. A directory is indexed when it is listed, as the
+ * entries of all sources are read anyway, and the oldest directory is removed
+ * if the index is full.
+ *
+ * The directory of every source that was read is watched with inotify before
+ * it is read, and a background thread applies the reported changes. Sources
+ * that could not be watched are not "known", resolve_path() probes them as
+ * before. If a watched directory is removed or moved, or if the kernel drops
+ * events, the affected directories are removed from the index.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "hash.h"
+#include "srcindex.h"
+
+#define SI_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct si_name {
+	struct si_name *next;
+	uint64_t hash;
+	uint64_t present;
+	uint64_t deleted; /* removed while the directory was built */
+	char name[];
+};
+
+struct src_index_dir {
+	struct src_index *idx;
+	struct src_index_dir *next; /* hash chain */
+	struct src_index_dir *newer, *older; /* only complete directories */
+
+	uint64_t hash;
+	char *path;
+	size_t path_len;
+
+	int complete;
+	int dropped; /* removed while it was built, freed by src_index_dir_end() */
+	uint64_t known;
+	int *wds; /* one per source, -1 if not watched */
+
+	struct si_name **names;
+	size_t size; /* power of two */
+	size_t count;
+};
+
+struct si_watch {
+	struct si_watch *next;
+	int wd;
+	unsigned int source;
+	struct src_index_dir *dir;
+};
+
+struct src_index {
+	unsigned int size;
+	unsigned int n_sources;
+
+	struct src_index_dir **dirs;
+	struct si_watch **watches;
+	size_t n_buckets; /* power of two, for both tables */
+
+	struct src_index_dir *newest, *oldest;
+	unsigned int n_complete;
+
+	int fd;
+	unsigned long hits;
+	unsigned long misses;
+
+	pthread_rwlock_t lock;
+};
+
+static struct src_index_dir *si_find_dir(struct src_index *idx, const char *path,
+					size_t len, uint64_t hash)
+{
+	struct src_index_dir *dir;
+
+	for (dir = idx->dirs[hash & (idx->n_buckets - 1)]; dir; dir = dir->next) {
+		if (dir->hash == hash && dir->path_len == len && !memcmp(dir->path, path, len))
+			return dir;
+	}
+
+	return NULL;
+}
+
+static struct si_name *si_find_name(struct src_index_dir *dir, const char *name,
+					uint64_t hash)
+{
+	struct si_name *n;
+
+	for (n = dir->names[hash & (dir->size - 1)]; n; n = n->next) {
+		if (n->hash == hash && !strcmp(n->name, name))
+			return n;
+	}
+
+	return NULL;
+}
+
+/* keeps the longer chains on error */
+static void si_grow(struct src_index_dir *dir)
+{
+	struct si_name **old, *n, *next;
+	size_t i, slot, old_size;
+
+	old = dir->names;
+	old_size = dir->size;
+
+	dir->names = calloc(old_size * 2, sizeof(struct si_name *));
+	if (!dir->names) {
+		dir->names = old;
+		return;
+	}
+	dir->size = old_size * 2;
+
+	for (i=0; i < old_size; i++) {
+		for (n = old[i]; n; n = next) {
+			next = n->next;
+
+			slot = n->hash & (dir->size - 1);
+			n->next = dir->names[slot];
+			dir->names[slot] = n;
+		}
+	}
+
+	free(old);
+}
+
+/*
+ * Sets or clears the bit of a source for a name. If the name cannot be
+ * stored, the source is not known anymore. While the directory is built, a
+ * removed name is remembered, as the listing may still return it.
+ */
+static void si_set_name(struct src_index_dir *dir, const char *name,
+					unsigned int source, int present)
+{
+	struct si_name *n;
+	uint64_t hash;
+	size_t len, slot;
+
+	hash = hash_bytes(name, strlen(name));
+	n = si_find_name(dir, name, hash);
+
+	if (!n) {
+		if (!present && dir->complete)
+			return;
+
+		len = strlen(name);
+		n = malloc(sizeof(struct si_name) + len + 1);
+		if (!n) {
+			dir->known &= ~SRC_INDEX_BIT(source);
+			return;
+		}
+
+		n->hash = hash;
+		n->present = 0;
+		n->deleted = 0;
+		memcpy(n->name, name, len + 1);
+
+		if (dir->count >= dir->size)
+			si_grow(dir);
+
+		slot = hash & (dir->size - 1);
+		n->next = dir->names[slot];
+		dir->names[slot] = n;
+		dir->count++;
+	}
+
+	if (present) {
+		n->present |= SRC_INDEX_BIT(source);
+		n->deleted &= ~SRC_INDEX_BIT(source);
+	} else {
+		n->present &= ~SRC_INDEX_BIT(source);
+		if (!dir->complete)
+			n->deleted |= SRC_INDEX_BIT(source);
+	}
+}
+
+static int si_watch_add(struct src_index *idx, int wd, struct src_index_dir *dir,
+					unsigned int source)
+{
+	struct si_watch *w;
+	size_t slot;
+
+	w = malloc(sizeof(struct si_watch));
+	if (!w)
+		return -1;
+
+	w->wd = wd;
+	w->source = source;
+	w->dir = dir;
+
+	slot = (unsigned int) wd & (idx->n_buckets - 1);
+	w->next = idx->watches[slot];
+	idx->watches[slot] = w;
+
+	return 0;
+}
+
+/*
+ * Removes the watches of a directory. A watch of the kernel is only removed
+ * if no other directory uses it, e.g., if the same directory is reached
+ * through different sources. The watch ignored was already removed.
+ */
+static void si_unwatch(struct src_index_dir *dir, int ignored)
+{
+	struct src_index *idx = dir->idx;
+	struct si_watch **p, *w;
+	unsigned int i;
+	int used;
+
+	for (i=0; i < idx->n_sources; i++) {
+		if (dir->wds[i] < 0)
+			continue;
+
+		used = 0;
+		p = &idx->watches[(unsigned int) dir->wds[i] & (idx->n_buckets - 1)];
+		while (*p) {
+			w = *p;
+			if (w->wd == dir->wds[i] && w->dir == dir && w->source == i) {
+				*p = w->next;
+				free(w);
+				continue;
+			}
+
+			if (w->wd == dir->wds[i])
+				used = 1;
+			p = &w->next;
+		}
+
+		if (!used && dir->wds[i] != ignored)
+			inotify_rm_watch(idx->fd, dir->wds[i]);
+
+		dir->wds[i] = -1;
+	}
+
+	dir->known = 0;
+}
+
+static void si_dir_free(struct src_index_dir *dir)
+{
+	struct si_name *n, *next;
+	size_t i;
+
+	for (i=0; i < dir->size; i++) {
+		for (n = dir->names[i]; n; n = next) {
+			next = n->next;
+			free(n);
+		}
+	}
+
+	free(dir->names);
+	free(dir->wds);
+	free(dir->path);
+	free(dir);
+}
+
+/* removes a directory from the tables, must be called with the write lock held */
+static void si_dir_unlink(struct src_index_dir *dir)
+{
+	struct src_index *idx = dir->idx;
+	struct src_index_dir **p;
+
+	p = &idx->dirs[dir->hash & (idx->n_buckets - 1)];
+	while (*p != dir)
+		p = &(*p)->next;
+	*p = dir->next;
+
+	if (!dir->complete)
+		return;
+
+	if (dir->newer)
+		dir->newer->older = dir->older;
+	else
+		idx->newest = dir->older;
+	if (dir->older)
+		dir->older->newer = dir->newer;
+	else
+		idx->oldest = dir->newer;
+	idx->n_complete--;
+}
+
+/* must be called with the write lock held */
+static void si_dir_remove(struct src_index_dir *dir, int ignored)
+{
+	si_unwatch(dir, ignored);
+
+	// the thread that builds the directory is still using it
+	if (!dir->complete) {
+		dir->dropped = 1;
+		return;
+	}
+
+	si_dir_unlink(dir);
+	si_dir_free(dir);
+}
+
+static void si_remove_all(struct src_index *idx)
+{
+	struct src_index_dir *dir, *next;
+	size_t i;
+
+	for (i=0; i < idx->n_buckets; i++) {
+		for (dir = idx->dirs[i]; dir; dir = next) {
+			next = dir->next;
+			si_dir_remove(dir, -1);
+		}
+	}
+}
+
+static void si_handle_event(struct src_index *idx, const struct inotify_event *ev)
+{
+	struct si_watch *w, *next;
+	size_t slot;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		si_remove_all(idx);
+		return;
+	}
+
+	slot = (unsigned int) ev->wd & (idx->n_buckets - 1);
+
+	if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+		// removing a directory removes its watches from the chain
+		w = idx->watches[slot];
+		while (w) {
+			if (w->wd == ev->wd) {
+				si_dir_remove(w->dir, ev->mask & IN_IGNORED ? ev->wd : -1);
+				w = idx->watches[slot];
+			} else {
+				w = w->next;
+			}
+		}
+		return;
+	}
+
+	if (!ev->len)
+		return;
+
+	for (w = idx->watches[slot]; w; w = next) {
+		next = w->next;
+
+		if (w->wd == ev->wd)
+			si_set_name(w->dir, ev->name, w->source,
+						ev->mask & (IN_CREATE | IN_MOVED_TO));
+	}
+}
+
+static void *si_thread(void *arg)
+{
+	char buf[65536] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct src_index *idx = arg;
+	ssize_t len;
+	char *p;
+
+	while (1) {
+		len = read(idx->fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+
+		pthread_rwlock_wrlock(&idx->lock);
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *) p;
+			si_handle_event(idx, ev);
+		}
+		pthread_rwlock_unlock(&idx->lock);
+	}
+
+	// without events, the index cannot be trusted anymore
+	pthread_rwlock_wrlock(&idx->lock);
+	si_remove_all(idx);
+	idx->size = 0;
+	pthread_rwlock_unlock(&idx->lock);
+
+	return NULL;
+}
+
+struct src_index *src_index_new(unsigned int size, unsigned int n_sources)
+{
+	struct src_index *idx;
+	pthread_t thread;
+
+	if (size == 0 || n_sources > SRC_INDEX_MAX_SOURCES)
+		return NULL;
+
+	idx = calloc(1, sizeof(struct src_index));
+	if (!idx)
+		return NULL;
+
+	idx->size = size;
+	idx->n_sources = n_sources;
+
+	idx->n_buckets = 64;
+	while (idx->n_buckets < size)
+		idx->n_buckets *= 2;
+
+	idx->dirs = calloc(idx->n_buckets, sizeof(struct src_index_dir *));
+	idx->watches = calloc(idx->n_buckets, sizeof(struct si_watch *));
+	idx->fd = inotify_init1(IN_CLOEXEC);
+	if (!idx->dirs || !idx->watches || idx->fd == -1)
+		goto error;
+
+	pthread_rwlock_init(&idx->lock, NULL);
+
+	if (pthread_create(&thread, NULL, si_thread, idx))
+		goto error;
+	pthread_detach(thread);
+
+	return idx;
+
+error:
+	if (idx->fd != -1)
+		close(idx->fd);
+	free(idx->dirs);
+	free(idx->watches);
+	free(idx);
+	return NULL;
+}
+
+/* splits a FUSE path into the length of its directory and its name */
+static const char *si_split(const char *path, size_t *dir_len)
+{
+	const char *slash;
+
+	slash = strrchr(path, '/');
+	if (!slash || !slash[1])
+		return NULL;
+
+	// the entries of the root directory
+	*dir_len = slash == path ? 1 : (size_t) (slash - path);
+
+	return slash + 1;
+}
+
+int src_index_lookup(struct src_index *idx, const char *path, uint64_t *known,
+				uint64_t *present)
+{
+	struct src_index_dir *dir;
+	struct si_name *n;
+	const char *name;
+	size_t len;
+
+	name = si_split(path, &len);
+	if (!name)
+		return 0;
+
+	pthread_rwlock_rdlock(&idx->lock);
+
+	dir = si_find_dir(idx, path, len, hash_bytes(path, len));
+	if (!dir || !dir->complete || !dir->known) {
+		pthread_rwlock_unlock(&idx->lock);
+		__atomic_fetch_add(&idx->misses, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	n = si_find_name(dir, name, hash_bytes(name, strlen(name)));
+	*known = dir->known;
+	*present = n ? n->present & dir->known : 0;
+
+	pthread_rwlock_unlock(&idx->lock);
+
+	__atomic_fetch_add(&idx->hits, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+struct src_index_dir *src_index_dir_begin(struct src_index *idx, const char *path)
+{
+	struct src_index_dir *dir;
+	unsigned int i;
+	uint64_t hash;
+	size_t len, slot;
+
+	len = strlen(path);
+	hash = hash_bytes(path, len);
+
+	dir = calloc(1, sizeof(struct src_index_dir));
+	if (!dir)
+		return NULL;
+
+	dir->idx = idx;
+	dir->hash = hash;
+	dir->path = strdup(path);
+	dir->path_len = len;
+	dir->size = 16;
+	dir->names = calloc(dir->size, sizeof(struct si_name *));
+	dir->wds = malloc(sizeof(int) * idx->n_sources);
+	if (!dir->path || !dir->names || !dir->wds) {
+		si_dir_free(dir);
+		return NULL;
+	}
+
+	for (i=0; i < idx->n_sources; i++)
+		dir->wds[i] = -1;
+
+	pthread_rwlock_wrlock(&idx->lock);
+	if (idx->size == 0 || si_find_dir(idx, path, len, hash)) {
+		pthread_rwlock_unlock(&idx->lock);
+		si_dir_free(dir);
+		return NULL;
+	}
+
+	slot = hash & (idx->n_buckets - 1);
+	dir->next = idx->dirs[slot];
+	idx->dirs[slot] = dir;
+	pthread_rwlock_unlock(&idx->lock);
+
+	return dir;
+}
+
+void src_index_dir_source(struct src_index_dir *dir, unsigned int source,
+				const char *realpath)
+{
+	struct src_index *idx = dir->idx;
+	int wd;
+
+	// sources that do not contain the directory stay unknown
+	wd = inotify_add_watch(idx->fd, realpath, SI_WATCH_MASK);
+	if (wd == -1)
+		return;
+
+	pthread_rwlock_wrlock(&idx->lock);
+	if (!dir->dropped && si_watch_add(idx, wd, dir, source) == 0) {
+		dir->wds[source] = wd;
+		dir->known |= SRC_INDEX_BIT(source);
+	}
+	pthread_rwlock_unlock(&idx->lock);
+}
+
+void src_index_dir_add(struct src_index_dir *dir, unsigned int source,
+				const char *name)
+{
+	struct si_name *n;
+
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+		return;
+
+	pthread_rwlock_wrlock(&dir->idx->lock);
+	if (dir->known & SRC_INDEX_BIT(source)) {
+		// the name was removed after it was read and must not return
+		n = si_find_name(dir, name, hash_bytes(name, strlen(name)));
+		if (!n || !(n->deleted & SRC_INDEX_BIT(source)))
+			si_set_name(dir, name, source, 1);
+	}
+	pthread_rwlock_unlock(&dir->idx->lock);
+}
+
+void src_index_dir_end(struct src_index_dir *dir, int ok)
+{
+	struct src_index *idx = dir->idx;
+
+	pthread_rwlock_wrlock(&idx->lock);
+
+	if (!ok || dir->dropped || !dir->known) {
+		si_unwatch(dir, -1);
+		si_dir_unlink(dir);
+		pthread_rwlock_unlock(&idx->lock);
+
+		si_dir_free(dir);
+		return;
+	}
+
+	dir->complete = 1;
+	dir->older = idx->newest;
+	if (idx->newest)
+		idx->newest->newer = dir;
+	else
+		idx->oldest = dir;
+	idx->newest = dir;
+	idx->n_complete++;
+
+	while (idx->n_complete > idx->size)
+		si_dir_remove(idx->oldest, -1);
+
+	pthread_rwlock_unlock(&idx->lock);
+}
+
+void src_index_set(struct src_index *idx, const char *path, unsigned int source,
+				int present)
+{
+	struct src_index_dir *dir;
+	const char *name;
+	size_t len;
+
+	name = si_split(path, &len);
+	if (!name)
+		return;
+
+	pthread_rwlock_wrlock(&idx->lock);
+	dir = si_find_dir(idx, path, len, hash_bytes(path, len));
+	if (dir && (dir->known & SRC_INDEX_BIT(source)))
+		si_set_name(dir, name, source, present);
+	pthread_rwlock_unlock(&idx->lock);
+}
+
+void src_index_remove_tree(struct src_index *idx, const char *path)
+{
+	struct src_index_dir *dir, *next;
+	size_t i, len;
+
+	len = strlen(path);
+
+	pthread_rwlock_wrlock(&idx->lock);
+	for (i=0; i < idx->n_buckets; i++) {
+		for (dir = idx->dirs[i]; dir; dir = next) {
+			next = dir->next;
+
+			if (dir->path_len >= len && !memcmp(dir->path, path, len) &&
+				(dir->path[len] == '\0' || dir->path[len] == '/'))
+				si_dir_remove(dir, -1);
+		}
+	}
+	pthread_rwlock_unlock(&idx->lock);
+}
+
+void src_index_stats(struct src_index *idx, unsigned long *hits,
+				unsigned long *misses)
+{
+	*hits = __atomic_load_n(&idx->hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&idx->misses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,62 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Index of the sources that contain the entries of a directory
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef SRCINDEX_H
+#define SRCINDEX_H
+
+#include <stdint.h>
+
+// the sources are stored as bits of a 64 bit mask
+#define SRC_INDEX_MAX_SOURCES 64
+#define SRC_INDEX_BIT(source) ((uint64_t) 1 << (source))
+
+struct src_index;
+struct src_index_dir;
+
+/*
+ * Creates an index for up to size directories and starts the thread that
+ * keeps it up to date with inotify. Returns NULL on error.
+ */
+struct src_index *src_index_new(unsigned int size, unsigned int n_sources);
+
+/*
+ * Looks up the sources of a FUSE path. Returns 0 if its directory is not
+ * indexed. Otherwise, known is set to the sources whose directory was read
+ * and present to those of them that contain the name.
+ */
+int src_index_lookup(struct src_index *idx, const char *path, uint64_t *known,
+				uint64_t *present);
+
+/*
+ * Indexing a directory while it is listed: src_index_dir_begin() returns NULL
+ * if the directory is already indexed. Every source has to be announced with
+ * src_index_dir_source() before it is read, so changes during the listing are
+ * not missed. src_index_dir_end() adds the directory to the index if ok is
+ * set or discards it.
+ */
+struct src_index_dir *src_index_dir_begin(struct src_index *idx, const char *path);
+void src_index_dir_source(struct src_index_dir *dir, unsigned int source,
+				const char *realpath);
+void src_index_dir_add(struct src_index_dir *dir, unsigned int source,
+				const char *name);
+void src_index_dir_end(struct src_index_dir *dir, int ok);
+
+/* records whether a source contains a FUSE path after it was changed */
+void src_index_set(struct src_index *idx, const char *path, unsigned int source,
+				int present);
+
+/* forgets a directory and all directories below it, e.g., after a rename */
+void src_index_remove_tree(struct src_index *idx, const char *path);
+
+void src_index_stats(struct src_index *idx, unsigned long *hits,
+				unsigned long *misses);
+
+#endif
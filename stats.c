@@ -0,0 +1,371 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Counters and latency histograms of the FUSE operations
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * Every thread counts in its own block, so recording an operation needs no
+ * lock and no atomic read-modify-write, only relaxed loads and stores that
+ * a reader cannot see torn. A reader sums the blocks of all threads. The
+ * block of a thread that exits is kept with its counts and taken over by
+ * the next thread, so the number of blocks does not grow with the threads
+ * that libfuse starts and stops.
+ *
+ * The latency histogram has buckets with upper bounds of 1 us to 2^20 us,
+ * about 1 s, doubling from bucket to bucket, and a last bucket for longer
+ * operations.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#define STATS_BUCKETS 22
+
+struct stats_counters {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t excluded;
+	uint64_t send_failures;
+	uint64_t bytes;
+	uint64_t time_ns;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_thread {
+	struct stats_thread *next;
+	int in_use;
+
+	struct stats_counters ops[];
+};
+
+int stats_enabled = 0;
+
+static const char **names;
+static unsigned int n_ops;
+
+static struct stats_thread *threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+
+static __thread struct stats_thread *self;
+
+static char *socket_path;
+static int socket_fd = -1;
+
+static void stats_release(void *arg)
+{
+	struct stats_thread *t = arg;
+
+	pthread_mutex_lock(&threads_lock);
+	t->in_use = 0;
+	pthread_mutex_unlock(&threads_lock);
+}
+
+static struct stats_thread *stats_acquire(void)
+{
+	struct stats_thread *t;
+
+	pthread_mutex_lock(&threads_lock);
+
+	for (t = threads; t && t->in_use; t = t->next) {}
+
+	if (!t) {
+		t = calloc(1, sizeof(struct stats_thread) + n_ops * sizeof(struct stats_counters));
+		if (!t) {
+			pthread_mutex_unlock(&threads_lock);
+			return NULL;
+		}
+		t->next = threads;
+		threads = t;
+	}
+	t->in_use = 1;
+
+	pthread_mutex_unlock(&threads_lock);
+
+	pthread_setspecific(thread_key, t);
+
+	return t;
+}
+
+int stats_init(const char **op_names, unsigned int count)
+{
+	if (pthread_key_create(&thread_key, stats_release))
+		return -1;
+
+	names = op_names;
+	n_ops = count;
+	stats_enabled = 1;
+
+	return 0;
+}
+
+/* only the thread that owns the block writes, so no atomic increment is needed */
+static inline void stats_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+				__ATOMIC_RELAXED);
+}
+
+static unsigned int stats_bucket(uint64_t ns)
+{
+	unsigned int b;
+
+	if (ns <= 1000)
+		return 0;
+
+	// bucket b holds latencies up to 1000 << b ns
+	b = 64 - __builtin_clzll((ns - 1) / 1000);
+
+	return b < STATS_BUCKETS - 1 ? b : STATS_BUCKETS - 1;
+}
+
+void stats_record(unsigned int op, uint64_t start, int error, int excluded,
+					uint64_t bytes)
+{
+	struct stats_counters *c;
+	uint64_t ns;
+
+	ns = trace_now() - start;
+
+	if (!self)
+		self = stats_acquire();
+	if (!self || op >= n_ops)
+		return;
+
+	c = &self->ops[op];
+	stats_add(&c->calls, 1);
+	stats_add(&c->time_ns, ns);
+	stats_add(&c->buckets[stats_bucket(ns)], 1);
+
+	if (error == ENOENT && excluded)
+		stats_add(&c->excluded, 1);
+	else if (error)
+		stats_add(&c->errors, 1);
+
+	if (bytes)
+		stats_add(&c->bytes, bytes);
+}
+
+void stats_record_send_failure(unsigned int op)
+{
+	if (!self)
+		self = stats_acquire();
+	if (!self || op >= n_ops)
+		return;
+
+	stats_add(&self->ops[op].send_failures, 1);
+}
+
+static void stats_sum(struct stats_counters *sum)
+{
+	struct stats_thread *t;
+	unsigned int i, b;
+
+	memset(sum, 0, n_ops * sizeof(struct stats_counters));
+
+	pthread_mutex_lock(&threads_lock);
+	for (t = threads; t; t = t->next) {
+		for (i=0; i < n_ops; i++) {
+			const uint64_t *src = (const uint64_t *) &t->ops[i];
+			uint64_t *dst = (uint64_t *) &sum[i];
+
+			for (b=0; b < sizeof(struct stats_counters) / sizeof(uint64_t); b++)
+				dst[b] += __atomic_load_n(&src[b], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/* prints one counter of all operations that were called */
+static void stats_write_counter(FILE *out, const struct stats_counters *sum,
+					const char *name, const char *help, size_t offset)
+{
+	uint64_t value;
+	unsigned int i;
+
+	fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+
+	for (i=0; i < n_ops; i++) {
+		value = *(const uint64_t *) ((const char *) &sum[i] + offset);
+		if (sum[i].calls)
+			fprintf(out, "%s{op=\"%s\"} %llu\n", name, names[i],
+				(unsigned long long) value);
+	}
+}
+
+int stats_write(FILE *out)
+{
+	struct stats_counters *sum;
+	unsigned long long count;
+	unsigned int i, b;
+
+	sum = malloc(n_ops * sizeof(struct stats_counters));
+	if (!sum)
+		return -1;
+
+	stats_sum(sum);
+
+	stats_write_counter(out, sum, "sparsefs_ops_total",
+		"Number of FUSE operations.", offsetof(struct stats_counters, calls));
+	stats_write_counter(out, sum, "sparsefs_errors_total",
+		"Operations that failed, except for paths excluded by the rules.",
+		offsetof(struct stats_counters, errors));
+	stats_write_counter(out, sum, "sparsefs_excluded_total",
+		"Operations that failed with ENOENT as the rules exclude the path.",
+		offsetof(struct stats_counters, excluded));
+	stats_write_counter(out, sum, "sparsefs_send_failures_total",
+		"Replies that could not be sent to the kernel.",
+		offsetof(struct stats_counters, send_failures));
+	stats_write_counter(out, sum, "sparsefs_bytes_total",
+		"Bytes read or written.", offsetof(struct stats_counters, bytes));
+
+	fprintf(out, "# HELP sparsefs_op_duration_seconds Latency of the FUSE operations.\n"
+		"# TYPE sparsefs_op_duration_seconds histogram\n");
+
+	for (i=0; i < n_ops; i++) {
+		if (!sum[i].calls)
+			continue;
+
+		count = 0;
+		for (b=0; b < STATS_BUCKETS - 1; b++) {
+			count += sum[i].buckets[b];
+			fprintf(out, "sparsefs_op_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+				names[i], (1000ULL << b) / 1e9, count);
+		}
+		count += sum[i].buckets[b];
+		fprintf(out, "sparsefs_op_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+			names[i], count);
+		fprintf(out, "sparsefs_op_duration_seconds_sum{op=\"%s\"} %.9f\n",
+			names[i], sum[i].time_ns / 1e9);
+		fprintf(out, "sparsefs_op_duration_seconds_count{op=\"%s\"} %llu\n",
+			names[i], count);
+	}
+
+	free(sum);
+
+	return ferror(out) ? -1 : 0;
+}
+
+/* sends the statistics and closes the connection */
+static void stats_send(int fd)
+{
+	struct timeval timeout = { 1, 0 };
+	size_t size = 0, done;
+	char *buf = NULL;
+	ssize_t r;
+	FILE *out;
+
+	// a client that does not read must not stall the statistics
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	out = open_memstream(&buf, &size);
+	if (out) {
+		stats_write(out);
+		fclose(out);
+	}
+
+	for (done = 0; buf && done < size; done += r) {
+		r = send(fd, buf + done, size - done, MSG_NOSIGNAL);
+		if (r <= 0)
+			break;
+	}
+
+	free(buf);
+	close(fd);
+}
+
+static void *stats_thread(void *arg)
+{
+	int fd;
+
+	while (1) {
+		fd = accept(socket_fd, NULL, NULL);
+		if (fd >= 0)
+			stats_send(fd);
+		else if (errno != EINTR && errno != ECONNABORTED)
+			break;
+	}
+
+	return NULL;
+}
+
+int stats_serve(const char *path)
+{
+	struct sockaddr_un addr;
+	pthread_t thread;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// the socket of an earlier mount is replaced, but no other file
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)))
+		goto error;
+
+	// only the owner may connect, sparsefs runs with umask 0
+	if (chmod(path, S_IRUSR | S_IWUSR) || listen(fd, 8)) {
+		unlink(path);
+		goto error;
+	}
+
+	socket_path = strdup(path);
+	socket_fd = fd;
+	if (!socket_path || pthread_create(&thread, NULL, stats_thread, NULL)) {
+		unlink(path);
+		free(socket_path);
+		socket_path = NULL;
+		socket_fd = -1;
+		goto error;
+	}
+	pthread_detach(thread);
+
+	return 0;
+
+error:
+	close(fd);
+	return -1;
+}
+
+void stats_stop(void)
+{
+	if (!socket_path)
+		return;
+
+	unlink(socket_path);
+	free(socket_path);
+	socket_path = NULL;
+
+	// wakes up accept() in stats_thread()
+	shutdown(socket_fd, SHUT_RDWR);
+}
@@ -0,0 +1,55 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Counters and latency histograms of the FUSE operations
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* 1 once stats_init() was called, the operations only record if it is set */
+extern int stats_enabled;
+
+/*
+ * Enables the statistics for the given operations. The names are used as
+ * labels and must stay valid. Returns 0 on success.
+ */
+int stats_init(const char **op_names, unsigned int n_ops);
+
+/*
+ * Records an operation that started at start, see trace_now(). error is 0
+ * or a positive errno, excluded tells whether an ENOENT is the verdict of
+ * the rules instead of a missing file. bytes are the bytes read or written.
+ */
+void stats_record(unsigned int op, uint64_t start, int error, int excluded,
+					uint64_t bytes);
+
+/*
+ * Records that the reply of an operation could not be sent to the kernel,
+ * e.g. because the request was interrupted. The operation itself is still
+ * recorded with stats_record().
+ */
+void stats_record_send_failure(unsigned int op);
+
+/* writes the merged counters of all threads in the Prometheus text format */
+int stats_write(FILE *out);
+
+/*
+ * Starts a thread that writes the statistics to every client that connects
+ * to a Unix socket at path. An existing socket at path is replaced and only
+ * the owner can connect to the new one.
+ */
+int stats_serve(const char *path);
+
+/* removes the socket of stats_serve() */
+void stats_stop(void);
+
+#endif
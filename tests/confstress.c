@@ -0,0 +1,194 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Stress test of the versioned configuration
+ *
+ *  Reader threads continuously look up paths in the current configuration
+ *  while the main thread publishes new versions. Every version has sources and
+ *  rules that carry the same tag, so a reader that sees parts of different
+ *  versions or a version that was already freed notices the mismatch.
+ *
+ *  usage: confstress [threads] [seconds]
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "conf.h"
+
+#define N_SOURCES 4
+#define MAX_LEN 64
+
+static int stop;
+static unsigned long failures;
+
+static struct conf *make_conf(unsigned long tag)
+{
+	char buf[MAX_LEN];
+	struct conf *c;
+	unsigned int i;
+
+	c = conf_new();
+	if (!c)
+		return NULL;
+
+	c->default_exclude = 0;
+	c->rules = ruleset_new();
+	if (!c->rules)
+		goto error;
+
+	for (i=0; i < N_SOURCES; i++) {
+		snprintf(buf, MAX_LEN, "/src%u/%lu", i, tag);
+		if (conf_add_source(c, buf))
+			goto error;
+	}
+
+	// one exact rule in the hash table and one wildcard rule
+	snprintf(buf, MAX_LEN, "/src0/%lu/exact", tag);
+	if (ruleset_append(c->rules, buf, 1))
+		goto error;
+	snprintf(buf, MAX_LEN, "/src1/%lu/*.o", tag);
+	if (ruleset_append(c->rules, buf, 1))
+		goto error;
+	if (ruleset_compile(c->rules))
+		goto error;
+
+	return c;
+
+error:
+	conf_free(c);
+	return NULL;
+}
+
+static int check_conf(const struct conf *c)
+{
+	char buf[MAX_LEN];
+	unsigned long tag;
+	unsigned int i;
+
+	if (c->n_sources != N_SOURCES ||
+		sscanf(c->sources[0].path, "/src0/%lu/", &tag) != 1)
+		return -1;
+
+	for (i=0; i < N_SOURCES; i++) {
+		snprintf(buf, MAX_LEN, "/src%u/%lu/", i, tag);
+		if (strcmp(c->sources[i].path, buf))
+			return -1;
+	}
+
+	snprintf(buf, MAX_LEN, "/src0/%lu/exact", tag);
+	if (!ruleset_match(c->rules, buf))
+		return -1;
+
+	snprintf(buf, MAX_LEN, "/src1/%lu/main.o", tag);
+	if (!ruleset_match(c->rules, buf))
+		return -1;
+
+	// the rules of the previous version must not match
+	snprintf(buf, MAX_LEN, "/src1/%lu/main.o", tag - 1);
+	if (ruleset_match(c->rules, buf))
+		return -1;
+
+	return 0;
+}
+
+static void *reader(void *arg)
+{
+	unsigned long *lookups = arg;
+	unsigned long last = 0;
+	const struct conf *c;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		c = conf_get();
+
+		if (c->version < last || check_conf(c)) {
+			__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+			fprintf(stderr, "inconsistent version %lu after %lu\n", c->version, last);
+		}
+		last = c->version;
+
+		// nested read sections must see a version that is not older
+		if (conf_get()->version < last)
+			__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+		conf_put(c);
+		conf_put(c);
+
+		(*lookups)++;
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, n_threads;
+	unsigned long v, total = 0;
+	time_t end;
+	unsigned long *lookups;
+	pthread_t *threads;
+	struct conf *c;
+
+	n_threads = argc > 1 ? atoi(argv[1]) : 8;
+	end = time(NULL) + (argc > 2 ? atoi(argv[2]) : 2);
+
+	threads = calloc(n_threads, sizeof(pthread_t));
+	lookups = calloc(n_threads, sizeof(unsigned long));
+	c = make_conf(1);
+	if (!threads || !lookups || !c || conf_publish(c)) {
+		fprintf(stderr, "cannot create the first version\n");
+		return 1;
+	}
+
+	for (i=0; i < n_threads; i++) {
+		if (pthread_create(&threads[i], NULL, reader, &lookups[i])) {
+			fprintf(stderr, "cannot create thread %u\n", i);
+			return 1;
+		}
+	}
+
+	for (v=2; time(NULL) < end; v++) {
+		c = make_conf(v);
+		if (!c || conf_publish(c)) {
+			fprintf(stderr, "cannot publish version %lu\n", v);
+			failures++;
+			break;
+		}
+	}
+
+	// a version with a different number of sources must be rejected
+	c = conf_new();
+	if (!c || conf_add_source(c, "/src0") || conf_publish(c) == 0) {
+		fprintf(stderr, "a version with a different number of sources was published\n");
+		failures++;
+	}
+	conf_free(c);
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i=0; i < n_threads; i++) {
+		pthread_join(threads[i], NULL);
+		total += lookups[i];
+	}
+
+	c = (struct conf *) conf_get();
+	if (c->version != v - 1) {
+		fprintf(stderr, "version %lu, expected %lu\n", c->version, v - 1);
+		failures++;
+	}
+	conf_put(c);
+
+	printf("%u threads, %lu versions, %lu lookups, %lu failures\n",
+		n_threads, v - 1, total, failures);
+
+	free(threads);
+	free(lookups);
+
+	return failures ? 1 : 0;
+}
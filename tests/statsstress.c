@@ -0,0 +1,315 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Stress test of the statistics
+ *
+ *  Rounds of threads record a known sequence of operations and exit, so the
+ *  next round takes over their counters, while a reader thread continuously
+ *  writes the statistics and checks that the counts never go back. In the
+ *  end, the merged counters must match the recorded operations, and the
+ *  statistics served on the Unix socket, which only the owner may use, must
+ *  match stats_write().
+ *
+ *  usage: statsstress [threads] [rounds]
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "stats.h"
+#include "trace.h"
+
+#define N_OPS 3
+#define N_RECORDS 20000
+
+struct counts {
+	unsigned long long calls, errors, excluded, bytes, histogram;
+};
+
+static const char *op_names[N_OPS] = { "getattr", "read", "write" };
+
+static int stop;
+static unsigned long failures;
+
+/* the operation with index i of every thread, see writer() */
+static void record_args(unsigned int i, unsigned int *op, int *error, int *excluded,
+					uint64_t *bytes, uint64_t *latency)
+{
+	*op = i % N_OPS;
+	*error = i % 5 == 0 || i % 5 == 1 ? ENOENT : i % 5 == 2 ? EACCES : 0;
+	*excluded = i % 5 == 0 || i % 5 == 2;
+	*bytes = *op == 1 ? 4096 : 0;
+	*latency = (uint64_t) 500 << (i % 24);
+}
+
+static void *writer(void *arg)
+{
+	unsigned int i, op;
+	uint64_t bytes, latency;
+	int error, excluded;
+
+	for (i=0; i < N_RECORDS; i++) {
+		record_args(i, &op, &error, &excluded, &bytes, &latency);
+		stats_record(op, trace_now() - latency, error, excluded, bytes);
+	}
+
+	return NULL;
+}
+
+/* parses the output of stats_write() */
+static int parse(char *text, struct counts *c)
+{
+	char metric[64], op[16];
+	unsigned long long value;
+	unsigned long long *dst;
+	char *line, *save;
+	unsigned int i;
+
+	memset(c, 0, N_OPS * sizeof(struct counts));
+
+	for (line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (line[0] == '#')
+			continue;
+
+		if (sscanf(line, "%63[^{]{op=\"%15[^\"]\"%*[^ ] %llu", metric, op, &value) != 3)
+			return -1;
+
+		for (i=0; i < N_OPS && strcmp(op, op_names[i]); i++) {}
+		if (i == N_OPS)
+			return -1;
+
+		dst = NULL;
+		if (!strcmp(metric, "sparsefs_ops_total"))
+			dst = &c[i].calls;
+		else if (!strcmp(metric, "sparsefs_errors_total"))
+			dst = &c[i].errors;
+		else if (!strcmp(metric, "sparsefs_excluded_total"))
+			dst = &c[i].excluded;
+		else if (!strcmp(metric, "sparsefs_bytes_total"))
+			dst = &c[i].bytes;
+		else if (!strcmp(metric, "sparsefs_op_duration_seconds_bucket") &&
+			strstr(line, "le=\"+Inf\""))
+			dst = &c[i].histogram;
+
+		if (dst)
+			*dst = value;
+	}
+
+	return 0;
+}
+
+/* returns the output of stats_write(), which must be freed */
+static char *write_stats(void)
+{
+	size_t size = 0;
+	char *buf = NULL;
+	FILE *out;
+
+	out = open_memstream(&buf, &size);
+	if (!out)
+		return NULL;
+
+	if (stats_write(out)) {
+		fclose(out);
+		free(buf);
+		return NULL;
+	}
+	fclose(out);
+
+	return buf;
+}
+
+static void *reader(void *arg)
+{
+	struct counts prev[N_OPS] = { { 0 } }, curr[N_OPS];
+	unsigned long *reads = arg;
+	unsigned int i;
+	char *text;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		text = write_stats();
+		if (!text || parse(text, curr)) {
+			__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+			free(text);
+			break;
+		}
+		free(text);
+
+		for (i=0; i < N_OPS; i++) {
+			if (curr[i].calls < prev[i].calls || curr[i].errors < prev[i].errors ||
+				curr[i].bytes < prev[i].bytes)
+				__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+		}
+		memcpy(prev, curr, sizeof(prev));
+		(*reads)++;
+	}
+
+	return NULL;
+}
+
+/* reads the statistics from the socket at path */
+static char *read_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	size_t len = 0, size = 4096;
+	char *buf, *tmp;
+	ssize_t r;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return NULL;
+
+	buf = malloc(size);
+	if (!buf || connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+		goto error;
+
+	while ((r = read(fd, buf + len, size - len - 1)) > 0) {
+		len += r;
+		if (len + 1 == size) {
+			tmp = realloc(buf, size * 2);
+			if (!tmp)
+				goto error;
+			buf = tmp;
+			size *= 2;
+		}
+	}
+	if (r < 0)
+		goto error;
+
+	buf[len] = 0;
+	close(fd);
+
+	return buf;
+
+error:
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct counts expected[N_OPS] = { { 0 } }, result[N_OPS];
+	unsigned int i, r, n_threads, n_rounds, op;
+	uint64_t bytes, latency;
+	int error, excluded;
+	unsigned long reads = 0;
+	pthread_t reader_thread;
+	pthread_t *threads;
+	char path[64], *text, *served;
+	struct stat st;
+
+	n_threads = argc > 1 ? atoi(argv[1]) : 8;
+	n_rounds = argc > 2 ? atoi(argv[2]) : 10;
+
+	threads = calloc(n_threads, sizeof(pthread_t));
+	if (!threads || stats_init(op_names, N_OPS)) {
+		fprintf(stderr, "cannot enable the statistics\n");
+		return 1;
+	}
+
+	if (pthread_create(&reader_thread, NULL, reader, &reads)) {
+		fprintf(stderr, "cannot create the reader\n");
+		return 1;
+	}
+
+	for (r=0; r < n_rounds; r++) {
+		for (i=0; i < n_threads; i++) {
+			if (pthread_create(&threads[i], NULL, writer, NULL)) {
+				fprintf(stderr, "cannot create thread %u\n", i);
+				return 1;
+			}
+		}
+		for (i=0; i < n_threads; i++)
+			pthread_join(threads[i], NULL);
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	pthread_join(reader_thread, NULL);
+
+	for (i=0; i < N_RECORDS; i++) {
+		record_args(i, &op, &error, &excluded, &bytes, &latency);
+		expected[op].calls++;
+		expected[op].histogram++;
+		expected[op].bytes += bytes;
+		if (error == ENOENT && excluded)
+			expected[op].excluded++;
+		else if (error)
+			expected[op].errors++;
+	}
+
+	text = write_stats();
+	if (!text || parse(text, result)) {
+		fprintf(stderr, "cannot parse the statistics\n");
+		return 1;
+	}
+	free(text);
+
+	for (i=0; i < N_OPS; i++) {
+		struct counts *e = &expected[i], *c = &result[i];
+		unsigned long long n = (unsigned long long) n_threads * n_rounds;
+
+		if (c->calls != e->calls * n || c->errors != e->errors * n ||
+			c->excluded != e->excluded * n || c->bytes != e->bytes * n ||
+			c->histogram != e->histogram * n) {
+			fprintf(stderr, "%s: %llu calls, %llu errors, %llu excluded, %llu bytes, "
+				"%llu in the histogram, expected %llu, %llu, %llu, %llu, %llu\n",
+				op_names[i], c->calls, c->errors, c->excluded, c->bytes,
+				c->histogram, e->calls * n, e->errors * n, e->excluded * n,
+				e->bytes * n, e->histogram * n);
+			failures++;
+		}
+	}
+
+	// without recording threads, the socket must serve the same statistics
+	snprintf(path, sizeof(path), "/tmp/statsstress.%d", (int) getpid());
+	umask(0); /* like sparsefs */
+	if (stats_serve(path)) {
+		fprintf(stderr, "cannot serve the statistics on %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (lstat(path, &st) || (st.st_mode & 0777) != 0600) {
+		fprintf(stderr, "the socket is not private\n");
+		failures++;
+	}
+
+	text = write_stats();
+	served = read_socket(path);
+	if (!text || !served || strcmp(text, served)) {
+		fprintf(stderr, "the socket served different statistics\n");
+		failures++;
+	}
+	free(text);
+	free(served);
+
+	stats_stop();
+	if (access(path, F_OK) == 0) {
+		fprintf(stderr, "the socket was not removed\n");
+		failures++;
+	}
+
+	printf("%u threads, %u rounds, %lu reads, %lu failures\n",
+		n_threads, n_rounds, reads, failures);
+
+	free(threads);
+
+	return failures ? 1 : 0;
+}
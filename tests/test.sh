@@ -5,7 +5,7 @@ qgrep() {
 }
 
 cleanup() {
-	fusermount -zu ${FDIR}
+	fusermount3 -zu ${FDIR}
 	rmdir ${FDIR}
 }
 
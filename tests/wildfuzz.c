@@ -0,0 +1,140 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Differential test of the precompiled patterns against wildmatch()
+ *
+ *  Random patterns built from literals, '?', '*', '**', classes and escapes
+ *  are matched against random texts and texts that are derived from the
+ *  pattern. Every result of wildprog_match() has to be the same as the one
+ *  of wildmatch().
+ *
+ *  usage: wildfuzz [iterations] [seed]
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wildmatch.h"
+#include "wildprog.h"
+
+#define MAX_LEN 512
+
+static const char *pieces[] = {
+	"a", "b", "c", ".", "/", "/", "?", "*", "*", "**", "***", "[ab]", "[!a]", "[^/]",
+	"[a-c]", "[]a]", "[a-]", "[[:alpha:]]", "[[:foo:]]", "[[:a]", "[\\]]", "\\*",
+	"\\/", "\\", "[", "]", "-",
+};
+#define N_PIECES (sizeof(pieces) / sizeof(pieces[0]))
+
+static const char alphabet[] = "abc./-]*\\";
+
+static unsigned long failures;
+
+static void append(char *buf, const char *s)
+{
+	size_t len = strlen(buf);
+
+	snprintf(buf + len, MAX_LEN - len, "%s", s);
+}
+
+// appends a string that a piece likely matches
+static void instantiate(char *buf, const char *piece)
+{
+	char s[2] = { 0, 0 };
+	unsigned int i, n;
+
+	if (!strcmp(piece, "?") || piece[0] == '[') {
+		s[0] = "ab/]"[rand() % 4];
+		append(buf, s);
+	} else if (piece[0] == '*') {
+		n = rand() % 4;
+		for (i = 0; i < n; i++) {
+			s[0] = (piece[1] == '*' ? "ab/" : "ab")[rand() % (piece[1] == '*' ? 3 : 2)];
+			append(buf, s);
+		}
+	} else if (piece[0] == '\\' && piece[1]) {
+		append(buf, piece + 1);
+	} else {
+		append(buf, piece);
+	}
+}
+
+static void make_case(char *pattern, char *text, unsigned int n_pieces)
+{
+	const char *piece;
+	unsigned int i, n;
+
+	pattern[0] = text[0] = 0;
+	for (i = 0; i < n_pieces; i++) {
+		piece = pieces[rand() % N_PIECES];
+		append(pattern, piece);
+		instantiate(text, piece);
+	}
+
+	// otherwise a random text
+	if (rand() % 2) {
+		n = rand() % 16;
+		for (i = 0; i < n; i++)
+			text[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+		text[n] = 0;
+	}
+}
+
+static void check(const char *pattern, const char *text, unsigned int flags)
+{
+	struct wildprog *wp;
+	int expected, result;
+
+	wp = wildprog_compile(pattern, flags);
+	if (!wp) {
+		fprintf(stderr, "cannot compile \"%s\"\n", pattern);
+		failures++;
+		return;
+	}
+
+	expected = wildmatch(pattern, text, flags, NULL) == WM_MATCH;
+	result = wildprog_match(wp, text) == WM_MATCH;
+	if (expected != result) {
+		fprintf(stderr, "\"%s\" %s \"%s\" (flags %u), expected %s\n", pattern,
+			result ? "matches" : "does not match", text, flags, expected ? "a match" : "no match");
+		failures++;
+	}
+
+	wildprog_free(wp);
+}
+
+int main(int argc, char **argv)
+{
+	char pattern[MAX_LEN], text[MAX_LEN];
+	unsigned long i, n;
+
+	n = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+
+	check("a/**/b", "a/b", WM_PATHNAME);
+	check("a/**/b", "a/xb", WM_PATHNAME);
+	check("a/**/b", "a//b", WM_PATHNAME);
+	check("**/*.c", "x/y.c", WM_PATHNAME);
+	check("**/*.c", "y.c", WM_PATHNAME);
+	check("**.c", "y.c", WM_PATHNAME);
+	check("/data/**", "/data/", WM_PATHNAME);
+	check("*/b", "a/x/b", WM_PATHNAME);
+
+	for (i = 0; i < n; i++) {
+		// mostly short patterns, sometimes more than 64 tokens
+		make_case(pattern, text, i % 16 ? rand() % 8 : 60 + rand() % 40);
+
+		check(pattern, text, WM_PATHNAME);
+		check(pattern, text, 0);
+	}
+
+	printf("%lu cases, %lu failures\n", n, failures);
+
+	return failures ? 1 : 0;
+}
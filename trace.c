@@ -0,0 +1,290 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Runtime tracing of FUSE operations and filter decisions
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * The FUSE threads store their events in a bounded ring and never block or
+ * write to a file themselves. Every slot carries a sequence number that tells
+ * whether it is free for the producer at a given position or ready for the
+ * consumer, so a producer only needs a single compare-and-swap to claim a
+ * slot. A background thread drains the ring and formats the events.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_MSG_LEN 160
+
+enum trace_type {
+	TRACE_EVENT_OP,
+	TRACE_EVENT_VERDICT,
+	TRACE_EVENT_MSG,
+};
+
+struct trace_event {
+	unsigned long seq;
+
+	enum trace_type type;
+	uint64_t time;
+	uint64_t latency;
+	const char *op;
+	int result;
+	unsigned int source;
+	char msg[TRACE_MSG_LEN];
+};
+
+int trace_level = TRACE_OFF;
+
+static struct trace_event *ring;
+static unsigned long ring_mask;
+static unsigned long head; /* next position of the producers */
+static unsigned long tail; /* next position of the consumer */
+static unsigned long dropped;
+static unsigned long reported; /* dropped events that were written already */
+
+static FILE *trace_out;
+static pthread_t drain_thread;
+static int running;
+
+uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* claims the next free slot, returns NULL if the ring is full */
+static struct trace_event *trace_reserve(void)
+{
+	struct trace_event *ev;
+	unsigned long pos, seq;
+
+	pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	while (1) {
+		ev = &ring[pos & ring_mask];
+		seq = __atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((long) (seq - pos) < 0) {
+			__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		}
+	}
+
+	ev->time = trace_now();
+
+	return ev;
+}
+
+/* hands a slot filled by the producer over to the consumer */
+static void trace_commit(struct trace_event *ev)
+{
+	__atomic_store_n(&ev->seq, ev->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_copy(char *dst, const char *src)
+{
+	size_t len = strlen(src);
+
+	// keep the end of long paths as it is more meaningful
+	if (len >= TRACE_MSG_LEN)
+		src += len - TRACE_MSG_LEN + 1;
+
+	memcpy(dst, src, len < TRACE_MSG_LEN ? len + 1 : TRACE_MSG_LEN);
+}
+
+void trace_op(const char *op, const char *path, int result, uint64_t start)
+{
+	struct trace_event *ev;
+
+	ev = trace_reserve();
+	if (!ev)
+		return;
+
+	ev->type = TRACE_EVENT_OP;
+	ev->latency = ev->time - start;
+	ev->op = op;
+	ev->result = result;
+	trace_copy(ev->msg, path);
+
+	trace_commit(ev);
+}
+
+void trace_verdict(const char *path, unsigned int source, int exclude, int cached)
+{
+	struct trace_event *ev;
+
+	ev = trace_reserve();
+	if (!ev)
+		return;
+
+	ev->type = TRACE_EVENT_VERDICT;
+	ev->source = source;
+	ev->result = exclude;
+	ev->op = cached ? "cached" : "resolved";
+	trace_copy(ev->msg, path);
+
+	trace_commit(ev);
+}
+
+void trace_printf(const char *format, ...)
+{
+	struct trace_event *ev;
+	va_list args;
+	size_t len;
+
+	ev = trace_reserve();
+	if (!ev)
+		return;
+
+	ev->type = TRACE_EVENT_MSG;
+
+	va_start(args, format);
+	vsnprintf(ev->msg, TRACE_MSG_LEN, format, args);
+	va_end(args);
+
+	// the newline is added when the event is written
+	len = strlen(ev->msg);
+	if (len > 0 && ev->msg[len-1] == '\n')
+		ev->msg[len-1] = 0;
+
+	trace_commit(ev);
+}
+
+static void trace_write(struct trace_event *ev)
+{
+	fprintf(trace_out, "%llu.%06llu ", (unsigned long long) ev->time / 1000000000ULL,
+		(unsigned long long) ev->time % 1000000000ULL / 1000);
+
+	switch (ev->type) {
+		case TRACE_EVENT_OP:
+			fprintf(trace_out, "%s %s = %d (%.1f us)\n", ev->op, ev->msg,
+				ev->result, ev->latency / 1e3);
+			break;
+
+		case TRACE_EVENT_VERDICT:
+			if (ev->result)
+				fprintf(trace_out, "verdict %s: exclude (%s)\n", ev->msg, ev->op);
+			else
+				fprintf(trace_out, "verdict %s: include from source %u (%s)\n",
+					ev->msg, ev->source, ev->op);
+			break;
+
+		case TRACE_EVENT_MSG:
+			fprintf(trace_out, "debug %s\n", ev->msg);
+			break;
+	}
+}
+
+/* writes all events that are ready, returns their number */
+static unsigned int trace_drain(void)
+{
+	struct trace_event *ev;
+	unsigned int n = 0;
+
+	while (1) {
+		ev = &ring[tail & ring_mask];
+		if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != tail + 1)
+			break;
+
+		trace_write(ev);
+
+		// release the slot for the producer one round later
+		__atomic_store_n(&ev->seq, tail + ring_mask + 1, __ATOMIC_RELEASE);
+		tail++;
+		n++;
+	}
+
+	return n;
+}
+
+static void trace_report_dropped(void)
+{
+	unsigned long n;
+
+	n = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (n != reported) {
+		fprintf(trace_out, "trace: %lu events dropped\n", n - reported);
+		reported = n;
+	}
+}
+
+static void *trace_thread(void *arg)
+{
+	struct timespec delay = { 0, 5000000 };
+
+	while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		if (trace_drain() > 0)
+			continue;
+
+		trace_report_dropped();
+		fflush(trace_out);
+		nanosleep(&delay, NULL);
+	}
+
+	return NULL;
+}
+
+int trace_start(int level, FILE *out, unsigned int size)
+{
+	unsigned long i;
+
+	if (level <= TRACE_OFF)
+		return 0;
+
+	for (ring_mask = 1; ring_mask < size; ring_mask *= 2) {}
+
+	ring = calloc(ring_mask, sizeof(struct trace_event));
+	if (!ring)
+		return -1;
+
+	for (i=0; i < ring_mask; i++)
+		ring[i].seq = i;
+	ring_mask--;
+
+	trace_out = out;
+	running = 1;
+	if (pthread_create(&drain_thread, NULL, trace_thread, NULL)) {
+		free(ring);
+		ring = NULL;
+		return -1;
+	}
+
+	__atomic_store_n(&trace_level, level, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void trace_stop(void)
+{
+	if (!ring)
+		return;
+
+	__atomic_store_n(&trace_level, TRACE_OFF, __ATOMIC_RELEASE);
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	pthread_join(drain_thread, NULL);
+
+	// events of operations that were still running may be lost here
+	trace_drain();
+	trace_report_dropped();
+	fflush(trace_out);
+}
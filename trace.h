@@ -0,0 +1,46 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Runtime tracing of FUSE operations and filter decisions
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum trace_level {
+	TRACE_OFF,
+	TRACE_OPS,      /* result and latency of every FUSE operation */
+	TRACE_VERDICTS, /* additionally the filter decision of every path */
+	TRACE_DEBUG,    /* additionally all debug messages */
+};
+
+/* the active level, TRACE_OFF until trace_start() was called */
+extern int trace_level;
+
+/*
+ * Starts the background thread that writes the events to out. Events are
+ * buffered in a ring with room for size events, events that do not fit are
+ * dropped and counted. Returns 0 on success.
+ */
+int trace_start(int level, FILE *out, unsigned int size);
+
+/* writes the remaining events and stops the background thread */
+void trace_stop(void);
+
+/* timestamp for trace_op() in nanoseconds */
+uint64_t trace_now(void);
+
+void trace_op(const char *op, const char *path, int result, uint64_t start);
+void trace_verdict(const char *path, unsigned int source, int exclude, int cached);
+void trace_printf(const char *format, ...)
+	__attribute__ ((format (printf, 1, 2)));
+
+#endif
@@ -0,0 +1,524 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Precompiled wildcard patterns
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+/*
+ * A pattern is compiled into a list of tokens: a set of characters, '*' or
+ * '**'. The set is a 256-bit bitmap, so literals, '?' and classes like
+ * "[a-z]" are all matched the same way. The text is matched by simulating
+ * an automaton whose state i means "the first i tokens matched". All states
+ * are bits of a bitmask and one character advances all of them with a few
+ * shifts and ands, so there is no backtracking. A state of '*' stays active
+ * on every character but '/', one of '**' on every character, and both can be
+ * skipped. If "**" is followed by '/', the slash can be skipped, too, but only
+ * when "**" is entered, so "a/" + "**" + "/b" matches "a/b", but not "a/xb".
+ *
+ * Characters that no token distinguishes share a class, so the program only
+ * stores the states that advance on a character for every class instead of
+ * for every character, e.g., four classes '.', 'c', '/' and the rest for
+ * "*.c". Patterns start with a literal prefix that is compared with
+ * strncmp() and the automaton starts after it.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wildmatch.h"
+#include "wildprog.h"
+
+// a program has at most WP_MAX_WORDS * 64 states
+#define WP_MAX_WORDS 8
+
+enum {
+	WP_SET,
+	WP_STAR,
+	WP_STARSTAR,
+};
+
+struct wp_token {
+	int type;
+	int skip; /* "**" that may also skip the following '/' */
+	int ch; /* the only character of a set or -1 */
+	uint64_t set[4];
+};
+
+struct wildprog {
+	unsigned int n_words;
+	unsigned int start; /* state after the literal prefix */
+	unsigned int accept; /* state after the last token */
+	int literal; /* pattern without wildcards */
+	int never; /* malformed pattern that cannot match */
+	int tail_starstar; /* pattern ends with "**" */
+	const char *prefix;
+	size_t prefix_len;
+	const char *suffix;
+	size_t suffix_len;
+	unsigned char cls[256];
+	const uint64_t *stars; /* states of '*' and '**' */
+	const uint64_t *starstars; /* states of '**' */
+	const uint64_t *skips; /* states of '**' that may skip a following '/' */
+	const uint64_t *masks; /* for every class, the states that advance on its characters */
+};
+
+/*
+ * Returns the ']' that closes the class starting at p or NULL if the class is
+ * malformed. This follows the parser in wildmatch.c.
+ */
+static const char *wp_class_end(const char *p)
+{
+	const char *s;
+	char ch, prev_ch;
+
+	ch = *++p;
+	if (ch == '!' || ch == '^')
+		ch = *++p;
+	prev_ch = 0;
+	do {
+		if (!ch)
+			return NULL;
+		if (ch == '\\') {
+			ch = *++p;
+			if (!ch)
+				return NULL;
+		} else if (ch == '-' && prev_ch && p[1] && p[1] != ']') {
+			ch = *++p;
+			if (ch == '\\') {
+				ch = *++p;
+				if (!ch)
+					return NULL;
+			}
+			ch = 0;
+		} else if (ch == '[' && p[1] == ':') {
+			for (s = p += 2; (ch = *p) && ch != ']'; p++) {}
+			if (!ch)
+				return NULL;
+			if (p - s - 1 < 0 || p[-1] != ':') {
+				// no ":]", so '[' is a normal character
+				p = s - 2;
+				ch = '[';
+				continue;
+			}
+			ch = 0;
+		}
+	} while (prev_ch = ch, (ch = *++p) != ']');
+
+	return p;
+}
+
+static void wp_set_bit(uint64_t *set, unsigned char ch)
+{
+	set[ch / 64] |= 1ULL << (ch % 64);
+}
+
+static int wp_has_bit(const uint64_t *set, unsigned char ch)
+{
+	return (set[ch / 64] >> (ch % 64)) & 1;
+}
+
+// '/' has its own class as '*' does not stay active on it
+static int wp_same_class(const uint64_t *masks, unsigned int n_words, unsigned int a, unsigned int b)
+{
+	unsigned int i;
+
+	if (a == '/' || b == '/')
+		return a == b;
+
+	for (i = 0; i < n_words; i++) {
+		if (masks[a * n_words + i] != masks[b * n_words + i])
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Fills the set of a class by asking wildmatch() about every character, so
+ * ranges, escapes and named classes behave exactly the same.
+ */
+static int wp_class_set(const char *p, const char *end, struct wp_token *t)
+{
+	char *class, text[2];
+	unsigned int ch;
+
+	class = strndup(p, end - p + 1);
+	if (!class)
+		return -1;
+
+	text[1] = 0;
+	for (ch = 1; ch < 256; ch++) {
+		text[0] = ch;
+		if (wildmatch(class, text, 0, NULL) == WM_MATCH)
+			wp_set_bit(t->set, ch);
+	}
+
+	free(class);
+
+	return 0;
+}
+
+/*
+ * Splits the pattern into tokens. Returns 1 if the pattern is malformed, as
+ * wildmatch() never matches it then, 0 on success and -1 on errors.
+ */
+static int wp_parse(const char *pattern, unsigned int flags, struct wp_token *tokens, unsigned int *n_tokens)
+{
+	const char *p, *stars, *end;
+	struct wp_token *t;
+	unsigned int n = 0;
+
+	for (p = pattern; *p; n++) {
+		t = &tokens[n];
+		memset(t, 0, sizeof(*t));
+		t->type = WP_SET;
+		t->ch = -1;
+
+		switch (*p) {
+			case '\\':
+				if (!p[1])
+					return 1;
+				p++;
+				/* FALLTHROUGH */
+			default:
+				t->ch = (unsigned char) *p;
+				wp_set_bit(t->set, t->ch);
+				p++;
+				break;
+			case '?':
+				memset(t->set, 0xff, sizeof(t->set));
+				p++;
+				break;
+			case '[':
+				end = wp_class_end(p);
+				if (!end)
+					return 1;
+				if (wp_class_set(p, end, t))
+					return -1;
+				p = end + 1;
+				break;
+			case '*':
+				for (stars = p; *p == '*'; p++) {}
+
+				if (!(flags & WM_PATHNAME)) {
+					t->type = WP_STARSTAR;
+				} else if (p - stars == 1) {
+					t->type = WP_STAR;
+				} else {
+					// "**" is only special as a complete path segment
+					if ((stars != pattern && stars[-1] != '/') ||
+						(*p && *p != '/' && (p[0] != '\\' || p[1] != '/')))
+						return 1;
+
+					t->type = WP_STARSTAR;
+					t->skip = *p == '/';
+				}
+				break;
+		}
+
+		// only a literal '/' matches a '/'
+		if (t->type == WP_SET && t->ch < 0 && (flags & WM_PATHNAME))
+			t->set['/' / 64] &= ~(1ULL << ('/' % 64));
+	}
+
+	*n_tokens = n;
+
+	return 0;
+}
+
+struct wildprog *wildprog_compile(const char *pattern, unsigned int flags)
+{
+	struct wildprog *wp;
+	struct wp_token *tokens;
+	uint64_t *masks, *words;
+	unsigned int i, j, k, n, n_words, n_classes, classes[256];
+	unsigned char wp_cls[256];
+	size_t prefix_len, suffix_len, size;
+	char *strings;
+	int r;
+
+	if (flags & ~WM_PATHNAME) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	tokens = malloc(sizeof(struct wp_token) * (strlen(pattern) + 1));
+	if (!tokens)
+		return NULL;
+
+	r = wp_parse(pattern, flags, tokens, &n);
+	if (r < 0) {
+		free(tokens);
+		return NULL;
+	}
+	if (r > 0) {
+		free(tokens);
+		wp = calloc(1, sizeof(struct wildprog));
+		if (wp)
+			wp->never = 1;
+		return wp;
+	}
+
+	n_words = n / 64 + 1;
+	if (n_words > WP_MAX_WORDS) {
+		free(tokens);
+		errno = E2BIG;
+		return NULL;
+	}
+
+	// the states that advance on every character, a class is represented by its first character
+	masks = calloc(256 * n_words, sizeof(uint64_t));
+	if (!masks) {
+		free(tokens);
+		return NULL;
+	}
+
+	for (j = 0; j < n; j++) {
+		if (tokens[j].ch >= 0) {
+			masks[tokens[j].ch * n_words + j / 64] |= 1ULL << (j % 64);
+			continue;
+		}
+
+		for (i = 0; tokens[j].type == WP_SET && i < 256; i++) {
+			if (wp_has_bit(tokens[j].set, i))
+				masks[i * n_words + j / 64] |= 1ULL << (j % 64);
+		}
+	}
+
+	n_classes = 0;
+	for (i = 0; i < 256; i++) {
+		for (k = 0; k < n_classes; k++) {
+			if (wp_same_class(masks, n_words, classes[k], i))
+				break;
+		}
+		if (k == n_classes)
+			classes[n_classes++] = i;
+		wp_cls[i] = k;
+	}
+
+	for (prefix_len = 0; prefix_len < n && tokens[prefix_len].ch >= 0; prefix_len++) {}
+
+	for (i = n; i > 0 && tokens[i - 1].ch >= 0; i--) {}
+	if (i > 0 && tokens[i - 1].skip)
+		i++;
+	suffix_len = i < n ? n - i : 0;
+
+	size = sizeof(struct wildprog) + (3 + n_classes) * n_words * sizeof(uint64_t) + prefix_len + suffix_len + 2;
+	wp = calloc(1, size);
+	if (!wp) {
+		free(masks);
+		free(tokens);
+		return NULL;
+	}
+
+	words = (uint64_t *) (wp + 1);
+	wp->stars = words;
+	wp->starstars = words + n_words;
+	wp->skips = words + 2 * n_words;
+	wp->masks = words + 3 * n_words;
+
+	for (j = 0; j < n; j++) {
+		if (tokens[j].type != WP_SET)
+			words[j / 64] |= 1ULL << (j % 64);
+		if (tokens[j].type == WP_STARSTAR)
+			words[n_words + j / 64] |= 1ULL << (j % 64);
+		if (tokens[j].skip)
+			words[2 * n_words + j / 64] |= 1ULL << (j % 64);
+	}
+
+	memcpy(wp->cls, wp_cls, sizeof(wp->cls));
+	for (k = 0; k < n_classes; k++)
+		memcpy(&words[(3 + k) * n_words], &masks[classes[k] * n_words], n_words * sizeof(uint64_t));
+
+	strings = (char *) (words + (3 + n_classes) * n_words);
+	for (j = 0; j < prefix_len; j++)
+		strings[j] = tokens[j].ch;
+	wp->prefix = strings;
+	wp->prefix_len = prefix_len;
+
+	strings += prefix_len + 1;
+	for (j = 0; j < suffix_len; j++)
+		strings[j] = tokens[n - suffix_len + j].ch;
+	wp->suffix = strings;
+	wp->suffix_len = suffix_len;
+
+	wp->n_words = n_words;
+	wp->start = prefix_len;
+	wp->accept = n;
+	wp->literal = prefix_len == n;
+	wp->tail_starstar = n > 0 && tokens[n - 1].type == WP_STARSTAR;
+
+	free(masks);
+	free(tokens);
+
+	return wp;
+}
+
+void wildprog_free(struct wildprog *wp)
+{
+	free(wp);
+}
+
+/*
+ * Adds the states that are reached without a character. entered are the
+ * states that were just entered, only these may skip the '/' after "**".
+ */
+static uint64_t wp_close1(const struct wildprog *wp, uint64_t entered, uint64_t states)
+{
+	uint64_t next;
+
+	while (1) {
+		next = ((states & wp->stars[0]) << 1) | ((entered & wp->skips[0]) << 2);
+		if (!(next & ~entered))
+			return states;
+
+		entered |= next;
+		states |= next;
+	}
+}
+
+/*
+ * The common case of up to 63 tokens with one word per state set. If no state
+ * advances on a character and the states stay the same, e.g., while "**" in
+ * "**" + "/x" skips the characters of a long path, the following characters
+ * of the same kind ('/' or not) that do not advance a state are skipped.
+ */
+static int wp_match1(const struct wildprog *wp, const unsigned char *text)
+{
+	uint64_t states, entered, accept, tail, idle[2] = { 0, 0 };
+	uint64_t prev;
+	unsigned char ch;
+	int slash;
+
+	accept = 1ULL << wp->accept;
+	tail = wp->tail_starstar ? 1ULL << (wp->accept - 1) : 0;
+
+	states = wp_close1(wp, 1ULL << wp->start, 1ULL << wp->start);
+
+	while ((ch = *text++)) {
+		if (states & tail)
+			return WM_MATCH;
+
+		entered = (states & wp->masks[wp->cls[ch]]) << 1;
+		slash = ch == '/';
+		if (!entered && states == idle[slash])
+			continue;
+
+		prev = states;
+		states = entered | (states & (slash ? wp->starstars[0] : wp->stars[0]));
+		if (!states)
+			return WM_NOMATCH;
+
+		states = wp_close1(wp, entered, states);
+		if (!entered && states == prev)
+			idle[slash] = states;
+	}
+
+	return states & accept ? WM_MATCH : WM_NOMATCH;
+}
+
+// dst = src << shift over n words, shift is 1 or 2
+static void wp_shift(uint64_t *dst, const uint64_t *src, unsigned int n, unsigned int shift)
+{
+	unsigned int i;
+
+	for (i = n; i-- > 0; )
+		dst[i] = (src[i] << shift) | (i ? src[i - 1] >> (64 - shift) : 0);
+}
+
+static void wp_close(const struct wildprog *wp, uint64_t *entered, uint64_t *states)
+{
+	uint64_t a[WP_MAX_WORDS], b[WP_MAX_WORDS], next;
+	unsigned int i, n = wp->n_words;
+	int changed;
+
+	do {
+		for (i = 0; i < n; i++) {
+			a[i] = states[i] & wp->stars[i];
+			b[i] = entered[i] & wp->skips[i];
+		}
+		wp_shift(a, a, n, 1);
+		wp_shift(b, b, n, 2);
+
+		changed = 0;
+		for (i = 0; i < n; i++) {
+			next = a[i] | b[i];
+			if (next & ~entered[i])
+				changed = 1;
+			entered[i] |= next;
+			states[i] |= next;
+		}
+	} while (changed);
+}
+
+static int wp_match(const struct wildprog *wp, const unsigned char *text)
+{
+	uint64_t states[WP_MAX_WORDS], entered[WP_MAX_WORDS];
+	const uint64_t *mask, *loop;
+	unsigned int i, n = wp->n_words;
+	unsigned int tail = wp->accept - 1;
+	unsigned char ch;
+	int any;
+
+	memset(states, 0, sizeof(states));
+	memset(entered, 0, sizeof(entered));
+	states[wp->start / 64] = entered[wp->start / 64] = 1ULL << (wp->start % 64);
+	wp_close(wp, entered, states);
+
+	while ((ch = *text++)) {
+		if (wp->tail_starstar && (states[tail / 64] >> (tail % 64)) & 1)
+			return WM_MATCH;
+
+		mask = &wp->masks[wp->cls[ch] * n];
+		loop = ch == '/' ? wp->starstars : wp->stars;
+
+		for (i = 0; i < n; i++)
+			entered[i] = states[i] & mask[i];
+		wp_shift(entered, entered, n, 1);
+
+		any = 0;
+		for (i = 0; i < n; i++) {
+			states[i] = entered[i] | (states[i] & loop[i]);
+			any |= states[i] != 0;
+		}
+		if (!any)
+			return WM_NOMATCH;
+
+		wp_close(wp, entered, states);
+	}
+
+	return (states[wp->accept / 64] >> (wp->accept % 64)) & 1 ? WM_MATCH : WM_NOMATCH;
+}
+
+int wildprog_match(const struct wildprog *wp, const char *text)
+{
+	size_t len;
+
+	if (wp->never)
+		return WM_NOMATCH;
+
+	if (wp->literal)
+		return strcmp(text, wp->prefix) ? WM_NOMATCH : WM_MATCH;
+
+	if (strncmp(text, wp->prefix, wp->prefix_len))
+		return WM_NOMATCH;
+	text += wp->prefix_len;
+
+	if (wp->suffix_len) {
+		len = strlen(text);
+		if (len < wp->suffix_len || memcmp(text + len - wp->suffix_len, wp->suffix, wp->suffix_len))
+			return WM_NOMATCH;
+	}
+
+	if (wp->n_words == 1)
+		return wp_match1(wp, (const unsigned char *) text);
+
+	return wp_match(wp, (const unsigned char *) text);
+}
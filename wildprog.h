@@ -0,0 +1,32 @@
+/*
+ *  SparseFS
+ *  --------
+ *
+ *  Precompiled wildcard patterns
+ *
+ *  Copyright 2016 Mario Kicherer <dev@kicherer.org>
+ *
+ *  This program can be distributed under the terms of the GNU GPLv3. See the file COPYING.
+ */
+
+#ifndef WILDPROG_H
+#define WILDPROG_H
+
+struct wildprog;
+
+/*
+ * Compiles a pattern for wildmatch() with the given flags. Only WM_PATHNAME
+ * is supported. Returns NULL with errno set if the flags are not supported,
+ * the pattern is too long or no memory is left. The caller can use
+ * wildmatch() in these cases.
+ */
+struct wildprog *wildprog_compile(const char *pattern, unsigned int flags);
+void wildprog_free(struct wildprog *wp);
+
+/*
+ * Returns WM_MATCH or WM_NOMATCH like wildmatch() for the pattern. It neither
+ * recurses nor allocates memory and its time is linear in the length of text.
+ */
+int wildprog_match(const struct wildprog *wp, const char *text);
+
+#endif